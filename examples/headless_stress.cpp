@@ -0,0 +1,113 @@
+#include "graphics.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+// Renders headless windows on many threads at once and checks every frame
+// against a reference rendered on the main thread first. Exits with 1 on the
+// first mismatch, so it can run in CI.
+//
+//   headless_stress [threads] [rounds]
+
+const int WIDTH = 320;
+const int HEIGHT = 240;
+const int SCENES = 4;
+
+// Deterministic scene per seed, touching the primitives, blending, clipping,
+// paths, flood fill and (for odd seeds) indexed mode
+static void drawScene(WindowHandle* window, int seed) {
+    bool indexed = seed % 2 == 1;
+    if (indexed) {
+        Color palette[16];
+        for (int i = 0; i < 16; i++) palette[i] = Color(i * 16, 255 - i * 16, (i * 53 + seed * 40) % 256);
+        setPalette(window, 0, 16, palette);
+        setIndexedMode(window, true);
+    }
+    
+    clearScreen(window, Color(20 + seed * 10, 20, 40));
+    for (int i = 0; i < 40; i++) {
+        int x = (i * 37 + seed * 11) % WIDTH, y = (i * 53 + seed * 7) % HEIGHT;
+        drawLine(window, x, y, WIDTH - 1 - y % WIDTH, (x * 3) % HEIGHT, Color(255, i * 6, seed * 60));
+    }
+    drawFilledRectangle(window, 30 + seed * 5, 40, 120, 80, Color(0, 200, 100, 160));
+    drawRectangle(window, -1, -1, WIDTH + 1, HEIGHT + 1, Color(255, 255, 255));
+    drawFilledCircle(window, WIDTH / 2, HEIGHT / 2, 50 + seed * 5, Color(200, 60, 60, 128));
+    drawCircle(window, WIDTH / 3, HEIGHT / 3, 30, Color(240, 240, 0));
+    
+    pushClipRect(window, 40, 40, WIDTH - 80, HEIGHT - 80);
+    for (int i = 0; i < 200; i++) drawPixel(window, (i * 97) % WIDTH, (i * 61) % HEIGHT, Color(255, 255, 255));
+    
+    Path* path = createPath();
+    moveTo(path, 60.0f + seed * 10, 200.0f);
+    cubicTo(path, 100.0f, 20.0f, 220.0f, 260.0f, 280.0f, 60.0f);
+    lineTo(path, 300.0f, 220.0f);
+    closePath(path);
+    fillPath(window, path, Color(80, 120, 255, 200), seed < 2 ? FILL_NONZERO : FILL_EVEN_ODD);
+    destroyPath(path);
+    popClipRect(window);
+    
+    drawRectangle(window, 5, 5, 20, 20, Color(255, 0, 255));
+    floodFill(window, 10, 10, Color(0, 255, 255));
+    swapBuffers(window);
+}
+
+// The scene rendered into a fresh window, or an empty vector if the window
+// couldn't be created
+static std::vector<Color> render(int seed) {
+    std::vector<Color> pixels;
+    WindowHandle* window = createHeadlessWindow(WIDTH, HEIGHT);
+    if (!window) return pixels;
+    
+    drawScene(window, seed);
+    const Color* frame = getHeadlessPixels(window);
+    if (frame) pixels.assign(frame, frame + WIDTH * HEIGHT);
+    destroyWindow(window);
+    return pixels;
+}
+
+static bool samePixels(const std::vector<Color>& a, const std::vector<Color>& b) {
+    return a.size() == b.size() && (a.empty() || std::memcmp(a.data(), b.data(), a.size() * sizeof(Color)) == 0);
+}
+
+int main(int argc, char* argv[]) {
+    int threads = argc > 1 ? std::atoi(argv[1]) : 8;
+    int rounds = argc > 2 ? std::atoi(argv[2]) : 50;
+    if (threads <= 0 || rounds <= 0) {
+        std::printf("usage: headless_stress [threads] [rounds]\n");
+        return 1;
+    }
+    
+    std::vector<std::vector<Color>> reference(SCENES);
+    for (int seed = 0; seed < SCENES; seed++) {
+        reference[seed] = render(seed);
+        if (reference[seed].empty()) {
+            std::printf("FAIL: could not render reference scene %d\n", seed);
+            return 1;
+        }
+    }
+    
+    std::atomic<int> failures(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(std::thread([t, rounds, &reference, &failures] {
+            for (int round = 0; round < rounds; round++) {
+                int seed = (t + round) % SCENES;
+                if (samePixels(render(seed), reference[seed])) continue;
+                if (failures.fetch_add(1) == 0) {
+                    std::printf("FAIL: thread %d round %d scene %d differs from the reference\n", t, round, seed);
+                }
+            }
+        }));
+    }
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    
+    if (failures.load() > 0) {
+        std::printf("FAIL: %d of %d frames differ\n", failures.load(), threads * rounds);
+        return 1;
+    }
+    std::printf("OK: %d frames on %d threads match the reference\n", threads * rounds, threads);
+    return 0;
+}
@@ -34,10 +34,6 @@ void project(const Vec3& v, int& x2d, int& y2d, float width, float height, float
     y2d = static_cast<int>(v.y * factor + height / 2);
 }
 
-struct Star {
-    float x, y, z;
-};
-
 int main() {
     const int width = 800;
     const int height = 600;
@@ -56,16 +52,22 @@ int main() {
         {0,4},{1,5},{2,6},{3,7}
     };
 
-    // Starfield
+    // Starfield, flying towards the camera and wrapping back to the far end
     const int starCount = 300;
-    std::vector<Star> stars;
+    ParticleSystem* stars = createParticleSystem(starCount);
     for (int i = 0; i < starCount; ++i) {
-        stars.push_back({
-            ((rand() % 200) - 100) / 10.0f,
-            ((rand() % 200) - 100) / 10.0f,
-            (rand() % 100) / 10.0f
-        });
+        emitParticle(stars,
+                     ((rand() % 200) - 100) / 10.0f,
+                     ((rand() % 200) - 100) / 10.0f,
+                     (rand() % 100) / 10.0f + 0.1f,
+                     0.0f, 0.0f, -0.05f,
+                     Color(255, 255, 255), 0.0f);
     }
+    setParticleWrap(stars, 0, 0, 0.1f, 0, 0, 10.0f);
+
+    ParticleView starView;
+    starView.centerX = width / 2;
+    starView.centerY = height / 2;
 
     float time = 0.0f;
 
@@ -77,17 +79,8 @@ int main() {
         clearScreen(window, Color(bg, 0, bg + 20));
 
         // --- STARFIELD ---
-        for (auto& star : stars) {
-            star.z -= 0.05f;
-            if (star.z <= 0.1f)
-                star.z = 10.0f;
-
-            int sx = static_cast<int>((star.x / star.z) * 200 + width/2);
-            int sy = static_cast<int>((star.y / star.z) * 200 + height/2);
-
-            if (sx >= 0 && sx < width && sy >= 0 && sy < height)
-                drawPixel(window, sx, sy, Color(255,255,255));
-        }
+        updateParticles(stars, 1.0f);
+        drawParticles(window, stars, starView);
 
         // Color cycling (rainbow)
         int r = static_cast<int>((std::sin(time) + 1) * 127);
@@ -125,6 +118,7 @@ int main() {
         delay(16);
     }
 
+    destroyParticleSystem(stars);
     destroyWindow(window);
     return 0;
 }
@@ -344,8 +344,9 @@ int main() {
         {0,4},{1,5},{2,6},{3,7}
     };
 
-    // Chunk cache
+    // Chunk cache, plus chunks still being generated on the job pool
     std::map<ChunkCoord, Chunk> chunkCache;
+    std::map<ChunkCoord, JobFuture<Chunk>> pendingChunks;
     
     // FPS counter
     int frameCount = 0;
@@ -422,7 +423,17 @@ int main() {
         
         cam.position = cam.position + cam.velocity;
 
-        // Chunk loading
+        // Chunk loading: merge chunks finished since the last frame, then
+        // queue generation of missing ones without waiting for them
+        for (auto it = pendingChunks.begin(); it != pendingChunks.end();) {
+            if (it->second.ready()) {
+                chunkCache[it->first] = std::move(it->second.get());
+                it = pendingChunks.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        
         ChunkCoord currentChunk = worldToChunk(cam.position);
         
         for (int x = -renderRadius; x <= renderRadius; ++x) {
@@ -430,15 +441,17 @@ int main() {
                 for (int z = -renderRadius; z <= renderRadius; ++z) {
                     ChunkCoord coord{currentChunk.x + x, currentChunk.y + y, currentChunk.z + z};
                     
-                    if (chunkCache.find(coord) == chunkCache.end()) {
-                        chunkCache[coord] = generateChunk(coord);
+                    if (chunkCache.find(coord) == chunkCache.end() &&
+                        pendingChunks.find(coord) == pendingChunks.end()) {
+                        pendingChunks[coord] = runAsync([coord] { return generateChunk(coord); });
                     }
                 }
             }
         }
         
         // Unload distant chunks
-        std::vector<ChunkCoord> toRemove;
+        // Per-frame scratch comes from the window's frame arena, not the heap
+        FrameVector<ChunkCoord> toRemove{FrameAllocator<ChunkCoord>(window)};
         for (auto& pair : chunkCache) {
             int dx = pair.first.x - currentChunk.x;
             int dy = pair.first.y - currentChunk.y;
@@ -493,7 +506,8 @@ int main() {
                 
                 if (length(cubePos) > viewDistance) continue;
 
-                std::vector<Vec3> transformed;
+                FrameVector<Vec3> transformed{FrameAllocator<Vec3>(window)};
+                transformed.reserve(cubeVertices.size());
                 bool anyVisible = false;
 
                 for (auto v : cubeVertices) {
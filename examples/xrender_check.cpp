@@ -0,0 +1,150 @@
+#include "graphics.h"
+#ifdef USE_X11
+// Xlib has its own KeyCode typedef which clashes with ours
+#define KeyCode X11KeyCode
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrender.h>
+#undef KeyCode
+#endif
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Draws the same scene on an X11 window that uses XRender and on one forced
+// onto the core protocol (GRAPHICS_NO_XRENDER), reads both back and exits
+// with 1 if they differ. Only primitives that have to be pixel-identical on
+// both paths are drawn: opaque fills, axis-aligned lines, rectangle outlines
+// and unscaled blits. Needs the X11 backend and an X server, e.g. under
+// xvfb-run (make xrender-check).
+
+const int WIDTH = 320;
+const int HEIGHT = 240;
+
+static void drawScene(WindowHandle* window) {
+    clearScreen(window, Color(30, 30, 60));
+    
+    // Fills, some reaching past the window edges
+    drawFilledRectangle(window, 10, 10, 100, 60, Color(200, 40, 40));
+    drawFilledRectangle(window, -20, 150, 60, 120, Color(40, 200, 40));
+    drawFilledRectangle(window, WIDTH - 30, -10, 50, 40, Color(40, 40, 200));
+    drawFilledRectangle(window, 150, 100, 1, 1, Color(255, 255, 0));
+    
+    // Axis lines in both directions, partly off-screen
+    for (int i = 0; i < 10; i++) {
+        drawLine(window, 5, 80 + i * 3, 140 + i * 7, 80 + i * 3, Color(255, i * 25, 0));
+        drawLine(window, 200 + i * 4, HEIGHT + 20, 200 + i * 4, 120 - i * 5, Color(0, 255, i * 25));
+    }
+    drawLine(window, -50, 5, WIDTH + 50, 5, Color(255, 255, 255));
+    drawLine(window, 3, 3, 3, 3, Color(255, 0, 255));
+    
+    // Outlines, including degenerate and clipped ones
+    drawRectangle(window, 120, 20, 60, 40, Color(255, 255, 255));
+    drawRectangle(window, 190, 20, 1, 30, Color(255, 128, 0));
+    drawRectangle(window, 200, 20, 30, 1, Color(0, 128, 255));
+    drawRectangle(window, 240, 20, 2, 2, Color(128, 255, 0));
+    drawRectangle(window, -1, -1, WIDTH + 2, HEIGHT + 2, Color(255, 0, 0));
+    drawRectangle(window, WIDTH - 40, HEIGHT - 40, 80, 80, Color(0, 255, 255));
+    
+    // The same under a clip rectangle
+    pushClipRect(window, 60, 120, 100, 70);
+    drawFilledRectangle(window, 40, 110, 60, 40, Color(180, 180, 0));
+    drawRectangle(window, 70, 100, 120, 60, Color(0, 200, 200));
+    drawLine(window, 0, 150, WIDTH, 150, Color(255, 255, 255));
+    drawLine(window, 100, 0, 100, HEIGHT, Color(255, 255, 255));
+    popClipRect(window);
+    
+    // Unscaled blits of an opaque surface, whole and in part
+    Surface* surface = createSurface(window, 48, 32);
+    if (surface) {
+        setRenderTarget(window, surface);
+        clearScreen(window, Color(90, 20, 120));
+        drawFilledRectangle(window, 8, 8, 16, 12, Color(250, 200, 50));
+        drawRectangle(window, 0, 0, 48, 32, Color(255, 255, 255));
+        drawLine(window, 4, 28, 44, 28, Color(0, 255, 0));
+        setRenderTarget(window, nullptr);
+    
+        Rect whole(250, 150, 48, 32);
+        blitSurface(window, surface, nullptr, &whole);
+        Rect part(8, 8, 24, 16);
+        Rect dest(10, 200, 24, 16);
+        blitSurface(window, surface, &part, &dest);
+        Rect edge(WIDTH - 20, 100, 48, 32);
+        blitSurface(window, surface, nullptr, &edge);
+        destroySurface(surface);
+    }
+}
+
+// Whether windows created from now on skip XRender
+static void forceCore(bool core) {
+#ifdef USE_X11
+    if (core) {
+        setenv("GRAPHICS_NO_XRENDER", "1", 1);
+    } else {
+        unsetenv("GRAPHICS_NO_XRENDER");
+    }
+#else
+    (void)core;
+#endif
+}
+
+// The scene as drawn by a new window, empty if it couldn't be drawn
+static std::vector<Color> render(bool core) {
+    std::vector<Color> pixels;
+    forceCore(core);
+    WindowHandle* window = createWindow(core ? "core" : "xrender", WIDTH, HEIGHT);
+    forceCore(false);
+    if (!window) return pixels;
+    
+    drawScene(window);
+    pixels.resize(static_cast<size_t>(WIDTH) * HEIGHT);
+    if (!readPixels(window, nullptr, pixels.data(), 0)) pixels.clear();
+    swapBuffers(window);
+    destroyWindow(window);
+    return pixels;
+}
+
+// Without RENDER on the server both windows would take the core path
+static bool hasRender() {
+#ifdef USE_X11
+    Display* display = XOpenDisplay(nullptr);
+    if (!display) return false;
+    int eventBase, errorBase;
+    bool render = XRenderQueryExtension(display, &eventBase, &errorBase);
+    XCloseDisplay(display);
+    return render;
+#else
+    return false;
+#endif
+}
+
+int main() {
+    if (!hasRender()) {
+        std::printf("FAIL: needs the X11 backend and an X display with the RENDER extension\n");
+        return 1;
+    }
+    
+    std::vector<Color> xrender = render(false);
+    std::vector<Color> core = render(true);
+    if (xrender.empty() || core.empty()) {
+        std::printf("FAIL: could not draw and read back the windows\n");
+        return 1;
+    }
+    
+    int mismatches = 0;
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            const Color& a = xrender[static_cast<size_t>(y) * WIDTH + x];
+            const Color& b = core[static_cast<size_t>(y) * WIDTH + x];
+            if (a.r == b.r && a.g == b.g && a.b == b.b) continue;
+            if (mismatches++ < 10) {
+                std::printf("  (%d, %d): xrender %d,%d,%d core %d,%d,%d\n", x, y, a.r, a.g, a.b, b.r, b.g, b.b);
+            }
+        }
+    }
+    if (mismatches > 0) {
+        std::printf("FAIL: %d pixels differ between XRender and the core protocol\n", mismatches);
+        return 1;
+    }
+    std::printf("OK: XRender and the core protocol draw the same %dx%d scene\n", WIDTH, HEIGHT);
+    return 0;
+}
@@ -1,1526 +1,8688 @@
 #include "graphics.h"
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cctype>
 
-#ifdef USE_SDL
+// Vectorized pixel conversion, picked at runtime from the CPU features
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define GRAPHICS_X86_SIMD
+    #include <immintrin.h>
+#endif
 
-#include <SDL2/SDL.h>
-#include <cstring>
+// ============================================================================
+// TRACING - shared by all backends
+// ============================================================================
 
-// Platform-specific window handle structure
-struct WindowHandle {
-    SDL_Window* window;
-    SDL_Renderer* renderer;
-    bool shouldClose;
-    
-    // Input state
-    bool keyState[KEY_COUNT];
-    bool prevKeyState[KEY_COUNT];
-    
-    bool mouseState[MOUSE_BUTTON_COUNT];
-    bool prevMouseState[MOUSE_BUTTON_COUNT];
+#ifdef GRAPHICS_TRACE
+
+// Events kept per thread, older ones are overwritten
+const uint64_t TRACE_RING_SIZE = 1 << 15;
+
+// Fields are relaxed atomics, plain stores on the recording thread that
+// writeTrace may read while they are overwritten
+struct TraceEvent {
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> end;
+};
+
+// Written only by its thread, read by writeTrace. head counts every event
+// ever recorded; slot head % TRACE_RING_SIZE is the next one written.
+struct TraceRing {
+    TraceEvent events[TRACE_RING_SIZE];
+    std::atomic<uint64_t> head;
+    int thread;
+    std::string name;
     
-    int mouseX, mouseY;
-    int prevMouseX, prevMouseY;
-    int mouseDeltaX, mouseDeltaY;
+    TraceRing() : head(0), thread(0) {}
+};
+
+// Rings outlive their threads so a trace written at exit still has them
+struct TraceRegistry {
+    std::mutex mutex;
+    std::vector<TraceRing*> rings;
+    std::string exitFile;
+    uint64_t baseTicks;
+    std::chrono::steady_clock::time_point baseTime;
     
-    int mouseWheelDelta;
+    TraceRegistry() : baseTicks(traceClock()), baseTime(std::chrono::steady_clock::now()) {}
+};
+
+static TraceRegistry& traceRegistry() {
+    static TraceRegistry* registry = new TraceRegistry();
+    return *registry;
+}
+
+static thread_local TraceRing* traceRing = nullptr;
+
+static TraceRing* threadTraceRing() {
+    if (traceRing) return traceRing;
     
-    bool mouseLocked;
+    TraceRegistry& registry = traceRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    traceRing = new TraceRing();
+    traceRing->thread = static_cast<int>(registry.rings.size()) + 1;
+    traceRing->name = traceRing->thread == 1 ? "main" : "thread " + std::to_string(traceRing->thread);
+    registry.rings.push_back(traceRing);
+    return traceRing;
+}
+
+void traceEvent(const char* name, uint64_t start, uint64_t end) {
+    TraceRing* ring = threadTraceRing();
+    uint64_t slot = ring->head.load(std::memory_order_relaxed);
+    TraceEvent& event = ring->events[slot % TRACE_RING_SIZE];
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(start, std::memory_order_relaxed);
+    event.end.store(end, std::memory_order_relaxed);
+    ring->head.store(slot + 1, std::memory_order_release);
+}
+
+// Names the calling thread's track in the trace
+static void traceThreadName(const std::string& name) {
+    TraceRing* ring = threadTraceRing();
+    std::lock_guard<std::mutex> lock(traceRegistry().mutex);
+    ring->name = name;
+}
+
+#else
+
+static void traceThreadName(const std::string&) {}
+
+#endif // GRAPHICS_TRACE
+
+// ============================================================================
+// CLIPPING - shared by all backends
+// ============================================================================
+
+// Visible area of a window in pixels (x1/y1 are exclusive)
+struct ClipRect {
+    int x0, y0, x1, y1;
     
-    WindowHandle() : window(nullptr), renderer(nullptr), shouldClose(false),
-                     mouseX(0), mouseY(0), prevMouseX(0), prevMouseY(0),
-                     mouseDeltaX(0), mouseDeltaY(0), mouseWheelDelta(0),
-                     mouseLocked(false) {
-        memset(keyState, 0, sizeof(keyState));
-        memset(prevKeyState, 0, sizeof(prevKeyState));
-        memset(mouseState, 0, sizeof(mouseState));
-        memset(prevMouseState, 0, sizeof(prevMouseState));
-    }
+    ClipRect(int left = 0, int top = 0, int right = 0, int bottom = 0)
+        : x0(left), y0(top), x1(right), y1(bottom) {}
 };
 
-// Initialize SDL (called once)
-static bool sdlInitialized = false;
-
-static void ensureSDLInit() {
-    if (!sdlInitialized) {
-        if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-            // Handle error - in production, use proper error handling
-            return;
-        }
-        sdlInitialized = true;
-    }
+static inline bool pointInClip(const ClipRect& clip, int x, int y) {
+    return x >= clip.x0 && x < clip.x1 && y >= clip.y0 && y < clip.y1;
 }
 
-// SDL key mapping
-static KeyCode mapSDLKey(SDL_Keycode sdlKey) {
-    switch (sdlKey) {
-        case SDLK_UP: return KEY_UP;
-        case SDLK_DOWN: return KEY_DOWN;
-        case SDLK_LEFT: return KEY_LEFT;
-        case SDLK_RIGHT: return KEY_RIGHT;
-        
-        case SDLK_a: return KEY_A;
-        case SDLK_b: return KEY_B;
-        case SDLK_c: return KEY_C;
-        case SDLK_d: return KEY_D;
-        case SDLK_e: return KEY_E;
-        case SDLK_f: return KEY_F;
-        case SDLK_g: return KEY_G;
-        case SDLK_h: return KEY_H;
-        case SDLK_i: return KEY_I;
-        case SDLK_j: return KEY_J;
-        case SDLK_k: return KEY_K;
-        case SDLK_l: return KEY_L;
-        case SDLK_m: return KEY_M;
-        case SDLK_n: return KEY_N;
-        case SDLK_o: return KEY_O;
-        case SDLK_p: return KEY_P;
-        case SDLK_q: return KEY_Q;
-        case SDLK_r: return KEY_R;
-        case SDLK_s: return KEY_S;
-        case SDLK_t: return KEY_T;
-        case SDLK_u: return KEY_U;
-        case SDLK_v: return KEY_V;
-        case SDLK_w: return KEY_W;
-        case SDLK_x: return KEY_X;
-        case SDLK_y: return KEY_Y;
-        case SDLK_z: return KEY_Z;
-        
-        case SDLK_0: return KEY_0;
-        case SDLK_1: return KEY_1;
-        case SDLK_2: return KEY_2;
-        case SDLK_3: return KEY_3;
-        case SDLK_4: return KEY_4;
-        case SDLK_5: return KEY_5;
-        case SDLK_6: return KEY_6;
-        case SDLK_7: return KEY_7;
-        case SDLK_8: return KEY_8;
-        case SDLK_9: return KEY_9;
-        
-        case SDLK_F1: return KEY_F1;
-        case SDLK_F2: return KEY_F2;
-        case SDLK_F3: return KEY_F3;
-        case SDLK_F4: return KEY_F4;
-        case SDLK_F5: return KEY_F5;
-        case SDLK_F6: return KEY_F6;
-        case SDLK_F7: return KEY_F7;
-        case SDLK_F8: return KEY_F8;
-        case SDLK_F9: return KEY_F9;
-        case SDLK_F10: return KEY_F10;
-        case SDLK_F11: return KEY_F11;
-        case SDLK_F12: return KEY_F12;
-        
-        case SDLK_SPACE: return KEY_SPACE;
-        case SDLK_RETURN: return KEY_ENTER;
-        case SDLK_ESCAPE: return KEY_ESCAPE;
-        case SDLK_BACKSPACE: return KEY_BACKSPACE;
-        case SDLK_TAB: return KEY_TAB;
-        case SDLK_LSHIFT:
-        case SDLK_RSHIFT: return KEY_SHIFT;
-        case SDLK_LCTRL:
-        case SDLK_RCTRL: return KEY_CONTROL;
-        case SDLK_LALT:
-        case SDLK_RALT: return KEY_ALT;
-        
-        case SDLK_PLUS:
-        case SDLK_EQUALS: return KEY_PLUS;
-        case SDLK_MINUS: return KEY_MINUS;
-        
-        default: return KEY_UNKNOWN;
+// floor((a * b + c) / d) and the remainder, exact for values below 2^34 where
+// a * b itself would overflow
+static void mulDiv(unsigned long long a, unsigned long long b, unsigned long long c, unsigned long long d,
+                   long long& quotient, long long& remainder) {
+    unsigned long long q = c / d, r = c % d;
+    unsigned long long termQ = b / d, termR = b % d;
+    for (; a != 0; a >>= 1) {
+        if (a & 1) {
+            q += termQ;
+            r += termR;
+            if (r >= d) { r -= d; q++; }
+        }
+        termQ *= 2;
+        termR *= 2;
+        if (termR >= d) { termR -= d; termQ++; }
     }
+    quotient = static_cast<long long>(q);
+    remainder = static_cast<long long>(r);
 }
 
-WindowHandle* createWindow(const char* title, int width, int height) {
-    ensureSDLInit();
-    
-    WindowHandle* handle = new WindowHandle();
-    
-    handle->window = SDL_CreateWindow(
-        title,
-        SDL_WINDOWPOS_CENTERED,
-        SDL_WINDOWPOS_CENTERED,
-        width,
-        height,
-        SDL_WINDOW_SHOWN
-    );
+// A line lights one pixel per step along its major axis. Step i of an x-major
+// line is (x1 + i * sx, y1 + k * sy) with k = i * minor / major rounded half
+// up, so any step can be computed on its own. Clipping picks the first and
+// last visible step of the whole line instead of moving its endpoints, which
+// would change the slope and so the pixels in between.
+struct LineWalk {
+    int x1, y1, sx, sy;
+    bool steep;                 // y is the major axis
+    long long major, minor;     // Absolute deltas along the axes
+    long long first, last;      // Visible steps, inclusive
     
-    if (!handle->window) {
-        delete handle;
-        return nullptr;
+    // Minor axis offset of a step, with the remainder for walking on from it
+    void offsetAt(long long step, long long& offset, long long& remainder) const {
+        if (major == 0) {
+            offset = 0;
+            remainder = 0;
+            return;
+        }
+        mulDiv(step, 2 * minor, major, 2 * major, offset, remainder);
     }
     
-    handle->renderer = SDL_CreateRenderer(
-        handle->window,
-        -1,
-        SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC
-    );
-    
-    if (!handle->renderer) {
-        SDL_DestroyWindow(handle->window);
-        delete handle;
-        return nullptr;
+    long long offsetAt(long long step) const {
+        long long offset, remainder;
+        offsetAt(step, offset, remainder);
+        return offset;
     }
     
-    // Enable alpha blending
-    SDL_SetRenderDrawBlendMode(handle->renderer, SDL_BLENDMODE_BLEND);
+    void point(long long step, long long offset, int& x, int& y) const {
+        long long along = steep ? offset : step;
+        long long down = steep ? step : offset;
+        x = static_cast<int>(x1 + along * sx);
+        y = static_cast<int>(y1 + down * sy);
+    }
     
-    return handle;
+    void point(long long step, int& x, int& y) const {
+        point(step, offsetAt(step), x, y);
+    }
+};
+
+// First step in [from, to] whose minor offset is at least target, or to + 1
+static long long firstStepReaching(const LineWalk& walk, long long from, long long to, long long target) {
+    long long low = from, high = to + 1;
+    while (low < high) {
+        long long middle = low + (high - low) / 2;
+        if (walk.offsetAt(middle) >= target) high = middle;
+        else low = middle + 1;
+    }
+    return low;
 }
 
-void destroyWindow(WindowHandle* window) {
-    if (!window) return;
+// Sets up the walk of the line and its visible steps. Returns false if no
+// pixel of the line is inside the clip.
+static bool clipLine(const ClipRect& clip, int x1, int y1, int x2, int y2, LineWalk& walk) {
+    if (clip.x0 >= clip.x1 || clip.y0 >= clip.y1) return false;
     
-    if (window->renderer) {
-        SDL_DestroyRenderer(window->renderer);
+    // Trivial reject - both endpoints beyond the same edge
+    if ((x1 < clip.x0 && x2 < clip.x0) || (x1 >= clip.x1 && x2 >= clip.x1) ||
+        (y1 < clip.y0 && y2 < clip.y0) || (y1 >= clip.y1 && y2 >= clip.y1)) {
+        return false;
     }
     
-    if (window->window) {
-        SDL_DestroyWindow(window->window);
-    }
+    long long dx = static_cast<long long>(x2) - x1;
+    long long dy = static_cast<long long>(y2) - y1;
+    walk.x1 = x1;
+    walk.y1 = y1;
+    walk.sx = dx < 0 ? -1 : 1;
+    walk.sy = dy < 0 ? -1 : 1;
+    dx = dx < 0 ? -dx : dx;
+    dy = dy < 0 ? -dy : dy;
+    walk.steep = dy > dx;
+    walk.major = walk.steep ? dy : dx;
+    walk.minor = walk.steep ? dx : dy;
     
-    delete window;
+    // The clip as offsets from the start along each axis
+    long long majorStart = walk.steep ? y1 : x1;
+    long long majorLow = walk.steep ? clip.y0 : clip.x0;
+    long long majorHigh = (walk.steep ? clip.y1 : clip.x1) - 1;
+    int majorSign = walk.steep ? walk.sy : walk.sx;
+    long long minorStart = walk.steep ? x1 : y1;
+    long long minorLow = walk.steep ? clip.x0 : clip.y0;
+    long long minorHigh = (walk.steep ? clip.x1 : clip.y1) - 1;
+    int minorSign = walk.steep ? walk.sx : walk.sy;
     
-    // Cleanup SDL if this was the last window
-    if (sdlInitialized) {
-        SDL_Quit();
-        sdlInitialized = false;
-    }
+    long long nearMajor = majorSign > 0 ? majorLow - majorStart : majorStart - majorHigh;
+    long long farMajor = majorSign > 0 ? majorHigh - majorStart : majorStart - majorLow;
+    long long nearMinor = minorSign > 0 ? minorLow - minorStart : minorStart - minorHigh;
+    long long farMinor = minorSign > 0 ? minorHigh - minorStart : minorStart - minorLow;
+    
+    walk.first = std::max(0LL, nearMajor);
+    walk.last = std::min(walk.major, farMajor);
+    if (walk.first > walk.last) return false;
+    
+    // The minor offset only grows along the line, so the steps inside the
+    // clip on that axis are a range too
+    walk.first = firstStepReaching(walk, walk.first, walk.last, nearMinor);
+    walk.last = firstStepReaching(walk, walk.first, walk.last, farMinor + 1) - 1;
+    return walk.first <= walk.last;
 }
 
-bool windowShouldClose(WindowHandle* window) {
-    if (!window) return true;
-    return window->shouldClose;
+// Whether a backend can draw the line from its own endpoints. Lines reaching
+// past the limit are walked by the library and drawn as points instead.
+static bool lineFits(int x1, int y1, int x2, int y2, int limit) {
+    return std::abs(static_cast<long long>(x1)) <= limit && std::abs(static_cast<long long>(y1)) <= limit &&
+           std::abs(static_cast<long long>(x2)) <= limit && std::abs(static_cast<long long>(y2)) <= limit;
 }
 
-void pollEvents(WindowHandle* window) {
-    if (!window) return;
-    
-    // Save previous state
-    memcpy(window->prevKeyState, window->keyState, sizeof(window->keyState));
-    memcpy(window->prevMouseState, window->mouseState, sizeof(window->mouseState));
-    
-    window->prevMouseX = window->mouseX;
-    window->prevMouseY = window->mouseY;
-    window->mouseWheelDelta = 0;
-    
-    SDL_Event event;
-    while (SDL_PollEvent(&event)) {
-        if (event.type == SDL_QUIT) {
-            window->shouldClose = true;
-        }
-        else if (event.type == SDL_KEYDOWN) {
-            KeyCode key = mapSDLKey(event.key.keysym.sym);
-            if (key != KEY_UNKNOWN && key < KEY_COUNT) {
-                window->keyState[key] = true;
-            }
-            if (event.key.keysym.sym == SDLK_ESCAPE) {
-                window->shouldClose = true;
-            }
-        }
-        else if (event.type == SDL_KEYUP) {
-            KeyCode key = mapSDLKey(event.key.keysym.sym);
-            if (key != KEY_UNKNOWN && key < KEY_COUNT) {
-                window->keyState[key] = false;
-            }
-        }
-        else if (event.type == SDL_MOUSEBUTTONDOWN) {
-            if (event.button.button == SDL_BUTTON_LEFT)
-                window->mouseState[MOUSE_LEFT] = true;
-            else if (event.button.button == SDL_BUTTON_RIGHT)
-                window->mouseState[MOUSE_RIGHT] = true;
-            else if (event.button.button == SDL_BUTTON_MIDDLE)
-                window->mouseState[MOUSE_MIDDLE] = true;
-        }
-        else if (event.type == SDL_MOUSEBUTTONUP) {
-            if (event.button.button == SDL_BUTTON_LEFT)
-                window->mouseState[MOUSE_LEFT] = false;
-            else if (event.button.button == SDL_BUTTON_RIGHT)
-                window->mouseState[MOUSE_RIGHT] = false;
-            else if (event.button.button == SDL_BUTTON_MIDDLE)
-                window->mouseState[MOUSE_MIDDLE] = false;
-        }
-        else if (event.type == SDL_MOUSEMOTION) {
-            window->mouseX = event.motion.x;
-            window->mouseY = event.motion.y;
-        }
-        else if (event.type == SDL_MOUSEWHEEL) {
-            window->mouseWheelDelta = event.wheel.y;
+// Calls plot for every visible pixel of a clipped line
+template <typename Plot>
+static void walkLine(const LineWalk& walk, Plot plot) {
+    long long offset, remainder;
+    walk.offsetAt(walk.first, offset, remainder);
+    for (long long step = walk.first; step <= walk.last; step++) {
+        int x, y;
+        walk.point(step, offset, x, y);
+        plot(x, y);
+        remainder += 2 * walk.minor;
+        if (remainder >= 2 * walk.major) {
+            remainder -= 2 * walk.major;
+            offset++;
         }
     }
+}
+
+// Intersects a rectangle with the clip rectangle. Returns false if empty.
+static bool clipRectangle(const ClipRect& clip, int& x, int& y, int& width, int& height) {
+    if (width <= 0 || height <= 0) return false;
     
-    // Calculate mouse delta
-    window->mouseDeltaX = window->mouseX - window->prevMouseX;
-    window->mouseDeltaY = window->mouseY - window->prevMouseY;
+    long long left = x > clip.x0 ? x : clip.x0;
+    long long top = y > clip.y0 ? y : clip.y0;
+    long long right = static_cast<long long>(x) + width;
+    long long bottom = static_cast<long long>(y) + height;
+    if (right > clip.x1) right = clip.x1;
+    if (bottom > clip.y1) bottom = clip.y1;
     
-    // Handle mouse locking
-    if (window->mouseLocked) {
-        int centerX, centerY;
-        SDL_GetWindowSize(window->window, &centerX, &centerY);
-        centerX /= 2;
-        centerY /= 2;
-        
-        SDL_WarpMouseInWindow(window->window, centerX, centerY);
-        window->mouseX = centerX;
-        window->mouseY = centerY;
-    }
+    if (left >= right || top >= bottom) return false;
+    
+    x = static_cast<int>(left);
+    y = static_cast<int>(top);
+    width = static_cast<int>(right - left);
+    height = static_cast<int>(bottom - top);
+    return true;
 }
 
-void swapBuffers(WindowHandle* window) {
-    if (!window || !window->renderer) return;
-    SDL_RenderPresent(window->renderer);
+// True if a rectangle outline cannot touch the clip rectangle: either it lies
+// completely outside, or the clip rectangle sits entirely inside its edges.
+// right and bottom are where the backend draws the right and bottom edges:
+// x + width and y + height for X11, one pixel less for GDI.
+static bool rectOutlineOutsideClip(const ClipRect& clip, int x, int y, long long right, long long bottom) {
+    if (right < clip.x0 || x >= clip.x1 || bottom < clip.y0 || y >= clip.y1) return true;
+    return x < clip.x0 && y < clip.y0 && right >= clip.x1 && bottom >= clip.y1;
 }
 
-void clearScreen(WindowHandle* window, const Color& color) {
-    if (!window || !window->renderer) return;
-    
-    SDL_SetRenderDrawColor(window->renderer, color.r, color.g, color.b, color.a);
-    SDL_RenderClear(window->renderer);
+// True if a circle (outline or filled) cannot touch the clip rectangle
+static bool circleOutsideClip(const ClipRect& clip, int cx, int cy, int radius) {
+    if (radius < 0) return true;
+    return static_cast<long long>(cx) + radius < clip.x0 ||
+           static_cast<long long>(cx) - radius >= clip.x1 ||
+           static_cast<long long>(cy) + radius < clip.y0 ||
+           static_cast<long long>(cy) - radius >= clip.y1;
 }
 
-void setDrawColor(WindowHandle* window, const Color& color) {
-    if (!window || !window->renderer) return;
-    SDL_SetRenderDrawColor(window->renderer, color.r, color.g, color.b, color.a);
+// True if the clip rectangle lies strictly inside the circle, so an outline
+// of this radius passes around it without touching a visible pixel
+static bool clipInsideCircle(const ClipRect& clip, int cx, int cy, int radius) {
+    long long r = radius - 1;
+    if (r <= 0) return false;
+    long long dx = std::max<long long>(std::abs(static_cast<long long>(clip.x0) - cx),
+                                       std::abs(static_cast<long long>(clip.x1 - 1) - cx));
+    long long dy = std::max<long long>(std::abs(static_cast<long long>(clip.y0) - cy),
+                                       std::abs(static_cast<long long>(clip.y1 - 1) - cy));
+    return dx * dx + dy * dy < r * r;
 }
 
-void drawLine(WindowHandle* window, int x1, int y1, int x2, int y2, const Color& color) {
-    if (!window || !window->renderer) return;
+// Fills in blitSurface's optional rectangles and trims the source to the
+// surface, shrinking the destination by the same proportion. Returns false if
+// nothing is left to copy.
+static bool resolveBlitRects(const Rect* srcRect, const Rect* dstRect,
+                             int surfaceWidth, int surfaceHeight, int targetWidth, int targetHeight,
+                             Rect& src, Rect& dst) {
+    src = srcRect ? *srcRect : Rect(0, 0, surfaceWidth, surfaceHeight);
+    dst = dstRect ? *dstRect : Rect(0, 0, targetWidth, targetHeight);
+    if (src.width <= 0 || src.height <= 0 || dst.width <= 0 || dst.height <= 0) return false;
     
-    setDrawColor(window, color);
-    SDL_RenderDrawLine(window->renderer, x1, y1, x2, y2);
-}
-
-void drawRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
-    if (!window || !window->renderer) return;
+    ClipRect bounds(0, 0, surfaceWidth, surfaceHeight);
+    int x = src.x, y = src.y, w = src.width, h = src.height;
+    if (!clipRectangle(bounds, x, y, w, h)) return false;
     
-    SDL_Rect rect = {x, y, width, height};
-    setDrawColor(window, color);
-    SDL_RenderDrawRect(window->renderer, &rect);
+    if (w != src.width || h != src.height) {
+        double scaleX = static_cast<double>(dst.width) / src.width;
+        double scaleY = static_cast<double>(dst.height) / src.height;
+        dst = Rect(dst.x + static_cast<int>(std::lround((x - src.x) * scaleX)),
+                   dst.y + static_cast<int>(std::lround((y - src.y) * scaleY)),
+                   static_cast<int>(std::lround(w * scaleX)),
+                   static_cast<int>(std::lround(h * scaleY)));
+        src = Rect(x, y, w, h);
+    }
+    return dst.width > 0 && dst.height > 0;
 }
 
-void drawFilledRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
-    if (!window || !window->renderer) return;
+// ============================================================================
+// INPUT STATE - shared by all backends
+// ============================================================================
+
+// Input recording stores the input* calls of every published frame in
+// logical coordinates, so a replay reproduces the input state pollEvents
+// published without a device, whatever the window size or frame timing.
+// File layout: header, then per frame any records and RECORD_FRAME.
+const uint32_t INPUT_RECORDING_MAGIC = 0x504E4947;  // "GINP"
+const uint32_t INPUT_RECORDING_VERSION = 1;
+
+enum InputRecord {
+    RECORD_FRAME = 0,       // The frame was published
+    RECORD_KEY_DOWN,        // + key byte
+    RECORD_KEY_UP,
+    RECORD_BUTTON_DOWN,     // + button byte
+    RECORD_BUTTON_UP,
+    RECORD_MOTION,          // + zigzag varints x, y relative to the last recorded position
+    RECORD_WHEEL,           // + zigzag varint steps
+    RECORD_RECENTER,        // + like RECORD_MOTION, applied right after the previous frame
+    RECORD_CLOSE
+};
+
+struct InputRecording {
+    FILE* file;
+    std::vector<uint8_t> frame;  // Records since the last published frame
+    int lastX, lastY;
     
-    SDL_Rect rect = {x, y, width, height};
-    setDrawColor(window, color);
-    SDL_RenderFillRect(window->renderer, &rect);
-}
+    InputRecording() : file(nullptr), lastX(0), lastY(0) {}
+};
 
-void drawPixel(WindowHandle* window, int x, int y, const Color& color) {
-    if (!window || !window->renderer) return;
+struct InputReplay {
+    std::vector<uint8_t> data;
+    size_t pos;
+    int lastX, lastY;
+    bool applying;               // Records are being applied, live input is ignored otherwise
+    bool finished;               // Ran out of frames, the window asks to close
     
-    setDrawColor(window, color);
-    SDL_RenderDrawPoint(window->renderer, x, y);
-}
+    InputReplay() : pos(0), lastX(0), lastY(0), applying(false), finished(false) {}
+};
 
-// Helper function for drawing circles using midpoint circle algorithm
-void drawCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
-    if (!window || !window->renderer) return;
+// Per-window input bookkeeping. Backends translate native events into the
+// input* calls below; the query functions at the bottom of this file read it.
+// Events can be routed to a window while a different window is being polled,
+// so transitions accumulate in the pending* fields and only become visible
+// when the owning window calls pollEvents/waitEvents.
+struct InputState {
+    bool keyState[KEY_COUNT];
+    bool keyHit[KEY_COUNT];      // Went down at least once before the last poll
+    bool keyLifted[KEY_COUNT];   // Went up at least once before the last poll
+    bool pendingKeyHit[KEY_COUNT];
+    bool pendingKeyLifted[KEY_COUNT];
     
-    setDrawColor(window, color);
+    bool mouseState[MOUSE_BUTTON_COUNT];
+    bool mouseHit[MOUSE_BUTTON_COUNT];
+    bool mouseLifted[MOUSE_BUTTON_COUNT];
+    bool pendingMouseHit[MOUSE_BUTTON_COUNT];
+    bool pendingMouseLifted[MOUSE_BUTTON_COUNT];
     
-    int x = 0;
-    int y = radius;
-    int d = 3 - 2 * radius;
+    int mouseX, mouseY;
+    int prevMouseX, prevMouseY;
+    int mouseDeltaX, mouseDeltaY;
     
-    auto drawCirclePoints = [&](int xc, int yc, int x, int y) {
-        SDL_RenderDrawPoint(window->renderer, xc + x, yc + y);
-        SDL_RenderDrawPoint(window->renderer, xc - x, yc + y);
-        SDL_RenderDrawPoint(window->renderer, xc + x, yc - y);
-        SDL_RenderDrawPoint(window->renderer, xc - x, yc - y);
-        SDL_RenderDrawPoint(window->renderer, xc + y, yc + x);
-        SDL_RenderDrawPoint(window->renderer, xc - y, yc + x);
-        SDL_RenderDrawPoint(window->renderer, xc + y, yc - x);
-        SDL_RenderDrawPoint(window->renderer, xc - y, yc - x);
-    };
+    int mouseWheelDelta;
+    int pendingWheel;
     
-    drawCirclePoints(centerX, centerY, x, y);
+    std::deque<Event> events;
+    int pendingEvents;           // Events queued since the last poll
     
-    while (y >= x) {
-        x++;
-        
-        if (d > 0) {
-            y--;
-            d = d + 4 * (x - y) + 10;
-        } else {
-            d = d + 4 * x + 6;
+    // Maps window pixels to logical pixels when a logical size is set
+    int viewScale;
+    int viewX, viewY;
+    
+    InputRecording* recording;
+    InputReplay* replay;
+    
+    InputState() : mouseX(0), mouseY(0), prevMouseX(0), prevMouseY(0),
+                   mouseDeltaX(0), mouseDeltaY(0), mouseWheelDelta(0),
+                   pendingWheel(0), pendingEvents(0), viewScale(1), viewX(0), viewY(0),
+                   recording(nullptr), replay(nullptr) {
+        memset(keyState, 0, sizeof(keyState));
+        memset(keyHit, 0, sizeof(keyHit));
+        memset(keyLifted, 0, sizeof(keyLifted));
+        memset(pendingKeyHit, 0, sizeof(pendingKeyHit));
+        memset(pendingKeyLifted, 0, sizeof(pendingKeyLifted));
+        memset(mouseState, 0, sizeof(mouseState));
+        memset(mouseHit, 0, sizeof(mouseHit));
+        memset(mouseLifted, 0, sizeof(mouseLifted));
+        memset(pendingMouseHit, 0, sizeof(pendingMouseHit));
+        memset(pendingMouseLifted, 0, sizeof(pendingMouseLifted));
+    }
+    
+    ~InputState() {
+        if (recording) std::fclose(recording->file);
+        delete recording;
+        delete replay;
+    }
+};
+
+uint64_t getTimestamp() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void queueEvent(InputState& input, Event& event) {
+    event.timestamp = getTimestamp();
+    event.x = input.mouseX;
+    event.y = input.mouseY;
+    
+    if (input.events.size() >= static_cast<size_t>(MAX_QUEUED_EVENTS)) {
+        input.events.pop_front();
+    }
+    input.events.push_back(event);
+    input.pendingEvents++;
+}
+
+static void putVarint(std::vector<uint8_t>& out, int value) {
+    uint32_t bits = (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+    while (bits >= 0x80) {
+        out.push_back(static_cast<uint8_t>(bits | 0x80));
+        bits >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(bits));
+}
+
+static bool getVarint(const std::vector<uint8_t>& in, size_t& pos, int& value) {
+    uint32_t bits = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (pos >= in.size()) return false;
+        uint8_t byte = in[pos++];
+        bits |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            value = static_cast<int>((bits >> 1) ^ (0u - (bits & 1)));
+            return true;
         }
-        
-        drawCirclePoints(centerX, centerY, x, y);
     }
+    return false;
 }
 
-void drawFilledCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
-    if (!window || !window->renderer) return;
+// Live device input is ignored while a recording is replayed
+static bool acceptInput(const InputState& input) {
+    return !input.replay || input.replay->applying;
+}
+
+static void recordInput(InputState& input, InputRecord record, int value = 0) {
+    InputRecording* recording = input.recording;
+    if (!recording) return;
     
-    setDrawColor(window, color);
+    recording->frame.push_back(static_cast<uint8_t>(record));
+    if (record == RECORD_KEY_DOWN || record == RECORD_KEY_UP ||
+        record == RECORD_BUTTON_DOWN || record == RECORD_BUTTON_UP) {
+        recording->frame.push_back(static_cast<uint8_t>(value));
+    } else if (record == RECORD_WHEEL) {
+        putVarint(recording->frame, value);
+    } else if (record == RECORD_MOTION || record == RECORD_RECENTER) {
+        putVarint(recording->frame, input.mouseX - recording->lastX);
+        putVarint(recording->frame, input.mouseY - recording->lastY);
+        recording->lastX = input.mouseX;
+        recording->lastY = input.mouseY;
+    }
+}
+
+static void moveMouse(InputState& input, int x, int y);
+static void placeMouse(InputState& input, int x, int y);
+static void inputKey(InputState& input, KeyCode key, bool down);
+static void inputButton(InputState& input, MouseButton button, bool down);
+static void inputWheel(InputState& input, int steps);
+static void inputClose(InputState& input);
+static void queueClose(InputState& input);
+
+// Applies records up to the end of the frame (or, with recenters set, only
+// the recenters that follow it). False once the data ran out or is damaged.
+static bool replayRecords(InputState& input, bool recenters) {
+    InputReplay& replay = *input.replay;
+    const std::vector<uint8_t>& data = replay.data;
     
-    for (int y = -radius; y <= radius; y++) {
-        for (int x = -radius; x <= radius; x++) {
-            if (x * x + y * y <= radius * radius) {
-                SDL_RenderDrawPoint(window->renderer, centerX + x, centerY + y);
+    replay.applying = true;
+    bool ok = false;
+    while (replay.pos < data.size()) {
+        uint8_t record = data[replay.pos];
+        if (recenters && record != RECORD_RECENTER) {
+            ok = true;
+            break;
+        }
+        replay.pos++;
+        
+        int x, y, steps;
+        if (record == RECORD_FRAME) {
+            ok = true;
+            break;
+        } else if (record >= RECORD_KEY_DOWN && record <= RECORD_BUTTON_UP) {
+            if (replay.pos >= data.size()) break;
+            uint8_t value = data[replay.pos++];
+            if (record == RECORD_KEY_DOWN || record == RECORD_KEY_UP) {
+                inputKey(input, static_cast<KeyCode>(value), record == RECORD_KEY_DOWN);
+            } else {
+                inputButton(input, static_cast<MouseButton>(value), record == RECORD_BUTTON_DOWN);
+            }
+        } else if (record == RECORD_MOTION || record == RECORD_RECENTER) {
+            if (!getVarint(data, replay.pos, x) || !getVarint(data, replay.pos, y)) break;
+            replay.lastX += x;
+            replay.lastY += y;
+            if (record == RECORD_MOTION) {
+                moveMouse(input, replay.lastX, replay.lastY);
+            } else {
+                placeMouse(input, replay.lastX, replay.lastY);
             }
+        } else if (record == RECORD_WHEEL) {
+            if (!getVarint(data, replay.pos, steps)) break;
+            inputWheel(input, steps);
+        } else if (record == RECORD_CLOSE) {
+            inputClose(input);
+        } else {
+            break;
         }
     }
+    replay.applying = false;
+    
+    // Recenters may legitimately be the last records of a file
+    if (recenters && replay.pos >= data.size()) ok = true;
+    return ok;
 }
 
-void delay(uint32_t milliseconds) {
-    SDL_Delay(milliseconds);
+// Called by the owning window's pollEvents/waitEvents once native events
+// have been drained. Makes everything accumulated since the last call visible.
+static void publishInputFrame(InputState& input) {
+    InputReplay* replay = input.replay;
+    if (replay && !replay->finished && !replayRecords(input, false)) {
+        replay->finished = true;
+        queueClose(input);
+    }
+    
+    memcpy(input.keyHit, input.pendingKeyHit, sizeof(input.keyHit));
+    memcpy(input.keyLifted, input.pendingKeyLifted, sizeof(input.keyLifted));
+    memcpy(input.mouseHit, input.pendingMouseHit, sizeof(input.mouseHit));
+    memcpy(input.mouseLifted, input.pendingMouseLifted, sizeof(input.mouseLifted));
+    memset(input.pendingKeyHit, 0, sizeof(input.pendingKeyHit));
+    memset(input.pendingKeyLifted, 0, sizeof(input.pendingKeyLifted));
+    memset(input.pendingMouseHit, 0, sizeof(input.pendingMouseHit));
+    memset(input.pendingMouseLifted, 0, sizeof(input.pendingMouseLifted));
+    
+    input.mouseWheelDelta = input.pendingWheel;
+    input.pendingWheel = 0;
+    
+    input.mouseDeltaX = input.mouseX - input.prevMouseX;
+    input.mouseDeltaY = input.mouseY - input.prevMouseY;
+    input.prevMouseX = input.mouseX;
+    input.prevMouseY = input.mouseY;
+    
+    input.pendingEvents = 0;
+    
+    if (InputRecording* recording = input.recording) {
+        recording->frame.push_back(RECORD_FRAME);
+        std::fwrite(recording->frame.data(), 1, recording->frame.size(), recording->file);
+        recording->frame.clear();
+    }
+    if (replay && !replay->finished && !replayRecords(input, true)) {
+        replay->finished = true;
+    }
 }
 
-// ============================================================================
-// INPUT HANDLING - SDL
-// ============================================================================
-
-bool keyDown(WindowHandle* window, KeyCode key) {
-    if (!window || key >= KEY_COUNT) return false;
-    return window->keyState[key];
+// Whether waitEvents has something to return: a replay always has a frame
+static bool inputPending(const InputState& input) {
+    return input.pendingEvents > 0 || input.replay != nullptr;
 }
 
-bool keyPressed(WindowHandle* window, KeyCode key) {
-    if (!window || key >= KEY_COUNT) return false;
-    return window->keyState[key] && !window->prevKeyState[key];
+// Asked to close by a finished replay
+static bool replayClosed(const InputState& input) {
+    return input.replay && input.replay->finished;
 }
 
-bool keyReleased(WindowHandle* window, KeyCode key) {
-    if (!window || key >= KEY_COUNT) return false;
-    return !window->keyState[key] && window->prevKeyState[key];
+static int floorDiv(int value, int divisor) {
+    int quotient = value / divisor;
+    return (value % divisor != 0 && value < 0) ? quotient - 1 : quotient;
 }
 
-bool mouseDown(WindowHandle* window, MouseButton button) {
-    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
-    return window->mouseState[button];
+static int windowToLogicalX(const InputState& input, int x) { return floorDiv(x - input.viewX, input.viewScale); }
+static int windowToLogicalY(const InputState& input, int y) { return floorDiv(y - input.viewY, input.viewScale); }
+
+// Center of the window pixel block a logical pixel is shown as
+static int logicalToWindowX(const InputState& input, int x) {
+    return x * input.viewScale + input.viewX + input.viewScale / 2;
+}
+static int logicalToWindowY(const InputState& input, int y) {
+    return y * input.viewScale + input.viewY + input.viewScale / 2;
 }
 
-bool mousePressed(WindowHandle* window, MouseButton button) {
-    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
-    return window->mouseState[button] && !window->prevMouseState[button];
+// Moves the mouse without a delta (x/y in logical pixels)
+static void placeMouse(InputState& input, int x, int y) {
+    input.mouseX = input.prevMouseX = x;
+    input.mouseY = input.prevMouseY = y;
+    recordInput(input, RECORD_RECENTER);
 }
 
-bool mouseReleased(WindowHandle* window, MouseButton button) {
-    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
-    return !window->mouseState[button] && window->prevMouseState[button];
+// Used by mouse locking after the cursor was warped back to the center
+// (x/y in window pixels)
+static void recenterMouse(InputState& input, int x, int y) {
+    if (!acceptInput(input)) return;
+    placeMouse(input, windowToLogicalX(input, x), windowToLogicalY(input, y));
 }
 
-void getMousePosition(WindowHandle* window, int& x, int& y) {
-    if (!window) {
-        x = y = 0;
-        return;
+static void inputKey(InputState& input, KeyCode key, bool down) {
+    if (key == KEY_UNKNOWN || key >= KEY_COUNT || !acceptInput(input)) return;
+    if (input.keyState[key] == down) return; // Auto-repeat
+    
+    input.keyState[key] = down;
+    recordInput(input, down ? RECORD_KEY_DOWN : RECORD_KEY_UP, key);
+    if (down) {
+        input.pendingKeyHit[key] = true;
+    } else {
+        input.pendingKeyLifted[key] = true;
     }
-    x = window->mouseX;
-    y = window->mouseY;
+    
+    Event event;
+    event.type = down ? EVENT_KEY_DOWN : EVENT_KEY_UP;
+    event.key = key;
+    queueEvent(input, event);
 }
 
-void getMouseDelta(WindowHandle* window, int& dx, int& dy) {
-    if (!window) {
-        dx = dy = 0;
-        return;
+static void inputButton(InputState& input, MouseButton button, bool down) {
+    if (button >= MOUSE_BUTTON_COUNT || !acceptInput(input)) return;
+    if (input.mouseState[button] == down) return;
+    
+    input.mouseState[button] = down;
+    recordInput(input, down ? RECORD_BUTTON_DOWN : RECORD_BUTTON_UP, button);
+    if (down) {
+        input.pendingMouseHit[button] = true;
+    } else {
+        input.pendingMouseLifted[button] = true;
     }
-    dx = window->mouseDeltaX;
-    dy = window->mouseDeltaY;
+    
+    Event event;
+    event.type = down ? EVENT_MOUSE_DOWN : EVENT_MOUSE_UP;
+    event.button = button;
+    queueEvent(input, event);
 }
 
-void setMousePosition(WindowHandle* window, int x, int y) {
-    if (!window || !window->window) return;
-    SDL_WarpMouseInWindow(window->window, x, y);
-    window->mouseX = x;
-    window->mouseY = y;
+// x/y in logical pixels
+static void moveMouse(InputState& input, int x, int y) {
+    input.mouseX = x;
+    input.mouseY = y;
+    recordInput(input, RECORD_MOTION);
+    
+    Event event;
+    event.type = EVENT_MOUSE_MOVE;
+    queueEvent(input, event);
 }
 
-void setMouseLocked(WindowHandle* window, bool locked) {
-    if (!window || !window->window) return;
-    window->mouseLocked = locked;
+static void inputMotion(InputState& input, int x, int y) {
+    if (!acceptInput(input)) return;
+    moveMouse(input, windowToLogicalX(input, x), windowToLogicalY(input, y));
+}
+
+static void inputWheel(InputState& input, int steps) {
+    if (steps == 0 || !acceptInput(input)) return;
+    input.pendingWheel += steps;
+    recordInput(input, RECORD_WHEEL, steps);
     
-    if (locked) {
-        SDL_SetRelativeMouseMode(SDL_TRUE);
-        SDL_ShowCursor(SDL_DISABLE);
-    } else {
-        SDL_SetRelativeMouseMode(SDL_FALSE);
-        SDL_ShowCursor(SDL_ENABLE);
-    }
+    Event event;
+    event.type = EVENT_MOUSE_WHEEL;
+    event.wheel = steps;
+    queueEvent(input, event);
 }
 
-bool isMouseLocked(WindowHandle* window) {
-    if (!window) return false;
-    return window->mouseLocked;
+static void queueClose(InputState& input) {
+    Event event;
+    event.type = EVENT_CLOSE;
+    queueEvent(input, event);
 }
 
-int getMouseWheelDelta(WindowHandle* window) {
-    if (!window) return 0;
-    return window->mouseWheelDelta;
+// Closing the window still works during a replay
+static void inputClose(InputState& input) {
+    recordInput(input, RECORD_CLOSE);
+    queueClose(input);
 }
 
-#endif // USE_SDL
+// ============================================================================
+// PRESENT PACING - shared by all backends
+// ============================================================================
 
-#ifdef USE_WIN32
+const int DEFAULT_REFRESH_RATE = 60;
 
-#include <windows.h>
-#include <vector>
-#include <cstring>
+// Frame pacing for present modes the backend can't do natively. The schedule
+// advances in whole refresh periods from the last present, so a steady frame
+// rate doesn't drift and a late frame doesn't push every later frame back.
+struct PresentClock {
+    PresentMode mode;
+    uint64_t interval;      // Refresh period in microseconds
+    uint64_t nextVBlank;    // Estimated time of the next refresh
+    
+    PresentClock(PresentMode presentMode = PRESENT_VSYNC)
+        : mode(presentMode), interval(1000000 / DEFAULT_REFRESH_RATE), nextVBlank(0) {}
+    
+    void setRefreshRate(int hz) {
+        if (hz <= 1) hz = DEFAULT_REFRESH_RATE; // 0/1 mean "hardware default"
+        interval = 1000000 / hz;
+    }
+};
 
-// Platform-specific window handle structure for Win32
-struct WindowHandle {
-    HWND hwnd;
-    HDC hdc;
-    HDC memDC;
-    HBITMAP memBitmap;
-    HBITMAP oldBitmap;
-    int width;
-    int height;
-    bool shouldClose;
-    COLORREF currentColor;
+static void advanceVBlank(PresentClock& clock, uint64_t now) {
+    if (now >= clock.nextVBlank + clock.interval) {
+        // Fell behind by more than a refresh: restart the schedule from now
+        clock.nextVBlank = now + clock.interval;
+    } else {
+        while (clock.nextVBlank <= now) clock.nextVBlank += clock.interval;
+    }
+}
+
+// Rate-capped immediate: never block, present the first frame of each refresh
+// period right away and drop the rest of that period's frames. Returns false
+// when this frame should be dropped. Only meant for loops that keep
+// rendering, the very last frame may otherwise go unseen.
+static bool cappedFrameDue(PresentClock& clock) {
+    uint64_t now = getTimestamp();
+    if (now < clock.nextVBlank) return false;
+    advanceVBlank(clock, now);
+    return true;
+}
+
+// Emulated vsync: sleeps until the next estimated refresh. In adaptive mode
+// a frame that already missed its refresh is presented right away instead of
+// waiting a whole extra period.
+static void waitForVBlank(PresentClock& clock) {
+    uint64_t now = getTimestamp();
+    bool late = now >= clock.nextVBlank;
     
-    // Input state
-    bool keyState[KEY_COUNT];
-    bool prevKeyState[KEY_COUNT];
+    // Late frames go out right away in adaptive mode, and in vsync mode once
+    // the schedule is more than a whole refresh behind
+    if (late && (clock.mode == PRESENT_ADAPTIVE || now >= clock.nextVBlank + clock.interval)) {
+        advanceVBlank(clock, now);
+        return;
+    }
     
-    bool mouseState[MOUSE_BUTTON_COUNT];
-    bool prevMouseState[MOUSE_BUTTON_COUNT];
+    if (late) advanceVBlank(clock, now);
+    std::this_thread::sleep_for(std::chrono::microseconds(clock.nextVBlank - now));
+    clock.nextVBlank += clock.interval;
+}
+
+// ============================================================================
+// PIXEL FORMATS - shared by all backends
+// ============================================================================
+
+// Memory layout of one pixel: the channel masks of the pixel read as a native
+// endian 16/32-bit word. A zero alpha mask means the format has no alpha.
+// Bits not covered by any mask are written as zero.
+struct PixelLayout {
+    int bytesPerPixel;
+    uint32_t redMask, greenMask, blueMask, alphaMask;
+};
+
+static bool hostIsLittleEndian() {
+    const uint32_t one = 1;
+    uint8_t firstByte;
+    std::memcpy(&firstByte, &one, 1);
+    return firstByte == 1;
+}
+
+// Mask of the channel stored in memory byte i of a 32-bit pixel
+static uint32_t byteMask(int byteIndex) {
+    int shift = hostIsLittleEndian() ? byteIndex * 8 : (3 - byteIndex) * 8;
+    return 0xFFu << shift;
+}
+
+static PixelLayout layoutOf(PixelFormat format) {
+    PixelLayout layout = {4, 0, 0, 0, 0};
+    switch (format) {
+        case PIXEL_RGBA32:
+            layout.redMask = byteMask(0); layout.greenMask = byteMask(1);
+            layout.blueMask = byteMask(2); layout.alphaMask = byteMask(3);
+            break;
+        case PIXEL_BGRA32:
+            layout.blueMask = byteMask(0); layout.greenMask = byteMask(1);
+            layout.redMask = byteMask(2); layout.alphaMask = byteMask(3);
+            break;
+        case PIXEL_BGRX32:
+            layout.blueMask = byteMask(0); layout.greenMask = byteMask(1);
+            layout.redMask = byteMask(2);
+            break;
+        case PIXEL_ARGB32:
+            layout.alphaMask = byteMask(0); layout.redMask = byteMask(1);
+            layout.greenMask = byteMask(2); layout.blueMask = byteMask(3);
+            break;
+        case PIXEL_RGB565:
+            layout.bytesPerPixel = 2;
+            layout.redMask = 0xF800; layout.greenMask = 0x07E0; layout.blueMask = 0x001F;
+            break;
+    }
+    return layout;
+}
+
+// Finds the memory byte of each channel (R, G, B, A) for 32-bit layouts whose
+// channels are whole bytes. A missing alpha channel is reported as -1.
+static bool byteLayout(const PixelLayout& layout, int bytes[4]) {
+    if (layout.bytesPerPixel != 4) return false;
     
-    int mouseX, mouseY;
-    int prevMouseX, prevMouseY;
-    int mouseDeltaX, mouseDeltaY;
+    const uint32_t masks[4] = {layout.redMask, layout.greenMask, layout.blueMask, layout.alphaMask};
+    for (int channel = 0; channel < 4; channel++) {
+        bytes[channel] = -1;
+        if (channel == 3 && masks[3] == 0) continue;
+        for (int i = 0; i < 4; i++) {
+            if (masks[channel] == byteMask(i)) bytes[channel] = i;
+        }
+        if (bytes[channel] < 0) return false;
+    }
+    return true;
+}
+
+static bool isRGB565(const PixelLayout& layout) {
+    return layout.bytesPerPixel == 2 && layout.redMask == 0xF800 && layout.greenMask == 0x07E0 &&
+           layout.blueMask == 0x001F && layout.alphaMask == 0;
+}
+
+// Shift and width of one channel, for layouts without a fast path
+struct ChannelCodec {
+    uint32_t mask;
+    int shift;
+    int bits;
     
-    int mouseWheelDelta;
+    ChannelCodec(uint32_t channelMask = 0) : mask(channelMask), shift(0), bits(0) {
+        if (!mask) return;
+        while (!((mask >> shift) & 1)) shift++;
+        while (bits + shift < 32 && ((mask >> (shift + bits)) & 1)) bits++;
+    }
     
-    bool mouseLocked;
+    uint32_t pack(uint8_t value) const {
+        if (!mask) return 0;
+        uint32_t v = bits <= 8 ? value >> (8 - bits)
+                               : (static_cast<uint32_t>(value) << (bits - 8)) | (value >> (16 - bits));
+        return (v << shift) & mask;
+    }
     
-    WindowHandle() : hwnd(nullptr), hdc(nullptr), memDC(nullptr), 
-                     memBitmap(nullptr), oldBitmap(nullptr),
-                     width(0), height(0), shouldClose(false), 
-                     currentColor(RGB(255, 255, 255)),
-                     mouseX(0), mouseY(0), prevMouseX(0), prevMouseY(0),
-                     mouseDeltaX(0), mouseDeltaY(0), mouseWheelDelta(0),
-                     mouseLocked(false) {
-        memset(keyState, 0, sizeof(keyState));
-        memset(prevKeyState, 0, sizeof(prevKeyState));
-        memset(mouseState, 0, sizeof(mouseState));
-        memset(prevMouseState, 0, sizeof(prevMouseState));
+    // Expands by bit replication, so full scale maps to 255 and 565 matches the SIMD path
+    uint8_t unpack(uint32_t pixel) const {
+        if (!mask) return 255;
+        uint32_t v = (pixel & mask) >> shift;
+        if (bits >= 8) return static_cast<uint8_t>(v >> (bits - 8));
+        uint32_t expanded = v << (8 - bits);
+        for (int filled = bits; filled < 8; filled *= 2) expanded |= expanded >> filled;
+        return static_cast<uint8_t>(expanded);
     }
 };
 
-// Global window class name
-static const char* WINDOW_CLASS_NAME = "LibGraffikWindowClass";
-static bool classRegistered = false;
+static uint32_t packPixel(const PixelLayout& layout, const Color& color) {
+    return ChannelCodec(layout.redMask).pack(color.r) | ChannelCodec(layout.greenMask).pack(color.g) |
+           ChannelCodec(layout.blueMask).pack(color.b) | ChannelCodec(layout.alphaMask).pack(color.a);
+}
 
-// Win32 key mapping
-static KeyCode mapWin32Key(WPARAM wParam) {
-    switch (wParam) {
-        case VK_UP: return KEY_UP;
-        case VK_DOWN: return KEY_DOWN;
-        case VK_LEFT: return KEY_LEFT;
-        case VK_RIGHT: return KEY_RIGHT;
-        
-        case 'A': return KEY_A;
-        case 'B': return KEY_B;
-        case 'C': return KEY_C;
-        case 'D': return KEY_D;
-        case 'E': return KEY_E;
-        case 'F': return KEY_F;
-        case 'G': return KEY_G;
-        case 'H': return KEY_H;
-        case 'I': return KEY_I;
-        case 'J': return KEY_J;
-        case 'K': return KEY_K;
-        case 'L': return KEY_L;
-        case 'M': return KEY_M;
-        case 'N': return KEY_N;
-        case 'O': return KEY_O;
-        case 'P': return KEY_P;
-        case 'Q': return KEY_Q;
-        case 'R': return KEY_R;
-        case 'S': return KEY_S;
-        case 'T': return KEY_T;
-        case 'U': return KEY_U;
-        case 'V': return KEY_V;
-        case 'W': return KEY_W;
-        case 'X': return KEY_X;
-        case 'Y': return KEY_Y;
-        case 'Z': return KEY_Z;
-        
-        case '0': return KEY_0;
-        case '1': return KEY_1;
-        case '2': return KEY_2;
-        case '3': return KEY_3;
-        case '4': return KEY_4;
-        case '5': return KEY_5;
-        case '6': return KEY_6;
-        case '7': return KEY_7;
-        case '8': return KEY_8;
-        case '9': return KEY_9;
-        
-        case VK_F1: return KEY_F1;
-        case VK_F2: return KEY_F2;
-        case VK_F3: return KEY_F3;
-        case VK_F4: return KEY_F4;
-        case VK_F5: return KEY_F5;
-        case VK_F6: return KEY_F6;
-        case VK_F7: return KEY_F7;
-        case VK_F8: return KEY_F8;
-        case VK_F9: return KEY_F9;
-        case VK_F10: return KEY_F10;
-        case VK_F11: return KEY_F11;
-        case VK_F12: return KEY_F12;
-        
-        case VK_SPACE: return KEY_SPACE;
-        case VK_RETURN: return KEY_ENTER;
-        case VK_ESCAPE: return KEY_ESCAPE;
-        case VK_BACK: return KEY_BACKSPACE;
-        case VK_TAB: return KEY_TAB;
-        case VK_SHIFT: return KEY_SHIFT;
-        case VK_CONTROL: return KEY_CONTROL;
-        case VK_MENU: return KEY_ALT;
-        
-        case VK_OEM_PLUS: return KEY_PLUS;
-        case VK_OEM_MINUS: return KEY_MINUS;
-        
-        default: return KEY_UNKNOWN;
+// A pixel of Word's size as one integer. Loops over a layout are instantiated
+// per pixel size and dispatched once per call, not once per pixel.
+template <typename Word>
+static inline uint32_t readWord(const uint8_t* p) {
+    Word v;
+    std::memcpy(&v, p, sizeof(Word));
+    return v;
+}
+
+template <typename Word>
+static inline void writeWord(uint8_t* p, uint32_t value) {
+    Word v = static_cast<Word>(value);
+    std::memcpy(p, &v, sizeof(Word));
+}
+
+template <typename Word>
+static void unpackWords(const uint8_t* src, const PixelLayout& from, uint8_t* rgba, size_t count) {
+    const ChannelCodec r(from.redMask), g(from.greenMask), b(from.blueMask), a(from.alphaMask);
+    for (size_t i = 0; i < count; i++, src += sizeof(Word), rgba += 4) {
+        uint32_t pixel = readWord<Word>(src);
+        rgba[0] = r.unpack(pixel);
+        rgba[1] = g.unpack(pixel);
+        rgba[2] = b.unpack(pixel);
+        rgba[3] = a.unpack(pixel);
     }
 }
 
-// Window procedure
-LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
-    WindowHandle* handle = (WindowHandle*)GetWindowLongPtr(hwnd, GWLP_USERDATA);
-    
-    switch (uMsg) {
-        case WM_CLOSE:
-            if (handle) {
-                handle->shouldClose = true;
-            }
-            return 0;
-            
-        case WM_KEYDOWN:
-        case WM_SYSKEYDOWN: {
+template <typename Word>
+static void packWords(const uint8_t* rgba, uint8_t* dst, const PixelLayout& to, size_t count) {
+    const ChannelCodec r(to.redMask), g(to.greenMask), b(to.blueMask), a(to.alphaMask);
+    for (size_t i = 0; i < count; i++, rgba += 4, dst += sizeof(Word)) {
+        writeWord<Word>(dst, r.pack(rgba[0]) | g.pack(rgba[1]) | b.pack(rgba[2]) | a.pack(rgba[3]));
+    }
+}
+
+static void unpackGeneric(const uint8_t* src, const PixelLayout& from, uint8_t* rgba, size_t count) {
+    if (from.bytesPerPixel == 4) unpackWords<uint32_t>(src, from, rgba, count);
+    else if (from.bytesPerPixel == 2) unpackWords<uint16_t>(src, from, rgba, count);
+    else unpackWords<uint8_t>(src, from, rgba, count);
+}
+
+static void packGeneric(const uint8_t* rgba, uint8_t* dst, const PixelLayout& to, size_t count) {
+    if (to.bytesPerPixel == 4) packWords<uint32_t>(rgba, dst, to, count);
+    else if (to.bytesPerPixel == 2) packWords<uint16_t>(rgba, dst, to, count);
+    else packWords<uint8_t>(rgba, dst, to, count);
+}
+
+// Byte shuffle between 32-bit layouts. map[j] is the source byte of
+// destination byte j, SHUFFLE_ZERO / SHUFFLE_OPAQUE fill it with 0x00 / 0xFF.
+const int SHUFFLE_ZERO = -1;
+const int SHUFFLE_OPAQUE = -2;
+
+static void shuffleScalar(const uint8_t* src, uint8_t* dst, size_t count, const int map[4]) {
+    for (size_t i = 0; i < count; i++, src += 4, dst += 4) {
+        uint8_t pixel[4];
+        for (int j = 0; j < 4; j++) {
+            pixel[j] = map[j] >= 0 ? src[map[j]] : (map[j] == SHUFFLE_OPAQUE ? 0xFF : 0x00);
+        }
+        std::memcpy(dst, pixel, 4);
+    }
+}
+
+#ifdef GRAPHICS_X86_SIMD
+// 0 = scalar, 1 = SSSE3, 2 = AVX2
+static int simdLevel() {
+    static int level = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return 2;
+        if (__builtin_cpu_supports("ssse3")) return 1;
+        return 0;
+    }();
+    return level;
+}
+
+// pshufb control for four pixels, plus the bytes to force to 0xFF
+static void shuffleControl(const int map[4], uint8_t control[16], uint8_t fill[16]) {
+    for (int p = 0; p < 4; p++) {
+        for (int j = 0; j < 4; j++) {
+            control[p * 4 + j] = map[j] >= 0 ? static_cast<uint8_t>(p * 4 + map[j]) : 0x80;
+            fill[p * 4 + j] = map[j] == SHUFFLE_OPAQUE ? 0xFF : 0x00;
+        }
+    }
+}
+
+// The SIMD kernels return how many pixels they converted, the caller finishes the tail
+__attribute__((target("ssse3")))
+static size_t shuffleSSSE3(const uint8_t* src, uint8_t* dst, size_t count, const int map[4]) {
+    uint8_t control[16], fill[16];
+    shuffleControl(map, control, fill);
+    const __m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(control));
+    const __m128i opaque = _mm_loadu_si128(reinterpret_cast<const __m128i*>(fill));
+    
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+        v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), opaque);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), v);
+    }
+    return i;
+}
+
+// vpshufb shuffles within 128-bit lanes, which is fine since pixels never straddle them
+__attribute__((target("avx2")))
+static size_t shuffleAVX2(const uint8_t* src, uint8_t* dst, size_t count, const int map[4]) {
+    uint8_t control[16], fill[16];
+    shuffleControl(map, control, fill);
+    const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(control)));
+    const __m256i opaque = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(fill)));
+    
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4 + 32));
+        a = _mm256_or_si256(_mm256_shuffle_epi8(a, shuffle), opaque);
+        b = _mm256_or_si256(_mm256_shuffle_epi8(b, shuffle), opaque);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), a);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4 + 32), b);
+    }
+    return i;
+}
+
+// RGBA bytes -> RGB565, eight pixels per iteration
+__attribute__((target("sse2")))
+static size_t packRGB565SSE2(const uint8_t* rgba, uint16_t* dst, size_t count) {
+    const __m128i redMask = _mm_set1_epi32(0xF8);
+    const __m128i greenMask = _mm_set1_epi32(0xFC);
+    const __m128i bias = _mm_set1_epi32(0x8000);
+    
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i halves[2];
+        for (int h = 0; h < 2; h++) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba + (i + h * 4) * 4));
+            __m128i r = _mm_slli_epi32(_mm_and_si128(v, redMask), 8);
+            __m128i g = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 8), greenMask), 3);
+            __m128i b = _mm_srli_epi32(_mm_and_si128(_mm_srli_epi32(v, 16), redMask), 3);
+            // Bias into signed range so the saturating pack keeps all 16 bits
+            halves[h] = _mm_sub_epi32(_mm_or_si128(_mm_or_si128(r, g), b), bias);
+        }
+        __m128i packed = _mm_add_epi16(_mm_packs_epi32(halves[0], halves[1]), _mm_set1_epi16(-0x8000));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), packed);
+    }
+    return i;
+}
+
+// RGB565 -> RGBA bytes, eight pixels per iteration
+__attribute__((target("sse2")))
+static size_t unpackRGB565SSE2(const uint16_t* src, uint8_t* rgba, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask5 = _mm_set1_epi32(0x1F);
+    const __m128i mask6 = _mm_set1_epi32(0x3F);
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+    
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i words = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i halves[2] = {_mm_unpacklo_epi16(words, zero), _mm_unpackhi_epi16(words, zero)};
+        for (int h = 0; h < 2; h++) {
+            __m128i v = halves[h];
+            __m128i r = _mm_srli_epi32(v, 11);
+            __m128i g = _mm_and_si128(_mm_srli_epi32(v, 5), mask6);
+            __m128i b = _mm_and_si128(v, mask5);
+            r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+            g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+            b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+            __m128i out = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)),
+                                       _mm_or_si128(_mm_slli_epi32(b, 16), alpha));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(rgba + (i + h * 4) * 4), out);
+        }
+    }
+    return i;
+}
+#endif // GRAPHICS_X86_SIMD
+
+static void shufflePixels(const uint8_t* src, uint8_t* dst, size_t count, const int map[4]) {
+    size_t done = 0;
+#ifdef GRAPHICS_X86_SIMD
+    if (simdLevel() >= 2) done = shuffleAVX2(src, dst, count, map);
+    if (simdLevel() >= 1) done += shuffleSSSE3(src + done * 4, dst + done * 4, count - done, map);
+#endif
+    shuffleScalar(src + done * 4, dst + done * 4, count - done, map);
+}
+
+// Converts to RGBA bytes (the layout of Color)
+static void unpackPixels(const uint8_t* src, const PixelLayout& from, uint8_t* rgba, size_t count) {
+    int bytes[4];
+    if (byteLayout(from, bytes)) {
+        int map[4] = {bytes[0], bytes[1], bytes[2], bytes[3] >= 0 ? bytes[3] : SHUFFLE_OPAQUE};
+        shufflePixels(src, rgba, count, map);
+        return;
+    }
+    
+    size_t done = 0;
+#ifdef GRAPHICS_X86_SIMD
+    if (isRGB565(from) && simdLevel() >= 1) {
+        done = unpackRGB565SSE2(reinterpret_cast<const uint16_t*>(src), rgba, count);
+    }
+#endif
+    unpackGeneric(src + done * from.bytesPerPixel, from, rgba + done * 4, count - done);
+}
+
+// Converts from RGBA bytes (the layout of Color)
+static void packPixels(const uint8_t* rgba, uint8_t* dst, const PixelLayout& to, size_t count) {
+    int bytes[4];
+    if (byteLayout(to, bytes)) {
+        int map[4] = {SHUFFLE_ZERO, SHUFFLE_ZERO, SHUFFLE_ZERO, SHUFFLE_ZERO};
+        for (int channel = 0; channel < 4; channel++) {
+            if (bytes[channel] >= 0) map[bytes[channel]] = channel;
+        }
+        shufflePixels(rgba, dst, count, map);
+        return;
+    }
+    
+    size_t done = 0;
+#ifdef GRAPHICS_X86_SIMD
+    if (isRGB565(to) && simdLevel() >= 1) {
+        done = packRGB565SSE2(rgba, reinterpret_cast<uint16_t*>(dst), count);
+    }
+#endif
+    packGeneric(rgba + done * 4, dst + done * to.bytesPerPixel, to, count - done);
+}
+
+// Converts between any two layouts. Byte-aligned 32-bit layouts are converted
+// with a single shuffle, everything else goes through RGBA in cache-sized chunks.
+static void convertLayout(const void* source, const PixelLayout& from, void* dest,
+                          const PixelLayout& to, size_t count) {
+    const uint8_t* src = static_cast<const uint8_t*>(source);
+    uint8_t* dst = static_cast<uint8_t*>(dest);
+    const PixelLayout rgbaLayout = layoutOf(PIXEL_RGBA32);
+    
+    int fromBytes[4], toBytes[4];
+    bool fromBytewise = byteLayout(from, fromBytes);
+    bool toBytewise = byteLayout(to, toBytes);
+    
+    if (fromBytewise && toBytewise) {
+        int map[4] = {SHUFFLE_ZERO, SHUFFLE_ZERO, SHUFFLE_ZERO, SHUFFLE_ZERO};
+        for (int channel = 0; channel < 4; channel++) {
+            if (toBytes[channel] < 0) continue;
+            map[toBytes[channel]] = fromBytes[channel] >= 0 ? fromBytes[channel] : SHUFFLE_OPAQUE;
+        }
+        shufflePixels(src, dst, count, map);
+        return;
+    }
+    
+    if (std::memcmp(&from, &rgbaLayout, sizeof(PixelLayout)) == 0) {
+        packPixels(src, dst, to, count);
+        return;
+    }
+    if (std::memcmp(&to, &rgbaLayout, sizeof(PixelLayout)) == 0) {
+        unpackPixels(src, from, dst, count);
+        return;
+    }
+    
+    const size_t CHUNK = 1024;
+    uint8_t rgba[CHUNK * 4];
+    for (size_t i = 0; i < count; i += CHUNK) {
+        size_t n = std::min(CHUNK, count - i);
+        unpackPixels(src + i * from.bytesPerPixel, from, rgba, n);
+        packPixels(rgba, dst + i * to.bytesPerPixel, to, n);
+    }
+}
+
+// Integer placement of a logical canvas in the window: the largest whole
+// scale that fits, centered. A canvas larger than the window is cropped.
+struct CanvasView {
+    int scale;
+    int x, y;
+};
+
+static CanvasView computeCanvasView(int windowWidth, int windowHeight, int canvasWidth, int canvasHeight) {
+    CanvasView view;
+    view.scale = std::max(1, std::min(windowWidth / canvasWidth, windowHeight / canvasHeight));
+    view.x = std::max(0, (windowWidth - canvasWidth * view.scale) / 2);
+    view.y = std::max(0, (windowHeight - canvasHeight * view.scale) / 2);
+    return view;
+}
+
+// SDL and Win32 scale the canvas in the blit; X11 needs it on the CPU when the
+// server has no RENDER extension
+#ifdef USE_X11
+#ifdef GRAPHICS_X86_SIMD
+// Repeats each 32-bit pixel `scale` times. Returns how many source pixels were done.
+__attribute__((target("sse2")))
+static int expandRow32SSE2(const uint32_t* src, uint32_t* dst, int width, int scale) {
+    int x = 0;
+    if (scale == 2) {
+        for (; x + 4 <= width; x += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 2), _mm_unpacklo_epi32(v, v));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 2 + 4), _mm_unpackhi_epi32(v, v));
+        }
+    } else if (scale >= 4) {
+        for (; x < width; x++) {
+            __m128i pixel = _mm_set1_epi32(static_cast<int>(src[x]));
+            uint32_t* out = dst + x * scale;
+            int i = 0;
+            for (; i + 4 <= scale; i += 4) _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), pixel);
+            for (; i < scale; i++) out[i] = src[x];
+        }
+    }
+    return x;
+}
+#endif // GRAPHICS_X86_SIMD
+
+static void expandRow(const uint8_t* src, uint8_t* dst, int width, int bytesPerPixel, int scale) {
+    int x = 0;
+    if (bytesPerPixel == 4) {
+        const uint32_t* in = reinterpret_cast<const uint32_t*>(src);
+        uint32_t* out = reinterpret_cast<uint32_t*>(dst);
+#ifdef GRAPHICS_X86_SIMD
+        x = expandRow32SSE2(in, out, width, scale);
+#endif
+        for (; x < width; x++) std::fill_n(out + x * scale, scale, in[x]);
+        return;
+    }
+    
+    for (; x < width; x++) {
+        for (int i = 0; i < scale; i++) {
+            std::memcpy(dst + (x * scale + i) * bytesPerPixel, src + x * bytesPerPixel, bytesPerPixel);
+        }
+    }
+}
+
+// Nearest-neighbour integer upscale: every source pixel becomes a scale x scale
+// block. Each row is expanded once, then copied down for the other scale-1 rows.
+// Rows must be 4-byte aligned for 32-bit pixels.
+static void upscaleNearest(const uint8_t* src, size_t srcPitch, int width, int height, int bytesPerPixel,
+                           uint8_t* dst, size_t dstPitch, int scale) {
+    size_t rowBytes = static_cast<size_t>(width) * scale * bytesPerPixel;
+    for (int y = 0; y < height; y++) {
+        uint8_t* out = dst + static_cast<size_t>(y) * scale * dstPitch;
+        expandRow(src + static_cast<size_t>(y) * srcPitch, out, width, bytesPerPixel, scale);
+        for (int i = 1; i < scale; i++) std::memcpy(out + i * dstPitch, out, rowBytes);
+    }
+}
+#endif // USE_X11
+
+// ============================================================================
+// SOFTWARE RASTER - shared by all backends
+// ============================================================================
+
+// Shape walkers for the buffers drawn on the CPU. They visit the same pixels
+// the backends draw and leave the writing to the caller: plot(x, y) for single
+// pixels and span(x0, x1, y) for inclusive runs on one row. Everything they
+// pass on is inside the clip rectangle, and no pixel is visited twice except
+// where the circle's octants meet.
+
+// The one pixel thick rectangle of the visible part of a horizontal or
+// vertical line, false for any other line. Backends fill these instead of
+// drawing a line.
+static bool axisLineRect(const LineWalk& walk, Rect& rect) {
+    if (walk.minor != 0) return false;
+    
+    int fromX, fromY, toX, toY;
+    walk.point(walk.first, fromX, fromY);
+    walk.point(walk.last, toX, toY);
+    rect = Rect(std::min(fromX, toX), std::min(fromY, toY), std::abs(toX - fromX) + 1, std::abs(toY - fromY) + 1);
+    return true;
+}
+
+// The outline of a width x height rectangle as up to four clipped edges that
+// don't overlap. Returns how many are visible.
+static int rectangleEdges(const ClipRect& clip, int x, int y, int width, int height, Rect edges[4]) {
+    if (width <= 0 || height <= 0) return 0;
+    
+    Rect candidates[4] = {
+        Rect(x, y, width, 1),
+        Rect(x, y + height - 1, width, height > 1 ? 1 : 0),
+        Rect(x, y + 1, 1, height - 2),
+        Rect(x + width - 1, y + 1, width > 1 ? 1 : 0, height - 2)
+    };
+    int count = 0;
+    for (int i = 0; i < 4; i++) {
+        Rect& edge = candidates[i];
+        if (clipRectangle(clip, edge.x, edge.y, edge.width, edge.height)) edges[count++] = edge;
+    }
+    return count;
+}
+
+// One pixel per major axis step, endpoints included
+template <typename Plot, typename Span>
+static void rasterLine(const ClipRect& clip, int x1, int y1, int x2, int y2, Plot plot, Span span) {
+    LineWalk walk;
+    if (!clipLine(clip, x1, y1, x2, y2, walk)) return;
+    
+    Rect line;
+    if (axisLineRect(walk, line) && line.height == 1) {
+        span(line.x, line.x + line.width - 1, line.y);
+        return;
+    }
+    walkLine(walk, plot);
+}
+
+template <typename Span>
+static void rasterFill(const ClipRect& clip, int x, int y, int width, int height, Span span) {
+    if (!clipRectangle(clip, x, y, width, height)) return;
+    for (int row = y; row < y + height; row++) span(x, x + width - 1, row);
+}
+
+template <typename Span>
+static void rasterRectangle(const ClipRect& clip, int x, int y, int width, int height, Span span) {
+    Rect edges[4];
+    int count = rectangleEdges(clip, x, y, width, height, edges);
+    for (int i = 0; i < count; i++) rasterFill(clip, edges[i].x, edges[i].y, edges[i].width, edges[i].height, span);
+}
+
+// Same midpoint walk as the backends use
+template <typename Plot>
+static void rasterCircle(const ClipRect& clip, int centerX, int centerY, int radius, Plot plot) {
+    if (circleOutsideClip(clip, centerX, centerY, radius)) return;
+    if (clipInsideCircle(clip, centerX, centerY, radius)) return;
+    
+    auto clipped = [&](int px, int py) {
+        if (pointInClip(clip, px, py)) plot(px, py);
+    };
+    
+    int x = 0;
+    int y = radius;
+    int d = 3 - 2 * radius;
+    for (;;) {
+        clipped(centerX + x, centerY + y);
+        clipped(centerX - x, centerY + y);
+        clipped(centerX + x, centerY - y);
+        clipped(centerX - x, centerY - y);
+        clipped(centerX + y, centerY + x);
+        clipped(centerX - y, centerY + x);
+        clipped(centerX + y, centerY - x);
+        clipped(centerX - y, centerY - x);
+        if (y < x) break;
+        
+        x++;
+        if (d > 0) {
+            y--;
+            d = d + 4 * (x - y) + 10;
+        } else {
+            d = d + 4 * x + 6;
+        }
+    }
+}
+
+// One span per row: every pixel with x*x + y*y <= r*r
+template <typename Span>
+static void rasterFilledCircle(const ClipRect& clip, int centerX, int centerY, int radius, Span span) {
+    if (circleOutsideClip(clip, centerX, centerY, radius)) return;
+    
+    int yMin = std::max(-radius, clip.y0 - centerY);
+    int yMax = std::min(radius, clip.y1 - 1 - centerY);
+    long long r2 = static_cast<long long>(radius) * radius;
+    for (int y = yMin; y <= yMax; y++) {
+        long long rest = r2 - static_cast<long long>(y) * y;
+        int half = static_cast<int>(std::sqrt(static_cast<double>(rest)));
+        while (static_cast<long long>(half + 1) * (half + 1) <= rest) half++;
+        while (static_cast<long long>(half) * half > rest) half--;
+        
+        int x0 = std::max(centerX - half, clip.x0);
+        int x1 = std::min(centerX + half, clip.x1 - 1);
+        if (x0 <= x1) span(x0, x1, centerY + y);
+    }
+}
+
+// ============================================================================
+// INDEXED FRAMEBUFFER - shared by all backends
+// ============================================================================
+
+const int PALETTE_SIZE = 256;
+
+// 8-bit back buffer of palette indices. Drawing writes one byte per pixel; the
+// palette is applied once per frame when swapBuffers expands the buffer to the
+// backend's pixel layout, so changing the palette recolours without redrawing.
+struct IndexedFramebuffer {
+    bool enabled;
+    int width;
+    int height;
+    std::vector<uint8_t> pixels;
+    
+    Color palette[PALETTE_SIZE];
+    bool paletteChanged;
+    std::vector<uint16_t> nearest;          // Colour -> index cache, keyed by RGB565
+    bool nearestStale;
+    
+    uint32_t expanded[PALETTE_SIZE];        // Palette packed into expandedLayout
+    PixelLayout expandedLayout;
+    
+    IndexedFramebuffer() : enabled(false), width(0), height(0), paletteChanged(true),
+                           nearest(65536, 0xFFFF), nearestStale(false) {
+        std::memset(&expandedLayout, 0, sizeof(expandedLayout));
+        
+        // Default palette: 6x6x6 colour cube followed by a 40 step grey ramp
+        for (int i = 0; i < 216; i++) {
+            palette[i] = Color(static_cast<uint8_t>((i / 36) * 51), static_cast<uint8_t>(((i / 6) % 6) * 51),
+                               static_cast<uint8_t>((i % 6) * 51));
+        }
+        for (int i = 216; i < PALETTE_SIZE; i++) {
+            uint8_t level = static_cast<uint8_t>((i - 216) * 255 / 39);
+            palette[i] = Color(level, level, level);
+        }
+    }
+    
+    void resize(int newWidth, int newHeight) {
+        width = newWidth;
+        height = newHeight;
+        pixels.assign(static_cast<size_t>(width) * height, 0);
+    }
+};
+
+static void setPaletteEntry(IndexedFramebuffer& fb, int index, const Color& color) {
+    fb.palette[index] = color;
+    fb.paletteChanged = true;
+    fb.nearestStale = true;
+}
+
+// Colours are drawn with the closest palette entry, alpha is ignored
+static uint8_t paletteIndexFor(IndexedFramebuffer& fb, const Color& color) {
+    if (fb.nearestStale) {
+        std::fill(fb.nearest.begin(), fb.nearest.end(), 0xFFFF);
+        fb.nearestStale = false;
+    }
+    
+    int key = ((color.r >> 3) << 11) | ((color.g >> 2) << 5) | (color.b >> 3);
+    if (fb.nearest[key] != 0xFFFF) return static_cast<uint8_t>(fb.nearest[key]);
+    
+    int best = 0;
+    long bestDistance = -1;
+    for (int i = 0; i < PALETTE_SIZE; i++) {
+        long dr = fb.palette[i].r - color.r;
+        long dg = fb.palette[i].g - color.g;
+        long db = fb.palette[i].b - color.b;
+        long distance = dr * dr + dg * dg + db * db;
+        if (bestDistance < 0 || distance < bestDistance) {
+            best = i;
+            bestDistance = distance;
+        }
+    }
+    fb.nearest[key] = static_cast<uint16_t>(best);
+    return static_cast<uint8_t>(best);
+}
+
+static void indexedClear(IndexedFramebuffer& fb, uint8_t index) {
+    std::fill(fb.pixels.begin(), fb.pixels.end(), index);
+}
+
+#ifdef GRAPHICS_X86_SIMD
+// Eight palette lookups per gather
+__attribute__((target("avx2")))
+static int expandIndexedAVX2(const uint8_t* src, uint32_t* dst, int count, const uint32_t* palette) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i));
+        __m256i indices = _mm256_cvtepu8_epi32(bytes);
+        __m256i pixels = _mm256_i32gather_epi32(reinterpret_cast<const int*>(palette), indices, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), pixels);
+    }
+    return i;
+}
+#endif // GRAPHICS_X86_SIMD
+
+template <typename Word>
+static void expandIndexedWords(const uint8_t* src, uint8_t* dst, int count, const uint32_t* palette) {
+    for (int i = 0; i < count; i++) writeWord<Word>(dst + i * sizeof(Word), palette[src[i]]);
+}
+
+// Expands count indices into dst, in the layout the palette was packed for
+static void expandIndexedRow(const IndexedFramebuffer& fb, const uint8_t* src, uint8_t* dst, int count) {
+    const uint32_t* palette = fb.expanded;
+    int bytesPerPixel = fb.expandedLayout.bytesPerPixel;
+    
+    if (bytesPerPixel == 4) {
+        uint32_t* out = reinterpret_cast<uint32_t*>(dst);
+        int i = 0;
+#ifdef GRAPHICS_X86_SIMD
+        if (simdLevel() >= 2) i = expandIndexedAVX2(src, out, count, palette);
+#endif
+        for (; i + 4 <= count; i += 4) {
+            out[i] = palette[src[i]];
+            out[i + 1] = palette[src[i + 1]];
+            out[i + 2] = palette[src[i + 2]];
+            out[i + 3] = palette[src[i + 3]];
+        }
+        for (; i < count; i++) out[i] = palette[src[i]];
+        return;
+    }
+    
+    if (bytesPerPixel == 2) {
+        expandIndexedWords<uint16_t>(src, dst, count, palette);
+    } else {
+        expandIndexedWords<uint8_t>(src, dst, count, palette);
+    }
+}
+
+// Repacks the palette if it or the target layout changed since the last frame
+static void preparePalette(IndexedFramebuffer& fb, const PixelLayout& layout) {
+    if (!fb.paletteChanged && std::memcmp(&layout, &fb.expandedLayout, sizeof(PixelLayout)) == 0) return;
+    
+    for (int i = 0; i < PALETTE_SIZE; i++) {
+        const Color& color = fb.palette[i];
+        fb.expanded[i] = packPixel(layout, Color(color.r, color.g, color.b, 255));
+    }
+    fb.expandedLayout = layout;
+    fb.paletteChanged = false;
+}
+
+// Expands the whole buffer into a pixel array with the given row pitch
+static void expandIndexed(IndexedFramebuffer& fb, const PixelLayout& layout, uint8_t* dst, size_t pitch) {
+    preparePalette(fb, layout);
+    for (int y = 0; y < fb.height; y++) {
+        expandIndexedRow(fb, &fb.pixels[static_cast<size_t>(y) * fb.width], dst + y * pitch, fb.width);
+    }
+}
+
+// ============================================================================
+// SOFTWARE FRAMEBUFFER - shared by all backends
+// ============================================================================
+
+// Pixels of a headless window, laid out like Color (PIXEL_RGBA32). Nothing in
+// here is shared between windows, so headless windows on different threads
+// draw without any locking.
+struct SoftwareFramebuffer {
+    int width;
+    int height;
+    std::vector<Color> pixels;
+    
+    SoftwareFramebuffer(int w, int h)
+        : width(w), height(h), pixels(static_cast<size_t>(w) * h, Color(0, 0, 0)) {}
+};
+
+// Source over, the blend mode SDL draws with
+static inline void blendPixel(Color& dst, const Color& src) {
+    if (src.a == 255) {
+        dst = src;
+        return;
+    }
+    int inverse = 255 - src.a;
+    dst.r = static_cast<uint8_t>((src.r * src.a + dst.r * inverse + 127) / 255);
+    dst.g = static_cast<uint8_t>((src.g * src.a + dst.g * inverse + 127) / 255);
+    dst.b = static_cast<uint8_t>((src.b * src.a + dst.b * inverse + 127) / 255);
+    dst.a = static_cast<uint8_t>(src.a + (dst.a * inverse + 127) / 255);
+}
+
+// Clearing replaces the pixels, alpha included, like SDL_RenderClear
+static void softwareClear(SoftwareFramebuffer& fb, const Color& color) {
+    std::fill(fb.pixels.begin(), fb.pixels.end(), color);
+}
+
+// ============================================================================
+// PIXEL WRITERS - shared by all backends
+// ============================================================================
+
+// What the shape walkers write, one writer per buffer format and write mode:
+// the Pixel type, plot(pixel) and fill(row, count). drawSoftware picks the
+// writer once per draw call, so every kernel is compiled for one format and
+// its inner loops have nothing left to branch on.
+
+// Palette indices of the indexed buffer
+struct IndexWriter {
+    typedef uint8_t Pixel;
+    uint8_t index;
+    
+    explicit IndexWriter(uint8_t value) : index(value) {}
+    void plot(uint8_t& pixel) const { pixel = index; }
+    void fill(uint8_t* row, int count) const { std::memset(row, index, count); }
+};
+
+// Opaque colours replace the pixels
+struct CopyWriter {
+    typedef Color Pixel;
+    Color color;
+    
+    explicit CopyWriter(const Color& value) : color(value) {}
+    void plot(Color& pixel) const { pixel = color; }
+    void fill(Color* row, int count) const { std::fill(row, row + count, color); }
+};
+
+#ifdef GRAPHICS_X86_SIMD
+// floor(t / 255) for t <= 65535 - 255, eight 16-bit lanes at a time
+__attribute__((target("sse2")))
+static inline __m128i divide255(__m128i t) {
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(t, _mm_set1_epi16(1)), _mm_srli_epi16(t, 8));
+    return _mm_srli_epi16(sum, 8);
+}
+
+// BlendWriter::fill four pixels at a time
+__attribute__((target("sse2")))
+static int blendFillSSE2(Color* row, int count, const uint16_t channels[4], uint16_t factor) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weighted = _mm_setr_epi16(channels[0], channels[1], channels[2], channels[3],
+                                            channels[0], channels[1], channels[2], channels[3]);
+    const __m128i inverse = _mm_set1_epi16(static_cast<short>(factor));
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), inverse), weighted);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), inverse), weighted);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), _mm_packus_epi16(divide255(lo), divide255(hi)));
+    }
+    return i;
+}
+#endif // GRAPHICS_X86_SIMD
+
+// Source over with one translucent colour, blendPixel with its per-colour
+// work hoisted out: each channel is (weighted + dst * inverse) / 255, where
+// weighted is src * alpha (255 * alpha for alpha itself) plus the rounding
+// term. The sum stays below 65536, so it fits 16-bit lanes.
+struct BlendWriter {
+    typedef Color Pixel;
+    uint16_t weighted[4];
+    uint16_t inverse;
+    
+    explicit BlendWriter(const Color& color) : inverse(static_cast<uint16_t>(255 - color.a)) {
+        weighted[0] = static_cast<uint16_t>(color.r * color.a + 127);
+        weighted[1] = static_cast<uint16_t>(color.g * color.a + 127);
+        weighted[2] = static_cast<uint16_t>(color.b * color.a + 127);
+        weighted[3] = static_cast<uint16_t>(255 * color.a + 127);
+    }
+    
+    void plot(Color& pixel) const {
+        pixel.r = static_cast<uint8_t>((weighted[0] + pixel.r * inverse) / 255);
+        pixel.g = static_cast<uint8_t>((weighted[1] + pixel.g * inverse) / 255);
+        pixel.b = static_cast<uint8_t>((weighted[2] + pixel.b * inverse) / 255);
+        pixel.a = static_cast<uint8_t>((weighted[3] + pixel.a * inverse) / 255);
+    }
+    
+    void fill(Color* row, int count) const {
+        int i = 0;
+#ifdef GRAPHICS_X86_SIMD
+        i = blendFillSSE2(row, count, weighted, inverse);
+#endif
+        for (; i < count; i++) plot(row[i]);
+    }
+};
+
+// Implemented with the public API further down, the backends call these first
+// thing. Each returns false for a native window.
+static bool presentHeadless(WindowHandle* window);
+static bool destroyHeadless(WindowHandle* window);
+static bool headlessEvents(WindowHandle* window);
+
+// ============================================================================
+// PARTICLES - shared by all backends
+// ============================================================================
+
+// One projected point of a batched point draw
+struct BatchPoint {
+    int x, y;
+    Color color;
+};
+
+static inline bool sameColor(const Color& a, const Color& b) {
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+// Particle attributes kept as structure of arrays, so updating and projecting
+// stream through memory and vectorize 8 particles at a time
+struct ParticleSystem {
+    int capacity;
+    int count;
+    std::vector<float> x, y, z;
+    std::vector<float> vx, vy, vz;
+    std::vector<float> age, life;        // life <= 0 never expires
+    std::vector<Color> color;
+    bool anyMortal;                      // Some particle has a lifetime
+    
+    bool wrap[3];                        // Positions wrap around [wrapMin, wrapMax) per axis
+    float wrapMin[3], wrapMax[3];
+    
+    std::vector<BatchPoint> projected;   // Scratch for drawParticles
+    
+    explicit ParticleSystem(int size) : capacity(size), count(0), x(size), y(size), z(size),
+                                        vx(size), vy(size), vz(size), age(size), life(size),
+                                        color(size), anyMortal(false) {
+        for (int i = 0; i < 3; i++) {
+            wrap[i] = false;
+            wrapMin[i] = wrapMax[i] = 0.0f;
+        }
+    }
+};
+
+// p += v * dt, then wrap into [lo, hi). Particles never move a whole period
+// per step, so a single add or subtract is enough.
+static void integrateScalar(float* p, const float* v, int begin, int end, float dt, bool wrap, float lo,
+                            float hi) {
+    float period = hi - lo;
+    for (int i = begin; i < end; i++) {
+        float value = p[i] + v[i] * dt;
+        if (wrap) {
+            if (value >= hi) value -= period;
+            else if (value < lo) value += period;
+        }
+        p[i] = value;
+    }
+}
+
+#ifdef GRAPHICS_X86_SIMD
+__attribute__((target("avx")))
+static int integrateAVX(float* p, const float* v, int count, float dt, bool wrap, float lo, float hi) {
+    __m256 step = _mm256_set1_ps(dt);
+    __m256 low = _mm256_set1_ps(lo);
+    __m256 high = _mm256_set1_ps(hi);
+    __m256 period = _mm256_set1_ps(hi - lo);
+    
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 value = _mm256_add_ps(_mm256_loadu_ps(p + i), _mm256_mul_ps(_mm256_loadu_ps(v + i), step));
+        if (wrap) {
+            __m256 over = _mm256_and_ps(_mm256_cmp_ps(value, high, _CMP_GE_OQ), period);
+            __m256 under = _mm256_and_ps(_mm256_cmp_ps(value, low, _CMP_LT_OQ), period);
+            value = _mm256_add_ps(_mm256_sub_ps(value, over), under);
+        }
+        _mm256_storeu_ps(p + i, value);
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static int integrateSSE2(float* p, const float* v, int count, float dt, bool wrap, float lo, float hi) {
+    __m128 step = _mm_set1_ps(dt);
+    __m128 low = _mm_set1_ps(lo);
+    __m128 high = _mm_set1_ps(hi);
+    __m128 period = _mm_set1_ps(hi - lo);
+    
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 value = _mm_add_ps(_mm_loadu_ps(p + i), _mm_mul_ps(_mm_loadu_ps(v + i), step));
+        if (wrap) {
+            __m128 over = _mm_and_ps(_mm_cmpge_ps(value, high), period);
+            __m128 under = _mm_and_ps(_mm_cmplt_ps(value, low), period);
+            value = _mm_add_ps(_mm_sub_ps(value, over), under);
+        }
+        _mm_storeu_ps(p + i, value);
+    }
+    return i;
+}
+#endif // GRAPHICS_X86_SIMD
+
+static void integrateAxis(ParticleSystem& system, std::vector<float>& p, const std::vector<float>& v, int axis,
+                          float dt) {
+    bool wrap = system.wrap[axis];
+    float lo = system.wrapMin[axis], hi = system.wrapMax[axis];
+    int done = 0;
+#ifdef GRAPHICS_X86_SIMD
+    if (simdLevel() >= 2) done = integrateAVX(p.data(), v.data(), system.count, dt, wrap, lo, hi);
+    else done = integrateSSE2(p.data(), v.data(), system.count, dt, wrap, lo, hi);
+#endif
+    integrateScalar(p.data(), v.data(), done, system.count, dt, wrap, lo, hi);
+}
+
+// Camera-space projection parameters, see ParticleView
+struct ProjectParams {
+    float position[3];
+    float rotation[9];
+    float focal, centerX, centerY, nearZ, farZ;
+    bool fade;
+};
+
+static void emitProjected(const ParticleSystem& system, const ProjectParams& view, int i, int sx, int sy,
+                          float depth, BatchPoint*& out) {
+    Color color = system.color[i];
+    if (view.fade) {
+        float scale = 1.0f - depth / view.farZ;
+        color.r = static_cast<uint8_t>(color.r * scale);
+        color.g = static_cast<uint8_t>(color.g * scale);
+        color.b = static_cast<uint8_t>(color.b * scale);
+    }
+    out->x = sx;
+    out->y = sy;
+    out->color = color;
+    out++;
+}
+
+static void projectScalar(const ParticleSystem& system, const ProjectParams& view, int begin, BatchPoint*& out) {
+    const float* r = view.rotation;
+    for (int i = begin; i < system.count; i++) {
+        float dx = system.x[i] - view.position[0];
+        float dy = system.y[i] - view.position[1];
+        float dz = system.z[i] - view.position[2];
+        
+        float depth = r[6] * dx + r[7] * dy + r[8] * dz;
+        if (!(depth > view.nearZ && depth < view.farZ)) continue;
+        
+        float factor = view.focal / depth;
+        float sx = (r[0] * dx + r[1] * dy + r[2] * dz) * factor + view.centerX;
+        float sy = (r[3] * dx + r[4] * dy + r[5] * dz) * factor + view.centerY;
+        emitProjected(system, view, i, static_cast<int>(sx), static_cast<int>(sy), depth, out);
+    }
+}
+
+#ifdef GRAPHICS_X86_SIMD
+// Transforms and projects 8 particles per step, only visible ones are emitted
+__attribute__((target("avx")))
+static int projectAVX(const ParticleSystem& system, const ProjectParams& view, BatchPoint*& out) {
+    const float* r = view.rotation;
+    __m256 px = _mm256_set1_ps(view.position[0]);
+    __m256 py = _mm256_set1_ps(view.position[1]);
+    __m256 pz = _mm256_set1_ps(view.position[2]);
+    __m256 nearZ = _mm256_set1_ps(view.nearZ);
+    __m256 farZ = _mm256_set1_ps(view.farZ);
+    __m256 focal = _mm256_set1_ps(view.focal);
+    __m256 centerX = _mm256_set1_ps(view.centerX);
+    __m256 centerY = _mm256_set1_ps(view.centerY);
+    
+    int i = 0;
+    for (; i + 8 <= system.count; i += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&system.x[i]), px);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&system.y[i]), py);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&system.z[i]), pz);
+        
+        __m256 depth = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(r[6]), dx),
+                                                   _mm256_mul_ps(_mm256_set1_ps(r[7]), dy)),
+                                     _mm256_mul_ps(_mm256_set1_ps(r[8]), dz));
+        int visible = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(depth, nearZ, _CMP_GT_OQ),
+                                                       _mm256_cmp_ps(depth, farZ, _CMP_LT_OQ)));
+        if (!visible) continue;
+        
+        __m256 camX = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(r[0]), dx),
+                                                  _mm256_mul_ps(_mm256_set1_ps(r[1]), dy)),
+                                    _mm256_mul_ps(_mm256_set1_ps(r[2]), dz));
+        __m256 camY = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(r[3]), dx),
+                                                  _mm256_mul_ps(_mm256_set1_ps(r[4]), dy)),
+                                    _mm256_mul_ps(_mm256_set1_ps(r[5]), dz));
+        __m256 factor = _mm256_div_ps(focal, depth);
+        
+        alignas(32) int sx[8], sy[8];
+        alignas(32) float z[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(sx),
+                           _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(camX, factor), centerX)));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(sy),
+                           _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(camY, factor), centerY)));
+        _mm256_store_ps(z, depth);
+        
+        for (int lane = 0; lane < 8; lane++) {
+            if (visible & (1 << lane)) emitProjected(system, view, i + lane, sx[lane], sy[lane], z[lane], out);
+        }
+    }
+    return i;
+}
+#endif // GRAPHICS_X86_SIMD
+
+// Projects every particle, returns the number of points written to out
+static int projectParticles(const ParticleSystem& system, const ProjectParams& view, BatchPoint* out) {
+    BatchPoint* start = out;
+    int done = 0;
+#ifdef GRAPHICS_X86_SIMD
+    if (simdLevel() >= 2) done = projectAVX(system, view, out);
+#endif
+    projectScalar(system, view, done, out);
+    return static_cast<int>(out - start);
+}
+
+// ============================================================================
+// FLOOD FILL - shared by all backends
+// ============================================================================
+
+// Scanline flood fill over a buffer of palette indices or Colors. Runs of the
+// seed value are found with SSE2 compares, 16 indices or 4 colours at a time.
+
+static inline bool samePixel(uint8_t a, uint8_t b) {
+    return a == b;
+}
+
+static inline bool samePixel(const Color& a, const Color& b) {
+    return sameColor(a, b);
+}
+
+#ifdef GRAPHICS_X86_SIMD
+// Bit i is set where p[i] equals value
+__attribute__((target("sse2")))
+static inline unsigned equalMask(const uint8_t* p, uint8_t value) {
+    __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i equal = _mm_cmpeq_epi8(pixels, _mm_set1_epi8(static_cast<char>(value)));
+    return static_cast<unsigned>(_mm_movemask_epi8(equal));
+}
+
+__attribute__((target("sse2")))
+static inline unsigned equalMask(const Color* p, const Color& value) {
+    uint32_t word;
+    std::memcpy(&word, &value, sizeof(word));
+    __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i equal = _mm_cmpeq_epi32(pixels, _mm_set1_epi32(static_cast<int>(word)));
+    return static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(equal)));
+}
+#endif // GRAPHICS_X86_SIMD
+
+// First index in [from, to) where row[i] == value is `equal`, to if there is
+// none (from if the range is empty)
+template <typename T>
+static int scanRun(const T* row, int from, int to, const T& value, bool equal) {
+    int i = from;
+#ifdef GRAPHICS_X86_SIMD
+    const int lanes = 16 / sizeof(T);
+    const unsigned all = (1u << lanes) - 1;
+    for (; i + lanes <= to; i += lanes) {
+        unsigned mask = equalMask(row + i, value);
+        if (!equal) mask ^= all;
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < to; i++) {
+        if (samePixel(row[i], value) == equal) break;
+    }
+    return i;
+}
+
+// Start of the run of value that ends just before end, not below from
+template <typename T>
+static int runStart(const T* row, int from, int end, const T& value) {
+    int i = end;
+#ifdef GRAPHICS_X86_SIMD
+    const int lanes = 16 / sizeof(T);
+    const unsigned all = (1u << lanes) - 1;
+    for (; i - lanes >= from; i -= lanes) {
+        unsigned mask = equalMask(row + i - lanes, value) ^ all;
+        if (mask) return i - lanes + (32 - __builtin_clz(mask));
+    }
+#endif
+    while (i > from && samePixel(row[i - 1], value)) i--;
+    return i;
+}
+
+// Row y from x0 to x1 was filled, the row y + dy next to it is still to scan
+struct FloodSegment {
+    int x0, x1, y, dy;
+};
+
+// Fills every pixel 4-connected to (x, y) inside clip that has the seed's
+// value with fill, which must differ from it. Scanning and filling are
+// combined (Smith's span fill), each span is filled once and then passed to
+// span(x0, x1, y).
+template <typename T, typename Span>
+static void floodRegion(T* pixels, int width, const ClipRect& clip, int x, int y, const T& fill, Span span) {
+    const T seed = pixels[static_cast<size_t>(y) * width + x];
+    
+    std::vector<FloodSegment> stack;
+    FloodSegment down = {x, x, y, 1};
+    FloodSegment up = {x, x, y - 1, -1};
+    stack.push_back(down);
+    stack.push_back(up);
+    
+    while (!stack.empty()) {
+        FloodSegment segment = stack.back();
+        stack.pop_back();
+        if (segment.y < clip.y0 || segment.y >= clip.y1) continue;
+        
+        T* row = pixels + static_cast<size_t>(segment.y) * width;
+        int x1 = segment.x0;
+        int x2 = segment.x1;
+        int start = x1;
+        
+        // A run reaching left past the segment leaks back into the row it came from
+        if (samePixel(row[x1], seed)) {
+            start = runStart(row, clip.x0, x1, seed);
+            if (start < x1) {
+                FloodSegment back = {start, x1 - 1, segment.y - segment.dy, -segment.dy};
+                stack.push_back(back);
+            }
+        }
+        
+        while (x1 <= x2) {
+            x1 = scanRun(row, x1, clip.x1, seed, false);
+            if (x1 > start) {
+                std::fill(row + start, row + x1, fill);
+                span(start, x1 - 1, segment.y);
+                
+                FloodSegment next = {start, x1 - 1, segment.y + segment.dy, segment.dy};
+                stack.push_back(next);
+            }
+            if (x1 - 1 > x2) {
+                FloodSegment back = {x2 + 1, x1 - 1, segment.y - segment.dy, -segment.dy};
+                stack.push_back(back);
+            }
+            
+            x1 = scanRun(row, x1 + 1, x2, seed, true);
+            start = x1;
+        }
+    }
+}
+
+// ============================================================================
+// VECTOR PATHS - shared by all backends
+// ============================================================================
+
+// Paths are flattened to polygons as they are built and filled the way font
+// rasterizers do it: every edge adds the signed area it covers to the cells
+// of an accumulation buffer, and a prefix sum along each row turns the cells
+// into each pixel's winding number, fractional where an edge passes through.
+// The cost is the edges' length plus one SIMD pass over the bounding box.
+// Pixels where edges of opposite direction meet get their averaged winding,
+// the usual approximation of this method.
+
+// A point of a flattened path. move starts a contour, the previous one is
+// closed back to its first point when the path is filled.
+struct PathPoint {
+    float x, y;
+    bool move;
+};
+
+struct Path {
+    std::vector<PathPoint> points;
+    float startX, startY;       // First point of the current contour
+    float x, y;                 // Current point
+    bool current;               // There is a current point
+    bool closed;                // closePath was called, the next segment starts a contour
+    
+    Path() : startX(0.0f), startY(0.0f), x(0.0f), y(0.0f), current(false), closed(false) {}
+};
+
+// Curves are split until no chord strays further than this many pixels
+const float PATH_TOLERANCE = 0.2f;
+const int MAX_CURVE_SEGMENTS = 1024;
+
+// Paths with coordinates beyond this aren't filled, edge slopes could overflow
+const float PATH_LIMIT = 1e15f;
+
+// Wang's formula: a degree n curve whose second differences are at most
+// length apart needs sqrt(n (n - 1) / 8 * length / tolerance) segments
+static int curveSegments(float degreeFactor, float length) {
+    float segments = std::ceil(std::sqrt(degreeFactor * length / PATH_TOLERANCE));
+    if (!(segments >= 1.0f)) return 1;
+    return static_cast<int>(std::min(segments, static_cast<float>(MAX_CURVE_SEGMENTS)));
+}
+
+static void addPathPoint(Path& path, float x, float y, bool move) {
+    PathPoint point = {x, y, move};
+    path.points.push_back(point);
+    path.x = x;
+    path.y = y;
+}
+
+// Coverage of a filled path over its bounding box inside the clip: width x
+// height bytes for the target pixels from (x, y), 255 = fully covered
+struct CoverageMask {
+    int x, y, width, height;
+    const uint8_t* coverage;
+};
+
+// Buffers of the rasterizer, kept per window between fills. area has width + 2
+// cells per row, room for the cells right of the last pixel that edges along
+// the right border touch. Accumulating leaves every cell zero again.
+struct PathRaster {
+    std::vector<float> area;
+    std::vector<uint8_t> coverage;
+};
+
+// Adds the area of an edge inside [0, right] horizontally, the rows of the
+// box are clipped here. Cells take d * (1 - fraction of the pixel right of
+// the edge) and the cell after them the rest, so the row's prefix sum rises
+// by the edge's height d from the pixels right of it.
+static void accumulateLine(float* area, int stride, int height, float right, float x0, float y0, float x1,
+                           float y1) {
+    if (y0 == y1) return;
+    float dir = 1.0f;
+    if (y0 > y1) {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+        dir = -1.0f;
+    }
+    if (y1 <= 0.0f || y0 >= height) return;
+    
+    float dxdy = (x1 - x0) / (y1 - y0);
+    float x = y0 < 0.0f ? x0 - y0 * dxdy : x0;
+    int rowEnd = std::min(height, static_cast<int>(std::ceil(y1)));
+    for (int row = y0 > 0.0f ? static_cast<int>(y0) : 0; row < rowEnd; row++) {
+        float* cells = area + static_cast<size_t>(row) * stride;
+        float dy = std::min(row + 1.0f, y1) - std::max(static_cast<float>(row), y0);
+        float next = std::min(std::max(x + dxdy * dy, 0.0f), right);
+        float d = dy * dir;
+        
+        float xMin = std::min(x, next), xMax = std::max(x, next);
+        float leftFloor = std::floor(xMin);
+        int first = static_cast<int>(leftFloor);
+        int last = static_cast<int>(std::ceil(xMax));
+        if (last <= first + 1) {
+            // Within one pixel: split by the edge's mean position in it
+            float middle = 0.5f * (x + next) - leftFloor;
+            cells[first] += d - d * middle;
+            cells[first + 1] += d * middle;
+        } else {
+            // Across several: a triangle in the first and last pixel, an equal
+            // share for each one between
+            float step = 1.0f / (xMax - xMin);
+            float leftFraction = xMin - leftFloor;
+            float firstArea = 0.5f * step * (1.0f - leftFraction) * (1.0f - leftFraction);
+            float rightFraction = xMax - last + 1.0f;
+            float lastArea = 0.5f * step * rightFraction * rightFraction;
+            cells[first] += d * firstArea;
+            if (last == first + 2) {
+                cells[first + 1] += d * (1.0f - firstArea - lastArea);
+            } else {
+                float secondArea = step * (1.5f - leftFraction);
+                cells[first + 1] += d * (secondArea - firstArea);
+                for (int i = first + 2; i < last - 1; i++) cells[i] += d * step;
+                float before = secondArea + (last - first - 3) * step;
+                cells[last - 1] += d * (1.0f - before - lastArea);
+            }
+            cells[last] += d * lastArea;
+        }
+        x = next;
+    }
+}
+
+// Splits an edge where it leaves the box sideways. Parts left of it still
+// wind the pixels right of them, so they run down the left border; parts
+// right of it run down the right border, past the last pixel.
+static void accumulateEdge(float* area, int stride, int width, int height, float x0, float y0, float x1,
+                           float y1) {
+    float right = static_cast<float>(width);
+    float t[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    int count = 1;
+    if ((x0 < 0.0f) != (x1 < 0.0f)) t[count++] = -x0 / (x1 - x0);
+    if ((x0 > right) != (x1 > right)) t[count++] = (right - x0) / (x1 - x0);
+    if (count == 3 && t[1] > t[2]) std::swap(t[1], t[2]);
+    t[count++] = 1.0f;
+    
+    float fromX = x0, fromY = y0;
+    for (int i = 1; i < count; i++) {
+        float toX = i + 1 == count ? x1 : x0 + (x1 - x0) * t[i];
+        float toY = i + 1 == count ? y1 : y0 + (y1 - y0) * t[i];
+        accumulateLine(area, stride, height, right, std::min(std::max(fromX, 0.0f), right), fromY,
+                       std::min(std::max(toX, 0.0f), right), toY);
+        fromX = toX;
+        fromY = toY;
+    }
+}
+
+// Coverage of a winding number: nonzero saturates, even-odd folds every
+// second unit back down
+static inline float windingCoverage(float winding, bool evenOdd) {
+    float value = std::fabs(winding);
+    if (evenOdd) {
+        value -= 2.0f * std::floor(value * 0.5f);
+        value = std::min(value, 2.0f - value);
+    }
+    return std::min(value, 1.0f);
+}
+
+#ifdef GRAPHICS_X86_SIMD
+// Prefix sum of four cells per step: two shifted adds within the register,
+// then the carry of the previous four broadcast into every lane
+__attribute__((target("sse2")))
+static int accumulateRowSSE2(float* cells, uint8_t* coverage, int count, bool evenOdd, float& sum) {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 scale = _mm_set1_ps(255.0f);
+    __m128 carry = _mm_setzero_ps();
+    
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 winding = _mm_loadu_ps(cells + i);
+        _mm_storeu_ps(cells + i, _mm_setzero_ps());
+        winding = _mm_add_ps(winding, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(winding), 4)));
+        winding = _mm_add_ps(winding, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(winding), 8)));
+        winding = _mm_add_ps(winding, carry);
+        carry = _mm_shuffle_ps(winding, winding, _MM_SHUFFLE(3, 3, 3, 3));
+        
+        __m128 value = _mm_andnot_ps(sign, winding);
+        if (evenOdd) {
+            // value is positive, so truncating is flooring
+            __m128 pairs = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(value, half)));
+            value = _mm_sub_ps(value, _mm_add_ps(pairs, pairs));
+            value = _mm_min_ps(value, _mm_sub_ps(two, value));
+        }
+        __m128i bytes = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(value, one), scale));
+        bytes = _mm_packs_epi32(bytes, bytes);
+        bytes = _mm_packus_epi16(bytes, bytes);
+        int packed = _mm_cvtsi128_si32(bytes);
+        std::memcpy(coverage + i, &packed, sizeof(packed));
+    }
+    sum = _mm_cvtss_f32(carry);
+    return i;
+}
+#endif // GRAPHICS_X86_SIMD
+
+// Turns one row of cells into coverage and zeroes the cells for the next fill
+static void accumulateRow(float* cells, uint8_t* coverage, int width, bool evenOdd) {
+    float sum = 0.0f;
+    int i = 0;
+#ifdef GRAPHICS_X86_SIMD
+    i = accumulateRowSSE2(cells, coverage, width, evenOdd, sum);
+#endif
+    for (; i < width; i++) {
+        sum += cells[i];
+        cells[i] = 0.0f;
+        coverage[i] = static_cast<uint8_t>(windingCoverage(sum, evenOdd) * 255.0f + 0.5f);
+    }
+    cells[width] = cells[width + 1] = 0.0f;
+}
+
+// Rasterizes the contours of a flattened path into raster, limited to clip.
+// False if none of it is inside.
+static bool rasterPath(PathRaster& raster, const ClipRect& clip, const PathPoint* points, int count,
+                       bool evenOdd, CoverageMask& mask) {
+    if (count < 3) return false;
+    
+    float minX = points[0].x, minY = points[0].y, maxX = minX, maxY = minY;
+    for (int i = 0; i < count; i++) {
+        // A NaN would stay in the area buffer and spoil every later fill
+        if (!(std::fabs(points[i].x) < PATH_LIMIT && std::fabs(points[i].y) < PATH_LIMIT)) return false;
+        minX = std::min(minX, points[i].x);
+        minY = std::min(minY, points[i].y);
+        maxX = std::max(maxX, points[i].x);
+        maxY = std::max(maxY, points[i].y);
+    }
+    
+    // Clamped as floats first, the bounds may be far outside int range
+    int x0 = static_cast<int>(std::max(std::floor(minX), static_cast<float>(clip.x0)));
+    int y0 = static_cast<int>(std::max(std::floor(minY), static_cast<float>(clip.y0)));
+    int x1 = static_cast<int>(std::min(std::ceil(maxX), static_cast<float>(clip.x1)));
+    int y1 = static_cast<int>(std::min(std::ceil(maxY), static_cast<float>(clip.y1)));
+    if (x0 >= x1 || y0 >= y1) return false;
+    
+    int width = x1 - x0, height = y1 - y0, stride = width + 2;
+    size_t cells = static_cast<size_t>(stride) * height;
+    if (raster.area.size() < cells) raster.area.resize(cells, 0.0f);
+    raster.coverage.resize(static_cast<size_t>(width) * height);
+    
+    float* area = raster.area.data();
+    float originX = static_cast<float>(x0), originY = static_cast<float>(y0);
+    int first = 0;
+    for (int i = 0; i < count; i++) {
+        bool last = i + 1 == count || points[i + 1].move;
+        const PathPoint& from = points[i];
+        const PathPoint& to = last ? points[first] : points[i + 1];
+        accumulateEdge(area, stride, width, height, from.x - originX, from.y - originY, to.x - originX,
+                       to.y - originY);
+        if (last) first = i + 1;
+    }
+    
+    for (int row = 0; row < height; row++) {
+        accumulateRow(area + static_cast<size_t>(row) * stride, &raster.coverage[static_cast<size_t>(row) * width],
+                      width, evenOdd);
+    }
+    
+    mask.x = x0;
+    mask.y = y0;
+    mask.width = width;
+    mask.height = height;
+    mask.coverage = raster.coverage.data();
+    return true;
+}
+
+// Visits a mask a row at a time: span(x0, x1, y) for inclusive runs of full
+// coverage and blend(x, y, coverage) for partly covered pixels
+template <typename Span, typename Blend>
+static void walkCoverage(const CoverageMask& mask, Span span, Blend blend) {
+    for (int row = 0; row < mask.height; row++) {
+        const uint8_t* coverage = mask.coverage + static_cast<size_t>(row) * mask.width;
+        int y = mask.y + row;
+        for (int i = 0; i < mask.width;) {
+            if (coverage[i] == 255) {
+                int end = i + 1;
+                while (end < mask.width && coverage[end] == 255) end++;
+                span(mask.x + i, mask.x + end - 1, y);
+                i = end;
+                continue;
+            }
+            if (coverage[i]) blend(mask.x + i, y, coverage[i]);
+            i++;
+        }
+    }
+}
+
+// Inclusive runs of pixels at least half covered, for targets without alpha
+template <typename Span>
+static void coverageRuns(const CoverageMask& mask, Span span) {
+    for (int row = 0; row < mask.height; row++) {
+        const uint8_t* coverage = mask.coverage + static_cast<size_t>(row) * mask.width;
+        for (int i = 0; i < mask.width;) {
+            if (coverage[i] < 128) {
+                i++;
+                continue;
+            }
+            int end = i + 1;
+            while (end < mask.width && coverage[end] >= 128) end++;
+            span(mask.x + i, mask.x + end - 1, mask.y + row);
+            i = end;
+        }
+    }
+}
+
+// ============================================================================
+// IMAGE TRANSFORMS - shared by all backends
+// ============================================================================
+
+// Backends that can't transform images themselves run drawImageTransformed
+// backwards on the CPU: destination pixel centres are mapped into the image
+// in 16.16 fixed point, and of each row only the run whose centres land in
+// the image is visited. Images are premultiplied, so texels past the edge are
+// transparent and bilinear edges fade out.
+
+// Premultiplied PIXEL_RGBA32 pixels, pitch in pixels
+struct ImagePixels {
+    const Color* pixels;
+    int width, height;
+    size_t pitch;
+};
+
+// Destination to image mapping, in image pixels with texel centres at .5
+struct ImageTransform {
+    double u0, v0;                  // Where the centre of destination pixel (0, 0) lands
+    double dudx, dudy, dvdx, dvdy;  // Change per destination pixel right and down
+    int x0, y0, x1, y1;             // Destination pixels it may touch, clipped (x1/y1 exclusive)
+};
+
+const double DEGREES_TO_RADIANS = 0.017453292519943295;
+
+// Positions and steps have to fit 16.16 fixed point: images up to 32767
+// pixels, shrunk at most 32767 times, centred within 1e8 pixels of the origin
+const int MAX_TRANSFORM_SIZE = 32767;
+const double MAX_TRANSFORM_SHRINK = 32767.0;
+const double MAX_TRANSFORM_POSITION = 1e8;
+
+// Maps the destination back into a width x height image drawn with its centre
+// at (x, y). False when nothing of it can land inside clip.
+static bool setupImageTransform(int width, int height, float x, float y, float angle, float scaleX,
+                                float scaleY, bool bilinear, const ClipRect& clip, ImageTransform& t) {
+    if (width <= 0 || height <= 0 || width > MAX_TRANSFORM_SIZE || height > MAX_TRANSFORM_SIZE) return false;
+    if (!(std::fabs(x) < MAX_TRANSFORM_POSITION && std::fabs(y) < MAX_TRANSFORM_POSITION)) return false;
+    if (!std::isfinite(angle) || !std::isfinite(scaleX) || !std::isfinite(scaleY)) return false;
+    if (!(std::fabs(scaleX) * MAX_TRANSFORM_SHRINK > 1.0 && std::fabs(scaleY) * MAX_TRANSFORM_SHRINK > 1.0)) {
+        return false;
+    }
+    
+    double radians = std::fmod(static_cast<double>(angle), 360.0) * DEGREES_TO_RADIANS;
+    double c = std::cos(radians), s = std::sin(radians);
+    
+    // Bounding box of the rotated corners, half a texel further out for bilinear
+    double halfWidth = width * 0.5 + (bilinear ? 0.5 : 0.0);
+    double halfHeight = height * 0.5 + (bilinear ? 0.5 : 0.0);
+    double extentX = std::fabs(c * scaleX) * halfWidth + std::fabs(s * scaleY) * halfHeight;
+    double extentY = std::fabs(s * scaleX) * halfWidth + std::fabs(c * scaleY) * halfHeight;
+    double left = std::max<double>(clip.x0, std::floor(x - extentX));
+    double top = std::max<double>(clip.y0, std::floor(y - extentY));
+    double right = std::min<double>(clip.x1, std::ceil(x + extentX));
+    double bottom = std::min<double>(clip.y1, std::ceil(y + extentY));
+    if (left >= right || top >= bottom) return false;
+    t.x0 = static_cast<int>(left);
+    t.y0 = static_cast<int>(top);
+    t.x1 = static_cast<int>(right);
+    t.y1 = static_cast<int>(bottom);
+    
+    // Inverse of rotating and then scaling around the centre
+    t.dudx = c / scaleX;
+    t.dudy = s / scaleX;
+    t.dvdx = -s / scaleY;
+    t.dvdy = c / scaleY;
+    t.u0 = width * 0.5 + t.dudx * (0.5 - x) + t.dudy * (0.5 - y);
+    t.v0 = height * 0.5 + t.dvdx * (0.5 - x) + t.dvdy * (0.5 - y);
+    return true;
+}
+
+static inline int64_t floorDivide(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    if (a % b != 0 && (a < 0) != (b < 0)) q--;
+    return q;
+}
+
+// Narrows the pixels [from, to) of a row to those with lo <= base + x * step < hi
+static void narrowRun(int64_t base, int64_t step, int64_t lo, int64_t hi, int& from, int& to) {
+    int64_t first, last;
+    if (step > 0) {
+        first = -floorDivide(base - lo, step);
+        last = -floorDivide(base - hi, step);
+    } else if (step < 0) {
+        first = floorDivide(hi - base, step) + 1;
+        last = floorDivide(lo - base, step) + 1;
+    } else {
+        if (base < lo || base >= hi) to = from;
+        return;
+    }
+    if (first > from) from = static_cast<int>(std::min<int64_t>(first, to));
+    if (last < to) to = static_cast<int>(std::max<int64_t>(last, from));
+}
+
+static inline Color imageTexel(const ImagePixels& image, int x, int y) {
+    if (x < 0 || y < 0 || x >= image.width || y >= image.height) return Color(0, 0, 0, 0);
+    return image.pixels[static_cast<size_t>(y) * image.pitch + x];
+}
+
+static inline uint8_t lerpTexels(int c00, int c10, int c01, int c11, int fx, int fy) {
+    int top = (c00 * (256 - fx) + c10 * fx) >> 8;
+    int bottom = (c01 * (256 - fx) + c11 * fx) >> 8;
+    return static_cast<uint8_t>((top * (256 - fy) + bottom * fy) >> 8);
+}
+
+// Source over with a premultiplied source
+static inline void blendPremultiplied(Color& dst, const Color& src) {
+    int inverse = 255 - src.a;
+    dst.r = static_cast<uint8_t>(std::min(255, src.r + (dst.r * inverse + 127) / 255));
+    dst.g = static_cast<uint8_t>(std::min(255, src.g + (dst.g * inverse + 127) / 255));
+    dst.b = static_cast<uint8_t>(std::min(255, src.b + (dst.b * inverse + 127) / 255));
+    dst.a = static_cast<uint8_t>(std::min(255, src.a + (dst.a * inverse + 127) / 255));
+}
+
+// Samples the image at 16.16 (u, v) and blends it into dst. Bilinear weights
+// are 8 bits, horizontally first, with the same rounding as the SSE2 path.
+static inline void transformPixel(const ImagePixels& image, Color& dst, int32_t u, int32_t v, bool bilinear) {
+    if (!bilinear) {
+        blendPremultiplied(dst, image.pixels[static_cast<size_t>(v >> 16) * image.pitch + (u >> 16)]);
+        return;
+    }
+    
+    int32_t su = u - 32768, sv = v - 32768;
+    int x = su >> 16, y = sv >> 16;
+    int fx = (su >> 8) & 255, fy = (sv >> 8) & 255;
+    Color c00 = imageTexel(image, x, y), c10 = imageTexel(image, x + 1, y);
+    Color c01 = imageTexel(image, x, y + 1), c11 = imageTexel(image, x + 1, y + 1);
+    Color sample(lerpTexels(c00.r, c10.r, c01.r, c11.r, fx, fy), lerpTexels(c00.g, c10.g, c01.g, c11.g, fx, fy),
+                 lerpTexels(c00.b, c10.b, c01.b, c11.b, fx, fy), lerpTexels(c00.a, c10.a, c01.a, c11.a, fx, fy));
+    blendPremultiplied(dst, sample);
+}
+
+#ifdef GRAPHICS_X86_SIMD
+// Bilinear samples of two pixels whose 2x2 texels start at a and b, as 16-bit
+// lanes. fx and fy hold each pixel's fractions in its four lanes.
+__attribute__((target("sse2")))
+static inline __m128i bilinearPairSSE2(const Color* a, const Color* b, size_t pitch, __m128i fx, __m128i fy) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(256);
+    
+    // Left texels of both pixels in the low half once widened, right ones in the high half
+    __m128i top = _mm_unpacklo_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(a)),
+                                     _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b)));
+    __m128i bottom = _mm_unpacklo_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(a + pitch)),
+                                        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + pitch)));
+    __m128i gx = _mm_sub_epi16(one, fx);
+    top = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(top, zero), gx),
+                                       _mm_mullo_epi16(_mm_unpackhi_epi8(top, zero), fx)), 8);
+    bottom = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(bottom, zero), gx),
+                                          _mm_mullo_epi16(_mm_unpackhi_epi8(bottom, zero), fx)), 8);
+    return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(top, _mm_sub_epi16(one, fy)), _mm_mullo_epi16(bottom, fy)),
+                          8);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i loadTexel(const ImagePixels& image, int x, int y) {
+    int32_t bits;
+    std::memcpy(&bits, &image.pixels[static_cast<size_t>(y) * image.pitch + x], sizeof(bits));
+    return _mm_cvtsi32_si128(bits);
+}
+
+// Blends four premultiplied pixels, or stores them when they are all opaque
+__attribute__((target("sse2")))
+static inline void blendPremultipliedSSE2(Color* dst, __m128i pixels) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i opaque = _mm_set1_epi16(255);
+    const __m128i round = _mm_set1_epi16(127);
+    __m128i alphas = _mm_cmpeq_epi8(pixels, _mm_set1_epi8(-1));
+    if ((_mm_movemask_epi8(alphas) & 0x8888) == 0x8888) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), pixels);
+        return;
+    }
+    
+    __m128i lo = _mm_unpacklo_epi8(pixels, zero), hi = _mm_unpackhi_epi8(pixels, zero);
+    __m128i inverseLo = _mm_sub_epi16(opaque, _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)),
+                                                                  _MM_SHUFFLE(3, 3, 3, 3)));
+    __m128i inverseHi = _mm_sub_epi16(opaque, _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)),
+                                                                  _MM_SHUFFLE(3, 3, 3, 3)));
+    __m128i target = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst));
+    __m128i targetLo = _mm_mullo_epi16(_mm_unpacklo_epi8(target, zero), inverseLo);
+    __m128i targetHi = _mm_mullo_epi16(_mm_unpackhi_epi8(target, zero), inverseHi);
+    lo = _mm_add_epi16(lo, divide255(_mm_add_epi16(targetLo, round)));
+    hi = _mm_add_epi16(hi, divide255(_mm_add_epi16(targetHi, round)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_packus_epi16(lo, hi));
+}
+
+// Four destination pixels per step, their positions in 32-bit lanes. They
+// are only used inside the span, where they fit; stepping past its end may
+// wrap. Bilinear groups with a texel outside the image take the scalar path.
+__attribute__((target("sse2")))
+static void transformSpanSSE2(const ImagePixels& image, Color* dst, int count, int64_t u, int64_t v, int64_t du,
+                              int64_t dv, bool bilinear) {
+    if (count < 4) return;
+    
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(32768);
+    const __m128i fraction = _mm_set1_epi32(255);
+    const __m128i lastX = _mm_set1_epi32(image.width - 2);
+    const __m128i lastY = _mm_set1_epi32(image.height - 2);
+    const __m128i stepU = _mm_set1_epi32(static_cast<int32_t>(static_cast<uint32_t>(du * 4)));
+    const __m128i stepV = _mm_set1_epi32(static_cast<int32_t>(static_cast<uint32_t>(dv * 4)));
+    __m128i pu = _mm_setr_epi32(static_cast<int32_t>(u), static_cast<int32_t>(u + du),
+                                static_cast<int32_t>(u + du * 2), static_cast<int32_t>(u + du * 3));
+    __m128i pv = _mm_setr_epi32(static_cast<int32_t>(v), static_cast<int32_t>(v + dv),
+                                static_cast<int32_t>(v + dv * 2), static_cast<int32_t>(v + dv * 3));
+    
+    alignas(16) int32_t xs[4], ys[4];
+    for (int i = 0; i + 4 <= count; i += 4, pu = _mm_add_epi32(pu, stepU), pv = _mm_add_epi32(pv, stepV)) {
+        if (!bilinear) {
+            _mm_store_si128(reinterpret_cast<__m128i*>(xs), _mm_srai_epi32(pu, 16));
+            _mm_store_si128(reinterpret_cast<__m128i*>(ys), _mm_srai_epi32(pv, 16));
+            __m128i first = _mm_unpacklo_epi32(loadTexel(image, xs[0], ys[0]), loadTexel(image, xs[1], ys[1]));
+            __m128i second = _mm_unpacklo_epi32(loadTexel(image, xs[2], ys[2]), loadTexel(image, xs[3], ys[3]));
+            blendPremultipliedSSE2(dst + i, _mm_unpacklo_epi64(first, second));
+            continue;
+        }
+        
+        __m128i su = _mm_sub_epi32(pu, half), sv = _mm_sub_epi32(pv, half);
+        __m128i x = _mm_srai_epi32(su, 16), y = _mm_srai_epi32(sv, 16);
+        __m128i outside = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi32(x, zero), _mm_cmpgt_epi32(x, lastX)),
+                                       _mm_or_si128(_mm_cmplt_epi32(y, zero), _mm_cmpgt_epi32(y, lastY)));
+        if (_mm_movemask_epi8(outside)) {
+            _mm_store_si128(reinterpret_cast<__m128i*>(xs), pu);
+            _mm_store_si128(reinterpret_cast<__m128i*>(ys), pv);
+            for (int k = 0; k < 4; k++) transformPixel(image, dst[i + k], xs[k], ys[k], true);
+            continue;
+        }
+        _mm_store_si128(reinterpret_cast<__m128i*>(xs), x);
+        _mm_store_si128(reinterpret_cast<__m128i*>(ys), y);
+        
+        // Fractions as 16-bit lanes, each pixel's repeated over its four channels
+        __m128i fx = _mm_and_si128(_mm_srli_epi32(su, 8), fraction);
+        __m128i fy = _mm_and_si128(_mm_srli_epi32(sv, 8), fraction);
+        fx = _mm_packs_epi32(fx, fx);
+        fy = _mm_packs_epi32(fy, fy);
+        fx = _mm_unpacklo_epi16(fx, fx);
+        fy = _mm_unpacklo_epi16(fy, fy);
+        
+        const Color* texels = image.pixels;
+        size_t pitch = image.pitch;
+        __m128i lo = bilinearPairSSE2(texels + static_cast<size_t>(ys[0]) * pitch + xs[0],
+                                      texels + static_cast<size_t>(ys[1]) * pitch + xs[1], pitch,
+                                      _mm_unpacklo_epi32(fx, fx), _mm_unpacklo_epi32(fy, fy));
+        __m128i hi = bilinearPairSSE2(texels + static_cast<size_t>(ys[2]) * pitch + xs[2],
+                                      texels + static_cast<size_t>(ys[3]) * pitch + xs[3], pitch,
+                                      _mm_unpackhi_epi32(fx, fx), _mm_unpackhi_epi32(fy, fy));
+        blendPremultipliedSSE2(dst + i, _mm_packus_epi16(lo, hi));
+    }
+}
+#endif // GRAPHICS_X86_SIMD
+
+static void transformSpan(const ImagePixels& image, Color* dst, int count, int64_t u, int64_t v, int64_t du,
+                          int64_t dv, bool bilinear) {
+    int i = 0;
+#ifdef GRAPHICS_X86_SIMD
+    transformSpanSSE2(image, dst, count, u, v, du, dv, bilinear);
+    i = count & ~3;
+#endif
+    for (; i < count; i++) {
+        transformPixel(image, dst[i], static_cast<int32_t>(u + i * du), static_cast<int32_t>(v + i * dv), bilinear);
+    }
+}
+
+// Blends the transformed image into dst, which holds the destination pixels
+// t.x0..t.x1 x t.y0..t.y1 in rows pitch pixels apart
+static void transformImage(const ImagePixels& image, const ImageTransform& t, bool bilinear, Color* dst,
+                           size_t pitch) {
+    GRAPHICS_TRACE_SCOPE("transformImage");
+    
+    // Nearest samples centres in [0, size), bilinear ones anywhere a texel of
+    // the 2x2 footprint is still inside
+    int64_t border = bilinear ? 32768 : 0;
+    int64_t uLo = -border + (bilinear ? 1 : 0), uHi = (static_cast<int64_t>(image.width) << 16) + border;
+    int64_t vLo = uLo, vHi = (static_cast<int64_t>(image.height) << 16) + border;
+    int64_t du = std::llround(t.dudx * 65536.0), dv = std::llround(t.dvdx * 65536.0);
+    
+    for (int y = t.y0; y < t.y1; y++) {
+        int64_t u = std::llround((t.u0 + t.dudy * y) * 65536.0);
+        int64_t v = std::llround((t.v0 + t.dvdy * y) * 65536.0);
+        int from = t.x0, to = t.x1;
+        narrowRun(u, du, uLo, uHi, from, to);
+        narrowRun(v, dv, vLo, vHi, from, to);
+        if (from >= to) continue;
+        
+        transformSpan(image, dst + static_cast<size_t>(y - t.y0) * pitch + (from - t.x0), to - from,
+                      u + from * du, v + from * dv, du, dv, bilinear);
+    }
+}
+
+// ============================================================================
+// IMAGE FILES - shared by all backends
+// ============================================================================
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Larger files are rejected rather than allocated (1 GiB of RGBA)
+const uint64_t MAX_IMAGE_PIXELS = 1u << 28;
+
+// BMP and PPM images with at least this many pixels are decoded in parallel
+// stripes of rows
+const int PARALLEL_DECODE_PIXELS = 512 * 512;
+
+// Read-only mapping of a whole file. Pages are read in by the OS as the
+// decoder touches them, nothing is copied into the heap first.
+struct MappedFile {
+    const uint8_t* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+    
+    MappedFile() : data(nullptr), size(0) {
+#ifdef _WIN32
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#endif
+    }
+    
+    ~MappedFile() {
+        close();
+    }
+    
+    bool open(const char* path) {
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER length;
+        if (!GetFileSizeEx(file, &length) || length.QuadPart <= 0) return false;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) return false;
+        data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!data) return false;
+        size = static_cast<size_t>(length.QuadPart);
+        return true;
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // The mapping keeps the file open
+        if (view == MAP_FAILED) return false;
+        
+        // Start reading the whole file while the headers are parsed
+        madvise(view, static_cast<size_t>(info.st_size), MADV_WILLNEED);
+        data = static_cast<const uint8_t*>(view);
+        size = static_cast<size_t>(info.st_size);
+        return true;
+#endif
+    }
+    
+    void close() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+#else
+        if (data) munmap(const_cast<uint8_t*>(data), size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+enum ImageKind {
+    IMAGE_QOI,
+    IMAGE_BMP,
+    IMAGE_PPM
+};
+
+// What the decoders need to know about a file, filled in by parseImage
+struct ImageFile {
+    ImageKind kind;
+    int width, height;
+    const uint8_t* pixels;      // First byte of the pixel data
+    const uint8_t* end;         // End of the file
+    
+    // BMP and PPM: rows of stride bytes, BMP usually stored bottom row first
+    size_t stride;
+    bool bottomUp;
+    int bitsPerPixel;           // BMP 8, 16, 24 or 32; PPM 8 or 16 per sample
+    int channels;               // PPM 1 (P5) or 3 (P6)
+    PixelLayout layout;         // BMP 16 and 32-bit pixels
+    Color palette[256];         // BMP 8-bit pixels
+    uint8_t scale[256];         // 8-bit PPM sample to 0-255
+    int maxValue;               // PPM
+};
+
+static uint32_t readLE16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t readLE32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint32_t readBE32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static bool validImageSize(int64_t width, int64_t height) {
+    return width > 0 && height > 0 && width <= INT32_MAX && height <= INT32_MAX &&
+           static_cast<uint64_t>(width) * static_cast<uint64_t>(height) <= MAX_IMAGE_PIXELS;
+}
+
+// Rows of stride bytes starting at offset must fit in the file
+static bool rowsFit(size_t size, size_t offset, size_t stride, int height) {
+    return offset <= size && stride * static_cast<uint64_t>(height) <= size - offset;
+}
+
+static bool parseQOI(const uint8_t* data, size_t size, ImageFile& image) {
+    if (size < 14 + 8 || std::memcmp(data, "qoif", 4) != 0) return false;
+    uint32_t width = readBE32(data + 4);
+    uint32_t height = readBE32(data + 8);
+    if (!validImageSize(width, height) || (data[12] != 3 && data[12] != 4)) return false;
+    
+    image.kind = IMAGE_QOI;
+    image.width = static_cast<int>(width);
+    image.height = static_cast<int>(height);
+    image.pixels = data + 14;
+    return true;
+}
+
+// Masks are stored as little endian words, PixelLayout wants native ones
+static uint32_t nativeMask(uint32_t mask, int bytesPerPixel) {
+    if (hostIsLittleEndian()) return mask;
+    if (bytesPerPixel == 2) return ((mask & 0xFF) << 8) | ((mask >> 8) & 0xFF);
+    return ((mask & 0xFF) << 24) | ((mask & 0xFF00) << 8) | ((mask >> 8) & 0xFF00) | (mask >> 24);
+}
+
+// BMP compression types that store plain pixels
+const uint32_t BMP_RGB = 0;
+const uint32_t BMP_BITFIELDS = 3;
+const uint32_t BMP_ALPHABITFIELDS = 6;
+
+// Uncompressed BMP with a BITMAPINFOHEADER or later: 8-bit palette, 24-bit,
+// 16/32-bit with default or BI_BITFIELDS masks
+static bool parseBMP(const uint8_t* data, size_t size, ImageFile& image) {
+    if (size < 54 || data[0] != 'B' || data[1] != 'M') return false;
+    
+    uint32_t offset = readLE32(data + 10);
+    uint32_t headerSize = readLE32(data + 14);
+    int64_t width = static_cast<int32_t>(readLE32(data + 18));
+    int64_t height = static_cast<int32_t>(readLE32(data + 22));
+    int bits = static_cast<int>(readLE16(data + 28));
+    uint32_t compression = readLE32(data + 30);
+    if (headerSize < 40 || 14 + static_cast<uint64_t>(headerSize) > size) return false;
+    
+    image.kind = IMAGE_BMP;
+    image.bottomUp = height > 0;
+    if (height < 0) height = -height;
+    if (!validImageSize(width, height)) return false;
+    image.width = static_cast<int>(width);
+    image.height = static_cast<int>(height);
+    image.bitsPerPixel = bits;
+    
+    if (compression == BMP_RGB && bits == 8) {
+        uint32_t colors = readLE32(data + 46);
+        if (colors == 0 || colors > 256) colors = 256;
+        size_t table = 14 + headerSize;
+        if (table + colors * 4 > size) return false;
+        for (uint32_t i = 0; i < 256; i++) {
+            const uint8_t* entry = data + table + i * 4;
+            image.palette[i] = i < colors ? Color(entry[2], entry[1], entry[0]) : Color(0, 0, 0);
+        }
+    } else if (compression == BMP_RGB && bits == 16) {
+        PixelLayout layout = {2, 0x7C00, 0x03E0, 0x001F, 0};
+        image.layout = layout;
+    } else if (compression == BMP_RGB && bits == 32) {
+        image.layout = layoutOf(PIXEL_BGRX32);
+    } else if ((compression == BMP_BITFIELDS || compression == BMP_ALPHABITFIELDS) && (bits == 16 || bits == 32)) {
+        bool hasAlpha = headerSize >= 56 || compression == BMP_ALPHABITFIELDS;
+        if (size < (hasAlpha ? 70u : 66u)) return false;
+        int bytes = bits / 8;
+        PixelLayout layout = {bytes, nativeMask(readLE32(data + 54), bytes), nativeMask(readLE32(data + 58), bytes),
+                              nativeMask(readLE32(data + 62), bytes),
+                              hasAlpha ? nativeMask(readLE32(data + 66), bytes) : 0};
+        image.layout = layout;
+    } else if (compression != BMP_RGB || bits != 24) {
+        return false;
+    }
+    
+    image.stride = (static_cast<size_t>(width) * bits + 31) / 32 * 4;
+    image.pixels = data + offset;
+    return rowsFit(size, offset, image.stride, image.height);
+}
+
+// Skips whitespace and comments, then reads a decimal number
+static bool readPPMNumber(const uint8_t*& p, const uint8_t* end, int64_t& value) {
+    while (p < end && (std::isspace(*p) || *p == '#')) {
+        if (*p == '#') {
+            while (p < end && *p != '\n') p++;
+        } else {
+            p++;
+        }
+    }
+    if (p == end || !std::isdigit(*p)) return false;
+    value = 0;
+    while (p < end && std::isdigit(*p) && value <= INT32_MAX) value = value * 10 + (*p++ - '0');
+    return true;
+}
+
+// Binary PPM (P6) and PGM (P5), 8 or 16 bits per sample
+static bool parsePPM(const uint8_t* data, size_t size, ImageFile& image) {
+    if (size < 3 || data[0] != 'P' || (data[1] != '5' && data[1] != '6')) return false;
+    
+    const uint8_t* p = data + 2;
+    const uint8_t* end = data + size;
+    int64_t width, height, maxValue;
+    if (!readPPMNumber(p, end, width) || !readPPMNumber(p, end, height) ||
+        !readPPMNumber(p, end, maxValue)) return false;
+    if (!validImageSize(width, height) || maxValue < 1 || maxValue > 65535) return false;
+    if (p == end || !std::isspace(*p)) return false;
+    p++;
+    
+    image.kind = IMAGE_PPM;
+    image.width = static_cast<int>(width);
+    image.height = static_cast<int>(height);
+    image.channels = data[1] == '6' ? 3 : 1;
+    image.bitsPerPixel = maxValue < 256 ? 8 : 16;
+    image.maxValue = static_cast<int>(maxValue);
+    image.bottomUp = false;
+    image.stride = static_cast<size_t>(width) * image.channels * (image.bitsPerPixel / 8);
+    image.pixels = p;
+    for (int i = 0; i < 256; i++) {
+        image.scale[i] = static_cast<uint8_t>(std::min<int64_t>(255, (i * 255 + maxValue / 2) / maxValue));
+    }
+    return rowsFit(size, p - data, image.stride, image.height);
+}
+
+static bool parseImage(const uint8_t* data, size_t size, ImageFile& image) {
+    image.end = data + size;
+    return parseQOI(data, size, image) || parseBMP(data, size, image) || parsePPM(data, size, image);
+}
+
+static void expandRGB24(const uint8_t* src, uint8_t* rgba, int count, bool redFirst) {
+    const int red = redFirst ? 0 : 2;
+    for (int i = 0; i < count; i++, src += 3, rgba += 4) {
+        rgba[0] = src[red];
+        rgba[1] = src[1];
+        rgba[2] = src[2 - red];
+        rgba[3] = 255;
+    }
+}
+
+// One PPM row to RGBA
+static void expandPPMRow(const ImageFile& image, const uint8_t* src, uint8_t* rgba) {
+    const int samples = image.width * image.channels;
+    if (image.bitsPerPixel == 8 && image.channels == 3 && image.maxValue == 255) {
+        expandRGB24(src, rgba, image.width, true);
+        return;
+    }
+    
+    for (int i = 0, x = 0; i < samples; i += image.channels, x++) {
+        uint8_t value[3];
+        for (int c = 0; c < image.channels; c++) {
+            if (image.bitsPerPixel == 8) {
+                value[c] = image.scale[src[i + c]];
+            } else {
+                const uint8_t* sample = src + (i + c) * 2;
+                uint32_t v = (sample[0] << 8) | sample[1];
+                value[c] = static_cast<uint8_t>(std::min<uint32_t>(255, (v * 255 + image.maxValue / 2) / image.maxValue));
+            }
+        }
+        uint8_t* out = rgba + x * 4;
+        out[0] = value[0];
+        out[1] = value[image.channels == 3 ? 1 : 0];
+        out[2] = value[image.channels == 3 ? 2 : 0];
+        out[3] = 255;
+    }
+}
+
+// Decodes rows [first, last) of a BMP or PPM file into dst. Rows needing more
+// than a byte shuffle are expanded through a row of RGBA that stays in cache.
+static void decodeRows(const ImageFile& image, int first, int last, uint8_t* dst, size_t pitch,
+                       const PixelLayout& layout) {
+    const PixelLayout rgbaLayout = layoutOf(PIXEL_RGBA32);
+    const bool direct = std::memcmp(&layout, &rgbaLayout, sizeof(PixelLayout)) == 0;
+    const bool packed = image.kind == IMAGE_BMP && (image.bitsPerPixel == 16 || image.bitsPerPixel == 32);
+    std::vector<uint8_t> scratch(direct || packed ? 0 : static_cast<size_t>(image.width) * 4);
+    
+    for (int y = first; y < last; y++) {
+        int stored = image.bottomUp ? image.height - 1 - y : y;
+        const uint8_t* src = image.pixels + static_cast<size_t>(stored) * image.stride;
+        uint8_t* out = dst + static_cast<size_t>(y) * pitch;
+        if (packed) {
+            convertLayout(src, image.layout, out, layout, image.width);
+            continue;
+        }
+        
+        uint8_t* rgba = direct ? out : scratch.data();
+        if (image.kind == IMAGE_PPM) {
+            expandPPMRow(image, src, rgba);
+        } else if (image.bitsPerPixel == 24) {
+            expandRGB24(src, rgba, image.width, false);
+        } else {
+            for (int x = 0; x < image.width; x++) std::memcpy(rgba + x * 4, &image.palette[src[x]], 4);
+        }
+        if (!direct) packPixels(rgba, out, layout, image.width);
+    }
+}
+
+// QOI chains every pixel to the previous ones (runs, deltas, the colour
+// index), so it is decoded front to back in a single pass. False if the data
+// ends early.
+static bool decodeQOI(const ImageFile& image, uint8_t* dst, size_t pitch, const PixelLayout& layout) {
+    const PixelLayout rgbaLayout = layoutOf(PIXEL_RGBA32);
+    const bool direct = std::memcmp(&layout, &rgbaLayout, sizeof(PixelLayout)) == 0;
+    std::vector<uint8_t> scratch(direct ? 0 : static_cast<size_t>(image.width) * 4);
+    
+    const uint8_t* p = image.pixels;
+    const uint8_t* end = image.end;
+    Color index[64];
+    for (int i = 0; i < 64; i++) index[i] = Color(0, 0, 0, 0);
+    Color px(0, 0, 0, 255);
+    int run = 0;
+    
+    for (int y = 0; y < image.height; y++) {
+        uint8_t* out = dst + static_cast<size_t>(y) * pitch;
+        Color* rgba = reinterpret_cast<Color*>(direct ? out : scratch.data());
+        
+        for (int x = 0; x < image.width;) {
+            // Runs may continue on the next row
+            if (run > 0) {
+                int n = std::min(run, image.width - x);
+                std::fill(rgba + x, rgba + x + n, px);
+                x += n;
+                run -= n;
+                continue;
+            }
+            
+            if (p == end) return false;
+            int op = *p++;
+            if (op == 0xFE || op == 0xFF) {
+                if (end - p < (op == 0xFE ? 3 : 4)) return false;
+                px.r = p[0];
+                px.g = p[1];
+                px.b = p[2];
+                if (op == 0xFF) px.a = p[3];
+                p += op == 0xFE ? 3 : 4;
+            } else if ((op >> 6) == 0) {
+                px = index[op];
+            } else if ((op >> 6) == 1) {
+                px.r += ((op >> 4) & 3) - 2;
+                px.g += ((op >> 2) & 3) - 2;
+                px.b += (op & 3) - 2;
+            } else if ((op >> 6) == 2) {
+                if (p == end) return false;
+                int dg = (op & 0x3F) - 32;
+                int next = *p++;
+                px.r += dg + ((next >> 4) & 0x0F) - 8;
+                px.g += dg;
+                px.b += dg + (next & 0x0F) - 8;
+            } else {
+                run = op & 0x3F;
+            }
+            index[(px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64] = px;
+            rgba[x++] = px;
+        }
+        if (!direct) packPixels(scratch.data(), out, layout, image.width);
+    }
+    return true;
+}
+
+// Decodes the image into width x height pixels of layout, pitch bytes apart
+static bool decodeImage(const ImageFile& image, uint8_t* dst, size_t pitch, const PixelLayout& layout) {
+    if (image.kind == IMAGE_QOI) return decodeQOI(image, dst, pitch, layout);
+    
+    if (static_cast<uint64_t>(image.width) * image.height < static_cast<uint64_t>(PARALLEL_DECODE_PIXELS)) {
+        decodeRows(image, 0, image.height, dst, pitch, layout);
+        return true;
+    }
+    
+    // Stripes of about 64K pixels
+    int grain = std::max(1, 65536 / image.width);
+    parallelFor(0, image.height, grain, [&](int first, int last) {
+        decodeRows(image, first, last, dst, pitch, layout);
+    });
+    return true;
+}
+
+// Upload buffer of a surface being loaded: width x height pixels of layout,
+// pitch bytes apart, that the decoder writes into
+struct ImageUpload {
+    Surface* surface;
+    uint8_t* pixels;
+    size_t pitch;
+    PixelLayout layout;
+    void* staging;                  // Backend data between begin and finish
+    std::vector<Color> fallback;    // RGBA pixels when the backend layout has no fast path
+    
+    ImageUpload() : surface(nullptr), pixels(nullptr), pitch(0), staging(nullptr) {
+        layout = layoutOf(PIXEL_RGBA32);
+    }
+};
+
+// Per backend: creates the surface and its upload buffer, then uploads the
+// decoded pixels or destroys the surface if decoding failed
+static bool beginImageUpload(WindowHandle* window, int width, int height, ImageUpload& upload);
+static void finishImageUpload(WindowHandle* window, ImageUpload& upload, bool decoded);
+
+// ============================================================================
+// FRAME ARENA - shared by all backends
+// ============================================================================
+
+const size_t FRAME_ARENA_MIN_BLOCK = 64 * 1024;
+
+// Blocks come from malloc, which aligns them this far
+const size_t FRAME_ARENA_ALIGNMENT = alignof(std::max_align_t);
+
+// Bump allocator for data that lives until the next swapBuffers. Allocating
+// is a pointer increment; reset rewinds everything at once. A frame that
+// overflows the first block chains more, and the next reset merges them into
+// one block sized for the whole frame, so a steady workload stops touching
+// the heap after its first frames.
+struct FrameArena {
+    struct Block {
+        uint8_t* data;
+        size_t size;
+    };
+    
+    std::vector<Block> blocks;
+    size_t current;              // Block being filled
+    size_t offset;               // Fill level of the current block
+    size_t used;                 // Bytes handed out since the last reset
+    uint64_t heapAllocations;
+    
+    FrameArena() : current(0), offset(0), used(0), heapAllocations(0) {}
+    
+    ~FrameArena() {
+        for (size_t i = 0; i < blocks.size(); i++) std::free(blocks[i].data);
+    }
+    
+    bool addBlock(size_t size) {
+        Block block = {static_cast<uint8_t*>(std::malloc(size)), size};
+        if (!block.data) return false;
+        blocks.push_back(block);
+        heapAllocations++;
+        return true;
+    }
+    
+    void* allocate(size_t size, size_t alignment) {
+        if (!blocks.empty()) {
+            Block& block = blocks[current];
+            uintptr_t base = reinterpret_cast<uintptr_t>(block.data);
+            size_t start = ((base + offset + alignment - 1) & ~(alignment - 1)) - base;
+            if (start + size <= block.size) {
+                offset = start + size;
+                used += size;
+                return block.data + start;
+            }
+        }
+        
+        size_t last = blocks.empty() ? 0 : blocks.back().size;
+        if (!addBlock(std::max(std::max(size + alignment, last * 2), FRAME_ARENA_MIN_BLOCK))) return nullptr;
+        current = blocks.size() - 1;
+        offset = 0;
+        return allocate(size, alignment);
+    }
+    
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t total = 0;
+            for (size_t i = 0; i < blocks.size(); i++) {
+                total += blocks[i].size;
+                std::free(blocks[i].data);
+            }
+            blocks.clear();
+            addBlock(total);
+        }
+        current = 0;
+        offset = 0;
+        used = 0;
+    }
+};
+
+// Called at the start of swapBuffers. Rewinds the window's frame arena on the
+// application thread; the render thread's replayed swapBuffers leaves it alone.
+static void endFrame(WindowHandle* window);
+
+// ============================================================================
+// RENDER THREAD - shared by all backends
+// ============================================================================
+
+enum CommandType {
+    CMD_COLOR,
+    CMD_CLEAR,
+    CMD_LINE,
+    CMD_RECTANGLE,
+    CMD_FILLED_RECTANGLE,
+    CMD_CIRCLE,
+    CMD_FILLED_CIRCLE,
+    CMD_PIXEL,
+    CMD_PRESENT_MODE,
+    CMD_SET_TARGET,
+    CMD_BLIT,
+    CMD_DESTROY_SURFACE,
+    CMD_SET_CANVAS,
+    CMD_INDEXED_MODE,
+    CMD_PALETTE_ENTRY,
+    CMD_POINTS,
+    CMD_READBACK,
+    CMD_FLOOD_FILL,
+    CMD_PUSH_CLIP,
+    CMD_POP_CLIP,
+    CMD_FILL_PATH,
+    CMD_DRAW_IMAGE,
+    CMD_DRAW_INDEX
+};
+
+struct DrawCommand {
+    CommandType type;
+    int a, b, c, d;
+    Color color;
+};
+
+// The arguments of a surface command, too large for a DrawCommand. For
+// CMD_BLIT, b and c of the command tell whether the source and destination
+// rectangles were given. CMD_DRAW_IMAGE keeps the filter in b and x, y,
+// angle, scaleX and scaleY in transform.
+struct SurfaceCommand {
+    Surface* surface;
+    Rect source, dest;
+    float transform[5];
+};
+
+// A readPixelsAsync request. It is captured by the thread that draws for the
+// window just before the next present and its future completes after it.
+struct PendingReadback {
+    Rect rect;
+    bool whole;                     // rect not given, read the whole target
+    bool captured;
+    std::shared_ptr<jobdetail::State<std::vector<Color>>> state;
+};
+
+// A frame of recorded commands. Point batches are too large for a command and
+// are appended to points instead, CMD_POINTS refers to them by offset (a) and
+// count (b). CMD_FILL_PATH does the same with pathPoints and keeps the fill
+// rule in c. CMD_READBACK refers to readbacks and surface commands to
+// surfaceCommands by index (a). CMD_DRAW_INDEX is the command color.g with
+// the arguments a-d, drawn with palette index color.r.
+struct CommandBuffer {
+    std::vector<DrawCommand> commands;
+    std::vector<BatchPoint> points;
+    std::vector<PathPoint> pathPoints;
+    std::vector<PendingReadback> readbacks;
+    std::vector<SurfaceCommand> surfaceCommands;
+    
+    void clear() {
+        commands.clear();
+        points.clear();
+        pathPoints.clear();
+        readbacks.clear();
+        surfaceCommands.clear();
+    }
+};
+
+// With threaded rendering the application thread records draw calls into one
+// command buffer while the render thread replays the other one. swapBuffers
+// hands the recorded buffer over with a single atomic store, so frame N+1 can
+// be simulated while frame N is rasterized and presented. The mutex and
+// condition variable are only used to park an idle thread, never held while
+// recording or drawing.
+struct RenderThread {
+    WindowHandle* window;
+    std::thread thread;
+    
+    CommandBuffer buffers[2];
+    int recording;                          // Only touched by the application thread
+    std::atomic<CommandBuffer*> submitted;  // Frame waiting for the render thread
+    std::atomic<bool> idle;                 // Render thread finished its last frame
+    std::atomic<bool> quit;
+    
+    std::mutex mutex;
+    std::condition_variable wake;
+    
+    RenderThread(WindowHandle* owner) : window(owner), recording(0), submitted(nullptr),
+                                        idle(true), quit(false) {}
+};
+
+// Set on the render thread itself, so replayed calls draw immediately
+static thread_local RenderThread* currentRenderThread = nullptr;
+
+// Implemented by each backend. Called on the thread that gives up / takes over
+// the backend renderer when threaded rendering starts or stops.
+static void releaseRenderer(WindowHandle* window);
+static void acquireRenderer(WindowHandle* window);
+
+// Implemented by each backend. Whether draw calls may be replayed on a thread
+// other than the one that created the window.
+static bool threadedRenderingSupported();
+
+// Implemented by each backend. Releases a surface's backend resources and
+// deletes it, on whichever thread currently draws for its window.
+static void freeSurface(Surface* surface);
+
+// Implemented by each backend. Makes the surface the logical-resolution canvas
+// that is drawn to by default and upscaled at swapBuffers (nullptr = none).
+static void setCanvas(WindowHandle* window, Surface* canvas);
+
+// Recomputes window->clip from the draw target's bounds and the clip stack,
+// and has the backend apply it. Called whenever either of them changes.
+static void updateClip(WindowHandle* window);
+
+// Implemented by each backend. Sets the renderer's own clip to window->clip
+// while a clip rectangle is pushed, or removes it (enabled = false) for work
+// that has to reach the whole target, like presenting.
+static void applyNativeClip(WindowHandle* window, bool enabled = true);
+
+// Implemented by each backend. Draws a batch of single pixel points.
+static void drawBatchPoints(WindowHandle* window, const BatchPoint* points, int count);
+
+// Draws a point batch, recording it while threaded rendering is on
+static void drawPoints(WindowHandle* window, const BatchPoint* points, int count);
+
+// Implemented by each backend. Blends color into the target through the
+// coverage of a filled path.
+static void drawCoverage(WindowHandle* window, const CoverageMask& mask, const Color& color);
+
+// Draws a clear, primitive or flood fill command with a palette index,
+// recording it while threaded rendering is on
+static void drawIndexed(WindowHandle* window, CommandType type, int a, int b, int c, int d, uint8_t index);
+
+// Fills a flattened path, recording it while threaded rendering is on
+static void fillPathPoints(WindowHandle* window, const PathPoint* points, int count, const Color& color,
+                           FillRule rule);
+
+// Executes a draw call on a buffer in memory: the indexed buffer in indexed
+// mode, or the pixels of a headless window. Returns false when the call is for
+// the backend.
+static bool drawSoftware(WindowHandle* window, CommandType type, int a, int b, int c, int d,
+                        const Color& color);
+
+// Implemented by each backend. Reads rect of the backend's current draw
+// target as PIXEL_RGBA32 rows pitch bytes apart. rect is inside the target.
+static bool readTarget(WindowHandle* window, const Rect& rect, Color* dst, size_t pitch);
+
+// Called on the thread that draws. queueReadback adds a readPixelsAsync
+// request, swapBuffers calls captureReadbacks to read the frame for pending
+// requests before it is presented and finishReadbacks to complete them after. With destroying set, requests that
+// weren't captured yet complete too, with an empty result.
+static void queueReadback(WindowHandle* window, const PendingReadback& readback);
+static void captureReadbacks(WindowHandle* window);
+static void finishReadbacks(WindowHandle* window, bool destroying = false);
+
+// Records a draw call instead of executing it. Returns false when the call
+// should be executed right away (no render thread, or we are the render thread).
+static bool deferDraw(RenderThread* rt, CommandType type, int a, int b, int c, int d,
+                      const Color& color) {
+    if (!rt || currentRenderThread == rt) return false;
+    
+    DrawCommand command;
+    command.type = type;
+    command.a = a;
+    command.b = b;
+    command.c = c;
+    command.d = d;
+    command.color = color;
+    rt->buffers[rt->recording].commands.push_back(command);
+    return true;
+}
+
+static bool deferSurfaceCommand(RenderThread* rt, CommandType type, Surface* surface,
+                                const Rect* source = nullptr, const Rect* dest = nullptr) {
+    if (!rt || currentRenderThread == rt) return false;
+    
+    std::vector<SurfaceCommand>& surfaceCommands = rt->buffers[rt->recording].surfaceCommands;
+    SurfaceCommand command;
+    command.surface = surface;
+    if (source) command.source = *source;
+    if (dest) command.dest = *dest;
+    surfaceCommands.push_back(command);
+    return deferDraw(rt, type, static_cast<int>(surfaceCommands.size() - 1), source != nullptr, dest != nullptr, 0,
+                     Color());
+}
+
+static bool deferImageTransform(RenderThread* rt, Surface* image, float x, float y, float angle, float scaleX,
+                                float scaleY, ImageFilter filter) {
+    if (!deferSurfaceCommand(rt, CMD_DRAW_IMAGE, image)) return false;
+    
+    CommandBuffer& buffer = rt->buffers[rt->recording];
+    buffer.commands.back().b = filter;
+    SurfaceCommand& command = buffer.surfaceCommands.back();
+    command.transform[0] = x;
+    command.transform[1] = y;
+    command.transform[2] = angle;
+    command.transform[3] = scaleX;
+    command.transform[4] = scaleY;
+    return true;
+}
+
+static void notifyRenderThread(RenderThread* rt) {
+    // Taking the lock orders the atomic store before the waiter's re-check
+    { std::lock_guard<std::mutex> lock(rt->mutex); }
+    rt->wake.notify_all();
+}
+
+static void waitForRenderThread(RenderThread* rt) {
+    if (rt->idle.load(std::memory_order_acquire)) return;
+    
+    GRAPHICS_TRACE_SCOPE("waitForRenderThread");
+    std::unique_lock<std::mutex> lock(rt->mutex);
+    rt->wake.wait(lock, [rt] { return rt->idle.load(std::memory_order_acquire); });
+}
+
+// Hands the recorded frame to the render thread. Blocks only while the
+// previous frame is still being rendered.
+static bool submitFrame(RenderThread* rt) {
+    if (!rt || currentRenderThread == rt) return false;
+    
+    waitForRenderThread(rt);
+    
+    rt->idle.store(false, std::memory_order_relaxed);
+    rt->submitted.store(&rt->buffers[rt->recording], std::memory_order_release);
+    notifyRenderThread(rt);
+    
+    // The other buffer was replayed completely before the render thread went idle
+    rt->recording ^= 1;
+    rt->buffers[rt->recording].clear();
+    return true;
+}
+
+static void replayCommands(WindowHandle* window, const CommandBuffer& frame) {
+    GRAPHICS_TRACE_SCOPE("replayCommands");
+    const std::vector<DrawCommand>& commands = frame.commands;
+    for (size_t i = 0; i < commands.size(); i++) {
+        const DrawCommand& cmd = commands[i];
+        switch (cmd.type) {
+            case CMD_COLOR: setDrawColor(window, cmd.color); break;
+            case CMD_CLEAR: clearScreen(window, cmd.color); break;
+            case CMD_LINE: drawLine(window, cmd.a, cmd.b, cmd.c, cmd.d, cmd.color); break;
+            case CMD_RECTANGLE: drawRectangle(window, cmd.a, cmd.b, cmd.c, cmd.d, cmd.color); break;
+            case CMD_FILLED_RECTANGLE: drawFilledRectangle(window, cmd.a, cmd.b, cmd.c, cmd.d, cmd.color); break;
+            case CMD_CIRCLE: drawCircle(window, cmd.a, cmd.b, cmd.c, cmd.color); break;
+            case CMD_FILLED_CIRCLE: drawFilledCircle(window, cmd.a, cmd.b, cmd.c, cmd.color); break;
+            case CMD_PIXEL: drawPixel(window, cmd.a, cmd.b, cmd.color); break;
+            case CMD_PRESENT_MODE: setPresentMode(window, static_cast<PresentMode>(cmd.a)); break;
+            case CMD_SET_TARGET: setRenderTarget(window, frame.surfaceCommands[cmd.a].surface); break;
+            case CMD_BLIT: {
+                const SurfaceCommand& blit = frame.surfaceCommands[cmd.a];
+                blitSurface(window, blit.surface, cmd.b ? &blit.source : nullptr, cmd.c ? &blit.dest : nullptr);
+                break;
+            }
+            case CMD_DESTROY_SURFACE: freeSurface(frame.surfaceCommands[cmd.a].surface); break;
+            case CMD_SET_CANVAS: setCanvas(window, frame.surfaceCommands[cmd.a].surface); break;
+            case CMD_INDEXED_MODE: setIndexedMode(window, cmd.a != 0); break;
+            case CMD_PALETTE_ENTRY: setPalette(window, cmd.a, 1, &cmd.color); break;
+            case CMD_POINTS: drawPoints(window, frame.points.data() + cmd.a, cmd.b); break;
+            case CMD_READBACK: queueReadback(window, frame.readbacks[cmd.a]); break;
+            case CMD_FLOOD_FILL: floodFill(window, cmd.a, cmd.b, cmd.color); break;
+            case CMD_PUSH_CLIP: pushClipRect(window, cmd.a, cmd.b, cmd.c, cmd.d); break;
+            case CMD_POP_CLIP: popClipRect(window); break;
+            case CMD_FILL_PATH:
+                fillPathPoints(window, frame.pathPoints.data() + cmd.a, cmd.b, cmd.color,
+                               static_cast<FillRule>(cmd.c));
+                break;
+            case CMD_DRAW_INDEX:
+                drawIndexed(window, static_cast<CommandType>(cmd.color.g), cmd.a, cmd.b, cmd.c, cmd.d, cmd.color.r);
+                break;
+            case CMD_DRAW_IMAGE: {
+                const SurfaceCommand& image = frame.surfaceCommands[cmd.a];
+                drawImageTransformed(window, image.surface, image.transform[0], image.transform[1],
+                                     image.transform[2], image.transform[3], image.transform[4],
+                                     static_cast<ImageFilter>(cmd.b));
+                break;
+            }
+        }
+    }
+}
+
+static void renderThreadMain(RenderThread* rt) {
+    currentRenderThread = rt;
+    traceThreadName("render thread");
+    acquireRenderer(rt->window);
+    
+    for (;;) {
+        CommandBuffer* frame = rt->submitted.exchange(nullptr, std::memory_order_acquire);
+        if (!frame) {
+            std::unique_lock<std::mutex> lock(rt->mutex);
+            rt->wake.wait(lock, [rt] {
+                return rt->submitted.load(std::memory_order_acquire) != nullptr ||
+                       rt->quit.load(std::memory_order_acquire);
+            });
+            if (rt->submitted.load(std::memory_order_acquire) == nullptr) break; // Quit
+            continue;
+        }
+        
+        replayCommands(rt->window, *frame);
+        swapBuffers(rt->window);
+        
+        rt->idle.store(true, std::memory_order_release);
+        notifyRenderThread(rt);
+    }
+    
+    releaseRenderer(rt->window);
+    currentRenderThread = nullptr;
+}
+
+static RenderThread* startRenderThread(WindowHandle* window) {
+    RenderThread* rt = new RenderThread(window);
+    releaseRenderer(window);
+    rt->thread = std::thread(renderThreadMain, rt);
+    return rt;
+}
+
+// Waits for the last submitted frame, then joins the thread. Anything recorded
+// since the last swapBuffers is dropped, like an unpresented back buffer.
+static void stopRenderThread(RenderThread* rt) {
+    if (!rt) return;
+    
+    waitForRenderThread(rt);
+    rt->quit.store(true, std::memory_order_release);
+    notifyRenderThread(rt);
+    rt->thread.join();
+    
+    acquireRenderer(rt->window);
+    
+    // Surfaces destroyed during the dropped frame still have to be released,
+    // readbacks requested in it are taken by the next frame instead
+    const CommandBuffer& frame = rt->buffers[rt->recording];
+    const std::vector<DrawCommand>& dropped = frame.commands;
+    for (size_t i = 0; i < dropped.size(); i++) {
+        if (dropped[i].type == CMD_DESTROY_SURFACE) freeSurface(frame.surfaceCommands[dropped[i].a].surface);
+        if (dropped[i].type == CMD_READBACK) queueReadback(rt->window, frame.readbacks[dropped[i].a]);
+    }
+    delete rt;
+}
+
+// ============================================================================
+// IMAGE CACHE - shared by all backends
+// ============================================================================
+
+const size_t DEFAULT_IMAGE_CACHE_BUDGET = 256u * 1024 * 1024;
+
+// Pixels decoded by a prefetch job, uploaded by the first acquireImage
+struct DecodedImage {
+    int width, height;
+    std::vector<Color> pixels;      // Empty if the file couldn't be read
+    
+    DecodedImage() : width(0), height(0) {}
+};
+
+static DecodedImage decodeImageFile(const std::string& path) {
+    GRAPHICS_TRACE_SCOPE("decodeImageFile");
+    DecodedImage decoded;
+    MappedFile file;
+    ImageFile image;
+    if (!file.open(path.c_str()) || !parseImage(file.data, file.size, image)) return decoded;
+    
+    decoded.pixels.resize(static_cast<size_t>(image.width) * image.height);
+    if (!decodeImage(image, reinterpret_cast<uint8_t*>(decoded.pixels.data()),
+                     static_cast<size_t>(image.width) * sizeof(Color), layoutOf(PIXEL_RGBA32))) {
+        std::vector<Color>().swap(decoded.pixels);
+        return decoded;
+    }
+    decoded.width = image.width;
+    decoded.height = image.height;
+    return decoded;
+}
+
+struct CachedImage {
+    std::string path;
+    Surface* surface;                   // nullptr while only prefetched
+    JobFuture<DecodedImage> prefetch;   // Valid until uploaded
+    size_t bytes;                       // Counted once uploaded or decoded
+    int references;
+    
+    CachedImage() : surface(nullptr), bytes(0), references(0) {}
+};
+
+typedef std::list<CachedImage> CachedImageList;
+
+// Images of one window, most recently used first. Unreferenced images stay
+// resident until all of them take more than the budget, then the least
+// recently used are freed. Prefetches count once decoded. Only the
+// application thread touches the cache.
+struct ImageCache {
+    CachedImageList images;
+    std::unordered_map<std::string, CachedImageList::iterator> byPath;
+    std::unordered_map<Surface*, CachedImageList::iterator> bySurface;
+    std::vector<CachedImageList::iterator> decoding;    // Prefetches not yet counted
+    size_t bytes;
+    ImageCacheStats stats;
+    
+    ImageCache() : bytes(0) {
+        std::memset(&stats, 0, sizeof(stats));
+        stats.budget = DEFAULT_IMAGE_CACHE_BUDGET;
+    }
+};
+
+// Marks an image as just drawn
+static void touchImage(ImageCache* cache, Surface* surface) {
+    if (!cache || currentRenderThread) return;
+    
+    std::unordered_map<Surface*, CachedImageList::iterator>::iterator found = cache->bySurface.find(surface);
+    if (found != cache->bySurface.end()) cache->images.splice(cache->images.begin(), cache->images, found->second);
+}
+
+// Counts prefetches whose decoding has finished
+static void collectPrefetches(ImageCache& cache) {
+    for (size_t i = 0; i < cache.decoding.size();) {
+        CachedImage& image = *cache.decoding[i];
+        if (!image.prefetch.ready()) {
+            i++;
+            continue;
+        }
+        image.bytes = image.prefetch.get().pixels.size() * sizeof(Color);
+        cache.bytes += image.bytes;
+        cache.decoding[i] = cache.decoding.back();
+        cache.decoding.pop_back();
+    }
+}
+
+// Drops an entry and returns its surface for the caller to destroy
+static Surface* removeImage(ImageCache& cache, CachedImageList::iterator image) {
+    Surface* surface = image->surface;
+    cache.bytes -= image->bytes;
+    cache.byPath.erase(image->path);
+    if (surface) cache.bySurface.erase(surface);
+    cache.decoding.erase(std::remove(cache.decoding.begin(), cache.decoding.end(), image), cache.decoding.end());
+    cache.images.erase(image);
+    return surface;
+}
+
+// Frees unreferenced images, least recently used first, until the cache fits
+// its budget. Prefetches still decoding are left alone.
+static void evictImages(ImageCache& cache) {
+    CachedImageList::iterator image = cache.images.end();
+    while (cache.bytes > cache.stats.budget && image != cache.images.begin()) {
+        --image;
+        if (image->references > 0 || (image->prefetch.valid() && !image->prefetch.ready())) continue;
+        
+        CachedImageList::iterator victim = image++;
+        destroySurface(removeImage(cache, victim));
+        cache.stats.evictions++;
+    }
+}
+
+#ifdef USE_SDL
+
+#include <SDL2/SDL.h>
+#include <cstring>
+#include <map>
+
+// Renderers take line endpoints as floats, exact up to 2^24
+const int SDL_LINE_LIMIT = 1 << 24;
+
+// Platform-specific window handle structure
+struct WindowHandle {
+    SDL_Window* window;
+    SDL_Renderer* renderer;
+    Uint32 windowID;
+    int width;
+    int height;
+    bool shouldClose;
+    ClipRect clip;
+    std::vector<Rect> clipStack;      // Innermost last, see pushClipRect
+    
+    InputState input;
+    bool mouseLocked;
+    
+    RenderThread* renderThread;
+    PresentClock present;
+    
+    Surface* target;                  // Current render target, nullptr = window
+    Surface* canvas;                  // Logical-resolution canvas, nullptr = none
+    Surface* pendingCanvas;           // Canvas as last requested by the application
+    std::vector<Surface*> surfaces;
+    
+    IndexedFramebuffer* indexed;      // Palette state and 8-bit buffer, nullptr = never used
+    ImageCache* imageCache;           // Images of acquireImage, nullptr = never used
+    SDL_Texture* indexedTexture;      // Streaming texture the indexed buffer is expanded into
+    SDL_Texture* coverageTexture;     // Streaming white texture, fillPath coverage goes into its alpha
+    PathRaster pathRaster;
+    SoftwareFramebuffer* headless;    // Pixels of a headless window, nullptr = native window
+    std::vector<PendingReadback> readbacks;
+    
+    std::vector<SDL_Point> pointScratch;  // Colour run of a point batch, circle outline
+    std::vector<SDL_Rect> rectScratch;    // Spans of a filled circle
+    FrameArena frameArena;
+    
+    WindowHandle() : window(nullptr), renderer(nullptr), windowID(0), width(0), height(0),
+                     shouldClose(false),
+                     mouseLocked(false), renderThread(nullptr), present(PRESENT_VSYNC),
+                     target(nullptr), canvas(nullptr), pendingCanvas(nullptr),
+                     indexed(nullptr), imageCache(nullptr), indexedTexture(nullptr), coverageTexture(nullptr),
+                     headless(nullptr) {}
+};
+
+// Offscreen surface backed by a render target texture. The texture is created
+// on first use by the thread that owns the renderer.
+struct Surface {
+    WindowHandle* window;
+    SDL_Texture* texture;
+    int width;
+    int height;
+    std::vector<Uint32> saved;  // Contents kept while the renderer is handed over
+    
+    Surface() : window(nullptr), texture(nullptr), width(0), height(0) {}
+};
+
+// Surface the drawing functions currently draw into, nullptr = back buffer
+static Surface* drawSurface(WindowHandle* window) {
+    return window->target ? window->target : window->canvas;
+}
+
+static void getTargetSize(WindowHandle* window, int& width, int& height) {
+    Surface* surface = drawSurface(window);
+    width = surface ? surface->width : window->width;
+    height = surface ? surface->height : window->height;
+}
+
+// SDL is initialized with the first window and shut down with the last one.
+// Every open window is registered by its SDL window ID so events can be
+// routed to the window they belong to, whichever window is being polled.
+// sdlMutex guards all of it; sdlUsers counts windows from ensureSDLInit on,
+// so a window still being created keeps SDL alive.
+static std::mutex sdlMutex;
+static bool sdlInitialized = false;
+static int sdlUsers = 0;
+static std::map<Uint32, WindowHandle*> sdlWindows;
+
+static bool ensureSDLInit() {
+    std::lock_guard<std::mutex> lock(sdlMutex);
+    if (!sdlInitialized) {
+        if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+            return false;
+        }
+        sdlInitialized = true;
+    }
+    sdlUsers++;
+    return true;
+}
+
+static void releaseSDLIfUnused() {
+    std::lock_guard<std::mutex> lock(sdlMutex);
+    if (--sdlUsers == 0 && sdlInitialized) {
+        SDL_Quit();
+        sdlInitialized = false;
+    }
+}
+
+// SDL key mapping
+static KeyCode mapSDLKey(SDL_Keycode sdlKey) {
+    switch (sdlKey) {
+        case SDLK_UP: return KEY_UP;
+        case SDLK_DOWN: return KEY_DOWN;
+        case SDLK_LEFT: return KEY_LEFT;
+        case SDLK_RIGHT: return KEY_RIGHT;
+        
+        case SDLK_a: return KEY_A;
+        case SDLK_b: return KEY_B;
+        case SDLK_c: return KEY_C;
+        case SDLK_d: return KEY_D;
+        case SDLK_e: return KEY_E;
+        case SDLK_f: return KEY_F;
+        case SDLK_g: return KEY_G;
+        case SDLK_h: return KEY_H;
+        case SDLK_i: return KEY_I;
+        case SDLK_j: return KEY_J;
+        case SDLK_k: return KEY_K;
+        case SDLK_l: return KEY_L;
+        case SDLK_m: return KEY_M;
+        case SDLK_n: return KEY_N;
+        case SDLK_o: return KEY_O;
+        case SDLK_p: return KEY_P;
+        case SDLK_q: return KEY_Q;
+        case SDLK_r: return KEY_R;
+        case SDLK_s: return KEY_S;
+        case SDLK_t: return KEY_T;
+        case SDLK_u: return KEY_U;
+        case SDLK_v: return KEY_V;
+        case SDLK_w: return KEY_W;
+        case SDLK_x: return KEY_X;
+        case SDLK_y: return KEY_Y;
+        case SDLK_z: return KEY_Z;
+        
+        case SDLK_0: return KEY_0;
+        case SDLK_1: return KEY_1;
+        case SDLK_2: return KEY_2;
+        case SDLK_3: return KEY_3;
+        case SDLK_4: return KEY_4;
+        case SDLK_5: return KEY_5;
+        case SDLK_6: return KEY_6;
+        case SDLK_7: return KEY_7;
+        case SDLK_8: return KEY_8;
+        case SDLK_9: return KEY_9;
+        
+        case SDLK_F1: return KEY_F1;
+        case SDLK_F2: return KEY_F2;
+        case SDLK_F3: return KEY_F3;
+        case SDLK_F4: return KEY_F4;
+        case SDLK_F5: return KEY_F5;
+        case SDLK_F6: return KEY_F6;
+        case SDLK_F7: return KEY_F7;
+        case SDLK_F8: return KEY_F8;
+        case SDLK_F9: return KEY_F9;
+        case SDLK_F10: return KEY_F10;
+        case SDLK_F11: return KEY_F11;
+        case SDLK_F12: return KEY_F12;
+        
+        case SDLK_SPACE: return KEY_SPACE;
+        case SDLK_RETURN: return KEY_ENTER;
+        case SDLK_ESCAPE: return KEY_ESCAPE;
+        case SDLK_BACKSPACE: return KEY_BACKSPACE;
+        case SDLK_TAB: return KEY_TAB;
+        case SDLK_LSHIFT:
+        case SDLK_RSHIFT: return KEY_SHIFT;
+        case SDLK_LCTRL:
+        case SDLK_RCTRL: return KEY_CONTROL;
+        case SDLK_LALT:
+        case SDLK_RALT: return KEY_ALT;
+        
+        case SDLK_PLUS:
+        case SDLK_EQUALS: return KEY_PLUS;
+        case SDLK_MINUS: return KEY_MINUS;
+        
+        default: return KEY_UNKNOWN;
+    }
+}
+
+static bool createRenderer(WindowHandle* window) {
+    // Only real vsync is left to the driver, the other modes are paced by us
+    Uint32 flags = SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE;
+    if (window->present.mode == PRESENT_VSYNC) flags |= SDL_RENDERER_PRESENTVSYNC;
+    
+    window->renderer = SDL_CreateRenderer(window->window, -1, flags);
+    if (!window->renderer) return false;
+    
+    // Enable alpha blending
+    SDL_SetRenderDrawBlendMode(window->renderer, SDL_BLENDMODE_BLEND);
+    return true;
+}
+
+// SDL_Render calls are only allowed on the thread that created the window,
+// so there is no render thread to hand the renderer to
+static bool threadedRenderingSupported() {
+    return false;
+}
+
+// Destroys the renderer so it can be created again with other flags, older
+// SDL picks vsync only then
+static void releaseRenderer(WindowHandle* window) {
+    if (!window->renderer) return;
+    
+    // Textures die with their renderer, read surfaces back so they survive
+    for (size_t i = 0; i < window->surfaces.size(); i++) {
+        Surface* surface = window->surfaces[i];
+        if (!surface->texture) continue;
+        
+        surface->saved.resize(static_cast<size_t>(surface->width) * surface->height);
+        SDL_SetRenderTarget(window->renderer, surface->texture);
+        SDL_RenderReadPixels(window->renderer, nullptr, SDL_PIXELFORMAT_RGBA8888,
+                             surface->saved.data(), surface->width * 4);
+        SDL_DestroyTexture(surface->texture);
+        surface->texture = nullptr;
+    }
+    
+    // The indexed buffer is expanded again every frame, nothing to keep
+    if (window->indexedTexture) {
+        SDL_DestroyTexture(window->indexedTexture);
+        window->indexedTexture = nullptr;
+    }
+    if (window->coverageTexture) {
+        SDL_DestroyTexture(window->coverageTexture);
+        window->coverageTexture = nullptr;
+    }
+    
+    SDL_DestroyRenderer(window->renderer);
+    window->renderer = nullptr;
+}
+
+static SDL_Texture* surfaceTexture(Surface* surface) {
+    SDL_Renderer* renderer = surface->window->renderer;
+    if (surface->texture || !renderer) return surface->texture;
+    
+    surface->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+                                         surface->width, surface->height);
+    if (!surface->texture) return nullptr;
+    SDL_SetTextureBlendMode(surface->texture, SDL_BLENDMODE_BLEND);
+    
+    if (!surface->saved.empty()) {
+        SDL_UpdateTexture(surface->texture, nullptr, surface->saved.data(), surface->width * 4);
+        std::vector<Uint32>().swap(surface->saved);
+    } else {
+        // New surfaces start fully transparent
+        SDL_Texture* previous = SDL_GetRenderTarget(renderer);
+        SDL_SetRenderTarget(renderer, surface->texture);
+        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        SDL_RenderClear(renderer);
+        SDL_SetRenderTarget(renderer, previous);
+        applyNativeClip(surface->window);  // Switching targets reset it
+    }
+    return surface->texture;
+}
+
+// Points the renderer and the clip rectangle at the current draw surface
+static void bindTarget(WindowHandle* window) {
+    Surface* surface = drawSurface(window);
+    if (window->renderer) SDL_SetRenderTarget(window->renderer, surface ? surfaceTexture(surface) : nullptr);
+    updateClip(window);
+}
+
+// SDL keeps one clip per target and swaps it on every target change, so the
+// clip is set again whenever a target is bound
+static void applyNativeClip(WindowHandle* window, bool enabled) {
+    if (!window->renderer) return;
+    if (!enabled || window->clipStack.empty()) {
+        SDL_RenderSetClipRect(window->renderer, nullptr);
+        return;
+    }
+    
+    // An empty rectangle turns SDL's clipping off, one outside the target doesn't
+    const ClipRect& clip = window->clip;
+    SDL_Rect rect = {-1, -1, 1, 1};
+    if (clip.x0 < clip.x1) {
+        SDL_Rect visible = {clip.x0, clip.y0, clip.x1 - clip.x0, clip.y1 - clip.y0};
+        rect = visible;
+    }
+    SDL_RenderSetClipRect(window->renderer, &rect);
+}
+
+static void acquireRenderer(WindowHandle* window) {
+    if (!window->renderer) createRenderer(window);
+    bindTarget(window);
+}
+
+WindowHandle* createWindow(const char* title, int width, int height) {
+    if (!ensureSDLInit()) return nullptr;
+    
+    WindowHandle* handle = new WindowHandle();
+    handle->width = width;
+    handle->height = height;
+    handle->clip = ClipRect(0, 0, width, height);
+    
+    handle->window = SDL_CreateWindow(
+        title,
+        SDL_WINDOWPOS_CENTERED,
+        SDL_WINDOWPOS_CENTERED,
+        width,
+        height,
+        SDL_WINDOW_SHOWN
+    );
+    
+    if (!handle->window) {
+        delete handle;
+        releaseSDLIfUnused();
+        return nullptr;
+    }
+    
+    SDL_DisplayMode displayMode;
+    if (SDL_GetWindowDisplayMode(handle->window, &displayMode) == 0) {
+        handle->present.setRefreshRate(displayMode.refresh_rate);
+    }
+    
+    if (!createRenderer(handle)) {
+        SDL_DestroyWindow(handle->window);
+        delete handle;
+        releaseSDLIfUnused();
+        return nullptr;
+    }
+    
+    handle->windowID = SDL_GetWindowID(handle->window);
+    {
+        std::lock_guard<std::mutex> lock(sdlMutex);
+        sdlWindows[handle->windowID] = handle;
+    }
+    
+    return handle;
+}
+
+void destroyWindow(WindowHandle* window) {
+    if (!window || destroyHeadless(window)) return;
+    
+    stopRenderThread(window->renderThread);
+    window->renderThread = nullptr;
+    finishReadbacks(window, true);
+    
+    // Release surfaces the application didn't destroy
+    for (size_t i = 0; i < window->surfaces.size(); i++) freeSurface(window->surfaces[i]);
+    window->surfaces.clear();
+    delete window->imageCache;
+    
+    {
+        std::lock_guard<std::mutex> lock(sdlMutex);
+        sdlWindows.erase(window->windowID);
+    }
+    delete window->indexed;
+    
+    if (window->indexedTexture) {
+        SDL_DestroyTexture(window->indexedTexture);
+    }
+    if (window->coverageTexture) {
+        SDL_DestroyTexture(window->coverageTexture);
+    }
+    
+    if (window->renderer) {
+        SDL_DestroyRenderer(window->renderer);
+    }
+    
+    if (window->window) {
+        SDL_DestroyWindow(window->window);
+    }
+    
+    delete window;
+    
+    // Cleanup SDL if this was the last window
+    releaseSDLIfUnused();
+}
+
+bool windowShouldClose(WindowHandle* window) {
+    if (!window) return true;
+    return window->shouldClose || replayClosed(window->input);
+}
+
+// Translates one SDL event into the window's input state
+static void processSDLEvent(WindowHandle* window, const SDL_Event& event) {
+    InputState& input = window->input;
+    
+    if (event.type == SDL_WINDOWEVENT) {
+        if (event.window.event == SDL_WINDOWEVENT_CLOSE) {
+            window->shouldClose = true;
+            inputClose(input);
+        }
+    }
+    else if (event.type == SDL_KEYDOWN) {
+        inputKey(input, mapSDLKey(event.key.keysym.sym), true);
+        if (event.key.keysym.sym == SDLK_ESCAPE) {
+            window->shouldClose = true;
+        }
+    }
+    else if (event.type == SDL_KEYUP) {
+        inputKey(input, mapSDLKey(event.key.keysym.sym), false);
+    }
+    else if (event.type == SDL_MOUSEBUTTONDOWN || event.type == SDL_MOUSEBUTTONUP) {
+        bool down = event.type == SDL_MOUSEBUTTONDOWN;
+        if (event.button.button == SDL_BUTTON_LEFT)
+            inputButton(input, MOUSE_LEFT, down);
+        else if (event.button.button == SDL_BUTTON_RIGHT)
+            inputButton(input, MOUSE_RIGHT, down);
+        else if (event.button.button == SDL_BUTTON_MIDDLE)
+            inputButton(input, MOUSE_MIDDLE, down);
+    }
+    else if (event.type == SDL_MOUSEMOTION) {
+        inputMotion(input, event.motion.x, event.motion.y);
+    }
+    else if (event.type == SDL_MOUSEWHEEL) {
+        inputWheel(input, event.wheel.y);
+    }
+}
+
+// Finds the window an SDL event belongs to. Events without a known window
+// go to the window that is currently being polled.
+static WindowHandle* eventTarget(const SDL_Event& event, WindowHandle* polling) {
+    Uint32 id = 0;
+    switch (event.type) {
+        case SDL_WINDOWEVENT: id = event.window.windowID; break;
+        case SDL_KEYDOWN:
+        case SDL_KEYUP: id = event.key.windowID; break;
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP: id = event.button.windowID; break;
+        case SDL_MOUSEMOTION: id = event.motion.windowID; break;
+        case SDL_MOUSEWHEEL: id = event.wheel.windowID; break;
+    }
+    
+    std::map<Uint32, WindowHandle*>::iterator it = sdlWindows.find(id);
+    return it != sdlWindows.end() ? it->second : polling;
+}
+
+static void dispatchSDLEvent(const SDL_Event& event, WindowHandle* polling) {
+    std::lock_guard<std::mutex> lock(sdlMutex);
+    if (event.type == SDL_QUIT) {
+        // Application-wide quit request - every window should close
+        for (std::map<Uint32, WindowHandle*>::iterator it = sdlWindows.begin();
+             it != sdlWindows.end(); ++it) {
+            it->second->shouldClose = true;
+            inputClose(it->second->input);
+        }
+        return;
+    }
+    processSDLEvent(eventTarget(event, polling), event);
+}
+
+// Common tail of pollEvents/waitEvents
+static void finishSDLEvents(WindowHandle* window) {
+    publishInputFrame(window->input);
+    
+    // Handle mouse locking
+    if (window->mouseLocked) {
+        int centerX, centerY;
+        SDL_GetWindowSize(window->window, &centerX, &centerY);
+        centerX /= 2;
+        centerY /= 2;
+        
+        SDL_WarpMouseInWindow(window->window, centerX, centerY);
+        recenterMouse(window->input, centerX, centerY);
+    }
+}
+
+void pollEvents(WindowHandle* window) {
+    GRAPHICS_TRACE_SCOPE("pollEvents");
+    if (!window || headlessEvents(window)) return;
+    
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+        dispatchSDLEvent(event, window);
+    }
+    
+    finishSDLEvents(window);
+}
+
+bool waitEvents(WindowHandle* window, int timeoutMs) {
+    GRAPHICS_TRACE_SCOPE("waitEvents");
+    if (!window || headlessEvents(window)) return false;
+    
+    // Sleep inside SDL until an event for this window shows up. Events for
+    // other windows are routed to them and do not end the wait.
+    Uint64 deadline = timeoutMs < 0 ? 0 : getTimestamp() + static_cast<Uint64>(timeoutMs) * 1000;
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+        dispatchSDLEvent(event, window);
+    }
+    
+    while (!inputPending(window->input) && !window->shouldClose) {
+        int waitMs = -1;
+        if (timeoutMs >= 0) {
+            Uint64 now = getTimestamp();
+            if (now >= deadline) break;
+            waitMs = static_cast<int>((deadline - now + 999) / 1000);
+        }
+        
+        bool received = waitMs < 0 ? SDL_WaitEvent(&event) != 0
+                                   : SDL_WaitEventTimeout(&event, waitMs) != 0;
+        if (!received) continue;
+        
+        dispatchSDLEvent(event, window);
+        while (SDL_PollEvent(&event)) {
+            dispatchSDLEvent(event, window);
+        }
+    }
+    
+    bool received = inputPending(window->input);
+    finishSDLEvents(window);
+    return received;
+}
+
+// SDL reads whatever render target is bound, which is the draw target
+static bool readTarget(WindowHandle* window, const Rect& rect, Color* dst, size_t pitch) {
+    if (!window->renderer) return false;
+    
+    // ABGR8888 is R, G, B, A in memory on little endian hosts, RGBA8888 on big endian ones
+    Uint32 format = hostIsLittleEndian() ? SDL_PIXELFORMAT_ABGR8888 : SDL_PIXELFORMAT_RGBA8888;
+    SDL_Rect area = {rect.x, rect.y, rect.width, rect.height};
+    return SDL_RenderReadPixels(window->renderer, &area, format, dst, static_cast<int>(pitch)) == 0;
+}
+
+// Expands the indexed buffer into a streaming texture and copies it to the
+// canvas or the window. Returns false if there was nothing to present.
+static bool presentIndexed(WindowHandle* window) {
+    IndexedFramebuffer* fb = window->indexed;
+    if (!fb || !fb->enabled || fb->pixels.empty()) return false;
+    
+    int textureWidth = 0, textureHeight = 0;
+    if (window->indexedTexture) {
+        SDL_QueryTexture(window->indexedTexture, nullptr, nullptr, &textureWidth, &textureHeight);
+        if (textureWidth != fb->width || textureHeight != fb->height) {
+            SDL_DestroyTexture(window->indexedTexture);
+            window->indexedTexture = nullptr;
+        }
+    }
+    if (!window->indexedTexture) {
+        window->indexedTexture = SDL_CreateTexture(window->renderer, SDL_PIXELFORMAT_ARGB8888,
+                                                   SDL_TEXTUREACCESS_STREAMING, fb->width, fb->height);
+        if (!window->indexedTexture) return false;
+        SDL_SetTextureBlendMode(window->indexedTexture, SDL_BLENDMODE_NONE);
+    }
+    
+    int bitsPerPixel;
+    PixelLayout layout;
+    SDL_PixelFormatEnumToMasks(SDL_PIXELFORMAT_ARGB8888, &bitsPerPixel, &layout.redMask, &layout.greenMask,
+                               &layout.blueMask, &layout.alphaMask);
+    layout.bytesPerPixel = bitsPerPixel / 8;
+    
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(window->indexedTexture, nullptr, &pixels, &pitch) != 0) return false;
+    expandIndexed(*fb, layout, static_cast<uint8_t*>(pixels), pitch);
+    SDL_UnlockTexture(window->indexedTexture);
+    
+    SDL_SetRenderTarget(window->renderer, window->canvas ? surfaceTexture(window->canvas) : nullptr);
+    applyNativeClip(window, false);
+    SDL_RenderCopy(window->renderer, window->indexedTexture, nullptr, nullptr);
+    return true;
+}
+
+// Upscales the logical canvas into the window with one scaled texture copy
+static void presentCanvas(WindowHandle* window) {
+    Surface* canvas = window->canvas;
+    SDL_Texture* texture = surfaceTexture(canvas);
+    if (!texture) return;
+    
+    CanvasView view = computeCanvasView(window->width, window->height, canvas->width, canvas->height);
+    SDL_Rect dest = {view.x, view.y, canvas->width * view.scale, canvas->height * view.scale};
+    
+    SDL_SetRenderTarget(window->renderer, nullptr);
+    applyNativeClip(window, false);
+    SDL_SetRenderDrawColor(window->renderer, 0, 0, 0, 255);
+    SDL_RenderClear(window->renderer);
+    
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_NONE);
+#if SDL_VERSION_ATLEAST(2, 0, 12)
+    SDL_SetTextureScaleMode(texture, SDL_ScaleModeNearest);
+#endif
+    SDL_RenderCopy(window->renderer, texture, nullptr, &dest);
+}
+
+void swapBuffers(WindowHandle* window) {
+    GRAPHICS_TRACE_SCOPE("swapBuffers");
+    if (!window) return;
+    endFrame(window);
+    if (submitFrame(window->renderThread)) return;
+    captureReadbacks(window);
+    if (presentHeadless(window)) return;
+    if (!window->renderer) return;
+    
+    PresentClock& present = window->present;
+    if (present.mode == PRESENT_CAPPED && !cappedFrameDue(present)) {
+        // The frame is dropped, its readbacks were captured above
+        finishReadbacks(window);
+        return;
+    }
+    if (present.mode == PRESENT_ADAPTIVE) waitForVBlank(present);
+    
+    bool indexed = presentIndexed(window);
+    if (window->canvas) presentCanvas(window);
+    SDL_RenderPresent(window->renderer);
+    finishReadbacks(window);
+    if (window->canvas || indexed) bindTarget(window);
+}
+
+void setPresentMode(WindowHandle* window, PresentMode mode) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_PRESENT_MODE, mode, 0, 0, 0, Color(0, 0, 0))) return;
+    
+    window->present.mode = mode;
+    if (!window->renderer) return;
+    
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+    SDL_RenderSetVSync(window->renderer, mode == PRESENT_VSYNC ? 1 : 0);
+#else
+    // Older SDL can only pick vsync when the renderer is created
+    releaseRenderer(window);
+    acquireRenderer(window);
+#endif
+}
+
+void clearScreen(WindowHandle* window, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_CLEAR, 0, 0, 0, 0, color)) return;
+    if (drawSoftware(window, CMD_CLEAR, 0, 0, 0, 0, color)) return;
+    if (!window->renderer) return;
+    
+    SDL_SetRenderDrawColor(window->renderer, color.r, color.g, color.b, color.a);
+    SDL_RenderClear(window->renderer);
+}
+
+void setDrawColor(WindowHandle* window, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_COLOR, 0, 0, 0, 0, color)) return;
+    if (!window->renderer) return;
+    SDL_SetRenderDrawColor(window->renderer, color.r, color.g, color.b, color.a);
+}
+
+void drawLine(WindowHandle* window, int x1, int y1, int x2, int y2, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_LINE, x1, y1, x2, y2, color)) return;
+    if (drawSoftware(window, CMD_LINE, x1, y1, x2, y2, color)) return;
+    if (!window->renderer) return;
+    LineWalk walk;
+    if (!clipLine(window->clip, x1, y1, x2, y2, walk)) return;
+    
+    setDrawColor(window, color);
+    
+    // Grid lines take the rectangle path
+    Rect line;
+    if (axisLineRect(walk, line)) {
+        SDL_Rect rect = {line.x, line.y, line.width, line.height};
+        SDL_RenderFillRect(window->renderer, &rect);
+        return;
+    }
+    
+    // The renderer clips the full line itself; past float precision the
+    // visible pixels go out as points
+    if (lineFits(x1, y1, x2, y2, SDL_LINE_LIMIT)) {
+        SDL_RenderDrawLine(window->renderer, x1, y1, x2, y2);
+        return;
+    }
+    std::vector<SDL_Point>& points = window->pointScratch;
+    points.clear();
+    walkLine(walk, [&](int x, int y) {
+        SDL_Point point = {x, y};
+        points.push_back(point);
+    });
+    SDL_RenderDrawPoints(window->renderer, points.data(), static_cast<int>(points.size()));
+}
+
+void drawRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_RECTANGLE, x, y, width, height, color)) return;
+    if (drawSoftware(window, CMD_RECTANGLE, x, y, width, height, color)) return;
+    if (!window->renderer) return;
+    
+    // Four filled edges in one call instead of four lines
+    Rect edges[4];
+    int count = rectangleEdges(window->clip, x, y, width, height, edges);
+    if (count == 0) return;
+    
+    SDL_Rect rects[4];
+    for (int i = 0; i < count; i++) {
+        SDL_Rect rect = {edges[i].x, edges[i].y, edges[i].width, edges[i].height};
+        rects[i] = rect;
+    }
+    setDrawColor(window, color);
+    SDL_RenderFillRects(window->renderer, rects, count);
+}
+
+void drawFilledRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_FILLED_RECTANGLE, x, y, width, height, color)) return;
+    if (drawSoftware(window, CMD_FILLED_RECTANGLE, x, y, width, height, color)) return;
+    if (!window->renderer) return;
+    if (!clipRectangle(window->clip, x, y, width, height)) return;
+    
+    SDL_Rect rect = {x, y, width, height};
+    setDrawColor(window, color);
+    SDL_RenderFillRect(window->renderer, &rect);
+}
+
+void drawPixel(WindowHandle* window, int x, int y, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_PIXEL, x, y, 0, 0, color)) return;
+    if (drawSoftware(window, CMD_PIXEL, x, y, 0, 0, color)) return;
+    if (!window->renderer) return;
+    if (!pointInClip(window->clip, x, y)) return;
+    
+    setDrawColor(window, color);
+    SDL_RenderDrawPoint(window->renderer, x, y);
+}
+
+// Consecutive points of one colour go out as a single SDL_RenderDrawPoints
+static void drawBatchPoints(WindowHandle* window, const BatchPoint* points, int count) {
+    if (!window->renderer) return;
+    
+    std::vector<SDL_Point>& run = window->pointScratch;
+    for (int i = 0; i < count;) {
+        const Color& color = points[i].color;
+        run.clear();
+        for (; i < count && sameColor(points[i].color, color); i++) {
+            if (!pointInClip(window->clip, points[i].x, points[i].y)) continue;
+            SDL_Point point = {points[i].x, points[i].y};
+            run.push_back(point);
+        }
+        if (run.empty()) continue;
+        
+        setDrawColor(window, color);
+        SDL_RenderDrawPoints(window->renderer, run.data(), static_cast<int>(run.size()));
+    }
+}
+
+// Helper function for drawing circles using midpoint circle algorithm
+void drawCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (drawSoftware(window, CMD_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (!window->renderer) return;
+    if (circleOutsideClip(window->clip, centerX, centerY, radius)) return;
+    if (clipInsideCircle(window->clip, centerX, centerY, radius)) return;
+    
+    // All octants go out as one point list
+    std::vector<SDL_Point>& points = window->pointScratch;
+    points.clear();
+    rasterCircle(window->clip, centerX, centerY, radius, [&](int x, int y) {
+        SDL_Point point = {x, y};
+        points.push_back(point);
+    });
+    if (points.empty()) return;
+    
+    setDrawColor(window, color);
+    SDL_RenderDrawPoints(window->renderer, points.data(), static_cast<int>(points.size()));
+}
+
+void drawFilledCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_FILLED_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (drawSoftware(window, CMD_FILLED_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (!window->renderer) return;
+    if (circleOutsideClip(window->clip, centerX, centerY, radius)) return;
+    
+    // One row span per rectangle, all in one call
+    std::vector<SDL_Rect>& rects = window->rectScratch;
+    rects.clear();
+    rasterFilledCircle(window->clip, centerX, centerY, radius, [&](int x0, int x1, int y) {
+        SDL_Rect rect = {x0, y, x1 - x0 + 1, 1};
+        rects.push_back(rect);
+    });
+    if (rects.empty()) return;
+    
+    setDrawColor(window, color);
+    SDL_RenderFillRects(window->renderer, rects.data(), static_cast<int>(rects.size()));
+}
+
+// The coverage becomes the alpha of white texels, colour and alpha modulation
+// tint them as the mask is copied. The texture only grows, in steps of 256
+// pixels, so fills of similar size share it.
+static void drawCoverage(WindowHandle* window, const CoverageMask& mask, const Color& color) {
+    if (!window->renderer) return;
+    
+    int textureWidth = 0, textureHeight = 0;
+    if (window->coverageTexture) {
+        SDL_QueryTexture(window->coverageTexture, nullptr, nullptr, &textureWidth, &textureHeight);
+    }
+    if (textureWidth < mask.width || textureHeight < mask.height) {
+        if (window->coverageTexture) SDL_DestroyTexture(window->coverageTexture);
+        textureWidth = (std::max(textureWidth, mask.width) + 255) & ~255;
+        textureHeight = (std::max(textureHeight, mask.height) + 255) & ~255;
+        window->coverageTexture = SDL_CreateTexture(window->renderer, SDL_PIXELFORMAT_ARGB8888,
+                                                    SDL_TEXTUREACCESS_STREAMING, textureWidth, textureHeight);
+        if (!window->coverageTexture) return;
+        SDL_SetTextureBlendMode(window->coverageTexture, SDL_BLENDMODE_BLEND);
+    }
+    
+    SDL_Rect area = {0, 0, mask.width, mask.height};
+    void* pixels;
+    int pitch;
+    if (SDL_LockTexture(window->coverageTexture, &area, &pixels, &pitch) != 0) return;
+    for (int y = 0; y < mask.height; y++) {
+        const uint8_t* coverage = mask.coverage + static_cast<size_t>(y) * mask.width;
+        Uint32* row = reinterpret_cast<Uint32*>(static_cast<uint8_t*>(pixels) + static_cast<size_t>(y) * pitch);
+        for (int x = 0; x < mask.width; x++) row[x] = static_cast<Uint32>(coverage[x]) << 24 | 0xFFFFFF;
+    }
+    SDL_UnlockTexture(window->coverageTexture);
+    
+    SDL_SetTextureColorMod(window->coverageTexture, color.r, color.g, color.b);
+    SDL_SetTextureAlphaMod(window->coverageTexture, color.a);
+    SDL_Rect dest = {mask.x, mask.y, mask.width, mask.height};
+    SDL_RenderCopy(window->renderer, window->coverageTexture, &area, &dest);
+}
+
+// ============================================================================
+// OFFSCREEN SURFACES - SDL
+// ============================================================================
+
+Surface* createSurface(WindowHandle* window, int width, int height) {
+    if (!window || window->headless || width <= 0 || height <= 0) return nullptr;
+    
+    Surface* surface = new Surface();
+    surface->window = window;
+    surface->width = width;
+    surface->height = height;
+    window->surfaces.push_back(surface);
+    return surface;
+}
+
+static void freeSurface(Surface* surface) {
+    WindowHandle* window = surface->window;
+    if (window->target == surface) setRenderTarget(window, nullptr);
+    if (window->canvas == surface) setCanvas(window, nullptr);
+    
+    if (surface->texture) SDL_DestroyTexture(surface->texture);
+    delete surface;
+}
+
+// Images are decoded into the surface's saved pixels, which surfaceTexture
+// uploads when the texture is created on the renderer's thread
+static bool beginImageUpload(WindowHandle* window, int width, int height, ImageUpload& upload) {
+    Surface* surface = createSurface(window, width, height);
+    if (!surface) return false;
+    
+    surface->saved.resize(static_cast<size_t>(width) * height);
+    PixelLayout rgba8888 = {4, 0xFF000000u, 0x00FF0000u, 0x0000FF00u, 0x000000FFu};
+    upload.surface = surface;
+    upload.pixels = reinterpret_cast<uint8_t*>(surface->saved.data());
+    upload.pitch = static_cast<size_t>(width) * 4;
+    upload.layout = rgba8888;
+    return true;
+}
+
+static void finishImageUpload(WindowHandle*, ImageUpload& upload, bool decoded) {
+    if (!decoded) destroySurface(upload.surface);
+}
+
+void setRenderTarget(WindowHandle* window, Surface* surface) {
+    if (!window || (surface && surface->window != window)) return;
+    if (deferSurfaceCommand(window->renderThread, CMD_SET_TARGET, surface)) return;
+    
+    window->target = surface;
+    bindTarget(window);
+}
+
+static void setCanvas(WindowHandle* window, Surface* canvas) {
+    window->canvas = canvas;
+    bindTarget(window);
+}
+
+void blitSurface(WindowHandle* window, Surface* surface, const Rect* srcRect, const Rect* dstRect) {
+    if (!window || !surface || surface->window != window) return;
+    touchImage(window->imageCache, surface);
+    if (deferSurfaceCommand(window->renderThread, CMD_BLIT, surface, srcRect, dstRect)) return;
+    if (drawSoftware(window, CMD_BLIT, 0, 0, 0, 0, Color())) return;
+    if (!window->renderer || surface == drawSurface(window)) return;
+    
+    SDL_Texture* texture = surfaceTexture(surface);
+    if (!texture) return;
+    
+    int targetWidth, targetHeight;
+    getTargetSize(window, targetWidth, targetHeight);
+    Rect src, dst;
+    if (!resolveBlitRects(srcRect, dstRect, surface->width, surface->height,
+                          targetWidth, targetHeight, src, dst)) return;
+    
+    SDL_Rect source = {src.x, src.y, src.width, src.height};
+    SDL_Rect dest = {dst.x, dst.y, dst.width, dst.height};
+    SDL_RenderCopy(window->renderer, texture, &source, &dest);
+}
+
+void drawImageTransformed(WindowHandle* window, Surface* image, float x, float y, float angle, float scaleX,
+                          float scaleY, ImageFilter filter) {
+    if (!window || !image || image->window != window) return;
+    touchImage(window->imageCache, image);
+    if (deferImageTransform(window->renderThread, image, x, y, angle, scaleX, scaleY, filter)) return;
+    if (drawSoftware(window, CMD_DRAW_IMAGE, 0, 0, 0, 0, Color())) return;
+    if (!window->renderer || image == drawSurface(window) || scaleX == 0.0f || scaleY == 0.0f) return;
+    
+    SDL_Texture* texture = surfaceTexture(image);
+    if (!texture) return;
+    
+    // SDL rotates around the centre of the destination rectangle and mirrors
+    // with flags instead of negative sizes
+    float width = image->width * std::fabs(scaleX), height = image->height * std::fabs(scaleY);
+    SDL_RendererFlip flip = static_cast<SDL_RendererFlip>((scaleX < 0.0f ? SDL_FLIP_HORIZONTAL : 0) |
+                                                          (scaleY < 0.0f ? SDL_FLIP_VERTICAL : 0));
+#if SDL_VERSION_ATLEAST(2, 0, 12)
+    SDL_SetTextureScaleMode(texture, filter == FILTER_BILINEAR ? SDL_ScaleModeLinear : SDL_ScaleModeNearest);
+#else
+    (void)filter;  // Older SDL filters as SDL_HINT_RENDER_SCALE_QUALITY says
+#endif
+#if SDL_VERSION_ATLEAST(2, 0, 10)
+    SDL_FRect dest = {x - width * 0.5f, y - height * 0.5f, width, height};
+    SDL_RenderCopyExF(window->renderer, texture, nullptr, &dest, angle, nullptr, flip);
+#else
+    // Integer rectangles only, the centre may move by half a pixel
+    int left = static_cast<int>(std::floor(x - width * 0.5f + 0.5f));
+    int top = static_cast<int>(std::floor(y - height * 0.5f + 0.5f));
+    SDL_Rect dest = {left, top, static_cast<int>(width + 0.5f), static_cast<int>(height + 0.5f)};
+    SDL_RenderCopyEx(window->renderer, texture, nullptr, &dest, angle, nullptr, flip);
+#endif
+#if SDL_VERSION_ATLEAST(2, 0, 12)
+    SDL_SetTextureScaleMode(texture, SDL_ScaleModeNearest);  // blitSurface scales nearest neighbour
+#endif
+}
+
+void delay(uint32_t milliseconds) {
+    SDL_Delay(milliseconds);
+}
+
+// ============================================================================
+// INPUT HANDLING - SDL
+// ============================================================================
+
+void setMousePosition(WindowHandle* window, int x, int y) {
+    if (!window || !window->window) return;
+    SDL_WarpMouseInWindow(window->window, logicalToWindowX(window->input, x),
+                          logicalToWindowY(window->input, y));
+    window->input.mouseX = x;
+    window->input.mouseY = y;
+}
+
+void setMouseLocked(WindowHandle* window, bool locked) {
+    if (!window || !window->window) return;
+    window->mouseLocked = locked;
+    
+    if (locked) {
+        SDL_SetRelativeMouseMode(SDL_TRUE);
+        SDL_ShowCursor(SDL_DISABLE);
+    } else {
+        SDL_SetRelativeMouseMode(SDL_FALSE);
+        SDL_ShowCursor(SDL_ENABLE);
+    }
+}
+
+#endif // USE_SDL
+
+#ifdef USE_WIN32
+
+#include <windows.h>
+#include <vector>
+#include <cstring>
+
+// GDI's coordinate space is 2^27 pixels either side of the origin
+const int GDI_LINE_LIMIT = (1 << 27) - 1;
+
+// Platform-specific window handle structure for Win32
+struct WindowHandle {
+    HWND hwnd;
+    HDC hdc;
+    HDC memDC;
+    HBITMAP memBitmap;
+    HBITMAP oldBitmap;
+    int width;
+    int height;
+    bool shouldClose;
+    COLORREF currentColor;
+    ClipRect clip;
+    std::vector<Rect> clipStack;      // Innermost last, see pushClipRect
+    
+    InputState input;
+    bool mouseLocked;
+    
+    RenderThread* renderThread;
+    PresentClock present;
+    
+    Surface* target;                  // Current render target, nullptr = window
+    Surface* canvas;                  // Logical-resolution canvas, nullptr = none
+    Surface* pendingCanvas;           // Canvas as last requested by the application
+    HDC targetDC;                     // DC the drawing functions draw into
+    std::vector<Surface*> surfaces;
+    
+    IndexedFramebuffer* indexed;      // Palette state and 8-bit buffer, nullptr = never used
+    ImageCache* imageCache;           // Images of acquireImage, nullptr = never used
+    std::vector<uint32_t> indexedPixels;  // Top-down BGRX staging for SetDIBitsToDevice
+    std::vector<POINT> runPoints;     // Pixel runs of a circle for PolyPolyline
+    std::vector<DWORD> runCounts;
+    HDC blendDC;                      // Premultiplied pixels for GdiAlphaBlend, see blendBuffer
+    HBITMAP blendBitmap;
+    HBITMAP blendOldBitmap;
+    uint32_t* blendBits;              // Top-down rows of blendWidth pixels
+    int blendWidth;
+    int blendHeight;
+    PathRaster pathRaster;
+    std::vector<Color> imagePixels;   // drawImageTransformed source and result
+    std::vector<Color> blendPixels;
+    SoftwareFramebuffer* headless;    // Pixels of a headless window, nullptr = native window
+    std::vector<PendingReadback> readbacks;
+    FrameArena frameArena;
+    
+    WindowHandle() : hwnd(nullptr), hdc(nullptr), memDC(nullptr), 
+                     memBitmap(nullptr), oldBitmap(nullptr),
+                     width(0), height(0), shouldClose(false), 
+                     currentColor(RGB(255, 255, 255)),
+                     mouseLocked(false), renderThread(nullptr), present(PRESENT_IMMEDIATE),
+                     target(nullptr), canvas(nullptr), pendingCanvas(nullptr), targetDC(nullptr),
+                     indexed(nullptr), imageCache(nullptr),
+                     blendDC(nullptr), blendBitmap(nullptr), blendOldBitmap(nullptr),
+                     blendBits(nullptr), blendWidth(0), blendHeight(0), headless(nullptr) {}
+};
+
+// Offscreen surface backed by a memory DC, created on first use
+struct Surface {
+    WindowHandle* window;
+    HDC dc;
+    HBITMAP bitmap;
+    HBITMAP oldBitmap;
+    int width;
+    int height;
+    
+    Surface() : window(nullptr), dc(nullptr), bitmap(nullptr), oldBitmap(nullptr),
+                width(0), height(0) {}
+};
+
+// Surface the drawing functions currently draw into, nullptr = back buffer
+static Surface* drawSurface(WindowHandle* window) {
+    return window->target ? window->target : window->canvas;
+}
+
+static void getTargetSize(WindowHandle* window, int& width, int& height) {
+    Surface* surface = drawSurface(window);
+    width = surface ? surface->width : window->width;
+    height = surface ? surface->height : window->height;
+}
+
+// Global window class name
+static const char* WINDOW_CLASS_NAME = "LibGraffikWindowClass";
+static std::mutex classMutex;
+static bool classRegistered = false;
+
+// Win32 key mapping
+static KeyCode mapWin32Key(WPARAM wParam) {
+    switch (wParam) {
+        case VK_UP: return KEY_UP;
+        case VK_DOWN: return KEY_DOWN;
+        case VK_LEFT: return KEY_LEFT;
+        case VK_RIGHT: return KEY_RIGHT;
+        
+        case 'A': return KEY_A;
+        case 'B': return KEY_B;
+        case 'C': return KEY_C;
+        case 'D': return KEY_D;
+        case 'E': return KEY_E;
+        case 'F': return KEY_F;
+        case 'G': return KEY_G;
+        case 'H': return KEY_H;
+        case 'I': return KEY_I;
+        case 'J': return KEY_J;
+        case 'K': return KEY_K;
+        case 'L': return KEY_L;
+        case 'M': return KEY_M;
+        case 'N': return KEY_N;
+        case 'O': return KEY_O;
+        case 'P': return KEY_P;
+        case 'Q': return KEY_Q;
+        case 'R': return KEY_R;
+        case 'S': return KEY_S;
+        case 'T': return KEY_T;
+        case 'U': return KEY_U;
+        case 'V': return KEY_V;
+        case 'W': return KEY_W;
+        case 'X': return KEY_X;
+        case 'Y': return KEY_Y;
+        case 'Z': return KEY_Z;
+        
+        case '0': return KEY_0;
+        case '1': return KEY_1;
+        case '2': return KEY_2;
+        case '3': return KEY_3;
+        case '4': return KEY_4;
+        case '5': return KEY_5;
+        case '6': return KEY_6;
+        case '7': return KEY_7;
+        case '8': return KEY_8;
+        case '9': return KEY_9;
+        
+        case VK_F1: return KEY_F1;
+        case VK_F2: return KEY_F2;
+        case VK_F3: return KEY_F3;
+        case VK_F4: return KEY_F4;
+        case VK_F5: return KEY_F5;
+        case VK_F6: return KEY_F6;
+        case VK_F7: return KEY_F7;
+        case VK_F8: return KEY_F8;
+        case VK_F9: return KEY_F9;
+        case VK_F10: return KEY_F10;
+        case VK_F11: return KEY_F11;
+        case VK_F12: return KEY_F12;
+        
+        case VK_SPACE: return KEY_SPACE;
+        case VK_RETURN: return KEY_ENTER;
+        case VK_ESCAPE: return KEY_ESCAPE;
+        case VK_BACK: return KEY_BACKSPACE;
+        case VK_TAB: return KEY_TAB;
+        case VK_SHIFT: return KEY_SHIFT;
+        case VK_CONTROL: return KEY_CONTROL;
+        case VK_MENU: return KEY_ALT;
+        
+        case VK_OEM_PLUS: return KEY_PLUS;
+        case VK_OEM_MINUS: return KEY_MINUS;
+        
+        default: return KEY_UNKNOWN;
+    }
+}
+
+// Window procedure
+LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam) {
+    WindowHandle* handle = (WindowHandle*)GetWindowLongPtr(hwnd, GWLP_USERDATA);
+    
+    switch (uMsg) {
+        case WM_CLOSE:
             if (handle) {
-                KeyCode key = mapWin32Key(wParam);
-                if (key != KEY_UNKNOWN && key < KEY_COUNT) {
-                    handle->keyState[key] = true;
-                }
+                handle->shouldClose = true;
+                inputClose(handle->input);
+            }
+            return 0;
+            
+        case WM_KEYDOWN:
+        case WM_SYSKEYDOWN: {
+            if (handle) {
+                inputKey(handle->input, mapWin32Key(wParam), true);
                 if (wParam == VK_ESCAPE) {
                     handle->shouldClose = true;
                 }
             }
-            return 0;
+            return 0;
+        }
+            
+        case WM_KEYUP:
+        case WM_SYSKEYUP: {
+            if (handle) {
+                inputKey(handle->input, mapWin32Key(wParam), false);
+            }
+            return 0;
+        }
+        
+        case WM_LBUTTONDOWN:
+            if (handle) inputButton(handle->input, MOUSE_LEFT, true);
+            return 0;
+            
+        case WM_LBUTTONUP:
+            if (handle) inputButton(handle->input, MOUSE_LEFT, false);
+            return 0;
+            
+        case WM_RBUTTONDOWN:
+            if (handle) inputButton(handle->input, MOUSE_RIGHT, true);
+            return 0;
+            
+        case WM_RBUTTONUP:
+            if (handle) inputButton(handle->input, MOUSE_RIGHT, false);
+            return 0;
+            
+        case WM_MBUTTONDOWN:
+            if (handle) inputButton(handle->input, MOUSE_MIDDLE, true);
+            return 0;
+            
+        case WM_MBUTTONUP:
+            if (handle) inputButton(handle->input, MOUSE_MIDDLE, false);
+            return 0;
+            
+        case WM_MOUSEMOVE:
+            if (handle) {
+                inputMotion(handle->input, LOWORD(lParam), HIWORD(lParam));
+            }
+            return 0;
+            
+        case WM_MOUSEWHEEL:
+            if (handle) {
+                inputWheel(handle->input, GET_WHEEL_DELTA_WPARAM(wParam) / WHEEL_DELTA);
+            }
+            return 0;
+            
+        case WM_PAINT: {
+            PAINTSTRUCT ps;
+            HDC hdc = BeginPaint(hwnd, &ps);
+            // Will be handled by swapBuffers
+            EndPaint(hwnd, &ps);
+            return 0;
+        }
+        
+        case WM_DESTROY:
+            // Other windows may still be open, so don't post WM_QUIT here
+            return 0;
+    }
+    
+    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+}
+
+// GDI memory DCs are not bound to a thread, nothing to hand over
+static void releaseRenderer(WindowHandle*) {}
+static void acquireRenderer(WindowHandle*) {}
+
+static bool threadedRenderingSupported() {
+    return true;
+}
+
+// Blocks until the desktop compositor has picked up the last frame. dwmapi is
+// loaded at runtime so the library still links without it; false if there is
+// no compositor (e.g. XP or composition turned off).
+typedef HRESULT (WINAPI *DwmFlushProc)();
+
+static DwmFlushProc loadDwmFlush() {
+    HMODULE dwmapi = LoadLibraryA("dwmapi.dll");
+    if (!dwmapi) return nullptr;
+    return reinterpret_cast<DwmFlushProc>(reinterpret_cast<void*>(GetProcAddress(dwmapi, "DwmFlush")));
+}
+
+static bool flushCompositor() {
+    static DwmFlushProc dwmFlush = loadDwmFlush();
+    return dwmFlush && SUCCEEDED(dwmFlush());
+}
+
+WindowHandle* createWindow(const char* title, int width, int height) {
+    // Register window class if not already registered
+    std::unique_lock<std::mutex> classLock(classMutex);
+    if (!classRegistered) {
+        WNDCLASSA wc = {};
+        wc.lpfnWndProc = WindowProc;
+        wc.hInstance = GetModuleHandle(nullptr);
+        wc.lpszClassName = WINDOW_CLASS_NAME;
+        wc.hCursor = LoadCursor(nullptr, IDC_ARROW);
+        wc.hbrBackground = (HBRUSH)GetStockObject(BLACK_BRUSH);
+        
+        if (!RegisterClassA(&wc)) {
+            return nullptr;
+        }
+        classRegistered = true;
+    }
+    classLock.unlock();
+    
+    WindowHandle* handle = new WindowHandle();
+    handle->width = width;
+    handle->height = height;
+    handle->clip = ClipRect(0, 0, width, height);
+    
+    // Create window
+    handle->hwnd = CreateWindowExA(
+        0,
+        WINDOW_CLASS_NAME,
+        title,
+        WS_OVERLAPPEDWINDOW,
+        CW_USEDEFAULT, CW_USEDEFAULT,
+        width, height,
+        nullptr,
+        nullptr,
+        GetModuleHandle(nullptr),
+        nullptr
+    );
+    
+    if (!handle->hwnd) {
+        delete handle;
+        return nullptr;
+    }
+    
+    // Store handle in window user data
+    SetWindowLongPtr(handle->hwnd, GWLP_USERDATA, (LONG_PTR)handle);
+    
+    // Get device context
+    handle->hdc = GetDC(handle->hwnd);
+    handle->present.setRefreshRate(GetDeviceCaps(handle->hdc, VREFRESH));
+    
+    // Create memory DC for double buffering
+    handle->memDC = CreateCompatibleDC(handle->hdc);
+    handle->memBitmap = CreateCompatibleBitmap(handle->hdc, width, height);
+    handle->oldBitmap = (HBITMAP)SelectObject(handle->memDC, handle->memBitmap);
+    handle->targetDC = handle->memDC;
+    
+    // Show window
+    ShowWindow(handle->hwnd, SW_SHOW);
+    UpdateWindow(handle->hwnd);
+    
+    return handle;
+}
+
+static void releaseBlendBuffer(WindowHandle* window);
+
+void destroyWindow(WindowHandle* window) {
+    if (!window || destroyHeadless(window)) return;
+    
+    stopRenderThread(window->renderThread);
+    window->renderThread = nullptr;
+    finishReadbacks(window, true);
+    
+    // Release surfaces the application didn't destroy
+    for (size_t i = 0; i < window->surfaces.size(); i++) freeSurface(window->surfaces[i]);
+    window->surfaces.clear();
+    delete window->imageCache;
+    delete window->indexed;
+    releaseBlendBuffer(window);
+    
+    if (window->memDC) {
+        if (window->oldBitmap) {
+            SelectObject(window->memDC, window->oldBitmap);
+        }
+        DeleteDC(window->memDC);
+    }
+    
+    if (window->memBitmap) {
+        DeleteObject(window->memBitmap);
+    }
+    
+    if (window->hdc) {
+        ReleaseDC(window->hwnd, window->hdc);
+    }
+    
+    if (window->hwnd) {
+        DestroyWindow(window->hwnd);
+    }
+    
+    delete window;
+}
+
+bool windowShouldClose(WindowHandle* window) {
+    if (!window) return true;
+    return window->shouldClose || replayClosed(window->input);
+}
+
+// Messages for every window of this thread are dispatched to their own
+// WindowProc, so draining the queue routes input to the right handle.
+static void drainWin32Messages() {
+    MSG msg;
+    while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
+    }
+}
+
+// Common tail of pollEvents/waitEvents
+static void finishWin32Events(WindowHandle* window) {
+    publishInputFrame(window->input);
+    
+    // Handle mouse locking
+    if (window->mouseLocked && window->hwnd) {
+        RECT rect;
+        GetClientRect(window->hwnd, &rect);
+        int centerX = rect.right / 2;
+        int centerY = rect.bottom / 2;
+        
+        POINT pt = {centerX, centerY};
+        ClientToScreen(window->hwnd, &pt);
+        SetCursorPos(pt.x, pt.y);
+        
+        recenterMouse(window->input, centerX, centerY);
+    }
+}
+
+void pollEvents(WindowHandle* window) {
+    GRAPHICS_TRACE_SCOPE("pollEvents");
+    if (!window || headlessEvents(window)) return;
+    
+    drainWin32Messages();
+    finishWin32Events(window);
+}
+
+bool waitEvents(WindowHandle* window, int timeoutMs) {
+    GRAPHICS_TRACE_SCOPE("waitEvents");
+    if (!window || headlessEvents(window)) return false;
+    
+    // Sleep until a message is queued for this thread, then drain them all.
+    // Keep waiting while the messages only concern other windows.
+    uint64_t deadline = timeoutMs < 0 ? 0 : getTimestamp() + static_cast<uint64_t>(timeoutMs) * 1000;
+    drainWin32Messages();
+    
+    while (!inputPending(window->input) && !window->shouldClose) {
+        DWORD timeout = INFINITE;
+        if (timeoutMs >= 0) {
+            uint64_t now = getTimestamp();
+            if (now >= deadline) break;
+            timeout = static_cast<DWORD>((deadline - now + 999) / 1000);
+        }
+        
+        MsgWaitForMultipleObjects(0, nullptr, FALSE, timeout, QS_ALLINPUT);
+        drainWin32Messages();
+    }
+    
+    bool received = inputPending(window->input);
+    finishWin32Events(window);
+    return received;
+}
+
+static HDC surfaceDC(Surface* surface);
+
+// Copies the rectangle of source into a top-down 32-bit DIB section
+static bool readDC(HDC source, const Rect& rect, Color* dst, size_t pitch) {
+    if (!source) return false;
+    
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = rect.width;
+    bmi.bmiHeader.biHeight = -rect.height;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    
+    void* bits = nullptr;
+    HBITMAP dib = CreateDIBSection(source, &bmi, DIB_RGB_COLORS, &bits, nullptr, 0);
+    if (!dib) return false;
+    
+    HDC dc = CreateCompatibleDC(source);
+    HGDIOBJ old = SelectObject(dc, dib);
+    bool copied = BitBlt(dc, 0, 0, rect.width, rect.height, source, rect.x, rect.y, SRCCOPY) != 0;
+    GdiFlush();
+    
+    if (copied) {
+        // GDI leaves the fourth byte undefined, it reads back as opaque
+        const uint8_t* src = static_cast<const uint8_t*>(bits);
+        uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+        for (int y = 0; y < rect.height; y++) {
+            unpackPixels(src + static_cast<size_t>(y) * rect.width * 4, layoutOf(PIXEL_BGRX32), out + y * pitch,
+                         rect.width);
+        }
+    }
+    
+    SelectObject(dc, old);
+    DeleteDC(dc);
+    DeleteObject(dib);
+    return copied;
+}
+
+static bool readTarget(WindowHandle* window, const Rect& rect, Color* dst, size_t pitch) {
+    return readDC(window->targetDC, rect, dst, pitch);
+}
+
+// Expands the indexed buffer into a 32-bit DIB and sets it into the canvas or
+// the back buffer
+static void presentIndexed(WindowHandle* window) {
+    IndexedFramebuffer* fb = window->indexed;
+    if (!fb || !fb->enabled || fb->pixels.empty()) return;
+    
+    window->indexedPixels.resize(static_cast<size_t>(fb->width) * fb->height);
+    expandIndexed(*fb, layoutOf(PIXEL_BGRX32), reinterpret_cast<uint8_t*>(window->indexedPixels.data()),
+                  static_cast<size_t>(fb->width) * 4);
+    
+    BITMAPINFO bmi = {};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = fb->width;
+    bmi.bmiHeader.biHeight = -fb->height;  // Top-down
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    
+    HDC dc = window->canvas ? surfaceDC(window->canvas) : window->memDC;
+    SetDIBitsToDevice(dc, 0, 0, fb->width, fb->height, 0, 0, 0, fb->height, window->indexedPixels.data(), &bmi,
+                      DIB_RGB_COLORS);
+}
+
+// Upscales the logical canvas into the back buffer, letterboxed in black
+static void presentCanvas(WindowHandle* window) {
+    Surface* canvas = window->canvas;
+    CanvasView view = computeCanvasView(window->width, window->height, canvas->width, canvas->height);
+    
+    RECT rect = {0, 0, window->width, window->height};
+    FillRect(window->memDC, &rect, (HBRUSH)GetStockObject(BLACK_BRUSH));
+    
+    SetStretchBltMode(window->memDC, COLORONCOLOR);
+    StretchBlt(window->memDC, view.x, view.y, canvas->width * view.scale, canvas->height * view.scale,
+               surfaceDC(canvas), 0, 0, canvas->width, canvas->height, SRCCOPY);
+}
+
+void swapBuffers(WindowHandle* window) {
+    GRAPHICS_TRACE_SCOPE("swapBuffers");
+    if (!window) return;
+    endFrame(window);
+    if (submitFrame(window->renderThread)) return;
+    captureReadbacks(window);
+    if (presentHeadless(window)) return;
+    if (!window->hdc || !window->memDC) return;
+    
+    PresentClock& present = window->present;
+    if (present.mode == PRESENT_CAPPED && !cappedFrameDue(present)) {
+        // The frame is dropped, its readbacks were captured above
+        finishReadbacks(window);
+        return;
+    }
+    if (present.mode == PRESENT_ADAPTIVE) waitForVBlank(present);
+    
+    applyNativeClip(window, false);
+    presentIndexed(window);
+    if (window->canvas) presentCanvas(window);
+    
+    // Copy from memory DC to window DC
+    BitBlt(window->hdc, 0, 0, window->width, window->height,
+           window->memDC, 0, 0, SRCCOPY);
+    applyNativeClip(window);
+    
+    if (present.mode == PRESENT_VSYNC) {
+        GdiFlush();
+        if (!flushCompositor()) waitForVBlank(present);
+    }
+    finishReadbacks(window);
+}
+
+void setPresentMode(WindowHandle* window, PresentMode mode) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_PRESENT_MODE, mode, 0, 0, 0, Color(0, 0, 0))) return;
+    window->present.mode = mode;
+}
+
+void clearScreen(WindowHandle* window, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_CLEAR, 0, 0, 0, 0, color)) return;
+    if (drawSoftware(window, CMD_CLEAR, 0, 0, 0, 0, color)) return;
+    if (!window->targetDC) return;
+    
+    int width, height;
+    getTargetSize(window, width, height);
+    
+    // Clearing ignores the clip rectangle, as on the other backends
+    RECT rect = {0, 0, width, height};
+    HBRUSH brush = CreateSolidBrush(RGB(color.r, color.g, color.b));
+    applyNativeClip(window, false);
+    FillRect(window->targetDC, &rect, brush);
+    applyNativeClip(window);
+    DeleteObject(brush);
+}
+
+void setDrawColor(WindowHandle* window, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_COLOR, 0, 0, 0, 0, color)) return;
+    window->currentColor = RGB(color.r, color.g, color.b);
+}
+
+// Circles and overlong lines are collected as pixel runs and drawn with one
+// PolyPolyline. GDI leaves out the last pixel of a line, so (x0, y)-(x1 + 1, y)
+// is exactly the run x0..x1.
+static void addRun(WindowHandle* window, int x0, int x1, int y) {
+    POINT from = {x0, y};
+    POINT to = {x1 + 1, y};
+    window->runPoints.push_back(from);
+    window->runPoints.push_back(to);
+    window->runCounts.push_back(2);
+}
+
+static void drawRuns(WindowHandle* window, const Color& color) {
+    if (window->runCounts.empty()) return;
+    
+    HPEN pen = CreatePen(PS_SOLID, 1, RGB(color.r, color.g, color.b));
+    HPEN oldPen = (HPEN)SelectObject(window->targetDC, pen);
+    PolyPolyline(window->targetDC, window->runPoints.data(), window->runCounts.data(),
+                 static_cast<DWORD>(window->runCounts.size()));
+    SelectObject(window->targetDC, oldPen);
+    DeleteObject(pen);
+    
+    window->runPoints.clear();
+    window->runCounts.clear();
+}
+
+void drawLine(WindowHandle* window, int x1, int y1, int x2, int y2, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_LINE, x1, y1, x2, y2, color)) return;
+    if (drawSoftware(window, CMD_LINE, x1, y1, x2, y2, color)) return;
+    if (!window->targetDC) return;
+    LineWalk walk;
+    if (!clipLine(window->clip, x1, y1, x2, y2, walk)) return;
+    
+    // Grid lines are filled, which unlike LineTo includes the end point
+    // like the other backends do
+    Rect line;
+    if (axisLineRect(walk, line)) {
+        RECT rect = {line.x, line.y, line.x + line.width, line.y + line.height};
+        HBRUSH brush = CreateSolidBrush(RGB(color.r, color.g, color.b));
+        FillRect(window->targetDC, &rect, brush);
+        DeleteObject(brush);
+        return;
+    }
+    
+    // GDI clips the full line itself within its coordinate space; beyond it
+    // the visible pixels go out as one pixel runs
+    if (!lineFits(x1, y1, x2, y2, GDI_LINE_LIMIT)) {
+        walkLine(walk, [&](int x, int y) { addRun(window, x, x, y); });
+        drawRuns(window, color);
+        return;
+    }
+    
+    HPEN pen = CreatePen(PS_SOLID, 1, RGB(color.r, color.g, color.b));
+    HPEN oldPen = (HPEN)SelectObject(window->targetDC, pen);
+    
+    MoveToEx(window->targetDC, x1, y1, nullptr);
+    LineTo(window->targetDC, x2, y2);
+    
+    SelectObject(window->targetDC, oldPen);
+    DeleteObject(pen);
+}
+
+void drawRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_RECTANGLE, x, y, width, height, color)) return;
+    if (drawSoftware(window, CMD_RECTANGLE, x, y, width, height, color)) return;
+    if (!window->targetDC) return;
+    // Rectangle() excludes the right and bottom coordinates
+    if (rectOutlineOutsideClip(window->clip, x, y, static_cast<long long>(x) + width - 1,
+                               static_cast<long long>(y) + height - 1)) return;
+    
+    HPEN pen = CreatePen(PS_SOLID, 1, RGB(color.r, color.g, color.b));
+    HPEN oldPen = (HPEN)SelectObject(window->targetDC, pen);
+    HBRUSH oldBrush = (HBRUSH)SelectObject(window->targetDC, GetStockObject(NULL_BRUSH));
+    
+    Rectangle(window->targetDC, x, y, x + width, y + height);
+    
+    SelectObject(window->targetDC, oldPen);
+    SelectObject(window->targetDC, oldBrush);
+    DeleteObject(pen);
+}
+
+void drawFilledRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_FILLED_RECTANGLE, x, y, width, height, color)) return;
+    if (drawSoftware(window, CMD_FILLED_RECTANGLE, x, y, width, height, color)) return;
+    if (!window->targetDC) return;
+    if (!clipRectangle(window->clip, x, y, width, height)) return;
+    
+    RECT rect = {x, y, x + width, y + height};
+    HBRUSH brush = CreateSolidBrush(RGB(color.r, color.g, color.b));
+    FillRect(window->targetDC, &rect, brush);
+    DeleteObject(brush);
+}
+
+void drawPixel(WindowHandle* window, int x, int y, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_PIXEL, x, y, 0, 0, color)) return;
+    if (drawSoftware(window, CMD_PIXEL, x, y, 0, 0, color)) return;
+    if (!window->targetDC) return;
+    if (!pointInClip(window->clip, x, y)) return;
+    
+    SetPixel(window->targetDC, x, y, RGB(color.r, color.g, color.b));
+}
+
+// GDI has no point list primitive, SetPixelV at least skips the colour readback
+static void drawBatchPoints(WindowHandle* window, const BatchPoint* points, int count) {
+    if (!window->targetDC) return;
+    
+    for (int i = 0; i < count; i++) {
+        const BatchPoint& point = points[i];
+        if (!pointInClip(window->clip, point.x, point.y)) continue;
+        SetPixelV(window->targetDC, point.x, point.y, RGB(point.color.r, point.color.g, point.color.b));
+    }
+}
+
+void drawCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (drawSoftware(window, CMD_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (!window->targetDC) return;
+    if (circleOutsideClip(window->clip, centerX, centerY, radius)) return;
+    if (clipInsideCircle(window->clip, centerX, centerY, radius)) return;
+    
+    rasterCircle(window->clip, centerX, centerY, radius, [&](int x, int y) { addRun(window, x, x, y); });
+    drawRuns(window, color);
+}
+
+void drawFilledCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_FILLED_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (drawSoftware(window, CMD_FILLED_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (!window->targetDC) return;
+    if (circleOutsideClip(window->clip, centerX, centerY, radius)) return;
+    
+    rasterFilledCircle(window->clip, centerX, centerY, radius,
+                       [&](int x0, int x1, int y) { addRun(window, x0, x1, y); });
+    drawRuns(window, color);
+}
+
+static void releaseBlendBuffer(WindowHandle* window) {
+    if (window->blendDC) {
+        SelectObject(window->blendDC, window->blendOldBitmap);
+        DeleteDC(window->blendDC);
+        window->blendDC = nullptr;
+    }
+    if (window->blendBitmap) {
+        DeleteObject(window->blendBitmap);
+        window->blendBitmap = nullptr;
+    }
+    window->blendBits = nullptr;
+    window->blendWidth = window->blendHeight = 0;
+}
+
+// GDI has no alpha for its own primitives, so translucent pixels go through a
+// premultiplied 32-bit DIB section and GdiAlphaBlend. The DIB only grows, in
+// steps of 256 pixels. Returns its rows, blendWidth pixels apart, nullptr if
+// it can't be created.
+static uint32_t* blendBuffer(WindowHandle* window, int width, int height) {
+    if (window->blendWidth < width || window->blendHeight < height) {
+        int grownWidth = (std::max(window->blendWidth, width) + 255) & ~255;
+        int grownHeight = (std::max(window->blendHeight, height) + 255) & ~255;
+        releaseBlendBuffer(window);
+        
+        BITMAPINFO bmi = {};
+        bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+        bmi.bmiHeader.biWidth = grownWidth;
+        bmi.bmiHeader.biHeight = -grownHeight;
+        bmi.bmiHeader.biPlanes = 1;
+        bmi.bmiHeader.biBitCount = 32;
+        bmi.bmiHeader.biCompression = BI_RGB;
+        
+        void* bits = nullptr;
+        window->blendBitmap = CreateDIBSection(window->hdc, &bmi, DIB_RGB_COLORS, &bits, nullptr, 0);
+        if (!window->blendBitmap) return nullptr;
+        window->blendDC = CreateCompatibleDC(window->hdc);
+        window->blendOldBitmap = (HBITMAP)SelectObject(window->blendDC, window->blendBitmap);
+        window->blendBits = static_cast<uint32_t*>(bits);
+        window->blendWidth = grownWidth;
+        window->blendHeight = grownHeight;
+    }
+    
+    // GDI may still be drawing from the previous contents
+    GdiFlush();
+    return window->blendBits;
+}
+
+// Composites the top left width x height pixels of the blend buffer at (x, y)
+static void drawBlendBuffer(WindowHandle* window, int x, int y, int width, int height) {
+    BLENDFUNCTION blend = {AC_SRC_OVER, 0, 255, AC_SRC_ALPHA};
+    GdiAlphaBlend(window->targetDC, x, y, width, height, window->blendDC, 0, 0, width, height, blend);
+}
+
+static void drawCoverage(WindowHandle* window, const CoverageMask& mask, const Color& color) {
+    if (!window->targetDC) return;
+    uint32_t* bits = blendBuffer(window, mask.width, mask.height);
+    if (!bits) return;
+    
+    // The premultiplied pixel for each coverage value
+    uint32_t tint[256];
+    for (int i = 0; i < 256; i++) {
+        uint32_t alpha = (color.a * i + 127) / 255;
+        tint[i] = alpha << 24 | (color.r * alpha + 127) / 255 << 16 | (color.g * alpha + 127) / 255 << 8 |
+                  (color.b * alpha + 127) / 255;
+    }
+    
+    for (int y = 0; y < mask.height; y++) {
+        const uint8_t* coverage = mask.coverage + static_cast<size_t>(y) * mask.width;
+        uint32_t* row = bits + static_cast<size_t>(y) * window->blendWidth;
+        for (int x = 0; x < mask.width; x++) row[x] = tint[coverage[x]];
+    }
+    drawBlendBuffer(window, mask.x, mask.y, mask.width, mask.height);
+}
+
+// ============================================================================
+// OFFSCREEN SURFACES - WIN32
+// ============================================================================
+
+Surface* createSurface(WindowHandle* window, int width, int height) {
+    if (!window || window->headless || width <= 0 || height <= 0) return nullptr;
+    
+    Surface* surface = new Surface();
+    surface->window = window;
+    surface->width = width;
+    surface->height = height;
+    window->surfaces.push_back(surface);
+    return surface;
+}
+
+static HDC surfaceDC(Surface* surface) {
+    if (surface->dc) return surface->dc;
+    
+    WindowHandle* window = surface->window;
+    surface->dc = CreateCompatibleDC(window->hdc);
+    
+    // Loaded images come with their bitmap, new surfaces start black
+    bool blank = !surface->bitmap;
+    if (blank) surface->bitmap = CreateCompatibleBitmap(window->hdc, surface->width, surface->height);
+    surface->oldBitmap = (HBITMAP)SelectObject(surface->dc, surface->bitmap);
+    if (blank) {
+        RECT rect = {0, 0, surface->width, surface->height};
+        FillRect(surface->dc, &rect, (HBRUSH)GetStockObject(BLACK_BRUSH));
+    }
+    return surface->dc;
+}
+
+// Points the drawing functions and the clip rectangle at the current draw surface
+static void bindTarget(WindowHandle* window) {
+    Surface* surface = drawSurface(window);
+    applyNativeClip(window, false);
+    window->targetDC = surface ? surfaceDC(surface) : window->memDC;
+    updateClip(window);
+}
+
+// A clip region on the target DC, removed again before the DC changes
+static void applyNativeClip(WindowHandle* window, bool enabled) {
+    if (!window->targetDC) return;
+    if (!enabled || window->clipStack.empty()) {
+        SelectClipRgn(window->targetDC, nullptr);
+        return;
+    }
+    
+    const ClipRect& clip = window->clip;
+    HRGN region = CreateRectRgn(clip.x0, clip.y0, clip.x1, clip.y1);
+    SelectClipRgn(window->targetDC, region);
+    DeleteObject(region);
+}
+
+static void freeSurface(Surface* surface) {
+    WindowHandle* window = surface->window;
+    if (window->target == surface) setRenderTarget(window, nullptr);
+    if (window->canvas == surface) setCanvas(window, nullptr);
+    
+    if (surface->dc) {
+        SelectObject(surface->dc, surface->oldBitmap);
+        DeleteDC(surface->dc);
+    }
+    if (surface->bitmap) DeleteObject(surface->bitmap);
+    delete surface;
+}
+
+// Images are decoded straight into the bits of a top-down DIB section, which
+// becomes the surface's bitmap
+static bool beginImageUpload(WindowHandle* window, int width, int height, ImageUpload& upload) {
+    Surface* surface = createSurface(window, width, height);
+    if (!surface) return false;
+    
+    BITMAPINFO info;
+    std::memset(&info, 0, sizeof(info));
+    info.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    info.bmiHeader.biWidth = width;
+    info.bmiHeader.biHeight = -height;
+    info.bmiHeader.biPlanes = 1;
+    info.bmiHeader.biBitCount = 32;
+    info.bmiHeader.biCompression = BI_RGB;
+    
+    void* bits = nullptr;
+    surface->bitmap = CreateDIBSection(window->hdc, &info, DIB_RGB_COLORS, &bits, nullptr, 0);
+    if (!surface->bitmap || !bits) {
+        destroySurface(surface);
+        return false;
+    }
+    
+    upload.surface = surface;
+    upload.pixels = static_cast<uint8_t*>(bits);
+    upload.pitch = static_cast<size_t>(width) * 4;
+    upload.layout = layoutOf(PIXEL_BGRX32);
+    return true;
+}
+
+static void finishImageUpload(WindowHandle*, ImageUpload& upload, bool decoded) {
+    if (!decoded) destroySurface(upload.surface);
+}
+
+void setRenderTarget(WindowHandle* window, Surface* surface) {
+    if (!window || (surface && surface->window != window)) return;
+    if (deferSurfaceCommand(window->renderThread, CMD_SET_TARGET, surface)) return;
+    
+    window->target = surface;
+    bindTarget(window);
+}
+
+static void setCanvas(WindowHandle* window, Surface* canvas) {
+    window->canvas = canvas;
+    bindTarget(window);
+}
+
+void blitSurface(WindowHandle* window, Surface* surface, const Rect* srcRect, const Rect* dstRect) {
+    if (!window || !surface || surface->window != window) return;
+    touchImage(window->imageCache, surface);
+    if (deferSurfaceCommand(window->renderThread, CMD_BLIT, surface, srcRect, dstRect)) return;
+    if (drawSoftware(window, CMD_BLIT, 0, 0, 0, 0, Color())) return;
+    if (!window->targetDC || surface == drawSurface(window)) return;
+    
+    int targetWidth, targetHeight;
+    getTargetSize(window, targetWidth, targetHeight);
+    Rect src, dst;
+    if (!resolveBlitRects(srcRect, dstRect, surface->width, surface->height,
+                          targetWidth, targetHeight, src, dst)) return;
+    
+    HDC dc = surfaceDC(surface);
+    if (src.width == dst.width && src.height == dst.height) {
+        BitBlt(window->targetDC, dst.x, dst.y, dst.width, dst.height, dc, src.x, src.y, SRCCOPY);
+    } else {
+        SetStretchBltMode(window->targetDC, COLORONCOLOR);
+        StretchBlt(window->targetDC, dst.x, dst.y, dst.width, dst.height,
+                   dc, src.x, src.y, src.width, src.height, SRCCOPY);
+    }
+}
+
+// GDI can't rotate with filtering or blend, so the image is read back and
+// drawn transformed into a transparent buffer on the CPU, which then goes
+// through the blend buffer. Surfaces are opaque, their pixels need no
+// premultiplying.
+void drawImageTransformed(WindowHandle* window, Surface* image, float x, float y, float angle, float scaleX,
+                          float scaleY, ImageFilter filter) {
+    if (!window || !image || image->window != window) return;
+    touchImage(window->imageCache, image);
+    if (deferImageTransform(window->renderThread, image, x, y, angle, scaleX, scaleY, filter)) return;
+    if (drawSoftware(window, CMD_DRAW_IMAGE, 0, 0, 0, 0, Color())) return;
+    if (!window->targetDC || image == drawSurface(window)) return;
+    
+    bool bilinear = filter == FILTER_BILINEAR;
+    ImageTransform t;
+    if (!setupImageTransform(image->width, image->height, x, y, angle, scaleX, scaleY, bilinear, window->clip,
+                             t)) return;
+    
+    std::vector<Color>& source = window->imagePixels;
+    source.resize(static_cast<size_t>(image->width) * image->height);
+    if (!readDC(surfaceDC(image), Rect(0, 0, image->width, image->height), source.data(),
+                static_cast<size_t>(image->width) * 4)) return;
+    
+    int width = t.x1 - t.x0, height = t.y1 - t.y0;
+    std::vector<Color>& pixels = window->blendPixels;
+    pixels.assign(static_cast<size_t>(width) * height, Color(0, 0, 0, 0));
+    ImagePixels texels = {source.data(), image->width, image->height, static_cast<size_t>(image->width)};
+    transformImage(texels, t, bilinear, pixels.data(), width);
+    
+    uint32_t* bits = blendBuffer(window, width, height);
+    if (!bits) return;
+    for (int row = 0; row < height; row++) {
+        packPixels(reinterpret_cast<const uint8_t*>(&pixels[static_cast<size_t>(row) * width]),
+                   reinterpret_cast<uint8_t*>(bits + static_cast<size_t>(row) * window->blendWidth),
+                   layoutOf(PIXEL_BGRA32), width);
+    }
+    drawBlendBuffer(window, t.x0, t.y0, width, height);
+}
+
+void delay(uint32_t milliseconds) {
+    Sleep(milliseconds);
+}
+
+// ============================================================================
+// INPUT HANDLING - WIN32
+// ============================================================================
+
+void setMousePosition(WindowHandle* window, int x, int y) {
+    if (!window || !window->hwnd) return;
+    
+    POINT pt = {logicalToWindowX(window->input, x), logicalToWindowY(window->input, y)};
+    ClientToScreen(window->hwnd, &pt);
+    SetCursorPos(pt.x, pt.y);
+    
+    window->input.mouseX = x;
+    window->input.mouseY = y;
+}
+
+void setMouseLocked(WindowHandle* window, bool locked) {
+    if (!window || !window->hwnd) return;
+    window->mouseLocked = locked;
+    
+    if (locked) {
+        ShowCursor(FALSE);
+    } else {
+        ShowCursor(TRUE);
+    }
+}
+
+#endif // USE_WIN32
+
+#ifdef USE_X11
+
+// Xlib has its own KeyCode typedef which clashes with ours
+#define KeyCode X11KeyCode
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/XKBlib.h>
+#include <X11/extensions/Xrender.h>
+#include <X11/extensions/XShm.h>
+#undef KeyCode
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dlfcn.h>
+#include <cstring>
+#include <map>
+
+// Line coordinates go over the wire as 16 bit integers
+const int X11_LINE_LIMIT = 32767;
+
+// Platform-specific window handle structure for X11
+struct WindowHandle {
+    Display* display;
+    Window window;
+    GC gc;
+    Pixmap backBuffer;
+    int width;
+    int height;
+    bool shouldClose;
+    Atom wmDeleteMessage;
+    unsigned long currentColor;
+    ClipRect clip;
+    std::vector<Rect> clipStack;      // Innermost last, see pushClipRect
+    
+    InputState input;
+    bool mouseLocked;
+    
+    // Whichever thread drains the shared connection only queues the window's
+    // events here; the thread that polls the window applies them to input
+    std::mutex inboxMutex;
+    std::vector<XEvent> inbox;
+    std::vector<XEvent> inboxEvents;  // Taken out of inbox by the polling thread
+    int wakePipe[2];                  // Written when inbox stops being empty, see waitEvents
+    bool mapped;                      // MapNotify was routed here, see createWindow
+    
+    RenderThread* renderThread;
+    PresentClock present;
+    
+    Surface* target;                  // Current render target, nullptr = window
+    Surface* canvas;                  // Logical-resolution canvas, nullptr = none
+    Surface* pendingCanvas;           // Canvas as last requested by the application
+    Drawable drawTarget;              // Drawable the drawing functions draw into
+    XImage* canvasImage;              // Window-sized staging image for the canvas upscale
+    IndexedFramebuffer* indexed;      // Palette state and 8-bit buffer, nullptr = never used
+    ImageCache* imageCache;           // Images of acquireImage, nullptr = never used
+    XImage* indexedImage;             // Staging image the indexed buffer is expanded into
+    SoftwareFramebuffer* headless;    // Pixels of a headless window, nullptr = native window
+    std::vector<PendingReadback> readbacks;
+    std::vector<XPoint> pointScratch; // Colour run of a point batch, circle outline
+    FrameArena frameArena;
+    std::vector<Surface*> surfaces;
+    
+    bool trueColor;                   // Pixel values can be computed from visualLayout
+    PixelLayout visualLayout;
+    
+    bool render;                      // RENDER extension available, see setupRender
+    XRenderPictFormat* renderFormat;  // Format of the window visual
+    XRenderPictFormat* maskFormat;    // A8, for antialiased shapes
+    Picture backPicture;
+    Picture drawPicture;              // Picture of drawTarget
+    bool nativeClip;                  // gc and drawPicture carry the clip stack
+    Picture solidPicture;             // Cached source of solidColor
+    Color solidColor;
+    std::vector<XPointFixed> renderPoints;
+    std::vector<XRectangle> renderRects;
+    Pixmap coveragePixmap;            // A8 mask of fillPath, grown as needed
+    Picture coveragePicture;
+    GC coverageGC;                    // Depth 8 GC for putting the mask
+    int coverageWidth;
+    int coverageHeight;
+    PathRaster pathRaster;
+    std::vector<Color> imagePixels;   // drawImageTransformed source and target without XRender
+    std::vector<Color> targetPixels;
+    
+    XShmSegmentInfo shm;              // Shared segment for readPixels, see attachShm
+    size_t shmSize;
+    bool shmFailed;
+    
+    WindowHandle() : display(nullptr), window(0), gc(nullptr), 
+                     backBuffer(0), width(0), height(0), 
+                     shouldClose(false), wmDeleteMessage(0),
+                     currentColor(0xFFFFFF),
+                     mouseLocked(false), mapped(false), renderThread(nullptr), present(PRESENT_IMMEDIATE),
+                     target(nullptr), canvas(nullptr), pendingCanvas(nullptr), drawTarget(0),
+                     canvasImage(nullptr), indexed(nullptr), imageCache(nullptr), indexedImage(nullptr),
+                     headless(nullptr),
+                     trueColor(false),
+                     render(false), renderFormat(nullptr), maskFormat(nullptr), backPicture(0), drawPicture(0),
+                     nativeClip(false), solidPicture(0), coveragePixmap(0), coveragePicture(0), coverageGC(nullptr),
+                     coverageWidth(0), coverageHeight(0), shmSize(0), shmFailed(false) {
+        visualLayout = layoutOf(PIXEL_BGRX32);
+        std::memset(&shm, 0, sizeof(shm));
+        wakePipe[0] = wakePipe[1] = -1;
+    }
+};
+
+// Offscreen surface backed by a pixmap, created on first use
+struct Surface {
+    WindowHandle* window;
+    Pixmap pixmap;
+    Picture picture;            // XRender picture of the pixmap, created on first use
+    int width;
+    int height;
+    
+    Surface() : window(nullptr), pixmap(0), picture(0), width(0), height(0) {}
+};
+
+// Surface the drawing functions currently draw into, nullptr = back buffer
+static Surface* drawSurface(WindowHandle* window) {
+    return window->target ? window->target : window->canvas;
+}
+
+static void getTargetSize(WindowHandle* window, int& width, int& height) {
+    Surface* surface = drawSurface(window);
+    width = surface ? surface->width : window->width;
+    height = surface ? surface->height : window->height;
+}
+
+// One connection to the X server is shared by every window of the process.
+// It is opened with the first window and closed with the last one. Windows
+// are registered by their X window ID so events reach the right handle no
+// matter which window is being polled. The mutex guards the connection's
+// lifetime and the registry; users counts windows from acquireDisplay on.
+struct X11Connection {
+    std::mutex mutex;
+    Display* display;
+    Atom wmDeleteMessage;
+    int users;
+    std::map<Window, WindowHandle*> windows;
+    
+    X11Connection() : display(nullptr), wmDeleteMessage(0), users(0) {}
+};
+
+static X11Connection x11;
+
+static Display* acquireDisplay() {
+    std::lock_guard<std::mutex> lock(x11.mutex);
+    if (!x11.display) {
+        // The render thread draws and flushes on the shared connection
+        static bool threadsInitialized = XInitThreads() != 0;
+        (void)threadsInitialized;
+        
+        x11.display = XOpenDisplay(nullptr);
+        if (!x11.display) return nullptr;
+        
+        // Report held keys as a single press instead of release/press pairs
+        XkbSetDetectableAutoRepeat(x11.display, True, nullptr);
+        
+        x11.wmDeleteMessage = XInternAtom(x11.display, "WM_DELETE_WINDOW", False);
+    }
+    x11.users++;
+    return x11.display;
+}
+
+static void releaseDisplayIfUnused() {
+    std::lock_guard<std::mutex> lock(x11.mutex);
+    if (--x11.users == 0 && x11.display) {
+        XCloseDisplay(x11.display);
+        x11.display = nullptr;
+        x11.wmDeleteMessage = 0;
+    }
+}
+
+// Helper to convert Color to X11 pixel value
+static unsigned long colorToPixel(WindowHandle* window, const Color& color) {
+    // TrueColor pixel values follow from the visual masks, no server round trip
+    if (window->trueColor) return packPixel(window->visualLayout, color);
+    
+    Display* display = window->display;
+    int screen = DefaultScreen(display);
+    Colormap colormap = DefaultColormap(display, screen);
+    XColor xcolor;
+    
+    xcolor.red = color.r * 257;   // Convert 0-255 to 0-65535
+    xcolor.green = color.g * 257;
+    xcolor.blue = color.b * 257;
+    xcolor.flags = DoRed | DoGreen | DoBlue;
+    
+    XAllocColor(display, colormap, &xcolor);
+    return xcolor.pixel;
+}
+
+// X11 key mapping
+static KeyCode mapX11Key(KeySym keysym) {
+    switch (keysym) {
+        case XK_Up: return KEY_UP;
+        case XK_Down: return KEY_DOWN;
+        case XK_Left: return KEY_LEFT;
+        case XK_Right: return KEY_RIGHT;
+        
+        case XK_a: case XK_A: return KEY_A;
+        case XK_b: case XK_B: return KEY_B;
+        case XK_c: case XK_C: return KEY_C;
+        case XK_d: case XK_D: return KEY_D;
+        case XK_e: case XK_E: return KEY_E;
+        case XK_f: case XK_F: return KEY_F;
+        case XK_g: case XK_G: return KEY_G;
+        case XK_h: case XK_H: return KEY_H;
+        case XK_i: case XK_I: return KEY_I;
+        case XK_j: case XK_J: return KEY_J;
+        case XK_k: case XK_K: return KEY_K;
+        case XK_l: case XK_L: return KEY_L;
+        case XK_m: case XK_M: return KEY_M;
+        case XK_n: case XK_N: return KEY_N;
+        case XK_o: case XK_O: return KEY_O;
+        case XK_p: case XK_P: return KEY_P;
+        case XK_q: case XK_Q: return KEY_Q;
+        case XK_r: case XK_R: return KEY_R;
+        case XK_s: case XK_S: return KEY_S;
+        case XK_t: case XK_T: return KEY_T;
+        case XK_u: case XK_U: return KEY_U;
+        case XK_v: case XK_V: return KEY_V;
+        case XK_w: case XK_W: return KEY_W;
+        case XK_x: case XK_X: return KEY_X;
+        case XK_y: case XK_Y: return KEY_Y;
+        case XK_z: case XK_Z: return KEY_Z;
+        
+        case XK_0: return KEY_0;
+        case XK_1: return KEY_1;
+        case XK_2: return KEY_2;
+        case XK_3: return KEY_3;
+        case XK_4: return KEY_4;
+        case XK_5: return KEY_5;
+        case XK_6: return KEY_6;
+        case XK_7: return KEY_7;
+        case XK_8: return KEY_8;
+        case XK_9: return KEY_9;
+        
+        case XK_F1: return KEY_F1;
+        case XK_F2: return KEY_F2;
+        case XK_F3: return KEY_F3;
+        case XK_F4: return KEY_F4;
+        case XK_F5: return KEY_F5;
+        case XK_F6: return KEY_F6;
+        case XK_F7: return KEY_F7;
+        case XK_F8: return KEY_F8;
+        case XK_F9: return KEY_F9;
+        case XK_F10: return KEY_F10;
+        case XK_F11: return KEY_F11;
+        case XK_F12: return KEY_F12;
+        
+        case XK_space: return KEY_SPACE;
+        case XK_Return: return KEY_ENTER;
+        case XK_Escape: return KEY_ESCAPE;
+        case XK_BackSpace: return KEY_BACKSPACE;
+        case XK_Tab: return KEY_TAB;
+        case XK_Shift_L:
+        case XK_Shift_R: return KEY_SHIFT;
+        case XK_Control_L:
+        case XK_Control_R: return KEY_CONTROL;
+        case XK_Alt_L:
+        case XK_Alt_R: return KEY_ALT;
+        
+        case XK_plus:
+        case XK_equal: return KEY_PLUS;
+        case XK_minus: return KEY_MINUS;
+        
+        default: return KEY_UNKNOWN;
+    }
+}
+
+// Xlib is made thread safe by XInitThreads, nothing to hand over
+static void releaseRenderer(WindowHandle*) {}
+static void acquireRenderer(WindowHandle*) {}
+
+static bool threadedRenderingSupported() {
+    return true;
+}
+
+static void setupRender(WindowHandle* window);
+static void releaseShm(WindowHandle* window);
+
+static void drainX11Events();
+
+// The refresh rate of the screen in Hz from XRandR, 0 if unknown. libXrandr
+// is loaded at runtime so the library still links without it.
+struct XRandR {
+    typedef void* (*GetScreenInfoProc)(Display*, Window);
+    typedef short (*ConfigCurrentRateProc)(void*);
+    typedef void (*FreeScreenConfigInfoProc)(void*);
+    
+    GetScreenInfoProc getScreenInfo;
+    ConfigCurrentRateProc configCurrentRate;
+    FreeScreenConfigInfoProc freeScreenConfigInfo;
+    
+    XRandR() : getScreenInfo(nullptr), configCurrentRate(nullptr), freeScreenConfigInfo(nullptr) {
+        void* library = dlopen("libXrandr.so.2", RTLD_LAZY | RTLD_LOCAL);
+        if (!library) return;
+        getScreenInfo = reinterpret_cast<GetScreenInfoProc>(dlsym(library, "XRRGetScreenInfo"));
+        configCurrentRate = reinterpret_cast<ConfigCurrentRateProc>(dlsym(library, "XRRConfigCurrentRate"));
+        freeScreenConfigInfo = reinterpret_cast<FreeScreenConfigInfoProc>(dlsym(library, "XRRFreeScreenConfigInfo"));
+    }
+};
+
+static int screenRefreshRate(Display* display, Window root) {
+    static XRandR xrandr;
+    if (!xrandr.getScreenInfo || !xrandr.configCurrentRate || !xrandr.freeScreenConfigInfo) return 0;
+    
+    // Null when the server doesn't have the extension
+    void* config = xrandr.getScreenInfo(display, root);
+    if (!config) return 0;
+    int rate = xrandr.configCurrentRate(config);
+    xrandr.freeScreenConfigInfo(config);
+    return rate;
+}
+
+WindowHandle* createWindow(const char* title, int width, int height) {
+    WindowHandle* handle = new WindowHandle();
+    handle->width = width;
+    handle->height = height;
+    handle->clip = ClipRect(0, 0, width, height);
+    
+    // Connect to the X server, or reuse the existing connection
+    handle->display = acquireDisplay();
+    if (!handle->display) {
+        delete handle;
+        return nullptr;
+    }
+    
+    int screen = DefaultScreen(handle->display);
+    Window root = RootWindow(handle->display, screen);
+    handle->present.setRefreshRate(screenRefreshRate(handle->display, root));
+    
+    Visual* visual = DefaultVisual(handle->display, screen);
+    if (visual->c_class == TrueColor) {
+        handle->trueColor = true;
+        handle->visualLayout.redMask = static_cast<uint32_t>(visual->red_mask);
+        handle->visualLayout.greenMask = static_cast<uint32_t>(visual->green_mask);
+        handle->visualLayout.blueMask = static_cast<uint32_t>(visual->blue_mask);
+        handle->visualLayout.alphaMask = 0;
+    }
+    
+    // Create window
+    handle->window = XCreateSimpleWindow(
+        handle->display,
+        root,
+        0, 0,
+        width, height,
+        1,
+        BlackPixel(handle->display, screen),
+        BlackPixel(handle->display, screen)
+    );
+    
+    if (!handle->window) {
+        delete handle;
+        releaseDisplayIfUnused();
+        return nullptr;
+    }
+    
+    // Set window title
+    XStoreName(handle->display, handle->window, title);
+    
+    // Select input events
+    XSelectInput(handle->display, handle->window, 
+                 ExposureMask | KeyPressMask | KeyReleaseMask | 
+                 ButtonPressMask | ButtonReleaseMask | 
+                 PointerMotionMask | StructureNotifyMask);
+    
+    // Handle window close event
+    handle->wmDeleteMessage = x11.wmDeleteMessage;
+    XSetWMProtocols(handle->display, handle->window, &handle->wmDeleteMessage, 1);
+    
+    // Create graphics context
+    handle->gc = XCreateGC(handle->display, handle->window, 0, nullptr);
+    
+    // Create back buffer for double buffering
+    handle->backBuffer = XCreatePixmap(handle->display, handle->window, 
+                                       width, height, 
+                                       DefaultDepth(handle->display, screen));
+    handle->drawTarget = handle->backBuffer;
+    setupRender(handle);
+    
+    // Without the pipe waitEvents only wakes up for traffic on the connection
+    if (pipe(handle->wakePipe) == 0) {
+        fcntl(handle->wakePipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(handle->wakePipe[1], F_SETFL, O_NONBLOCK);
+    } else {
+        handle->wakePipe[0] = handle->wakePipe[1] = -1;
+    }
+    
+    // Registered before mapping, so MapNotify reaches the window whichever
+    // thread drains the connection
+    {
+        std::lock_guard<std::mutex> lock(x11.mutex);
+        x11.windows[handle->window] = handle;
+    }
+    
+    // Map window to screen
+    XMapWindow(handle->display, handle->window);
+    XFlush(handle->display);
+    
+    // Wait for window to be mapped. Without a wake pipe another thread's
+    // drain can't wake us, so poll with a timeout then.
+    for (;;) {
+        drainX11Events();
+        {
+            std::lock_guard<std::mutex> lock(handle->inboxMutex);
+            if (handle->mapped) break;
+        }
+        
+        struct pollfd pfds[2];
+        pfds[0].fd = ConnectionNumber(handle->display);
+        pfds[1].fd = handle->wakePipe[0];
+        for (int i = 0; i < 2; i++) {
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+        poll(pfds, 2, handle->wakePipe[0] >= 0 ? -1 : 10);
+        
+        char bytes[64];
+        while (handle->wakePipe[0] >= 0 && read(handle->wakePipe[0], bytes, sizeof(bytes)) > 0) {}
+    }
+    return handle;
+}
+
+static void releaseCoverage(WindowHandle* window);
+
+void destroyWindow(WindowHandle* window) {
+    if (!window || destroyHeadless(window)) return;
+    
+    stopRenderThread(window->renderThread);
+    window->renderThread = nullptr;
+    finishReadbacks(window, true);
+    
+    // Release surfaces the application didn't destroy
+    for (size_t i = 0; i < window->surfaces.size(); i++) freeSurface(window->surfaces[i]);
+    window->surfaces.clear();
+    delete window->imageCache;
+    
+    {
+        std::lock_guard<std::mutex> lock(x11.mutex);
+        x11.windows.erase(window->window);
+    }
+    if (window->wakePipe[0] >= 0) {
+        close(window->wakePipe[0]);
+        close(window->wakePipe[1]);
+    }
+    delete window->indexed;
+    if (window->indexedImage) XDestroyImage(window->indexedImage);
+    if (window->canvasImage) XDestroyImage(window->canvasImage);
+    
+    if (window->display) {
+        releaseShm(window);
+        if (window->solidPicture) XRenderFreePicture(window->display, window->solidPicture);
+        if (window->backPicture) XRenderFreePicture(window->display, window->backPicture);
+        releaseCoverage(window);
+        
+        if (window->backBuffer) {
+            XFreePixmap(window->display, window->backBuffer);
+        }
+        
+        if (window->gc) {
+            XFreeGC(window->display, window->gc);
+        }
+        
+        if (window->window) {
+            XDestroyWindow(window->display, window->window);
+        }
+        
+        XFlush(window->display);
+    }
+    
+    delete window;
+    
+    // Close the connection if this was the last window
+    releaseDisplayIfUnused();
+}
+
+bool windowShouldClose(WindowHandle* window) {
+    if (!window) return true;
+    return window->shouldClose || replayClosed(window->input);
+}
+
+// Translates one X event into the window's input state
+static void processX11Event(WindowHandle* window, XEvent& event) {
+    InputState& input = window->input;
+    
+    switch (event.type) {
+        case ClientMessage:
+            if ((Atom)event.xclient.data.l[0] == window->wmDeleteMessage) {
+                window->shouldClose = true;
+                inputClose(input);
+            }
+            break;
+            
+        case KeyPress: {
+            KeySym keysym = XLookupKeysym(&event.xkey, 0);
+            inputKey(input, mapX11Key(keysym), true);
+            if (keysym == XK_Escape) {
+                window->shouldClose = true;
+            }
+            break;
+        }
+        
+        case KeyRelease: {
+            KeySym keysym = XLookupKeysym(&event.xkey, 0);
+            inputKey(input, mapX11Key(keysym), false);
+            break;
+        }
+        
+        case ButtonPress:
+            if (event.xbutton.button == Button1)
+                inputButton(input, MOUSE_LEFT, true);
+            else if (event.xbutton.button == Button2)
+                inputButton(input, MOUSE_MIDDLE, true);
+            else if (event.xbutton.button == Button3)
+                inputButton(input, MOUSE_RIGHT, true);
+            else if (event.xbutton.button == Button4)
+                inputWheel(input, 1);
+            else if (event.xbutton.button == Button5)
+                inputWheel(input, -1);
+            break;
+            
+        case ButtonRelease:
+            if (event.xbutton.button == Button1)
+                inputButton(input, MOUSE_LEFT, false);
+            else if (event.xbutton.button == Button2)
+                inputButton(input, MOUSE_MIDDLE, false);
+            else if (event.xbutton.button == Button3)
+                inputButton(input, MOUSE_RIGHT, false);
+            break;
+            
+        case MotionNotify:
+            inputMotion(input, event.xmotion.x, event.xmotion.y);
+            break;
+    }
+}
+
+// Reads everything the server has sent and queues each event in its window's
+// inbox. Windows may be polled from different threads, so the input state is
+// left to the thread polling the window. The registry lock keeps the windows
+// alive while their inboxes are filled.
+static void drainX11Events() {
+    std::lock_guard<std::mutex> lock(x11.mutex);
+    XEvent event;
+    while (XPending(x11.display) > 0) {
+        XNextEvent(x11.display, &event);
+        
+        std::map<Window, WindowHandle*>::iterator it = x11.windows.find(event.xany.window);
+        if (it == x11.windows.end()) continue;
+        
+        WindowHandle* window = it->second;
+        bool wake;
+        {
+            std::lock_guard<std::mutex> inboxLock(window->inboxMutex);
+            wake = window->inbox.empty();
+            window->inbox.push_back(event);
+            
+            // createWindow waits for this one, even with events already queued
+            if (event.type == MapNotify) {
+                window->mapped = true;
+                wake = true;
+            }
+        }
+        if (wake && window->wakePipe[1] >= 0) {
+            char byte = 0;
+            ssize_t written = write(window->wakePipe[1], &byte, 1);  // A full pipe is already awake
+            (void)written;
+        }
+    }
+}
+
+// Applies the window's queued events to its input state, on the polling thread
+static void applyX11Events(WindowHandle* window) {
+    {
+        std::lock_guard<std::mutex> lock(window->inboxMutex);
+        window->inboxEvents.swap(window->inbox);
+    }
+    for (size_t i = 0; i < window->inboxEvents.size(); i++) processX11Event(window, window->inboxEvents[i]);
+    window->inboxEvents.clear();
+}
+
+// Common tail of pollEvents/waitEvents
+static void finishX11Events(WindowHandle* window) {
+    applyX11Events(window);
+    publishInputFrame(window->input);
+    
+    // Handle mouse locking
+    if (window->mouseLocked) {
+        int centerX = window->width / 2;
+        int centerY = window->height / 2;
+        
+        XWarpPointer(window->display, None, window->window, 0, 0, 0, 0, centerX, centerY);
+        XFlush(window->display);
+        
+        recenterMouse(window->input, centerX, centerY);
+    }
+}
+
+void pollEvents(WindowHandle* window) {
+    GRAPHICS_TRACE_SCOPE("pollEvents");
+    if (!window || headlessEvents(window) || !window->display) return;
+    
+    drainX11Events();
+    finishX11Events(window);
+}
+
+bool waitEvents(WindowHandle* window, int timeoutMs) {
+    GRAPHICS_TRACE_SCOPE("waitEvents");
+    if (!window || headlessEvents(window) || !window->display) return false;
+    
+    // Sleep on the connection socket until an event for this window arrives.
+    // Events for other windows are routed to them and do not end the wait.
+    // Another thread may drain this window's events, its wake pipe ends the
+    // wait then.
+    uint64_t deadline = timeoutMs < 0 ? 0 : getTimestamp() + static_cast<uint64_t>(timeoutMs) * 1000;
+    drainX11Events();
+    applyX11Events(window);
+    
+    while (!inputPending(window->input) && !window->shouldClose) {
+        int waitMs = -1;
+        if (timeoutMs >= 0) {
+            uint64_t now = getTimestamp();
+            if (now >= deadline) break;
+            waitMs = static_cast<int>((deadline - now + 999) / 1000);
+        }
+        
+        struct pollfd pfds[2];
+        pfds[0].fd = ConnectionNumber(window->display);
+        pfds[1].fd = window->wakePipe[0];  // Ignored by poll when negative
+        for (int i = 0; i < 2; i++) {
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+        poll(pfds, 2, waitMs);
+        
+        char bytes[64];
+        while (window->wakePipe[0] >= 0 && read(window->wakePipe[0], bytes, sizeof(bytes)) > 0) {}
+        drainX11Events();
+        applyX11Events(window);
+    }
+    
+    bool received = inputPending(window->input);
+    finishX11Events(window);
+    return received;
+}
+
+static Pixmap surfacePixmap(Surface* surface);
+
+// ============================================================================
+// XRENDER - X11
+// ============================================================================
+
+// With the RENDER extension, primitives are composited server-side: colours
+// blend by their alpha, lines and circles are antialiased, and scaled blits
+// and the canvas upscale become a single transformed composite. Without it
+// the core protocol requests below are used and alpha is ignored.
+
+// XRender colours are 16 bits per channel and premultiplied
+static XRenderColor renderColor(const Color& color) {
+    XRenderColor result;
+    result.red = static_cast<unsigned short>(color.r * color.a * 257 / 255);
+    result.green = static_cast<unsigned short>(color.g * color.a * 257 / 255);
+    result.blue = static_cast<unsigned short>(color.b * color.a * 257 / 255);
+    result.alpha = static_cast<unsigned short>(color.a * 257);
+    return result;
+}
+
+static void setupRender(WindowHandle* window) {
+    // GRAPHICS_NO_XRENDER keeps the window on the core protocol, so the two
+    // paths can be compared (examples/xrender_check.cpp)
+    const char* noRender = std::getenv("GRAPHICS_NO_XRENDER");
+    if (noRender && noRender[0] != '\0' && std::strcmp(noRender, "0") != 0) return;
+    
+    Display* display = window->display;
+    int eventBase, errorBase;
+    if (!XRenderQueryExtension(display, &eventBase, &errorBase)) return;
+    
+    // Solid fill pictures need RENDER 0.10
+    int major = 0, minor = 0;
+    if (!XRenderQueryVersion(display, &major, &minor) || (major == 0 && minor < 10)) return;
+    
+    int screen = DefaultScreen(display);
+    window->renderFormat = XRenderFindVisualFormat(display, DefaultVisual(display, screen));
+    window->maskFormat = XRenderFindStandardFormat(display, PictStandardA8);
+    if (!window->renderFormat || !window->maskFormat) return;
+    
+    window->backPicture = XRenderCreatePicture(display, window->backBuffer, window->renderFormat, 0, nullptr);
+    window->drawPicture = window->backPicture;
+    window->render = window->backPicture != 0;
+}
+
+static Picture surfacePicture(Surface* surface) {
+    if (!surface->picture) {
+        WindowHandle* window = surface->window;
+        surface->picture = XRenderCreatePicture(window->display, surfacePixmap(surface), window->renderFormat,
+                                                0, nullptr);
+    }
+    return surface->picture;
+}
+
+// Source picture of the given colour, kept while consecutive draws share it
+static Picture solidPicture(WindowHandle* window, const Color& color) {
+    if (window->solidPicture && sameColor(window->solidColor, color)) return window->solidPicture;
+    
+    if (window->solidPicture) XRenderFreePicture(window->display, window->solidPicture);
+    XRenderColor fill = renderColor(color);
+    window->solidPicture = XRenderCreateSolidFill(window->display, &fill);
+    window->solidColor = color;
+    return window->solidPicture;
+}
+
+static void renderFillRectangles(WindowHandle* window, const Color& color, const XRectangle* rects, int count) {
+    XRenderColor fill = renderColor(color);
+    XRenderFillRectangles(window->display, PictOpOver, window->drawPicture, &fill, rects, count);
+}
+
+static XPointFixed fixedPoint(double x, double y) {
+    XPointFixed point;
+    point.x = XDoubleToFixed(x);
+    point.y = XDoubleToFixed(y);
+    return point;
+}
+
+// One pixel wide antialiased line through the pixel centres, ends included
+static void renderLine(WindowHandle* window, int x1, int y1, int x2, int y2, const Color& color) {
+    double dx = x2 - x1, dy = y2 - y1;
+    double length = std::sqrt(dx * dx + dy * dy);
+    if (length == 0.0) {
+        XRectangle pixel = {static_cast<short>(x1), static_cast<short>(y1), 1, 1};
+        renderFillRectangles(window, color, &pixel, 1);
+        return;
+    }
+    
+    // Half a pixel along the line (ux, uy) and across it (-uy, ux)
+    double ux = dx / length * 0.5, uy = dy / length * 0.5;
+    double ax = x1 + 0.5 - ux, ay = y1 + 0.5 - uy;
+    double bx = x2 + 0.5 + ux, by = y2 + 0.5 + uy;
+    
+    XTriangle triangles[2];
+    triangles[0].p1 = fixedPoint(ax - uy, ay + ux);
+    triangles[0].p2 = fixedPoint(ax + uy, ay - ux);
+    triangles[0].p3 = fixedPoint(bx + uy, by - ux);
+    triangles[1].p1 = triangles[0].p1;
+    triangles[1].p2 = triangles[0].p3;
+    triangles[1].p3 = fixedPoint(bx - uy, by + ux);
+    XRenderCompositeTriangles(window->display, PictOpOver, solidPicture(window, color), window->drawPicture,
+                              window->maskFormat, 0, 0, triangles, 2);
+}
+
+const double TWO_PI = 6.283185307179586;
+
+static int circleSegments(int radius) {
+    return std::max(16, std::min(720, radius * 2));
+}
+
+// Ring between radius - 0.5 and radius + 0.5 around the centre pixel
+static void renderCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
+    int segments = circleSegments(radius);
+    double cx = centerX + 0.5, cy = centerY + 0.5;
+    double inner = std::max(0.0, radius - 0.5), outer = radius + 0.5;
+    
+    std::vector<XPointFixed>& strip = window->renderPoints;
+    strip.clear();
+    for (int i = 0; i <= segments; i++) {
+        double angle = TWO_PI * (i % segments) / segments;
+        double c = std::cos(angle), s = std::sin(angle);
+        strip.push_back(fixedPoint(cx + outer * c, cy + outer * s));
+        strip.push_back(fixedPoint(cx + inner * c, cy + inner * s));
+    }
+    XRenderCompositeTriStrip(window->display, PictOpOver, solidPicture(window, color), window->drawPicture,
+                             window->maskFormat, 0, 0, strip.data(), static_cast<int>(strip.size()));
+}
+
+// Disc covering the pixels whose centres lie within radius
+static void renderFilledCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
+    int segments = circleSegments(radius);
+    double cx = centerX + 0.5, cy = centerY + 0.5;
+    double r = radius + 0.5;
+    
+    std::vector<XPointFixed>& fan = window->renderPoints;
+    fan.clear();
+    fan.push_back(fixedPoint(cx, cy));
+    for (int i = 0; i <= segments; i++) {
+        double angle = TWO_PI * (i % segments) / segments;
+        fan.push_back(fixedPoint(cx + r * std::cos(angle), cy + r * std::sin(angle)));
+    }
+    XRenderCompositeTriFan(window->display, PictOpOver, solidPicture(window, color), window->drawPicture,
+                           window->maskFormat, 0, 0, fan.data(), static_cast<int>(fan.size()));
+}
+
+static void releaseCoverage(WindowHandle* window) {
+    if (window->coveragePicture) XRenderFreePicture(window->display, window->coveragePicture);
+    if (window->coveragePixmap) XFreePixmap(window->display, window->coveragePixmap);
+    if (window->coverageGC) XFreeGC(window->display, window->coverageGC);
+    window->coveragePicture = 0;
+    window->coveragePixmap = 0;
+    window->coverageGC = nullptr;
+    window->coverageWidth = window->coverageHeight = 0;
+}
+
+// The mask is put into an A8 pixmap and the colour composited through it. The
+// pixmap only grows, in steps of 256 pixels.
+static void renderCoverage(WindowHandle* window, const CoverageMask& mask, const Color& color) {
+    Display* display = window->display;
+    if (window->coverageWidth < mask.width || window->coverageHeight < mask.height) {
+        int width = (std::max(window->coverageWidth, mask.width) + 255) & ~255;
+        int height = (std::max(window->coverageHeight, mask.height) + 255) & ~255;
+        releaseCoverage(window);
+        
+        window->coveragePixmap = XCreatePixmap(display, window->window, width, height, 8);
+        window->coveragePicture = XRenderCreatePicture(display, window->coveragePixmap, window->maskFormat, 0,
+                                                       nullptr);
+        window->coverageGC = XCreateGC(display, window->coveragePixmap, 0, nullptr);
+        window->coverageWidth = width;
+        window->coverageHeight = height;
+    }
+    
+    // Wraps the mask without copying it, Xlib pads the rows as the server wants
+    int screen = DefaultScreen(display);
+    XImage* image = XCreateImage(display, DefaultVisual(display, screen), 8, ZPixmap, 0,
+                                 reinterpret_cast<char*>(const_cast<uint8_t*>(mask.coverage)), mask.width,
+                                 mask.height, 8, mask.width);
+    if (!image) return;
+    XPutImage(display, window->coveragePixmap, window->coverageGC, image, 0, 0, 0, 0, mask.width, mask.height);
+    image->data = nullptr;
+    XDestroyImage(image);
+    
+    XRenderComposite(display, PictOpOver, solidPicture(window, color), window->coveragePicture,
+                     window->drawPicture, 0, 0, 0, 0, mask.x, mask.y, mask.width, mask.height);
+}
+
+// Copies src of the source picture scaled into dst, nearest neighbour like
+// the other backends
+static void renderBlit(WindowHandle* window, Picture source, const Rect& src, const Rect& dst, Picture target) {
+    Display* display = window->display;
+    bool scaled = src.width != dst.width || src.height != dst.height;
+    
+    if (scaled) {
+        // Maps destination pixels back to the source, offset included
+        XTransform transform = {{
+            {XDoubleToFixed(static_cast<double>(src.width) / dst.width), 0, XDoubleToFixed(src.x)},
+            {0, XDoubleToFixed(static_cast<double>(src.height) / dst.height), XDoubleToFixed(src.y)},
+            {0, 0, XDoubleToFixed(1.0)}
+        }};
+        XRenderSetPictureTransform(display, source, &transform);
+        XRenderSetPictureFilter(display, source, FilterNearest, nullptr, 0);
+        XRenderComposite(display, PictOpSrc, source, None, target, 0, 0, 0, 0, dst.x, dst.y, dst.width,
+                         dst.height);
+        
+        XTransform identity = {{
+            {XDoubleToFixed(1.0), 0, 0},
+            {0, XDoubleToFixed(1.0), 0},
+            {0, 0, XDoubleToFixed(1.0)}
+        }};
+        XRenderSetPictureTransform(display, source, &identity);
+    } else {
+        XRenderComposite(display, PictOpSrc, source, None, target, src.x, src.y, 0, 0, dst.x, dst.y, dst.width,
+                         dst.height);
+    }
+}
+
+// The server maps destination pixel centres back into the picture, which is
+// transparent outside, and filters it. False when the mapping doesn't fit
+// Render's 16.16 matrix.
+static bool renderTransformed(WindowHandle* window, Picture source, const ImageTransform& t, bool bilinear) {
+    // Relative to the box, so the translation stays near the image
+    double cu = t.u0 + t.dudx * (t.x0 - 0.5) + t.dudy * (t.y0 - 0.5);
+    double cv = t.v0 + t.dvdx * (t.x0 - 0.5) + t.dvdy * (t.y0 - 0.5);
+    const double limit = 32767.0;
+    if (!(std::fabs(cu) < limit && std::fabs(cv) < limit && std::fabs(t.dudx) < limit &&
+          std::fabs(t.dudy) < limit && std::fabs(t.dvdx) < limit && std::fabs(t.dvdy) < limit)) return false;
+    
+    Display* display = window->display;
+    XTransform transform = {{
+        {XDoubleToFixed(t.dudx), XDoubleToFixed(t.dudy), XDoubleToFixed(cu)},
+        {XDoubleToFixed(t.dvdx), XDoubleToFixed(t.dvdy), XDoubleToFixed(cv)},
+        {0, 0, XDoubleToFixed(1.0)}
+    }};
+    XRenderSetPictureTransform(display, source, &transform);
+    XRenderSetPictureFilter(display, source, bilinear ? FilterBilinear : FilterNearest, nullptr, 0);
+    XRenderComposite(display, PictOpOver, source, None, window->drawPicture, 0, 0, 0, 0, t.x0, t.y0,
+                     t.x1 - t.x0, t.y1 - t.y0);
+    
+    XTransform identity = {{
+        {XDoubleToFixed(1.0), 0, 0},
+        {0, XDoubleToFixed(1.0), 0},
+        {0, 0, XDoubleToFixed(1.0)}
+    }};
+    XRenderSetPictureTransform(display, source, &identity);
+    XRenderSetPictureFilter(display, source, FilterNearest, nullptr, 0);
+    return true;
+}
+
+// Client-side image in the screen format, zero filled
+static XImage* createStagingImage(Display* display, int width, int height) {
+    int screen = DefaultScreen(display);
+    XImage* image = XCreateImage(display, DefaultVisual(display, screen), DefaultDepth(display, screen),
+                                 ZPixmap, 0, nullptr, width, height, 32, 0);
+    if (!image) return nullptr;
+    
+    size_t size = static_cast<size_t>(image->bytes_per_line) * image->height;
+    image->data = static_cast<char*>(std::calloc(size, 1));
+    if (!image->data) {
+        XDestroyImage(image);
+        return nullptr;
+    }
+    return image;
+}
+
+// XShmAttach fails asynchronously, e.g. on a remote display, so the error is
+// caught by a handler while attachShm waits for the reply
+static std::atomic<bool> shmAttachFailed(false);
+
+static int trapShmError(Display*, XErrorEvent*) {
+    shmAttachFailed = true;
+    return 0;
+}
+
+static void releaseShm(WindowHandle* window) {
+    if (!window->shmSize) return;
+    XShmDetach(window->display, &window->shm);
+    XSync(window->display, False);
+    shmdt(window->shm.shmaddr);
+    window->shmSize = 0;
+}
+
+// Gives the window a shared memory segment of at least size bytes that the
+// server is attached to. False if shared memory can't be used with it.
+static bool attachShm(WindowHandle* window, size_t size) {
+    if (window->shmFailed) return false;
+    if (window->shmSize >= size) return true;
+    releaseShm(window);
+    
+    Display* display = window->display;
+    XShmSegmentInfo& shm = window->shm;
+    shm.shmid = XShmQueryExtension(display) ? shmget(IPC_PRIVATE, size, IPC_CREAT | 0600) : -1;
+    if (shm.shmid < 0) {
+        window->shmFailed = true;
+        return false;
+    }
+    
+    shm.shmaddr = static_cast<char*>(shmat(shm.shmid, nullptr, 0));
+    shm.readOnly = False;
+    bool attached = false;
+    if (shm.shmaddr != reinterpret_cast<char*>(-1)) {
+        XSync(display, False);
+        shmAttachFailed = false;
+        XErrorHandler previous = XSetErrorHandler(trapShmError);
+        if (XShmAttach(display, &shm)) {
+            XSync(display, False);
+            attached = !shmAttachFailed;
+        }
+        XSetErrorHandler(previous);
+        if (!attached) shmdt(shm.shmaddr);
+    }
+    
+    // Removed once both sides have detached
+    shmctl(shm.shmid, IPC_RMID, nullptr);
+    window->shmFailed = !attached;
+    if (attached) window->shmSize = size;
+    return attached;
+}
+
+// XShmGetImage into the shared segment when the server can attach to it,
+// XGetImage otherwise. shared tells which one the image came from.
+static XImage* readImage(WindowHandle* window, Drawable drawable, const Rect& rect, bool& shared) {
+    Display* display = window->display;
+    int screen = DefaultScreen(display);
+    
+    shared = false;
+    if (!window->shmFailed) {
+        XImage* image = XShmCreateImage(display, DefaultVisual(display, screen), DefaultDepth(display, screen),
+                                        ZPixmap, nullptr, &window->shm, rect.width, rect.height);
+        if (image && attachShm(window, static_cast<size_t>(image->bytes_per_line) * image->height)) {
+            image->data = window->shm.shmaddr;
+            if (XShmGetImage(display, drawable, image, rect.x, rect.y, AllPlanes)) {
+                shared = true;
+                return image;
+            }
+            image->data = nullptr;
+        }
+        if (image) XDestroyImage(image);
+    }
+    return XGetImage(display, drawable, rect.x, rect.y, rect.width, rect.height, AllPlanes, ZPixmap);
+}
+
+// Reads rect of a drawable in the screen format as PIXEL_RGBA32 rows
+static bool readDrawable(WindowHandle* window, Drawable drawable, const Rect& rect, Color* dst, size_t pitch) {
+    if (!window->display || !window->trueColor) return false;
+    
+    bool shared;
+    XImage* image = readImage(window, drawable, rect, shared);
+    if (!image) return false;
+    
+    PixelLayout layout = window->visualLayout;
+    layout.bytesPerPixel = image->bits_per_pixel / 8;
+    bool hostOrder = image->byte_order == (hostIsLittleEndian() ? LSBFirst : MSBFirst);
+    bool direct = hostOrder && (layout.bytesPerPixel == 2 || layout.bytesPerPixel == 4);
+    
+    uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+    for (int y = 0; y < rect.height; y++) {
+        uint8_t* row = out + y * pitch;
+        if (direct) {
+            const uint8_t* src = reinterpret_cast<const uint8_t*>(image->data) + y * image->bytes_per_line;
+            unpackPixels(src, layout, row, rect.width);
+            continue;
+        }
+        
+        // Odd depths and foreign byte orders go through Xlib per pixel
+        PixelLayout word = layout;
+        word.bytesPerPixel = 4;
+        for (int x = 0; x < rect.width; x++) {
+            uint32_t pixel = static_cast<uint32_t>(XGetPixel(image, x, y));
+            unpackPixels(reinterpret_cast<const uint8_t*>(&pixel), word, row + x * 4, 1);
+        }
+    }
+    
+    if (shared) image->data = nullptr;
+    XDestroyImage(image);
+    return true;
+}
+
+static bool readTarget(WindowHandle* window, const Rect& rect, Color* dst, size_t pitch) {
+    return readDrawable(window, window->drawTarget, rect, dst, pitch);
+}
+
+// Puts PIXEL_RGBA32 rows pitch bytes apart into rect of the draw target
+static void writeTarget(WindowHandle* window, const Rect& rect, const Color* src, size_t pitch) {
+    XImage* image = createStagingImage(window->display, rect.width, rect.height);
+    if (!image) return;
+    
+    PixelLayout layout = window->visualLayout;
+    layout.bytesPerPixel = image->bits_per_pixel / 8;
+    bool hostOrder = image->byte_order == (hostIsLittleEndian() ? LSBFirst : MSBFirst);
+    bool direct = window->trueColor && hostOrder && (layout.bytesPerPixel == 2 || layout.bytesPerPixel == 4);
+    
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+    for (int y = 0; y < rect.height; y++) {
+        const Color* row = reinterpret_cast<const Color*>(in + y * pitch);
+        if (direct) {
+            packPixels(reinterpret_cast<const uint8_t*>(row),
+                       reinterpret_cast<uint8_t*>(image->data) + y * image->bytes_per_line, layout, rect.width);
+            continue;
+        }
+        for (int x = 0; x < rect.width; x++) XPutPixel(image, x, y, colorToPixel(window, row[x]));
+    }
+    
+    XPutImage(window->display, window->drawTarget, window->gc, image, 0, 0, rect.x, rect.y, rect.width,
+              rect.height);
+    XDestroyImage(image);
+}
+
+// Expands the indexed buffer into a staging image and puts it into the canvas
+// or the back buffer
+static void presentIndexed(WindowHandle* window) {
+    IndexedFramebuffer* fb = window->indexed;
+    if (!fb || !fb->enabled || fb->pixels.empty()) return;
+    
+    Display* display = window->display;
+    XImage* image = window->indexedImage;
+    if (image && (image->width != fb->width || image->height != fb->height)) {
+        XDestroyImage(image);
+        image = nullptr;
+    }
+    if (!image) image = window->indexedImage = createStagingImage(display, fb->width, fb->height);
+    if (!image) return;
+    
+    PixelLayout layout = window->visualLayout;
+    layout.bytesPerPixel = image->bits_per_pixel / 8;
+    bool hostOrder = image->byte_order == (hostIsLittleEndian() ? LSBFirst : MSBFirst);
+    
+    if (window->trueColor && hostOrder && (layout.bytesPerPixel == 2 || layout.bytesPerPixel == 4)) {
+        expandIndexed(*fb, layout, reinterpret_cast<uint8_t*>(image->data), image->bytes_per_line);
+    } else {
+        // Odd depths and pseudo colour visuals go through Xlib per pixel
+        unsigned long pixels[PALETTE_SIZE];
+        for (int i = 0; i < PALETTE_SIZE; i++) pixels[i] = colorToPixel(window, fb->palette[i]);
+        for (int y = 0; y < fb->height; y++) {
+            const uint8_t* row = &fb->pixels[static_cast<size_t>(y) * fb->width];
+            for (int x = 0; x < fb->width; x++) XPutPixel(image, x, y, pixels[row[x]]);
+        }
+    }
+    
+    Drawable dest = window->canvas ? surfacePixmap(window->canvas) : window->backBuffer;
+    XPutImage(display, dest, window->gc, image, 0, 0, 0, 0, fb->width, fb->height);
+}
+
+// With XRender the canvas is scaled by the server in one composite. The core
+// protocol can't scale, so there the canvas is read back, upscaled on the CPU
+// and put into the back buffer. Only the canvas crosses the wire twice, the
+// window-sized image is kept and its letterbox stays black.
+static void presentCanvas(WindowHandle* window) {
+    Display* display = window->display;
+    Surface* canvas = window->canvas;
+    CanvasView view = computeCanvasView(window->width, window->height, canvas->width, canvas->height);
+    
+    if (window->render) {
+        XRenderColor black = renderColor(Color(0, 0, 0));
+        XRenderFillRectangle(display, PictOpSrc, window->backPicture, &black, 0, 0, window->width, window->height);
+        
+        Rect src(0, 0, canvas->width, canvas->height);
+        Rect dst(view.x, view.y, canvas->width * view.scale, canvas->height * view.scale);
+        renderBlit(window, surfacePicture(canvas), src, dst, window->backPicture);
+        return;
+    }
+    
+    XImage* in = XGetImage(display, surfacePixmap(canvas), 0, 0, canvas->width, canvas->height,
+                           AllPlanes, ZPixmap);
+    if (!in) return;
+    
+    if (!window->canvasImage) window->canvasImage = createStagingImage(display, window->width, window->height);
+    
+    XImage* out = window->canvasImage;
+    if (out && out->bits_per_pixel == in->bits_per_pixel && in->bits_per_pixel % 8 == 0) {
+        // Crop whatever doesn't fit, a canvas larger than the window isn't scaled
+        int width = std::min(canvas->width, (window->width - view.x) / view.scale);
+        int height = std::min(canvas->height, (window->height - view.y) / view.scale);
+        int bytesPerPixel = in->bits_per_pixel / 8;
+        
+        upscaleNearest(reinterpret_cast<const uint8_t*>(in->data), in->bytes_per_line, width, height,
+                       bytesPerPixel,
+                       reinterpret_cast<uint8_t*>(out->data) + static_cast<size_t>(view.y) * out->bytes_per_line +
+                           static_cast<size_t>(view.x) * bytesPerPixel,
+                       out->bytes_per_line, view.scale);
+        XPutImage(display, window->backBuffer, window->gc, out, 0, 0, 0, 0, window->width, window->height);
+    }
+    XDestroyImage(in);
+}
+
+void swapBuffers(WindowHandle* window) {
+    GRAPHICS_TRACE_SCOPE("swapBuffers");
+    if (!window) return;
+    endFrame(window);
+    if (submitFrame(window->renderThread)) return;
+    captureReadbacks(window);
+    if (presentHeadless(window)) return;
+    if (!window->display || !window->gc) return;
+    
+    // The core protocol has no vsync, so every mode except immediate is paced
+    // here by a timer at the XRandR refresh rate. That caps the frame rate but
+    // isn't locked to the scanout, so frames can still tear.
+    PresentClock& present = window->present;
+    if (present.mode == PRESENT_CAPPED && !cappedFrameDue(present)) {
+        // The frame is dropped, its readbacks were captured above
+        finishReadbacks(window);
+        return;
+    }
+    bool synced = present.mode == PRESENT_VSYNC || present.mode == PRESENT_ADAPTIVE;
+    if (synced) waitForVBlank(present);
+    
+    // The clip applies to drawing, not to presenting the frame
+    applyNativeClip(window, false);
+    presentIndexed(window);
+    if (window->canvas) presentCanvas(window);
+    
+    // Copy back buffer to window
+    XCopyArea(window->display, window->backBuffer, window->window, window->gc,
+              0, 0, window->width, window->height, 0, 0);
+    applyNativeClip(window);
+    
+    if (synced) {
+        // Don't let frames queue up in the server ahead of the screen
+        XSync(window->display, False);
+    } else {
+        // Flush the output buffer
+        XFlush(window->display);
+    }
+    finishReadbacks(window);
+}
+
+void setPresentMode(WindowHandle* window, PresentMode mode) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_PRESENT_MODE, mode, 0, 0, 0, Color(0, 0, 0))) return;
+    window->present.mode = mode;
+}
+
+void clearScreen(WindowHandle* window, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_CLEAR, 0, 0, 0, 0, color)) return;
+    if (drawSoftware(window, CMD_CLEAR, 0, 0, 0, 0, color)) return;
+    if (!window->display || !window->gc) return;
+    
+    int width, height;
+    getTargetSize(window, width, height);
+    
+    // Clearing ignores the clip rectangle, as on the other backends
+    applyNativeClip(window, false);
+    if (window->render) {
+        // Clearing replaces the contents, like the other backends it ignores alpha
+        XRenderColor fill = renderColor(Color(color.r, color.g, color.b, 255));
+        XRenderFillRectangle(window->display, PictOpSrc, window->drawPicture, &fill, 0, 0, width, height);
+    } else {
+        unsigned long pixel = colorToPixel(window, color);
+        XSetForeground(window->display, window->gc, pixel);
+        XFillRectangle(window->display, window->drawTarget, window->gc, 0, 0, width, height);
+        
+        // Keep the current draw color for the other primitives
+        XSetForeground(window->display, window->gc, window->currentColor);
+    }
+    applyNativeClip(window);
+}
+
+void setDrawColor(WindowHandle* window, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_COLOR, 0, 0, 0, 0, color)) return;
+    if (!window->display || !window->gc) return;
+    
+    window->currentColor = colorToPixel(window, color);
+    XSetForeground(window->display, window->gc, window->currentColor);
+}
+
+void drawLine(WindowHandle* window, int x1, int y1, int x2, int y2, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_LINE, x1, y1, x2, y2, color)) return;
+    if (drawSoftware(window, CMD_LINE, x1, y1, x2, y2, color)) return;
+    if (!window->display || !window->gc) return;
+    LineWalk walk;
+    if (!clipLine(window->clip, x1, y1, x2, y2, walk)) return;
+    
+    // Grid lines are pixel aligned rectangles, anti-aliasing would not change them
+    Rect line;
+    bool axisAligned = axisLineRect(walk, line);
+    
+    // The protocol carries 16 bit coordinates. Longer lines can't be handed
+    // to the server whole, so their visible pixels go out as points.
+    if (!axisAligned && !lineFits(x1, y1, x2, y2, X11_LINE_LIMIT)) {
+        std::vector<XPoint>& points = window->pointScratch;
+        points.clear();
+        walkLine(walk, [&](int x, int y) {
+            XPoint point;
+            point.x = static_cast<short>(x);
+            point.y = static_cast<short>(y);
+            points.push_back(point);
+        });
+        setDrawColor(window, color);
+        XDrawPoints(window->display, window->drawTarget, window->gc, points.data(), static_cast<int>(points.size()),
+                    CoordModeOrigin);
+        return;
+    }
+    
+    if (window->render) {
+        if (axisAligned) {
+            XRectangle rect = {static_cast<short>(line.x), static_cast<short>(line.y),
+                               static_cast<unsigned short>(line.width), static_cast<unsigned short>(line.height)};
+            renderFillRectangles(window, color, &rect, 1);
+        } else {
+            renderLine(window, x1, y1, x2, y2, color);
         }
-            
-        case WM_KEYUP:
-        case WM_SYSKEYUP: {
-            if (handle) {
-                KeyCode key = mapWin32Key(wParam);
-                if (key != KEY_UNKNOWN && key < KEY_COUNT) {
-                    handle->keyState[key] = false;
-                }
+        return;
+    }
+    
+    setDrawColor(window, color);
+    if (axisAligned) {
+        XFillRectangle(window->display, window->drawTarget, window->gc, line.x, line.y, line.width, line.height);
+    } else {
+        XDrawLine(window->display, window->drawTarget, window->gc, x1, y1, x2, y2);
+    }
+}
+
+void drawRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_RECTANGLE, x, y, width, height, color)) return;
+    if (drawSoftware(window, CMD_RECTANGLE, x, y, width, height, color)) return;
+    if (!window->display || !window->gc) return;
+    // XDrawRectangle draws its edges at x + width and y + height
+    if (rectOutlineOutsideClip(window->clip, x, y, static_cast<long long>(x) + width,
+                               static_cast<long long>(y) + height)) return;
+    
+    if (window->render) {
+        // Same pixels as XDrawRectangle, as four edges that don't overlap
+        XRectangle edges[4] = {
+            {static_cast<short>(x), static_cast<short>(y), static_cast<unsigned short>(width + 1), 1},
+            {static_cast<short>(x), static_cast<short>(y + height), static_cast<unsigned short>(width + 1), 1},
+            {static_cast<short>(x), static_cast<short>(y + 1), 1, static_cast<unsigned short>(height - 1)},
+            {static_cast<short>(x + width), static_cast<short>(y + 1), 1, static_cast<unsigned short>(height - 1)}
+        };
+        renderFillRectangles(window, color, edges, height > 0 ? 4 : 1);
+        return;
+    }
+    
+    setDrawColor(window, color);
+    XDrawRectangle(window->display, window->drawTarget, window->gc, x, y, width, height);
+}
+
+void drawFilledRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_FILLED_RECTANGLE, x, y, width, height, color)) return;
+    if (drawSoftware(window, CMD_FILLED_RECTANGLE, x, y, width, height, color)) return;
+    if (!window->display || !window->gc) return;
+    if (!clipRectangle(window->clip, x, y, width, height)) return;
+    
+    if (window->render) {
+        XRenderColor fill = renderColor(color);
+        XRenderFillRectangle(window->display, PictOpOver, window->drawPicture, &fill, x, y, width, height);
+        return;
+    }
+    
+    setDrawColor(window, color);
+    XFillRectangle(window->display, window->drawTarget, window->gc, x, y, width, height);
+}
+
+void drawPixel(WindowHandle* window, int x, int y, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_PIXEL, x, y, 0, 0, color)) return;
+    if (drawSoftware(window, CMD_PIXEL, x, y, 0, 0, color)) return;
+    if (!window->display || !window->gc) return;
+    if (!pointInClip(window->clip, x, y)) return;
+    
+    if (window->render) {
+        XRectangle pixel = {static_cast<short>(x), static_cast<short>(y), 1, 1};
+        renderFillRectangles(window, color, &pixel, 1);
+        return;
+    }
+    
+    setDrawColor(window, color);
+    XDrawPoint(window->display, window->drawTarget, window->gc, x, y);
+}
+
+// Consecutive points of one colour go out as a single XDrawPoints request, or
+// as one XRenderFillRectangles of 1x1 rectangles
+static void drawBatchPoints(WindowHandle* window, const BatchPoint* points, int count) {
+    if (!window->display || !window->gc) return;
+    
+    if (window->render) {
+        std::vector<XRectangle>& rects = window->renderRects;
+        for (int i = 0; i < count;) {
+            const Color& color = points[i].color;
+            rects.clear();
+            for (; i < count && sameColor(points[i].color, color); i++) {
+                if (!pointInClip(window->clip, points[i].x, points[i].y)) continue;
+                XRectangle pixel = {static_cast<short>(points[i].x), static_cast<short>(points[i].y), 1, 1};
+                rects.push_back(pixel);
             }
-            return 0;
+            if (!rects.empty()) renderFillRectangles(window, color, rects.data(), static_cast<int>(rects.size()));
+        }
+        return;
+    }
+    
+    std::vector<XPoint>& run = window->pointScratch;
+    for (int i = 0; i < count;) {
+        const Color& color = points[i].color;
+        run.clear();
+        for (; i < count && sameColor(points[i].color, color); i++) {
+            if (!pointInClip(window->clip, points[i].x, points[i].y)) continue;
+            XPoint point;
+            point.x = static_cast<short>(points[i].x);
+            point.y = static_cast<short>(points[i].y);
+            run.push_back(point);
         }
+        if (run.empty()) continue;
         
-        case WM_LBUTTONDOWN:
-            if (handle) handle->mouseState[MOUSE_LEFT] = true;
-            return 0;
-            
-        case WM_LBUTTONUP:
-            if (handle) handle->mouseState[MOUSE_LEFT] = false;
-            return 0;
-            
-        case WM_RBUTTONDOWN:
-            if (handle) handle->mouseState[MOUSE_RIGHT] = true;
-            return 0;
-            
-        case WM_RBUTTONUP:
-            if (handle) handle->mouseState[MOUSE_RIGHT] = false;
-            return 0;
-            
-        case WM_MBUTTONDOWN:
-            if (handle) handle->mouseState[MOUSE_MIDDLE] = true;
-            return 0;
-            
-        case WM_MBUTTONUP:
-            if (handle) handle->mouseState[MOUSE_MIDDLE] = false;
-            return 0;
-            
-        case WM_MOUSEMOVE:
-            if (handle) {
-                handle->mouseX = LOWORD(lParam);
-                handle->mouseY = HIWORD(lParam);
-            }
-            return 0;
-            
-        case WM_MOUSEWHEEL:
-            if (handle) {
-                handle->mouseWheelDelta = GET_WHEEL_DELTA_WPARAM(wParam) / WHEEL_DELTA;
-            }
-            return 0;
-            
-        case WM_PAINT: {
-            PAINTSTRUCT ps;
-            HDC hdc = BeginPaint(hwnd, &ps);
-            // Will be handled by swapBuffers
-            EndPaint(hwnd, &ps);
-            return 0;
+        setDrawColor(window, color);
+        XDrawPoints(window->display, window->drawTarget, window->gc, run.data(), static_cast<int>(run.size()),
+                    CoordModeOrigin);
+    }
+}
+
+void drawCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (drawSoftware(window, CMD_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (!window->display || !window->gc) return;
+    if (circleOutsideClip(window->clip, centerX, centerY, radius)) return;
+    if (clipInsideCircle(window->clip, centerX, centerY, radius)) return;
+    
+    if (window->render) {
+        renderCircle(window, centerX, centerY, radius, color);
+        return;
+    }
+    
+    // All octants go out as one XDrawPoints request
+    std::vector<XPoint>& points = window->pointScratch;
+    points.clear();
+    rasterCircle(window->clip, centerX, centerY, radius, [&](int x, int y) {
+        XPoint point;
+        point.x = static_cast<short>(x);
+        point.y = static_cast<short>(y);
+        points.push_back(point);
+    });
+    if (points.empty()) return;
+    
+    setDrawColor(window, color);
+    XDrawPoints(window->display, window->drawTarget, window->gc, points.data(), static_cast<int>(points.size()),
+                CoordModeOrigin);
+}
+
+void drawFilledCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_FILLED_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (drawSoftware(window, CMD_FILLED_CIRCLE, centerX, centerY, radius, 0, color)) return;
+    if (!window->display || !window->gc) return;
+    if (circleOutsideClip(window->clip, centerX, centerY, radius)) return;
+    
+    if (window->render) {
+        renderFilledCircle(window, centerX, centerY, radius, color);
+        return;
+    }
+    
+    setDrawColor(window, color);
+    
+    // X11 has XFillArc which is more efficient
+    XFillArc(window->display, window->drawTarget, window->gc,
+             centerX - radius, centerY - radius,
+             radius * 2, radius * 2,
+             0, 360 * 64);  // Angles in X11 are in 1/64ths of a degree
+}
+
+// The core protocol has no alpha, there the pixels at least half covered are
+// filled as one rectangle per run
+static void drawCoverage(WindowHandle* window, const CoverageMask& mask, const Color& color) {
+    if (!window->display || !window->gc) return;
+    
+    if (window->render) {
+        renderCoverage(window, mask, color);
+        return;
+    }
+    
+    std::vector<XRectangle>& rects = window->renderRects;
+    rects.clear();
+    coverageRuns(mask, [&](int x0, int x1, int y) {
+        XRectangle rect = {static_cast<short>(x0), static_cast<short>(y), static_cast<unsigned short>(x1 - x0 + 1), 1};
+        rects.push_back(rect);
+    });
+    if (rects.empty()) return;
+    
+    setDrawColor(window, color);
+    XFillRectangles(window->display, window->drawTarget, window->gc, rects.data(), static_cast<int>(rects.size()));
+}
+
+// ============================================================================
+// OFFSCREEN SURFACES - X11
+// ============================================================================
+
+Surface* createSurface(WindowHandle* window, int width, int height) {
+    if (!window || window->headless || width <= 0 || height <= 0) return nullptr;
+    
+    Surface* surface = new Surface();
+    surface->window = window;
+    surface->width = width;
+    surface->height = height;
+    window->surfaces.push_back(surface);
+    return surface;
+}
+
+static Pixmap surfacePixmap(Surface* surface) {
+    if (surface->pixmap) return surface->pixmap;
+    
+    WindowHandle* window = surface->window;
+    int screen = DefaultScreen(window->display);
+    surface->pixmap = XCreatePixmap(window->display, window->window, surface->width, surface->height,
+                                    DefaultDepth(window->display, screen));
+    
+    // Pixmap contents are undefined, new surfaces start black
+    bool clipped = window->nativeClip;
+    applyNativeClip(window, false);
+    XSetForeground(window->display, window->gc, BlackPixel(window->display, screen));
+    XFillRectangle(window->display, surface->pixmap, window->gc, 0, 0, surface->width, surface->height);
+    XSetForeground(window->display, window->gc, window->currentColor);
+    if (clipped) applyNativeClip(window);
+    return surface->pixmap;
+}
+
+// Points the drawing functions and the clip rectangle at the current draw surface
+static void bindTarget(WindowHandle* window) {
+    Surface* surface = drawSurface(window);
+    applyNativeClip(window, false);
+    window->drawTarget = surface ? surfacePixmap(surface) : window->backBuffer;
+    if (window->render) window->drawPicture = surface ? surfacePicture(surface) : window->backPicture;
+    updateClip(window);
+}
+
+// The clip lives on the GC and, with XRender, on the draw picture. It is
+// removed from both before either is pointed elsewhere.
+static void applyNativeClip(WindowHandle* window, bool enabled) {
+    if (!window->display || !window->gc) return;
+    if (!enabled || window->clipStack.empty()) {
+        if (!window->nativeClip) return;
+        XSetClipMask(window->display, window->gc, None);
+        if (window->drawPicture) {
+            XRenderPictureAttributes attributes;
+            attributes.clip_mask = None;
+            XRenderChangePicture(window->display, window->drawPicture, CPClipMask, &attributes);
+        }
+        window->nativeClip = false;
+        return;
+    }
+    
+    // No rectangles at all clips everything away
+    const ClipRect& clip = window->clip;
+    XRectangle rect = {static_cast<short>(clip.x0), static_cast<short>(clip.y0),
+                       static_cast<unsigned short>(clip.x1 - clip.x0),
+                       static_cast<unsigned short>(clip.y1 - clip.y0)};
+    int count = clip.x0 < clip.x1 ? 1 : 0;
+    XSetClipRectangles(window->display, window->gc, 0, 0, &rect, count, YXBanded);
+    if (window->drawPicture) {
+        XRenderSetPictureClipRectangles(window->display, window->drawPicture, 0, 0, &rect, count);
+    }
+    window->nativeClip = true;
+}
+
+static void freeSurface(Surface* surface) {
+    WindowHandle* window = surface->window;
+    if (window->target == surface) setRenderTarget(window, nullptr);
+    if (window->canvas == surface) setCanvas(window, nullptr);
+    
+    if (surface->picture) XRenderFreePicture(window->display, surface->picture);
+    if (surface->pixmap) XFreePixmap(window->display, surface->pixmap);
+    delete surface;
+}
+
+// Images are decoded into a staging image in the visual's pixel layout and
+// put into the surface's pixmap. Visuals without a fast path get RGBA pixels
+// that are converted through Xlib.
+static bool beginImageUpload(WindowHandle* window, int width, int height, ImageUpload& upload) {
+    if (!window->display) return false;
+    Surface* surface = createSurface(window, width, height);
+    if (!surface) return false;
+    
+    XImage* image = createStagingImage(window->display, width, height);
+    if (!image) {
+        destroySurface(surface);
+        return false;
+    }
+    
+    PixelLayout layout = window->visualLayout;
+    layout.bytesPerPixel = image->bits_per_pixel / 8;
+    bool hostOrder = image->byte_order == (hostIsLittleEndian() ? LSBFirst : MSBFirst);
+    
+    upload.surface = surface;
+    upload.staging = image;
+    if (window->trueColor && hostOrder && (layout.bytesPerPixel == 2 || layout.bytesPerPixel == 4)) {
+        upload.pixels = reinterpret_cast<uint8_t*>(image->data);
+        upload.pitch = image->bytes_per_line;
+        upload.layout = layout;
+    } else {
+        upload.fallback.resize(static_cast<size_t>(width) * height);
+        upload.pixels = reinterpret_cast<uint8_t*>(upload.fallback.data());
+        upload.pitch = static_cast<size_t>(width) * sizeof(Color);
+    }
+    return true;
+}
+
+static void finishImageUpload(WindowHandle* window, ImageUpload& upload, bool decoded) {
+    XImage* image = static_cast<XImage*>(upload.staging);
+    Surface* surface = upload.surface;
+    
+    if (decoded) {
+        Display* display = window->display;
+        for (size_t i = 0; i < upload.fallback.size(); i++) {
+            int x = static_cast<int>(i % surface->width), y = static_cast<int>(i / surface->width);
+            XPutPixel(image, x, y, colorToPixel(window, upload.fallback[i]));
         }
         
-        case WM_DESTROY:
-            PostQuitMessage(0);
-            return 0;
+        // A GC of its own, window->gc may be in use by the render thread
+        surface->pixmap = XCreatePixmap(display, window->window, surface->width, surface->height,
+                                        DefaultDepth(display, DefaultScreen(display)));
+        GC gc = XCreateGC(display, surface->pixmap, 0, nullptr);
+        XPutImage(display, surface->pixmap, gc, image, 0, 0, 0, 0, surface->width, surface->height);
+        XFreeGC(display, gc);
+    }
+    
+    XDestroyImage(image);
+    if (!decoded) destroySurface(surface);
+}
+
+void setRenderTarget(WindowHandle* window, Surface* surface) {
+    if (!window || (surface && surface->window != window)) return;
+    if (deferSurfaceCommand(window->renderThread, CMD_SET_TARGET, surface)) return;
+    if (!window->display || !window->gc) return;
+    
+    window->target = surface;
+    bindTarget(window);
+}
+
+static void setCanvas(WindowHandle* window, Surface* canvas) {
+    window->canvas = canvas;
+    bindTarget(window);
+    
+    if (!canvas && window->canvasImage) {
+        XDestroyImage(window->canvasImage);
+        window->canvasImage = nullptr;
+    }
+}
+
+// The core protocol can't scale, so scaled blits are resampled (nearest
+// neighbour) through client memory, limited to the visible destination.
+static void blitScaled(WindowHandle* window, Pixmap source, const Rect& src, const Rect& dst) {
+    int x = dst.x, y = dst.y, width = dst.width, height = dst.height;
+    if (!clipRectangle(window->clip, x, y, width, height)) return;
+    
+    Display* display = window->display;
+    XImage* in = XGetImage(display, source, src.x, src.y, src.width, src.height, AllPlanes, ZPixmap);
+    if (!in) return;
+    
+    int screen = DefaultScreen(display);
+    XImage* out = XCreateImage(display, DefaultVisual(display, screen), DefaultDepth(display, screen),
+                               ZPixmap, 0, nullptr, width, height, 32, 0);
+    if (!out) {
+        XDestroyImage(in);
+        return;
+    }
+    out->data = static_cast<char*>(std::malloc(static_cast<size_t>(out->bytes_per_line) * height));
+    if (!out->data) {
+        XDestroyImage(out);
+        XDestroyImage(in);
+        return;
+    }
+    
+    for (int row = 0; row < height; row++) {
+        long long sy = static_cast<long long>(y + row - dst.y) * src.height / dst.height;
+        for (int col = 0; col < width; col++) {
+            long long sx = static_cast<long long>(x + col - dst.x) * src.width / dst.width;
+            XPutPixel(out, col, row, XGetPixel(in, static_cast<int>(sx), static_cast<int>(sy)));
+        }
+    }
+    
+    XPutImage(display, window->drawTarget, window->gc, out, 0, 0, x, y, width, height);
+    XDestroyImage(out);
+    XDestroyImage(in);
+}
+
+void blitSurface(WindowHandle* window, Surface* surface, const Rect* srcRect, const Rect* dstRect) {
+    if (!window || !surface || surface->window != window) return;
+    touchImage(window->imageCache, surface);
+    if (deferSurfaceCommand(window->renderThread, CMD_BLIT, surface, srcRect, dstRect)) return;
+    if (drawSoftware(window, CMD_BLIT, 0, 0, 0, 0, Color())) return;
+    if (!window->display || !window->gc || surface == drawSurface(window)) return;
+    
+    int targetWidth, targetHeight;
+    getTargetSize(window, targetWidth, targetHeight);
+    Rect src, dst;
+    if (!resolveBlitRects(srcRect, dstRect, surface->width, surface->height,
+                          targetWidth, targetHeight, src, dst)) return;
+    
+    if (window->render) {
+        renderBlit(window, surfacePicture(surface), src, dst, window->drawPicture);
+        return;
+    }
+    
+    Pixmap pixmap = surfacePixmap(surface);
+    if (src.width == dst.width && src.height == dst.height) {
+        XCopyArea(window->display, pixmap, window->drawTarget, window->gc,
+                  src.x, src.y, src.width, src.height, dst.x, dst.y);
+    } else {
+        blitScaled(window, pixmap, src, dst);
+    }
+}
+
+// XRender transforms on the server. The core protocol can't, there the box
+// the image may cover is read back, drawn into on the CPU and put back, which
+// needs a TrueColor visual. Surfaces are opaque, their pixels need no
+// premultiplying.
+void drawImageTransformed(WindowHandle* window, Surface* image, float x, float y, float angle, float scaleX,
+                          float scaleY, ImageFilter filter) {
+    if (!window || !image || image->window != window) return;
+    touchImage(window->imageCache, image);
+    if (deferImageTransform(window->renderThread, image, x, y, angle, scaleX, scaleY, filter)) return;
+    if (drawSoftware(window, CMD_DRAW_IMAGE, 0, 0, 0, 0, Color())) return;
+    if (!window->display || !window->gc || image == drawSurface(window)) return;
+    
+    bool bilinear = filter == FILTER_BILINEAR;
+    ImageTransform t;
+    if (!setupImageTransform(image->width, image->height, x, y, angle, scaleX, scaleY, bilinear, window->clip,
+                             t)) return;
+    if (window->render && renderTransformed(window, surfacePicture(image), t, bilinear)) return;
+    
+    std::vector<Color>& source = window->imagePixels;
+    source.resize(static_cast<size_t>(image->width) * image->height);
+    if (!readDrawable(window, surfacePixmap(image), Rect(0, 0, image->width, image->height), source.data(),
+                      static_cast<size_t>(image->width) * 4)) return;
+    
+    Rect box(t.x0, t.y0, t.x1 - t.x0, t.y1 - t.y0);
+    std::vector<Color>& pixels = window->targetPixels;
+    pixels.resize(static_cast<size_t>(box.width) * box.height);
+    if (!readTarget(window, box, pixels.data(), static_cast<size_t>(box.width) * 4)) return;
+    
+    ImagePixels texels = {source.data(), image->width, image->height, static_cast<size_t>(image->width)};
+    transformImage(texels, t, bilinear, pixels.data(), box.width);
+    writeTarget(window, box, pixels.data(), static_cast<size_t>(box.width) * 4);
+}
+
+void delay(uint32_t milliseconds) {
+    usleep(milliseconds * 1000);
+}
+
+// ============================================================================
+// INPUT HANDLING - X11
+// ============================================================================
+
+void setMousePosition(WindowHandle* window, int x, int y) {
+    if (!window || !window->display) return;
+    
+    XWarpPointer(window->display, None, window->window, 0, 0, 0, 0,
+                 logicalToWindowX(window->input, x), logicalToWindowY(window->input, y));
+    XFlush(window->display);
+    
+    window->input.mouseX = x;
+    window->input.mouseY = y;
+}
+
+void setMouseLocked(WindowHandle* window, bool locked) {
+    if (!window || !window->display) return;
+    window->mouseLocked = locked;
+    
+    if (locked) {
+        // Hide cursor
+        Cursor invisibleCursor;
+        Pixmap bitmapNoData;
+        XColor black;
+        static char noData[] = {0,0,0,0,0,0,0,0};
+        black.red = black.green = black.blue = 0;
+        
+        bitmapNoData = XCreateBitmapFromData(window->display, window->window, noData, 8, 8);
+        invisibleCursor = XCreatePixmapCursor(window->display, bitmapNoData, bitmapNoData,
+                                             &black, &black, 0, 0);
+        XDefineCursor(window->display, window->window, invisibleCursor);
+        XFreeCursor(window->display, invisibleCursor);
+        XFreePixmap(window->display, bitmapNoData);
+    } else {
+        XUndefineCursor(window->display, window->window);
+    }
+}
+
+#endif // USE_X11
+
+// ============================================================================
+// INPUT HANDLING - shared by all backends
+// ============================================================================
+
+bool keyDown(WindowHandle* window, KeyCode key) {
+    if (!window || key >= KEY_COUNT) return false;
+    return window->input.keyState[key];
+}
+
+bool keyPressed(WindowHandle* window, KeyCode key) {
+    if (!window || key >= KEY_COUNT) return false;
+    return window->input.keyHit[key];
+}
+
+bool keyReleased(WindowHandle* window, KeyCode key) {
+    if (!window || key >= KEY_COUNT) return false;
+    return window->input.keyLifted[key];
+}
+
+bool mouseDown(WindowHandle* window, MouseButton button) {
+    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
+    return window->input.mouseState[button];
+}
+
+bool mousePressed(WindowHandle* window, MouseButton button) {
+    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
+    return window->input.mouseHit[button];
+}
+
+bool mouseReleased(WindowHandle* window, MouseButton button) {
+    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
+    return window->input.mouseLifted[button];
+}
+
+void getMousePosition(WindowHandle* window, int& x, int& y) {
+    if (!window) {
+        x = y = 0;
+        return;
+    }
+    x = window->input.mouseX;
+    y = window->input.mouseY;
+}
+
+void getMouseDelta(WindowHandle* window, int& dx, int& dy) {
+    if (!window) {
+        dx = dy = 0;
+        return;
     }
+    dx = window->input.mouseDeltaX;
+    dy = window->input.mouseDeltaY;
+}
+
+bool isMouseLocked(WindowHandle* window) {
+    if (!window) return false;
+    return window->mouseLocked;
+}
+
+int getMouseWheelDelta(WindowHandle* window) {
+    if (!window) return 0;
+    return window->input.mouseWheelDelta;
+}
+
+bool nextEvent(WindowHandle* window, Event* event) {
+    if (!window || !event || window->input.events.empty()) return false;
     
-    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+    *event = window->input.events.front();
+    window->input.events.pop_front();
+    return true;
 }
 
-WindowHandle* createWindow(const char* title, int width, int height) {
-    // Register window class if not already registered
-    if (!classRegistered) {
-        WNDCLASSA wc = {};
-        wc.lpfnWndProc = WindowProc;
-        wc.hInstance = GetModuleHandle(nullptr);
-        wc.lpszClassName = WINDOW_CLASS_NAME;
-        wc.hCursor = LoadCursor(nullptr, IDC_ARROW);
-        wc.hbrBackground = (HBRUSH)GetStockObject(BLACK_BRUSH);
-        
-        if (!RegisterClassA(&wc)) {
-            return nullptr;
+// The header holds the state held down when recording started, so a replay
+// begins from the same input state
+static void writeRecordingHeader(const InputState& input, std::vector<uint8_t>& out) {
+    for (int i = 0; i < 4; i++) out.push_back(static_cast<uint8_t>(INPUT_RECORDING_MAGIC >> (i * 8)));
+    for (int i = 0; i < 4; i++) out.push_back(static_cast<uint8_t>(INPUT_RECORDING_VERSION >> (i * 8)));
+    
+    putVarint(out, input.mouseX);
+    putVarint(out, input.mouseY);
+    putVarint(out, KEY_COUNT);
+    for (int key = 0; key < KEY_COUNT; key += 8) {
+        uint8_t bits = 0;
+        for (int i = 0; i < 8 && key + i < KEY_COUNT; i++) {
+            if (input.keyState[key + i]) bits |= 1 << i;
         }
-        classRegistered = true;
+        out.push_back(bits);
+    }
+    uint8_t buttons = 0;
+    for (int i = 0; i < MOUSE_BUTTON_COUNT; i++) {
+        if (input.mouseState[i]) buttons |= 1 << i;
+    }
+    out.push_back(buttons);
+}
+
+static bool readRecordingHeader(InputState& input, InputReplay& replay) {
+    const std::vector<uint8_t>& data = replay.data;
+    if (data.size() < 8 || readLE32(&data[0]) != INPUT_RECORDING_MAGIC ||
+        readLE32(&data[4]) != INPUT_RECORDING_VERSION) {
+        return false;
     }
     
-    WindowHandle* handle = new WindowHandle();
-    handle->width = width;
-    handle->height = height;
-    
-    // Create window
-    handle->hwnd = CreateWindowExA(
-        0,
-        WINDOW_CLASS_NAME,
-        title,
-        WS_OVERLAPPEDWINDOW,
-        CW_USEDEFAULT, CW_USEDEFAULT,
-        width, height,
-        nullptr,
-        nullptr,
-        GetModuleHandle(nullptr),
-        nullptr
-    );
+    size_t pos = 8;
+    int x, y, keyCount;
+    if (!getVarint(data, pos, x) || !getVarint(data, pos, y) || !getVarint(data, pos, keyCount) ||
+        keyCount < 0 || keyCount > KEY_COUNT || data.size() - pos < static_cast<size_t>(keyCount + 7) / 8 + 1) {
+        return false;
+    }
     
-    if (!handle->hwnd) {
-        delete handle;
-        return nullptr;
+    // Taken over silently: nothing was pressed or released by the replay yet
+    memset(input.keyState, 0, sizeof(input.keyState));
+    for (int key = 0; key < keyCount; key++) {
+        input.keyState[key] = (data[pos + key / 8] >> (key % 8)) & 1;
     }
+    pos += (keyCount + 7) / 8;
+    for (int i = 0; i < MOUSE_BUTTON_COUNT; i++) {
+        input.mouseState[i] = (data[pos] >> i) & 1;
+    }
+    pos++;
     
-    // Store handle in window user data
-    SetWindowLongPtr(handle->hwnd, GWLP_USERDATA, (LONG_PTR)handle);
+    memset(input.pendingKeyHit, 0, sizeof(input.pendingKeyHit));
+    memset(input.pendingKeyLifted, 0, sizeof(input.pendingKeyLifted));
+    memset(input.pendingMouseHit, 0, sizeof(input.pendingMouseHit));
+    memset(input.pendingMouseLifted, 0, sizeof(input.pendingMouseLifted));
+    input.pendingWheel = 0;
+    input.mouseX = input.prevMouseX = replay.lastX = x;
+    input.mouseY = input.prevMouseY = replay.lastY = y;
+    replay.pos = pos;
+    return true;
+}
+
+bool startInputRecording(WindowHandle* window, const char* path) {
+    if (!window || !path) return false;
+    stopInputRecording(window);
     
-    // Get device context
-    handle->hdc = GetDC(handle->hwnd);
+    FILE* file = std::fopen(path, "wb");
+    if (!file) return false;
     
-    // Create memory DC for double buffering
-    handle->memDC = CreateCompatibleDC(handle->hdc);
-    handle->memBitmap = CreateCompatibleBitmap(handle->hdc, width, height);
-    handle->oldBitmap = (HBITMAP)SelectObject(handle->memDC, handle->memBitmap);
+    InputState& input = window->input;
+    std::vector<uint8_t> header;
+    writeRecordingHeader(input, header);
+    if (std::fwrite(header.data(), 1, header.size(), file) != header.size()) {
+        std::fclose(file);
+        return false;
+    }
     
-    // Show window
-    ShowWindow(handle->hwnd, SW_SHOW);
-    UpdateWindow(handle->hwnd);
+    input.recording = new InputRecording();
+    input.recording->file = file;
+    input.recording->lastX = input.mouseX;
+    input.recording->lastY = input.mouseY;
+    return true;
+}
+
+// Input after the last published frame is not part of the recording
+bool stopInputRecording(WindowHandle* window) {
+    if (!window || !window->input.recording) return false;
     
-    return handle;
+    InputRecording* recording = window->input.recording;
+    bool ok = !std::ferror(recording->file);
+    ok = std::fclose(recording->file) == 0 && ok;
+    delete recording;
+    window->input.recording = nullptr;
+    return ok;
 }
 
-void destroyWindow(WindowHandle* window) {
-    if (!window) return;
+bool startInputReplay(WindowHandle* window, const char* path) {
+    if (!window || !path) return false;
     
-    if (window->memDC) {
-        if (window->oldBitmap) {
-            SelectObject(window->memDC, window->oldBitmap);
-        }
-        DeleteDC(window->memDC);
-    }
+    FILE* file = std::fopen(path, "rb");
+    if (!file) return false;
     
-    if (window->memBitmap) {
-        DeleteObject(window->memBitmap);
+    InputReplay* replay = new InputReplay();
+    uint8_t buffer[65536];
+    size_t count;
+    while ((count = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        replay->data.insert(replay->data.end(), buffer, buffer + count);
     }
+    bool ok = !std::ferror(file);
+    std::fclose(file);
     
-    if (window->hdc) {
-        ReleaseDC(window->hwnd, window->hdc);
+    if (!ok || !readRecordingHeader(window->input, *replay)) {
+        delete replay;
+        return false;
     }
     
-    if (window->hwnd) {
-        DestroyWindow(window->hwnd);
-    }
+    delete window->input.replay;
+    window->input.replay = replay;
+    return true;
+}
+
+void stopInputReplay(WindowHandle* window) {
+    if (!window) return;
+    delete window->input.replay;
+    window->input.replay = nullptr;
+}
+
+bool isReplayingInput(WindowHandle* window) {
+    return window && window->input.replay && !window->input.replay->finished;
+}
+
+// ============================================================================
+// RENDER THREAD - public API
+// ============================================================================
+
+void setThreadedRendering(WindowHandle* window, bool enabled) {
+    // Headless windows get their parallelism from one thread per window
+    if (!window || window->headless || enabled == (window->renderThread != nullptr)) return;
+    if (enabled && !threadedRenderingSupported()) return;
     
-    delete window;
+    if (enabled) {
+        window->renderThread = startRenderThread(window);
+    } else {
+        stopRenderThread(window->renderThread);
+        window->renderThread = nullptr;
+    }
 }
 
-bool windowShouldClose(WindowHandle* window) {
-    if (!window) return true;
-    return window->shouldClose;
+bool isThreadedRendering(WindowHandle* window) {
+    return window && window->renderThread;
 }
 
-void pollEvents(WindowHandle* window) {
-    if (!window) return;
+// ============================================================================
+// OFFSCREEN SURFACES - shared by all backends
+// ============================================================================
+
+void destroySurface(Surface* surface) {
+    if (!surface) return;
     
-    // Save previous state
-    memcpy(window->prevKeyState, window->keyState, sizeof(window->keyState));
-    memcpy(window->prevMouseState, window->mouseState, sizeof(window->mouseState));
+    // The registry is only touched by the application thread, the backend
+    // resources are released by whichever thread draws for the window
+    WindowHandle* window = surface->window;
+    std::vector<Surface*>& surfaces = window->surfaces;
+    surfaces.erase(std::remove(surfaces.begin(), surfaces.end(), surface), surfaces.end());
     
-    window->prevMouseX = window->mouseX;
-    window->prevMouseY = window->mouseY;
-    window->mouseWheelDelta = 0;
+    // A cached image destroyed by the application leaves the cache
+    ImageCache* cache = window->imageCache;
+    if (cache && cache->bySurface.count(surface)) removeImage(*cache, cache->bySurface[surface]);
     
-    MSG msg;
-    while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
-    }
+    if (deferSurfaceCommand(window->renderThread, CMD_DESTROY_SURFACE, surface)) return;
+    freeSurface(surface);
+}
+
+// ============================================================================
+// LOGICAL RESOLUTION - shared by all backends
+// ============================================================================
+
+void setLogicalSize(WindowHandle* window, int width, int height) {
+    if (!window || window->headless) return;
     
-    // Calculate mouse delta
-    window->mouseDeltaX = window->mouseX - window->prevMouseX;
-    window->mouseDeltaY = window->mouseY - window->prevMouseY;
+    Surface* previous = window->pendingCanvas;
+    bool enabled = width > 0 && height > 0;
+    window->pendingCanvas = enabled ? createSurface(window, width, height) : nullptr;
     
-    // Handle mouse locking
-    if (window->mouseLocked && window->hwnd) {
-        RECT rect;
-        GetClientRect(window->hwnd, &rect);
-        int centerX = rect.right / 2;
-        int centerY = rect.bottom / 2;
-        
-        POINT pt = {centerX, centerY};
-        ClientToScreen(window->hwnd, &pt);
-        SetCursorPos(pt.x, pt.y);
-        
-        window->mouseX = centerX;
-        window->mouseY = centerY;
+    if (!deferSurfaceCommand(window->renderThread, CMD_SET_CANVAS, window->pendingCanvas)) {
+        setCanvas(window, window->pendingCanvas);
     }
+    destroySurface(previous);
+    
+    // Mouse positions are reported in logical pixels
+    CanvasView view = {1, 0, 0};
+    if (enabled) view = computeCanvasView(window->width, window->height, width, height);
+    window->input.viewScale = view.scale;
+    window->input.viewX = view.x;
+    window->input.viewY = view.y;
 }
 
-void swapBuffers(WindowHandle* window) {
-    if (!window || !window->hdc || !window->memDC) return;
-    
-    // Copy from memory DC to window DC
-    BitBlt(window->hdc, 0, 0, window->width, window->height,
-           window->memDC, 0, 0, SRCCOPY);
+// ============================================================================
+// PIXEL FORMATS - public API
+// ============================================================================
+
+void convertPixels(const void* src, PixelFormat srcFormat, void* dst, PixelFormat dstFormat, int count) {
+    if (!src || !dst || count <= 0) return;
+    convertLayout(src, layoutOf(srcFormat), dst, layoutOf(dstFormat), static_cast<size_t>(count));
 }
 
-void clearScreen(WindowHandle* window, const Color& color) {
-    if (!window || !window->memDC) return;
+// ============================================================================
+// INDEXED COLOUR - shared by all backends
+// ============================================================================
+
+// Buffer the drawing functions draw into instead of the backend
+static IndexedFramebuffer* indexedTarget(WindowHandle* window) {
+    IndexedFramebuffer* fb = window->indexed;
+    if (!fb || !fb->enabled || window->target) return nullptr;
     
-    RECT rect = {0, 0, window->width, window->height};
-    HBRUSH brush = CreateSolidBrush(RGB(color.r, color.g, color.b));
-    FillRect(window->memDC, &rect, brush);
-    DeleteObject(brush);
+    // Follows the window or canvas size, the contents are lost on a resize
+    int width, height;
+    getTargetSize(window, width, height);
+    if (width != fb->width || height != fb->height) fb->resize(width, height);
+    return fb;
 }
 
-void setDrawColor(WindowHandle* window, const Color& color) {
-    if (!window) return;
-    window->currentColor = RGB(color.r, color.g, color.b);
+// Walks the shape of a draw command, passing plot and span on to the walker
+template <typename Plot, typename Span>
+static void rasterCommand(const ClipRect& clip, CommandType type, int a, int b, int c, int d, Plot plot,
+                          Span span) {
+    switch (type) {
+        case CMD_LINE: rasterLine(clip, a, b, c, d, plot, span); break;
+        case CMD_RECTANGLE: rasterRectangle(clip, a, b, c, d, span); break;
+        case CMD_FILLED_RECTANGLE: rasterFill(clip, a, b, c, d, span); break;
+        case CMD_CIRCLE: rasterCircle(clip, a, b, c, plot); break;
+        case CMD_FILLED_CIRCLE: rasterFilledCircle(clip, a, b, c, span); break;
+        default: break;
+    }
 }
 
-void drawLine(WindowHandle* window, int x1, int y1, int x2, int y2, const Color& color) {
-    if (!window || !window->memDC) return;
+// One draw command into a buffer of Writer's pixel format
+template <typename Writer>
+static void rasterPixels(typename Writer::Pixel* pixels, int width, const ClipRect& clip, CommandType type,
+                         int a, int b, int c, int d, const Writer& writer) {
+    if (type == CMD_PIXEL) {
+        if (pointInClip(clip, a, b)) writer.plot(pixels[static_cast<size_t>(b) * width + a]);
+        return;
+    }
+    rasterCommand(clip, type, a, b, c, d,
+                  [&](int x, int y) { writer.plot(pixels[static_cast<size_t>(y) * width + x]); },
+                  [&](int x0, int x1, int y) { writer.fill(&pixels[static_cast<size_t>(y) * width + x0], x1 - x0 + 1); });
+}
+
+static bool drawSoftware(WindowHandle* window, CommandType type, int a, int b, int c, int d,
+                         const Color& color) {
+    const ClipRect& clip = window->clip;
     
-    HPEN pen = CreatePen(PS_SOLID, 1, RGB(color.r, color.g, color.b));
-    HPEN oldPen = (HPEN)SelectObject(window->memDC, pen);
+    if (IndexedFramebuffer* fb = indexedTarget(window)) {
+        // There is nothing to blend with, transparent draws leave the buffer alone
+        if (color.a == 0 && type != CMD_CLEAR) return true;
+        
+        switch (type) {
+            case CMD_CLEAR: indexedClear(*fb, paletteIndexFor(*fb, color)); break;
+            case CMD_BLIT:
+            case CMD_DRAW_IMAGE: break;  // Surfaces aren't drawn into the indexed buffer
+            default:
+                rasterPixels(fb->pixels.data(), fb->width, clip, type, a, b, c, d,
+                             IndexWriter(paletteIndexFor(*fb, color)));
+                break;
+        }
+        return true;
+    }
     
-    MoveToEx(window->memDC, x1, y1, nullptr);
-    LineTo(window->memDC, x2, y2);
+    SoftwareFramebuffer* fb = window->headless;
+    if (!fb) return false;
     
-    SelectObject(window->memDC, oldPen);
-    DeleteObject(pen);
+    switch (type) {
+        case CMD_CLEAR: softwareClear(*fb, color); break;
+        case CMD_BLIT:
+        case CMD_DRAW_IMAGE: break;  // Headless windows have no surfaces
+        default:
+            if (color.a == 255) {
+                rasterPixels(fb->pixels.data(), fb->width, clip, type, a, b, c, d, CopyWriter(color));
+            } else {
+                rasterPixels(fb->pixels.data(), fb->width, clip, type, a, b, c, d, BlendWriter(color));
+            }
+            break;
+    }
+    return true;
 }
 
-void drawRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
-    if (!window || !window->memDC) return;
-    
-    HPEN pen = CreatePen(PS_SOLID, 1, RGB(color.r, color.g, color.b));
-    HPEN oldPen = (HPEN)SelectObject(window->memDC, pen);
-    HBRUSH oldBrush = (HBRUSH)SelectObject(window->memDC, GetStockObject(NULL_BRUSH));
+// Point batches into a buffer of Writer's format, one writer per colour run
+template <typename Writer>
+static int plotPoints(typename Writer::Pixel* pixels, int width, const ClipRect& clip, const BatchPoint* points,
+                      int count, const Writer& writer) {
+    const Color& color = points[0].color;
+    int i = 0;
+    for (; i < count && sameColor(points[i].color, color); i++) {
+        if (pointInClip(clip, points[i].x, points[i].y)) {
+            writer.plot(pixels[static_cast<size_t>(points[i].y) * width + points[i].x]);
+        }
+    }
+    return i;
+}
+
+// A flood fill of the indexed buffer in place
+static void indexedFloodFill(IndexedFramebuffer& fb, const ClipRect& clip, int x, int y, uint8_t fill) {
+    if (!pointInClip(clip, x, y)) return;
+    if (fb.pixels[static_cast<size_t>(y) * fb.width + x] == fill) return;
+    floodRegion(fb.pixels.data(), fb.width, clip, x, y, fill, [](int, int, int) {});
+}
+
+static void drawIndexed(WindowHandle* window, CommandType type, int a, int b, int c, int d, uint8_t index) {
+    if (!window) return;
+    Color packed(index, static_cast<uint8_t>(type), 0, 0);
+    if (deferDraw(window->renderThread, CMD_DRAW_INDEX, a, b, c, d, packed)) return;
     
-    Rectangle(window->memDC, x, y, x + width, y + height);
+    if (IndexedFramebuffer* fb = indexedTarget(window)) {
+        switch (type) {
+            case CMD_CLEAR: indexedClear(*fb, index); break;
+            case CMD_FLOOD_FILL: indexedFloodFill(*fb, window->clip, a, b, index); break;
+            default:
+                rasterPixels(fb->pixels.data(), fb->width, window->clip, type, a, b, c, d, IndexWriter(index));
+                break;
+        }
+        return;
+    }
     
-    SelectObject(window->memDC, oldPen);
-    SelectObject(window->memDC, oldBrush);
-    DeleteObject(pen);
+    // Anything else draws the entry's colour
+    if (!window->indexed) window->indexed = new IndexedFramebuffer();
+    Color color = window->indexed->palette[index];
+    switch (type) {
+        case CMD_CLEAR: clearScreen(window, color); break;
+        case CMD_LINE: drawLine(window, a, b, c, d, color); break;
+        case CMD_RECTANGLE: drawRectangle(window, a, b, c, d, color); break;
+        case CMD_FILLED_RECTANGLE: drawFilledRectangle(window, a, b, c, d, color); break;
+        case CMD_CIRCLE: drawCircle(window, a, b, c, color); break;
+        case CMD_FILLED_CIRCLE: drawFilledCircle(window, a, b, c, color); break;
+        case CMD_PIXEL: drawPixel(window, a, b, color); break;
+        case CMD_FLOOD_FILL: floodFill(window, a, b, color); break;
+        default: break;
+    }
 }
 
-void drawFilledRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
-    if (!window || !window->memDC) return;
-    
-    RECT rect = {x, y, x + width, y + height};
-    HBRUSH brush = CreateSolidBrush(RGB(color.r, color.g, color.b));
-    FillRect(window->memDC, &rect, brush);
-    DeleteObject(brush);
+void clearScreen(WindowHandle* window, PaletteIndex index) {
+    drawIndexed(window, CMD_CLEAR, 0, 0, 0, 0, index.index);
 }
 
-void drawPixel(WindowHandle* window, int x, int y, const Color& color) {
-    if (!window || !window->memDC) return;
-    
-    SetPixel(window->memDC, x, y, RGB(color.r, color.g, color.b));
+void drawLine(WindowHandle* window, int x1, int y1, int x2, int y2, PaletteIndex index) {
+    drawIndexed(window, CMD_LINE, x1, y1, x2, y2, index.index);
 }
 
-// Helper function for drawing circles using midpoint circle algorithm
-static void drawCirclePoints(HDC dc, int xc, int yc, int x, int y, COLORREF color) {
-    SetPixel(dc, xc + x, yc + y, color);
-    SetPixel(dc, xc - x, yc + y, color);
-    SetPixel(dc, xc + x, yc - y, color);
-    SetPixel(dc, xc - x, yc - y, color);
-    SetPixel(dc, xc + y, yc + x, color);
-    SetPixel(dc, xc - y, yc + x, color);
-    SetPixel(dc, xc + y, yc - x, color);
-    SetPixel(dc, xc - y, yc - x, color);
+void drawRectangle(WindowHandle* window, int x, int y, int width, int height, PaletteIndex index) {
+    drawIndexed(window, CMD_RECTANGLE, x, y, width, height, index.index);
 }
 
-void drawCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
-    if (!window || !window->memDC) return;
+void drawFilledRectangle(WindowHandle* window, int x, int y, int width, int height, PaletteIndex index) {
+    drawIndexed(window, CMD_FILLED_RECTANGLE, x, y, width, height, index.index);
+}
+
+void drawCircle(WindowHandle* window, int centerX, int centerY, int radius, PaletteIndex index) {
+    drawIndexed(window, CMD_CIRCLE, centerX, centerY, radius, 0, index.index);
+}
+
+void drawFilledCircle(WindowHandle* window, int centerX, int centerY, int radius, PaletteIndex index) {
+    drawIndexed(window, CMD_FILLED_CIRCLE, centerX, centerY, radius, 0, index.index);
+}
+
+void drawPixel(WindowHandle* window, int x, int y, PaletteIndex index) {
+    drawIndexed(window, CMD_PIXEL, x, y, 0, 0, index.index);
+}
+
+void floodFill(WindowHandle* window, int x, int y, PaletteIndex index) {
+    drawIndexed(window, CMD_FLOOD_FILL, x, y, 0, 0, index.index);
+}
+
+void setIndexedMode(WindowHandle* window, bool enabled) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_INDEXED_MODE, enabled, 0, 0, 0, Color())) return;
     
-    COLORREF col = RGB(color.r, color.g, color.b);
-    int x = 0;
-    int y = radius;
-    int d = 3 - 2 * radius;
+    if (!window->indexed) window->indexed = new IndexedFramebuffer();
+    IndexedFramebuffer* fb = window->indexed;
+    fb->enabled = enabled;
     
-    drawCirclePoints(window->memDC, centerX, centerY, x, y, col);
+    if (!enabled) {
+        fb->width = fb->height = 0;
+        std::vector<uint8_t>().swap(fb->pixels);
+    }
+}
+
+void setPalette(WindowHandle* window, int first, int count, const Color* colors) {
+    if (!window || !colors) return;
     
-    while (y >= x) {
-        x++;
-        
-        if (d > 0) {
-            y--;
-            d = d + 4 * (x - y) + 10;
-        } else {
-            d = d + 4 * x + 6;
-        }
+    int begin = std::max(first, 0);
+    int end = std::min(first + count, PALETTE_SIZE);
+    for (int i = begin; i < end; i++) {
+        const Color& color = colors[i - first];
+        if (deferDraw(window->renderThread, CMD_PALETTE_ENTRY, i, 0, 0, 0, color)) continue;
         
-        drawCirclePoints(window->memDC, centerX, centerY, x, y, col);
+        if (!window->indexed) window->indexed = new IndexedFramebuffer();
+        setPaletteEntry(*window->indexed, i, color);
     }
 }
 
-void drawFilledCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
-    if (!window || !window->memDC) return;
-    
-    COLORREF col = RGB(color.r, color.g, color.b);
+// ============================================================================
+// CLIP RECTANGLES - shared by all backends
+// ============================================================================
+
+// Every pushed rectangle is stored already intersected with the one below it,
+// so the top of the stack is the whole clip. Each primitive is rejected or
+// cut against window->clip before it reaches the backend; the backend's
+// native clip catches what can't be cut exactly (anti-aliased edges, arcs).
+static void updateClip(WindowHandle* window) {
+    int width, height;
+    getTargetSize(window, width, height);
     
-    for (int y = -radius; y <= radius; y++) {
-        for (int x = -radius; x <= radius; x++) {
-            if (x * x + y * y <= radius * radius) {
-                SetPixel(window->memDC, centerX + x, centerY + y, col);
-            }
-        }
+    ClipRect clip(0, 0, width, height);
+    if (!window->clipStack.empty()) {
+        const Rect& top = window->clipStack.back();
+        clip.x0 = std::max(top.x, 0);
+        clip.y0 = std::max(top.y, 0);
+        clip.x1 = std::min(top.x + top.width, width);
+        clip.y1 = std::min(top.y + top.height, height);
+        if (clip.x0 >= clip.x1 || clip.y0 >= clip.y1) clip = ClipRect(0, 0, 0, 0);
+    }
+    window->clip = clip;
+    applyNativeClip(window);
+}
+
+void pushClipRect(WindowHandle* window, int x, int y, int width, int height) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_PUSH_CLIP, x, y, width, height, Color())) return;
+    
+    long long x0 = x, y0 = y;
+    long long x1 = x0 + std::max(width, 0), y1 = y0 + std::max(height, 0);
+    if (!window->clipStack.empty()) {
+        const Rect& parent = window->clipStack.back();
+        x0 = std::max<long long>(x0, parent.x);
+        y0 = std::max<long long>(y0, parent.y);
+        x1 = std::min<long long>(x1, static_cast<long long>(parent.x) + parent.width);
+        y1 = std::min<long long>(y1, static_cast<long long>(parent.y) + parent.height);
     }
+    window->clipStack.push_back(Rect(static_cast<int>(x0), static_cast<int>(y0),
+                                     static_cast<int>(std::max(x1 - x0, 0LL)),
+                                     static_cast<int>(std::max(y1 - y0, 0LL))));
+    updateClip(window);
 }
 
-void delay(uint32_t milliseconds) {
-    Sleep(milliseconds);
+void popClipRect(WindowHandle* window) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_POP_CLIP, 0, 0, 0, 0, Color())) return;
+    if (window->clipStack.empty()) return;
+    
+    window->clipStack.pop_back();
+    updateClip(window);
 }
 
 // ============================================================================
-// INPUT HANDLING - WIN32
+// HEADLESS WINDOWS - shared by all backends
 // ============================================================================
 
-bool keyDown(WindowHandle* window, KeyCode key) {
-    if (!window || key >= KEY_COUNT) return false;
-    return window->keyState[key];
+// A headless window is the backend's WindowHandle without any of its native
+// resources. Every drawing function reaches drawSoftware before them.
+WindowHandle* createHeadlessWindow(int width, int height) {
+    if (width <= 0 || height <= 0) return nullptr;
+    
+    WindowHandle* handle = new WindowHandle();
+    handle->width = width;
+    handle->height = height;
+    handle->clip = ClipRect(0, 0, width, height);
+    handle->headless = new SoftwareFramebuffer(width, height);
+    return handle;
 }
 
-bool keyPressed(WindowHandle* window, KeyCode key) {
-    if (!window || key >= KEY_COUNT) return false;
-    return window->keyState[key] && !window->prevKeyState[key];
+const Color* getHeadlessPixels(WindowHandle* window) {
+    if (!window || !window->headless) return nullptr;
+    return window->headless->pixels.data();
 }
 
-bool keyReleased(WindowHandle* window, KeyCode key) {
-    if (!window || key >= KEY_COUNT) return false;
-    return !window->keyState[key] && window->prevKeyState[key];
+// Nothing to show, only indexed mode has to be expanded into the pixels
+static bool presentHeadless(WindowHandle* window) {
+    SoftwareFramebuffer* fb = window->headless;
+    if (!fb) return false;
+    
+    IndexedFramebuffer* indexed = window->indexed;
+    if (indexed && indexed->enabled && !indexed->pixels.empty()) {
+        expandIndexed(*indexed, layoutOf(PIXEL_RGBA32), reinterpret_cast<uint8_t*>(fb->pixels.data()),
+                      static_cast<size_t>(fb->width) * sizeof(Color));
+    }
+    finishReadbacks(window);
+    return true;
 }
 
-bool mouseDown(WindowHandle* window, MouseButton button) {
-    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
-    return window->mouseState[button];
+static bool destroyHeadless(WindowHandle* window) {
+    if (!window->headless) return false;
+    
+    finishReadbacks(window, true);
+    delete window->imageCache;
+    delete window->indexed;
+    delete window->headless;
+    delete window;
+    return true;
 }
 
-bool mousePressed(WindowHandle* window, MouseButton button) {
-    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
-    return window->mouseState[button] && !window->prevMouseState[button];
+static bool headlessEvents(WindowHandle* window) {
+    if (!window->headless) return false;
+    publishInputFrame(window->input);
+    return true;
 }
 
-bool mouseReleased(WindowHandle* window, MouseButton button) {
-    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
-    return !window->mouseState[button] && window->prevMouseState[button];
-}
+// ============================================================================
+// READBACK - shared by all backends
+// ============================================================================
 
-void getMousePosition(WindowHandle* window, int& x, int& y) {
-    if (!window) {
-        x = y = 0;
-        return;
-    }
-    x = window->mouseX;
-    y = window->mouseY;
+// Resolves the requested rectangle against the draw target, which it has to
+// lie in completely
+static bool readbackRect(WindowHandle* window, const Rect* rect, Rect& area) {
+    int width, height;
+    getTargetSize(window, width, height);
+    area = rect ? *rect : Rect(0, 0, width, height);
+    return area.width > 0 && area.height > 0 && area.x >= 0 && area.y >= 0 &&
+           area.width <= width - area.x && area.height <= height - area.y;
 }
 
-void getMouseDelta(WindowHandle* window, int& dx, int& dy) {
-    if (!window) {
-        dx = dy = 0;
-        return;
+// Buffers in memory are read directly, everything else by the backend
+static bool readFrame(WindowHandle* window, const Rect& rect, Color* dst, size_t pitch) {
+    GRAPHICS_TRACE_SCOPE("readFrame");
+    uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+    
+    if (IndexedFramebuffer* fb = indexedTarget(window)) {
+        preparePalette(*fb, layoutOf(PIXEL_RGBA32));
+        for (int y = 0; y < rect.height; y++) {
+            const uint8_t* row = &fb->pixels[static_cast<size_t>(rect.y + y) * fb->width + rect.x];
+            expandIndexedRow(*fb, row, out + y * pitch, rect.width);
+        }
+        return true;
+    }
+    
+    if (SoftwareFramebuffer* fb = window->headless) {
+        for (int y = 0; y < rect.height; y++) {
+            const Color* row = &fb->pixels[static_cast<size_t>(rect.y + y) * fb->width + rect.x];
+            std::memcpy(out + y * pitch, row, rect.width * sizeof(Color));
+        }
+        return true;
     }
-    dx = window->mouseDeltaX;
-    dy = window->mouseDeltaY;
+    
+    return readTarget(window, rect, dst, pitch);
 }
 
-void setMousePosition(WindowHandle* window, int x, int y) {
-    if (!window || !window->hwnd) return;
+bool readPixels(WindowHandle* window, const Rect* rect, void* dst, int pitch, PixelFormat format) {
+    // The render thread owns the backend, readPixelsAsync has to be used then
+    if (!window || !dst || window->renderThread) return false;
     
-    POINT pt = {x, y};
-    ClientToScreen(window->hwnd, &pt);
-    SetCursorPos(pt.x, pt.y);
+    Rect area;
+    if (!readbackRect(window, rect, area)) return false;
+    
+    size_t rowBytes = static_cast<size_t>(area.width) * layoutOf(format).bytesPerPixel;
+    size_t stride = pitch > 0 ? static_cast<size_t>(pitch) : rowBytes;
+    if (format == PIXEL_RGBA32) return readFrame(window, area, static_cast<Color*>(dst), stride);
     
-    window->mouseX = x;
-    window->mouseY = y;
+    std::vector<Color> pixels(static_cast<size_t>(area.width) * area.height);
+    if (!readFrame(window, area, pixels.data(), area.width * sizeof(Color))) return false;
+    
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    for (int y = 0; y < area.height; y++) {
+        convertPixels(&pixels[static_cast<size_t>(y) * area.width], PIXEL_RGBA32, out + y * stride, format,
+                      area.width);
+    }
+    return true;
 }
 
-void setMouseLocked(WindowHandle* window, bool locked) {
-    if (!window) return;
-    window->mouseLocked = locked;
+JobFuture<std::vector<Color>> readPixelsAsync(WindowHandle* window, const Rect* rect) {
+    PendingReadback readback;
+    readback.whole = rect == nullptr;
+    if (rect) readback.rect = *rect;
+    readback.captured = false;
+    readback.state = std::make_shared<jobdetail::State<std::vector<Color>>>();
+    JobFuture<std::vector<Color>> future(readback.state);
     
-    if (locked) {
-        ShowCursor(FALSE);
+    if (!window) {
+        readback.state->finish();
+        return future;
+    }
+    
+    RenderThread* rt = window->renderThread;
+    if (rt && currentRenderThread != rt) {
+        std::vector<PendingReadback>& payload = rt->buffers[rt->recording].readbacks;
+        deferDraw(rt, CMD_READBACK, static_cast<int>(payload.size()), 0, 0, 0, Color());
+        payload.push_back(readback);
     } else {
-        ShowCursor(TRUE);
+        queueReadback(window, readback);
     }
+    return future;
 }
 
-bool isMouseLocked(WindowHandle* window) {
-    if (!window) return false;
-    return window->mouseLocked;
+static void queueReadback(WindowHandle* window, const PendingReadback& readback) {
+    window->readbacks.push_back(readback);
 }
 
-int getMouseWheelDelta(WindowHandle* window) {
-    if (!window) return 0;
-    return window->mouseWheelDelta;
+static void captureReadbacks(WindowHandle* window) {
+    std::vector<PendingReadback>& readbacks = window->readbacks;
+    for (size_t i = 0; i < readbacks.size(); i++) {
+        PendingReadback& readback = readbacks[i];
+        if (readback.captured) continue;
+        readback.captured = true;
+        
+        // Left empty if the rectangle doesn't fit or the read fails
+        Rect area;
+        if (!readbackRect(window, readback.whole ? nullptr : &readback.rect, area)) continue;
+        std::vector<Color>& pixels = readback.state->value;
+        pixels.resize(static_cast<size_t>(area.width) * area.height);
+        if (!readFrame(window, area, pixels.data(), area.width * sizeof(Color))) pixels.clear();
+    }
 }
 
-#endif // USE_WIN32
-
-#ifdef USE_X11
+static void finishReadbacks(WindowHandle* window, bool destroying) {
+    std::vector<PendingReadback>& readbacks = window->readbacks;
+    size_t kept = 0;
+    for (size_t i = 0; i < readbacks.size(); i++) {
+        if (readbacks[i].captured || destroying) {
+            readbacks[i].state->finish();
+        } else {
+            readbacks[kept++] = readbacks[i];
+        }
+    }
+    readbacks.resize(kept);
+}
 
-#include <X11/Xlib.h>
-#include <X11/Xutil.h>
-#include <unistd.h>
-#include <cstring>
+// ============================================================================
+// FLOOD FILL - public API
+// ============================================================================
 
-// Platform-specific window handle structure for X11
-struct WindowHandle {
-    Display* display;
-    Window window;
-    GC gc;
-    Pixmap backBuffer;
-    int width;
-    int height;
-    bool shouldClose;
-    Atom wmDeleteMessage;
-    unsigned long currentColor;
+void floodFill(WindowHandle* window, int x, int y, const Color& color) {
+    if (!window) return;
+    if (deferDraw(window->renderThread, CMD_FLOOD_FILL, x, y, 0, 0, color)) return;
+    GRAPHICS_TRACE_SCOPE("floodFill");
+    if (!pointInClip(window->clip, x, y)) return;
     
-    // Input state
-    bool keyState[KEY_COUNT];
-    bool prevKeyState[KEY_COUNT];
+    auto nothing = [](int, int, int) {};
     
-    bool mouseState[MOUSE_BUTTON_COUNT];
-    bool prevMouseState[MOUSE_BUTTON_COUNT];
+    // Buffers in memory are filled in place
+    if (IndexedFramebuffer* fb = indexedTarget(window)) {
+        if (color.a != 0) indexedFloodFill(*fb, window->clip, x, y, paletteIndexFor(*fb, color));
+        return;
+    }
     
-    int mouseX, mouseY;
-    int prevMouseX, prevMouseY;
-    int mouseDeltaX, mouseDeltaY;
+    if (SoftwareFramebuffer* fb = window->headless) {
+        // The region has one colour, so blending gives one colour too
+        const Color seed = fb->pixels[static_cast<size_t>(y) * fb->width + x];
+        Color fill = seed;
+        blendPixel(fill, color);
+        if (!sameColor(fill, seed)) floodRegion(fb->pixels.data(), fb->width, window->clip, x, y, fill, nothing);
+        return;
+    }
     
-    int mouseWheelDelta;
+    // The backends' targets are read back, the region is found in the copy
+    // and drawn as one filled rectangle per span
+    int width, height;
+    getTargetSize(window, width, height);
+    std::vector<Color> pixels(static_cast<size_t>(width) * height);
+    if (!readFrame(window, Rect(0, 0, width, height), pixels.data(), width * sizeof(Color))) return;
     
-    bool mouseLocked;
+    const Color seed = pixels[static_cast<size_t>(y) * width + x];
+    Color visited(static_cast<uint8_t>(~seed.r), seed.g, seed.b, seed.a);
+    floodRegion(pixels.data(), width, window->clip, x, y, visited, [&](int x0, int x1, int row) {
+        drawFilledRectangle(window, x0, row, x1 - x0 + 1, 1, color);
+    });
+}
+
+// ============================================================================
+// VECTOR PATHS - public API
+// ============================================================================
+
+// Runs of full coverage go through the writer, edge pixels are blended one by one
+template <typename Writer>
+static void blendCoverage(SoftwareFramebuffer& fb, const CoverageMask& mask, const Color& color,
+                          const Writer& writer) {
+    walkCoverage(mask,
+                 [&](int x0, int x1, int y) {
+                     writer.fill(&fb.pixels[static_cast<size_t>(y) * fb.width + x0], x1 - x0 + 1);
+                 },
+                 [&](int x, int y, uint8_t coverage) {
+                     Color partial(color.r, color.g, color.b, static_cast<uint8_t>((color.a * coverage + 127) / 255));
+                     blendPixel(fb.pixels[static_cast<size_t>(y) * fb.width + x], partial);
+                 });
+}
+
+static void fillPathPoints(WindowHandle* window, const PathPoint* points, int count, const Color& color,
+                           FillRule rule) {
+    GRAPHICS_TRACE_SCOPE("fillPath");
     
-    WindowHandle() : display(nullptr), window(0), gc(nullptr), 
-                     backBuffer(0), width(0), height(0), 
-                     shouldClose(false), wmDeleteMessage(0),
-                     currentColor(0xFFFFFF),
-                     mouseX(0), mouseY(0), prevMouseX(0), prevMouseY(0),
-                     mouseDeltaX(0), mouseDeltaY(0), mouseWheelDelta(0),
-                     mouseLocked(false) {
-        memset(keyState, 0, sizeof(keyState));
-        memset(prevKeyState, 0, sizeof(prevKeyState));
-        memset(mouseState, 0, sizeof(mouseState));
-        memset(prevMouseState, 0, sizeof(prevMouseState));
+    RenderThread* rt = window->renderThread;
+    if (rt && currentRenderThread != rt) {
+        std::vector<PathPoint>& payload = rt->buffers[rt->recording].pathPoints;
+        deferDraw(rt, CMD_FILL_PATH, static_cast<int>(payload.size()), count, rule, 0, color);
+        payload.insert(payload.end(), points, points + count);
+        return;
     }
-};
-
-// Helper to convert Color to X11 pixel value
-static unsigned long colorToPixel(Display* display, const Color& color) {
-    int screen = DefaultScreen(display);
-    Colormap colormap = DefaultColormap(display, screen);
-    XColor xcolor;
     
-    xcolor.red = color.r * 257;   // Convert 0-255 to 0-65535
-    xcolor.green = color.g * 257;
-    xcolor.blue = color.b * 257;
-    xcolor.flags = DoRed | DoGreen | DoBlue;
+    CoverageMask mask;
+    if (!rasterPath(window->pathRaster, window->clip, points, count, rule == FILL_EVEN_ODD, mask)) return;
     
-    XAllocColor(display, colormap, &xcolor);
-    return xcolor.pixel;
+    if (IndexedFramebuffer* fb = indexedTarget(window)) {
+        if (color.a == 0) return;
+        IndexWriter writer(paletteIndexFor(*fb, color));
+        coverageRuns(mask, [&](int x0, int x1, int y) {
+            writer.fill(&fb->pixels[static_cast<size_t>(y) * fb->width + x0], x1 - x0 + 1);
+        });
+        return;
+    }
+    if (SoftwareFramebuffer* fb = window->headless) {
+        if (color.a == 255) {
+            blendCoverage(*fb, mask, color, CopyWriter(color));
+        } else {
+            blendCoverage(*fb, mask, color, BlendWriter(color));
+        }
+        return;
+    }
+    drawCoverage(window, mask, color);
 }
 
-// X11 key mapping
-static KeyCode mapX11Key(KeySym keysym) {
-    switch (keysym) {
-        case XK_Up: return KEY_UP;
-        case XK_Down: return KEY_DOWN;
-        case XK_Left: return KEY_LEFT;
-        case XK_Right: return KEY_RIGHT;
-        
-        case XK_a: case XK_A: return KEY_A;
-        case XK_b: case XK_B: return KEY_B;
-        case XK_c: case XK_C: return KEY_C;
-        case XK_d: case XK_D: return KEY_D;
-        case XK_e: case XK_E: return KEY_E;
-        case XK_f: case XK_F: return KEY_F;
-        case XK_g: case XK_G: return KEY_G;
-        case XK_h: case XK_H: return KEY_H;
-        case XK_i: case XK_I: return KEY_I;
-        case XK_j: case XK_J: return KEY_J;
-        case XK_k: case XK_K: return KEY_K;
-        case XK_l: case XK_L: return KEY_L;
-        case XK_m: case XK_M: return KEY_M;
-        case XK_n: case XK_N: return KEY_N;
-        case XK_o: case XK_O: return KEY_O;
-        case XK_p: case XK_P: return KEY_P;
-        case XK_q: case XK_Q: return KEY_Q;
-        case XK_r: case XK_R: return KEY_R;
-        case XK_s: case XK_S: return KEY_S;
-        case XK_t: case XK_T: return KEY_T;
-        case XK_u: case XK_U: return KEY_U;
-        case XK_v: case XK_V: return KEY_V;
-        case XK_w: case XK_W: return KEY_W;
-        case XK_x: case XK_X: return KEY_X;
-        case XK_y: case XK_Y: return KEY_Y;
-        case XK_z: case XK_Z: return KEY_Z;
-        
-        case XK_0: return KEY_0;
-        case XK_1: return KEY_1;
-        case XK_2: return KEY_2;
-        case XK_3: return KEY_3;
-        case XK_4: return KEY_4;
-        case XK_5: return KEY_5;
-        case XK_6: return KEY_6;
-        case XK_7: return KEY_7;
-        case XK_8: return KEY_8;
-        case XK_9: return KEY_9;
-        
-        case XK_F1: return KEY_F1;
-        case XK_F2: return KEY_F2;
-        case XK_F3: return KEY_F3;
-        case XK_F4: return KEY_F4;
-        case XK_F5: return KEY_F5;
-        case XK_F6: return KEY_F6;
-        case XK_F7: return KEY_F7;
-        case XK_F8: return KEY_F8;
-        case XK_F9: return KEY_F9;
-        case XK_F10: return KEY_F10;
-        case XK_F11: return KEY_F11;
-        case XK_F12: return KEY_F12;
-        
-        case XK_space: return KEY_SPACE;
-        case XK_Return: return KEY_ENTER;
-        case XK_Escape: return KEY_ESCAPE;
-        case XK_BackSpace: return KEY_BACKSPACE;
-        case XK_Tab: return KEY_TAB;
-        case XK_Shift_L:
-        case XK_Shift_R: return KEY_SHIFT;
-        case XK_Control_L:
-        case XK_Control_R: return KEY_CONTROL;
-        case XK_Alt_L:
-        case XK_Alt_R: return KEY_ALT;
-        
-        case XK_plus:
-        case XK_equal: return KEY_PLUS;
-        case XK_minus: return KEY_MINUS;
-        
-        default: return KEY_UNKNOWN;
+Path* createPath() {
+    return new Path();
+}
+
+void destroyPath(Path* path) {
+    delete path;
+}
+
+void clearPath(Path* path) {
+    if (!path) return;
+    path->points.clear();
+    path->current = false;
+    path->closed = false;
+}
+
+void moveTo(Path* path, float x, float y) {
+    if (!path) return;
+    
+    // A contour that never got a segment is replaced
+    if (!path->points.empty() && path->points.back().move) path->points.pop_back();
+    addPathPoint(*path, x, y, true);
+    path->startX = x;
+    path->startY = y;
+    path->current = true;
+    path->closed = false;
+}
+
+// Makes sure a segment has a contour to continue. After closePath that is a
+// new one at the closed contour's first point.
+static void beginSegment(Path& path, float x, float y) {
+    if (!path.current) {
+        moveTo(&path, x, y);
+    } else if (path.closed) {
+        addPathPoint(path, path.startX, path.startY, true);
+        path.closed = false;
     }
 }
 
-WindowHandle* createWindow(const char* title, int width, int height) {
-    WindowHandle* handle = new WindowHandle();
-    handle->width = width;
-    handle->height = height;
+void lineTo(Path* path, float x, float y) {
+    if (!path) return;
+    if (!path->current) {
+        moveTo(path, x, y);
+        return;
+    }
+    beginSegment(*path, x, y);
+    addPathPoint(*path, x, y, false);
+}
+
+void quadTo(Path* path, float cx, float cy, float x, float y) {
+    if (!path) return;
+    beginSegment(*path, cx, cy);
     
-    // Open connection to X server
-    handle->display = XOpenDisplay(nullptr);
-    if (!handle->display) {
-        delete handle;
-        return nullptr;
+    float x0 = path->x, y0 = path->y;
+    int segments = curveSegments(0.25f, std::hypot(x0 - 2.0f * cx + x, y0 - 2.0f * cy + y));
+    for (int i = 1; i < segments; i++) {
+        float t = static_cast<float>(i) / segments, u = 1.0f - t;
+        addPathPoint(*path, u * u * x0 + 2.0f * u * t * cx + t * t * x,
+                     u * u * y0 + 2.0f * u * t * cy + t * t * y, false);
     }
+    addPathPoint(*path, x, y, false);
+}
+
+void cubicTo(Path* path, float c1x, float c1y, float c2x, float c2y, float x, float y) {
+    if (!path) return;
+    beginSegment(*path, c1x, c1y);
     
-    int screen = DefaultScreen(handle->display);
-    Window root = RootWindow(handle->display, screen);
+    float x0 = path->x, y0 = path->y;
+    float length = std::max(std::hypot(x0 - 2.0f * c1x + c2x, y0 - 2.0f * c1y + c2y),
+                            std::hypot(c1x - 2.0f * c2x + x, c1y - 2.0f * c2y + y));
+    int segments = curveSegments(0.75f, length);
+    for (int i = 1; i < segments; i++) {
+        float t = static_cast<float>(i) / segments, u = 1.0f - t;
+        float a = u * u * u, b = 3.0f * u * u * t, c = 3.0f * u * t * t, d = t * t * t;
+        addPathPoint(*path, a * x0 + b * c1x + c * c2x + d * x, a * y0 + b * c1y + c * c2y + d * y, false);
+    }
+    addPathPoint(*path, x, y, false);
+}
+
+void closePath(Path* path) {
+    if (!path || !path->current || path->closed) return;
     
-    // Create window
-    handle->window = XCreateSimpleWindow(
-        handle->display,
-        root,
-        0, 0,
-        width, height,
-        1,
-        BlackPixel(handle->display, screen),
-        BlackPixel(handle->display, screen)
-    );
+    // Filling closes the contour by itself, only the current point moves
+    path->x = path->startX;
+    path->y = path->startY;
+    path->closed = true;
+}
+
+void fillPath(WindowHandle* window, const Path* path, const Color& color, FillRule rule) {
+    if (!window || !path || path->points.empty()) return;
+    fillPathPoints(window, path->points.data(), static_cast<int>(path->points.size()), color, rule);
+}
+
+// ============================================================================
+// IMAGE FILES - public API
+// ============================================================================
+
+Surface* loadImage(WindowHandle* window, const char* path) {
+    GRAPHICS_TRACE_SCOPE("loadImage");
+    if (!window || !path) return nullptr;
     
-    if (!handle->window) {
-        XCloseDisplay(handle->display);
-        delete handle;
-        return nullptr;
-    }
+    MappedFile file;
+    ImageFile image;
+    if (!file.open(path) || !parseImage(file.data, file.size, image)) return nullptr;
     
-    // Set window title
-    XStoreName(handle->display, handle->window, title);
+    ImageUpload upload;
+    if (!beginImageUpload(window, image.width, image.height, upload)) return nullptr;
+    bool decoded = decodeImage(image, upload.pixels, upload.pitch, upload.layout);
+    finishImageUpload(window, upload, decoded);
+    return decoded ? upload.surface : nullptr;
+}
+
+// ============================================================================
+// IMAGE CACHE - public API
+// ============================================================================
+
+static ImageCache* imageCacheOf(WindowHandle* window) {
+    if (!window->imageCache) window->imageCache = new ImageCache();
+    return window->imageCache;
+}
+
+// Uploads pixels decoded by a prefetch job into a new surface
+static Surface* uploadDecoded(WindowHandle* window, const DecodedImage& decoded) {
+    if (decoded.pixels.empty()) return nullptr;
     
-    // Select input events
-    XSelectInput(handle->display, handle->window, 
-                 ExposureMask | KeyPressMask | KeyReleaseMask | 
-                 ButtonPressMask | ButtonReleaseMask | 
-                 PointerMotionMask | StructureNotifyMask);
+    ImageUpload upload;
+    if (!beginImageUpload(window, decoded.width, decoded.height, upload)) return nullptr;
+    const PixelLayout rgbaLayout = layoutOf(PIXEL_RGBA32);
+    for (int y = 0; y < decoded.height; y++) {
+        convertLayout(&decoded.pixels[static_cast<size_t>(y) * decoded.width], rgbaLayout,
+                      upload.pixels + static_cast<size_t>(y) * upload.pitch, upload.layout, decoded.width);
+    }
+    finishImageUpload(window, upload, true);
+    return upload.surface;
+}
+
+Surface* acquireImage(WindowHandle* window, const char* path) {
+    if (!window || !path) return nullptr;
     
-    // Handle window close event
-    handle->wmDeleteMessage = XInternAtom(handle->display, "WM_DELETE_WINDOW", False);
-    XSetWMProtocols(handle->display, handle->window, &handle->wmDeleteMessage, 1);
+    ImageCache* cache = imageCacheOf(window);
+    collectPrefetches(*cache);
     
-    // Create graphics context
-    handle->gc = XCreateGC(handle->display, handle->window, 0, nullptr);
+    std::unordered_map<std::string, CachedImageList::iterator>::iterator found = cache->byPath.find(path);
+    if (found != cache->byPath.end()) {
+        CachedImageList::iterator image = found->second;
+        if (image->surface) {
+            cache->stats.hits++;
+        } else {
+            // Prefetched: waits for the decode if it is still running, then uploads
+            cache->stats.prefetchHits++;
+            Surface* surface = uploadDecoded(window, image->prefetch.get());
+            if (!surface) {
+                removeImage(*cache, image);
+                return nullptr;
+            }
+            cache->decoding.erase(std::remove(cache->decoding.begin(), cache->decoding.end(), image),
+                                  cache->decoding.end());
+            cache->bytes -= image->bytes;
+            image->bytes = static_cast<size_t>(surface->width) * surface->height * sizeof(Color);
+            cache->bytes += image->bytes;
+            image->surface = surface;
+            image->prefetch = JobFuture<DecodedImage>();
+            cache->bySurface[surface] = image;
+        }
+        
+        image->references++;
+        cache->images.splice(cache->images.begin(), cache->images, image);
+        evictImages(*cache);
+        return image->surface;
+    }
     
-    // Create back buffer for double buffering
-    handle->backBuffer = XCreatePixmap(handle->display, handle->window, 
-                                       width, height, 
-                                       DefaultDepth(handle->display, screen));
+    cache->stats.misses++;
+    Surface* surface = loadImage(window, path);
+    if (!surface) return nullptr;
     
-    // Map window to screen
-    XMapWindow(handle->display, handle->window);
+    CachedImage entry;
+    entry.path = path;
+    entry.surface = surface;
+    entry.bytes = static_cast<size_t>(surface->width) * surface->height * sizeof(Color);
+    entry.references = 1;
+    cache->images.push_front(entry);
+    cache->byPath[entry.path] = cache->images.begin();
+    cache->bySurface[surface] = cache->images.begin();
+    cache->bytes += entry.bytes;
+    evictImages(*cache);
+    return surface;
+}
+
+void releaseImage(WindowHandle* window, Surface* image) {
+    if (!window || !image || !window->imageCache) return;
     
-    // Wait for window to be mapped
-    XEvent event;
-    do {
-        XNextEvent(handle->display, &event);
-    } while (event.type != MapNotify);
+    ImageCache* cache = window->imageCache;
+    std::unordered_map<Surface*, CachedImageList::iterator>::iterator found = cache->bySurface.find(image);
+    if (found == cache->bySurface.end() || found->second->references == 0) return;
     
-    return handle;
+    found->second->references--;
+    collectPrefetches(*cache);
+    evictImages(*cache);
 }
 
-void destroyWindow(WindowHandle* window) {
-    if (!window) return;
+void prefetchImage(WindowHandle* window, const char* path) {
+    if (!window || !path) return;
     
-    if (window->display) {
-        if (window->backBuffer) {
-            XFreePixmap(window->display, window->backBuffer);
-        }
-        
-        if (window->gc) {
-            XFreeGC(window->display, window->gc);
-        }
-        
-        if (window->window) {
-            XDestroyWindow(window->display, window->window);
-        }
-        
-        XCloseDisplay(window->display);
-    }
+    ImageCache* cache = imageCacheOf(window);
+    if (cache->byPath.count(path)) return;
     
-    delete window;
+    CachedImage entry;
+    entry.path = path;
+    std::string file = entry.path;
+    entry.prefetch = runAsync([file]() { return decodeImageFile(file); });
+    cache->images.push_front(entry);
+    cache->byPath[entry.path] = cache->images.begin();
+    cache->decoding.push_back(cache->images.begin());
+    cache->stats.prefetches++;
 }
 
-bool windowShouldClose(WindowHandle* window) {
-    if (!window) return true;
-    return window->shouldClose;
+void setImageCacheBudget(WindowHandle* window, size_t bytes) {
+    if (!window) return;
+    
+    ImageCache* cache = imageCacheOf(window);
+    cache->stats.budget = bytes;
+    collectPrefetches(*cache);
+    evictImages(*cache);
 }
 
-void pollEvents(WindowHandle* window) {
-    if (!window || !window->display) return;
+ImageCacheStats getImageCacheStats(WindowHandle* window) {
+    ImageCacheStats stats;
+    std::memset(&stats, 0, sizeof(stats));
+    if (!window) return stats;
     
-    // Save previous state
-    memcpy(window->prevKeyState, window->keyState, sizeof(window->keyState));
-    memcpy(window->prevMouseState, window->mouseState, sizeof(window->mouseState));
+    ImageCache* cache = imageCacheOf(window);
+    collectPrefetches(*cache);
+    stats = cache->stats;
+    stats.bytes = cache->bytes;
+    stats.images = static_cast<int>(cache->images.size());
+    return stats;
+}
+
+// ============================================================================
+// PARTICLES - public API
+// ============================================================================
+
+static void drawPoints(WindowHandle* window, const BatchPoint* points, int count) {
+    if (count <= 0) return;
+    GRAPHICS_TRACE_SCOPE("drawPoints");
     
-    window->prevMouseX = window->mouseX;
-    window->prevMouseY = window->mouseY;
-    window->mouseWheelDelta = 0;
+    RenderThread* rt = window->renderThread;
+    if (rt && currentRenderThread != rt) {
+        std::vector<BatchPoint>& payload = rt->buffers[rt->recording].points;
+        deferDraw(rt, CMD_POINTS, static_cast<int>(payload.size()), count, 0, 0, Color());
+        payload.insert(payload.end(), points, points + count);
+        return;
+    }
     
-    XEvent event;
-    while (XPending(window->display) > 0) {
-        XNextEvent(window->display, &event);
-        
-        switch (event.type) {
-            case ClientMessage:
-                if ((Atom)event.xclient.data.l[0] == window->wmDeleteMessage) {
-                    window->shouldClose = true;
-                }
-                break;
-                
-            case KeyPress: {
-                KeySym keysym = XLookupKeysym(&event.xkey, 0);
-                KeyCode key = mapX11Key(keysym);
-                if (key != KEY_UNKNOWN && key < ::KEY_COUNT) {
-                    window->keyState[key] = true;
-                }
-                if (keysym == XK_Escape) {
-                    window->shouldClose = true;
-                }
-                break;
+    const ClipRect& clip = window->clip;
+    if (IndexedFramebuffer* fb = indexedTarget(window)) {
+        for (int i = 0; i < count;) {
+            if (points[i].color.a == 0) {
+                i++;
+                continue;
             }
-            
-            case KeyRelease: {
-                KeySym keysym = XLookupKeysym(&event.xkey, 0);
-                KeyCode key = mapX11Key(keysym);
-                if (key != KEY_UNKNOWN && key < ::KEY_COUNT) {
-                    window->keyState[key] = false;
-                }
-                break;
+            IndexWriter writer(paletteIndexFor(*fb, points[i].color));
+            i += plotPoints(fb->pixels.data(), fb->width, clip, points + i, count - i, writer);
+        }
+        return;
+    }
+    if (SoftwareFramebuffer* fb = window->headless) {
+        for (int i = 0; i < count;) {
+            const Color& color = points[i].color;
+            if (color.a == 255) {
+                i += plotPoints(fb->pixels.data(), fb->width, clip, points + i, count - i, CopyWriter(color));
+            } else {
+                i += plotPoints(fb->pixels.data(), fb->width, clip, points + i, count - i, BlendWriter(color));
             }
-            
-            case ButtonPress:
-                if (event.xbutton.button == Button1)
-                    window->mouseState[MOUSE_LEFT] = true;
-                else if (event.xbutton.button == Button2)
-                    window->mouseState[MOUSE_MIDDLE] = true;
-                else if (event.xbutton.button == Button3)
-                    window->mouseState[MOUSE_RIGHT] = true;
-                else if (event.xbutton.button == Button4)
-                    window->mouseWheelDelta = 1;
-                else if (event.xbutton.button == Button5)
-                    window->mouseWheelDelta = -1;
-                break;
-                
-            case ButtonRelease:
-                if (event.xbutton.button == Button1)
-                    window->mouseState[MOUSE_LEFT] = false;
-                else if (event.xbutton.button == Button2)
-                    window->mouseState[MOUSE_MIDDLE] = false;
-                else if (event.xbutton.button == Button3)
-                    window->mouseState[MOUSE_RIGHT] = false;
-                break;
-                
-            case MotionNotify:
-                window->mouseX = event.xmotion.x;
-                window->mouseY = event.xmotion.y;
-                break;
         }
+        return;
     }
+    drawBatchPoints(window, points, count);
+}
+
+ParticleSystem* createParticleSystem(int capacity) {
+    if (capacity <= 0) return nullptr;
+    return new ParticleSystem(capacity);
+}
+
+void destroyParticleSystem(ParticleSystem* system) {
+    delete system;
+}
+
+bool emitParticle(ParticleSystem* system, float x, float y, float z, float vx, float vy, float vz,
+                  const Color& color, float lifetime) {
+    if (!system || system->count >= system->capacity) return false;
     
-    // Calculate mouse delta
-    window->mouseDeltaX = window->mouseX - window->prevMouseX;
-    window->mouseDeltaY = window->mouseY - window->prevMouseY;
+    int i = system->count++;
+    system->x[i] = x;
+    system->y[i] = y;
+    system->z[i] = z;
+    system->vx[i] = vx;
+    system->vy[i] = vy;
+    system->vz[i] = vz;
+    system->color[i] = color;
+    system->age[i] = 0.0f;
+    system->life[i] = lifetime;
+    if (lifetime > 0.0f) system->anyMortal = true;
+    return true;
+}
+
+int particleCount(const ParticleSystem* system) {
+    return system ? system->count : 0;
+}
+
+void clearParticles(ParticleSystem* system) {
+    if (!system) return;
+    system->count = 0;
+    system->anyMortal = false;
+}
+
+void setParticleWrap(ParticleSystem* system, float minX, float minY, float minZ, float maxX, float maxY, float maxZ) {
+    if (!system) return;
     
-    // Handle mouse locking
-    if (window->mouseLocked) {
-        int centerX = window->width / 2;
-        int centerY = window->height / 2;
-        
-        XWarpPointer(window->display, None, window->window, 0, 0, 0, 0, centerX, centerY);
-        XFlush(window->display);
-        
-        window->mouseX = centerX;
-        window->mouseY = centerY;
+    const float mins[3] = {minX, minY, minZ};
+    const float maxs[3] = {maxX, maxY, maxZ};
+    for (int axis = 0; axis < 3; axis++) {
+        system->wrap[axis] = maxs[axis] > mins[axis];
+        system->wrapMin[axis] = mins[axis];
+        system->wrapMax[axis] = maxs[axis];
     }
 }
 
-void swapBuffers(WindowHandle* window) {
-    if (!window || !window->display || !window->gc) return;
+void updateParticles(ParticleSystem* system, float dt) {
+    if (!system) return;
+    GRAPHICS_TRACE_SCOPE("updateParticles");
     
-    // Copy back buffer to window
-    XCopyArea(window->display, window->backBuffer, window->window, window->gc,
-              0, 0, window->width, window->height, 0, 0);
+    integrateAxis(*system, system->x, system->vx, 0, dt);
+    integrateAxis(*system, system->y, system->vy, 1, dt);
+    integrateAxis(*system, system->z, system->vz, 2, dt);
+    if (!system->anyMortal) return;
     
-    // Flush the output buffer
-    XFlush(window->display);
+    // Expired particles are replaced by the last one
+    bool anyMortal = false;
+    for (int i = 0; i < system->count;) {
+        float life = system->life[i];
+        float age = system->age[i] += dt;
+        if (life <= 0.0f || age < life) {
+            anyMortal = anyMortal || life > 0.0f;
+            i++;
+            continue;
+        }
+        
+        int last = --system->count;
+        system->x[i] = system->x[last];
+        system->y[i] = system->y[last];
+        system->z[i] = system->z[last];
+        system->vx[i] = system->vx[last];
+        system->vy[i] = system->vy[last];
+        system->vz[i] = system->vz[last];
+        system->color[i] = system->color[last];
+        system->age[i] = system->age[last];
+        system->life[i] = system->life[last];
+    }
+    system->anyMortal = anyMortal;
 }
 
-void clearScreen(WindowHandle* window, const Color& color) {
-    if (!window || !window->display || !window->gc) return;
+void drawParticles(WindowHandle* window, ParticleSystem* system, const ParticleView& view) {
+    if (!window || !system || system->count == 0) return;
+    GRAPHICS_TRACE_SCOPE("drawParticles");
     
-    unsigned long pixel = colorToPixel(window->display, color);
-    XSetForeground(window->display, window->gc, pixel);
-    XFillRectangle(window->display, window->backBuffer, window->gc,
-                   0, 0, window->width, window->height);
-}
-
-void setDrawColor(WindowHandle* window, const Color& color) {
-    if (!window || !window->display || !window->gc) return;
+    ProjectParams params;
+    std::memcpy(params.position, view.position, sizeof(params.position));
+    std::memcpy(params.rotation, view.rotation, sizeof(params.rotation));
+    params.focal = view.focalLength;
+    params.centerX = view.centerX;
+    params.centerY = view.centerY;
+    params.nearZ = std::max(view.nearZ, 1e-6f);
+    params.farZ = view.farZ;
+    params.fade = view.depthFade;
     
-    window->currentColor = colorToPixel(window->display, color);
-    XSetForeground(window->display, window->gc, window->currentColor);
+    system->projected.resize(system->count);
+    int visible = projectParticles(*system, params, system->projected.data());
+    drawPoints(window, system->projected.data(), visible);
 }
 
-void drawLine(WindowHandle* window, int x1, int y1, int x2, int y2, const Color& color) {
-    if (!window || !window->display || !window->gc) return;
-    
-    setDrawColor(window, color);
-    XDrawLine(window->display, window->backBuffer, window->gc, x1, y1, x2, y2);
+// ============================================================================
+// FRAME ARENA - public API
+// ============================================================================
+
+static void endFrame(WindowHandle* window) {
+    RenderThread* rt = window->renderThread;
+    if (rt && currentRenderThread == rt) return;
+    window->frameArena.reset();
 }
 
-void drawRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
-    if (!window || !window->display || !window->gc) return;
-    
-    setDrawColor(window, color);
-    XDrawRectangle(window->display, window->backBuffer, window->gc, x, y, width, height);
+void* frameAlloc(WindowHandle* window, size_t size, size_t alignment) {
+    if (!window) return nullptr;
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > FRAME_ARENA_ALIGNMENT) return nullptr;
+    return window->frameArena.allocate(std::max<size_t>(size, 1), alignment);
 }
 
-void drawFilledRectangle(WindowHandle* window, int x, int y, int width, int height, const Color& color) {
-    if (!window || !window->display || !window->gc) return;
+FrameArenaStats getFrameArenaStats(WindowHandle* window) {
+    FrameArenaStats stats = {0, 0, 0};
+    if (!window) return stats;
     
-    setDrawColor(window, color);
-    XFillRectangle(window->display, window->backBuffer, window->gc, x, y, width, height);
+    const FrameArena& arena = window->frameArena;
+    stats.used = arena.used;
+    for (size_t i = 0; i < arena.blocks.size(); i++) stats.capacity += arena.blocks[i].size;
+    stats.heapAllocations = arena.heapAllocations;
+    return stats;
 }
 
-void drawPixel(WindowHandle* window, int x, int y, const Color& color) {
-    if (!window || !window->display || !window->gc) return;
+// ============================================================================
+// JOB SYSTEM - shared by all backends
+// ============================================================================
+
+typedef std::function<void()> Job;
+
+// A worker's own deque. The owner pushes and pops at the back, thieves take
+// from the front, so stolen jobs are the oldest and usually the largest.
+struct JobWorker {
+    std::mutex mutex;
+    std::deque<Job> jobs;
+    std::thread thread;
+};
+
+struct JobPool {
+    std::vector<JobWorker*> workers;
+    std::mutex sharedMutex;
+    std::deque<Job> shared;             // Jobs submitted from outside the pool
+    std::atomic<int> queued;            // Jobs in any queue, not yet taken
+    std::atomic<bool> quit;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
     
-    setDrawColor(window, color);
-    XDrawPoint(window->display, window->backBuffer, window->gc, x, y);
-}
+    JobPool();
+    ~JobPool();
+};
 
-// Helper function for drawing circles using midpoint circle algorithm
-static void drawCirclePoints(Display* display, Drawable drawable, GC gc,
-                             int xc, int yc, int x, int y) {
-    XDrawPoint(display, drawable, gc, xc + x, yc + y);
-    XDrawPoint(display, drawable, gc, xc - x, yc + y);
-    XDrawPoint(display, drawable, gc, xc + x, yc - y);
-    XDrawPoint(display, drawable, gc, xc - x, yc - y);
-    XDrawPoint(display, drawable, gc, xc + y, yc + x);
-    XDrawPoint(display, drawable, gc, xc - y, yc + x);
-    XDrawPoint(display, drawable, gc, xc + y, yc - x);
-    XDrawPoint(display, drawable, gc, xc - y, yc - x);
+// Index of the worker running on this thread, -1 outside the pool
+static thread_local int currentJobWorker = -1;
+
+static bool popFront(std::mutex& mutex, std::deque<Job>& jobs, Job& job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (jobs.empty()) return false;
+    job = std::move(jobs.front());
+    jobs.pop_front();
+    return true;
 }
 
-void drawCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
-    if (!window || !window->display || !window->gc) return;
+static bool takeJob(JobPool& pool, Job& job) {
+    int self = currentJobWorker;
+    int count = static_cast<int>(pool.workers.size());
     
-    setDrawColor(window, color);
+    if (self >= 0) {
+        JobWorker* own = pool.workers[self];
+        std::lock_guard<std::mutex> lock(own->mutex);
+        if (!own->jobs.empty()) {
+            job = std::move(own->jobs.back());
+            own->jobs.pop_back();
+            pool.queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
     
-    int x = 0;
-    int y = radius;
-    int d = 3 - 2 * radius;
+    bool found = popFront(pool.sharedMutex, pool.shared, job);
     
-    drawCirclePoints(window->display, window->backBuffer, window->gc, 
-                    centerX, centerY, x, y);
+    // Steal, starting after ourselves so thieves spread over the victims
+    for (int i = 1; !found && i <= count; i++) {
+        int victim = (self + i + count) % count;
+        if (victim != self) found = popFront(pool.workers[victim]->mutex, pool.workers[victim]->jobs, job);
+    }
     
-    while (y >= x) {
-        x++;
-        
-        if (d > 0) {
-            y--;
-            d = d + 4 * (x - y) + 10;
-        } else {
-            d = d + 4 * x + 6;
+    if (found) pool.queued.fetch_sub(1, std::memory_order_relaxed);
+    return found;
+}
+
+static void jobWorkerMain(JobPool* pool, int index) {
+    currentJobWorker = index;
+    traceThreadName("job worker " + std::to_string(index));
+    
+    for (;;) {
+        Job job;
+        if (takeJob(*pool, job)) {
+            GRAPHICS_TRACE_SCOPE("job");
+            job();
+            continue;
         }
         
-        drawCirclePoints(window->display, window->backBuffer, window->gc,
-                        centerX, centerY, x, y);
+        std::unique_lock<std::mutex> lock(pool->sleepMutex);
+        pool->wake.wait(lock, [pool] {
+            return pool->quit.load(std::memory_order_acquire) || pool->queued.load(std::memory_order_acquire) > 0;
+        });
+        if (pool->quit.load(std::memory_order_acquire)) return;
     }
 }
 
-void drawFilledCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color) {
-    if (!window || !window->display || !window->gc) return;
-    
-    setDrawColor(window, color);
+JobPool::JobPool() : queued(0), quit(false) {
+    int count = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+    for (int i = 0; i < count; i++) workers.push_back(new JobWorker());
     
-    // X11 has XFillArc which is more efficient
-    XFillArc(window->display, window->backBuffer, window->gc,
-             centerX - radius, centerY - radius,
-             radius * 2, radius * 2,
-             0, 360 * 64);  // Angles in X11 are in 1/64ths of a degree
+    // Start only once every deque exists, workers steal from all of them
+    for (int i = 0; i < count; i++) workers[i]->thread = std::thread(jobWorkerMain, this, i);
 }
 
-void delay(uint32_t milliseconds) {
-    usleep(milliseconds * 1000);
+JobPool::~JobPool() {
+    quit.store(true, std::memory_order_release);
+    { std::lock_guard<std::mutex> lock(sleepMutex); }
+    wake.notify_all();
+    
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->thread.join();
+        delete workers[i];
+    }
 }
 
-// ============================================================================
-// INPUT HANDLING - X11
-// ============================================================================
+static JobPool& jobPool() {
+    static JobPool pool;
+    return pool;
+}
 
-bool keyDown(WindowHandle* window, KeyCode key) {
-    if (!window || key >= KEY_COUNT) return false;
-    return window->keyState[key];
+void submitJob(std::function<void()> job) {
+    if (!job) return;
+    JobPool& pool = jobPool();
+    
+    int self = currentJobWorker;
+    if (self >= 0) {
+        std::lock_guard<std::mutex> lock(pool.workers[self]->mutex);
+        pool.workers[self]->jobs.push_back(std::move(job));
+    } else {
+        std::lock_guard<std::mutex> lock(pool.sharedMutex);
+        pool.shared.push_back(std::move(job));
+    }
+    pool.queued.fetch_add(1, std::memory_order_release);
+    
+    // Taking the lock orders the counter update before a sleeper's re-check
+    { std::lock_guard<std::mutex> lock(pool.sleepMutex); }
+    pool.wake.notify_one();
 }
 
-bool keyPressed(WindowHandle* window, KeyCode key) {
-    if (!window || key >= KEY_COUNT) return false;
-    return window->keyState[key] && !window->prevKeyState[key];
+bool runPendingJob() {
+    Job job;
+    if (!takeJob(jobPool(), job)) return false;
+    GRAPHICS_TRACE_SCOPE("job");
+    job();
+    return true;
 }
 
-bool keyReleased(WindowHandle* window, KeyCode key) {
-    if (!window || key >= KEY_COUNT) return false;
-    return !window->keyState[key] && window->prevKeyState[key];
+int jobWorkerCount() {
+    return static_cast<int>(jobPool().workers.size());
 }
 
-bool mouseDown(WindowHandle* window, MouseButton button) {
-    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
-    return window->mouseState[button];
+void parallelFor(int begin, int end, int grain, const std::function<void(int, int)>& body) {
+    if (begin >= end || !body) return;
+    
+    int count = end - begin;
+    if (grain <= 0) grain = std::max(1, count / (4 * (jobWorkerCount() + 1)));
+    
+    // Ranges after the first go to the pool, the caller takes the first itself
+    std::atomic<int> remaining((count + grain - 1) / grain - 1);
+    for (int first = begin + grain; first < end; first += grain) {
+        int last = std::min(first + grain, end);
+        submitJob([&body, &remaining, first, last] {
+            body(first, last);
+            remaining.fetch_sub(1, std::memory_order_release);
+        });
+    }
+    body(begin, std::min(begin + grain, end));
+    
+    while (remaining.load(std::memory_order_acquire) > 0) {
+        if (!runPendingJob()) std::this_thread::yield();
+    }
 }
 
-bool mousePressed(WindowHandle* window, MouseButton button) {
-    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
-    return window->mouseState[button] && !window->prevMouseState[button];
+namespace jobdetail {
+
+void StateBase::finish() {
+    std::vector<std::function<void()>> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done.store(true, std::memory_order_release);
+        ready.swap(continuations);
+    }
+    for (size_t i = 0; i < ready.size(); i++) submitJob(std::move(ready[i]));
 }
 
-bool mouseReleased(WindowHandle* window, MouseButton button) {
-    if (!window || button >= MOUSE_BUTTON_COUNT) return false;
-    return !window->mouseState[button] && window->prevMouseState[button];
+void StateBase::addContinuation(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!done.load(std::memory_order_relaxed)) {
+            continuations.push_back(std::move(job));
+            return;
+        }
+    }
+    submitJob(std::move(job));
 }
 
-void getMousePosition(WindowHandle* window, int& x, int& y) {
-    if (!window) {
-        x = y = 0;
-        return;
+void StateBase::wait() {
+    while (!done.load(std::memory_order_acquire)) {
+        if (!runPendingJob()) std::this_thread::yield();
     }
-    x = window->mouseX;
-    y = window->mouseY;
 }
 
-void getMouseDelta(WindowHandle* window, int& dx, int& dy) {
-    if (!window) {
-        dx = dy = 0;
-        return;
+} // namespace jobdetail
+
+// ============================================================================
+// TRACING - public API
+// ============================================================================
+
+#ifdef GRAPHICS_TRACE
+
+static void writeTraceString(FILE* file, const char* text) {
+    std::fputc('"', file);
+    for (const char* c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') std::fputc('\\', file);
+        if (static_cast<unsigned char>(*c) >= 0x20) std::fputc(*c, file);
     }
-    dx = window->mouseDeltaX;
-    dy = window->mouseDeltaY;
+    std::fputc('"', file);
 }
 
-void setMousePosition(WindowHandle* window, int x, int y) {
-    if (!window || !window->display) return;
+bool writeTrace(const char* path) {
+    if (!path) return false;
+    FILE* file = std::fopen(path, "w");
+    if (!file) return false;
     
-    XWarpPointer(window->display, None, window->window, 0, 0, 0, 0, x, y);
-    XFlush(window->display);
+    TraceRegistry& registry = traceRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
     
-    window->mouseX = x;
-    window->mouseY = y;
-}
-
-void setMouseLocked(WindowHandle* window, bool locked) {
-    if (!window || !window->display) return;
-    window->mouseLocked = locked;
+    // Ticks to microseconds, measured over the whole run
+    double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - registry.baseTime).count();
+    uint64_t ticks = traceClock() - registry.baseTicks;
+    double perMicrosecond = elapsed > 0.0 && ticks > 0 ? ticks / elapsed : 1000.0;
     
-    if (locked) {
-        // Hide cursor
-        Cursor invisibleCursor;
-        Pixmap bitmapNoData;
-        XColor black;
-        static char noData[] = {0,0,0,0,0,0,0,0};
-        black.red = black.green = black.blue = 0;
+    std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (size_t i = 0; i < registry.rings.size(); i++) {
+        TraceRing& ring = *registry.rings[i];
+        std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":",
+                     first ? "" : ",\n", ring.thread);
+        writeTraceString(file, ring.name.c_str());
+        std::fprintf(file, "}}");
+        first = false;
         
-        bitmapNoData = XCreateBitmapFromData(window->display, window->window, noData, 8, 8);
-        invisibleCursor = XCreatePixmapCursor(window->display, bitmapNoData, bitmapNoData,
-                                             &black, &black, 0, 0);
-        XDefineCursor(window->display, window->window, invisibleCursor);
-        XFreeCursor(window->display, invisibleCursor);
-        XFreePixmap(window->display, bitmapNoData);
-    } else {
-        XUndefineCursor(window->display, window->window);
+        // The thread may keep recording: only slots it can't have reached
+        // again by the time they were copied are written
+        uint64_t head = ring.head.load(std::memory_order_acquire);
+        uint64_t begin = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        std::vector<uint64_t> starts, ends;
+        std::vector<const char*> names;
+        for (uint64_t n = begin; n < head; n++) {
+            TraceEvent& event = ring.events[n % TRACE_RING_SIZE];
+            names.push_back(event.name.load(std::memory_order_relaxed));
+            starts.push_back(event.start.load(std::memory_order_relaxed));
+            ends.push_back(event.end.load(std::memory_order_relaxed));
+        }
+        uint64_t now = ring.head.load(std::memory_order_acquire);
+        uint64_t valid = now > TRACE_RING_SIZE ? now - TRACE_RING_SIZE : 0;
+        
+        for (uint64_t n = std::max(begin, valid); n < head; n++) {
+            size_t k = static_cast<size_t>(n - begin);
+            if (starts[k] < registry.baseTicks || ends[k] < starts[k]) continue;
+            std::fprintf(file, ",\n{\"name\":");
+            writeTraceString(file, names[k]);
+            std::fprintf(file, ",\"cat\":\"graphics\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                         ring.thread, (starts[k] - registry.baseTicks) / perMicrosecond,
+                         (ends[k] - starts[k]) / perMicrosecond);
+        }
     }
+    std::fprintf(file, "\n]}\n");
+    return std::fclose(file) == 0;
 }
 
-bool isMouseLocked(WindowHandle* window) {
-    if (!window) return false;
-    return window->mouseLocked;
+static void writeTraceAtExit() {
+    std::string path;
+    {
+        TraceRegistry& registry = traceRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        path = registry.exitFile;
+    }
+    if (!path.empty()) writeTrace(path.c_str());
 }
 
-int getMouseWheelDelta(WindowHandle* window) {
-    if (!window) return 0;
-    return window->mouseWheelDelta;
+void setTraceFile(const char* path) {
+    TraceRegistry& registry = traceRegistry();
+    {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.exitFile = path ? path : "";
+    }
+    static bool registered = std::atexit(writeTraceAtExit) == 0;
+    (void)registered;
 }
 
-#endif // USE_X11
\ No newline at end of file
+#else
+
+bool writeTrace(const char*) {
+    return false;
+}
+
+void setTraceFile(const char*) {}
+
+#endif // GRAPHICS_TRACE
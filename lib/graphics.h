@@ -1,7 +1,16 @@
 #ifndef GRAPHICS_H
 #define GRAPHICS_H
 
+#include <cstddef>
 #include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 // Platform detection
 #if defined(_WIN32) || defined(_WIN64)
@@ -30,16 +39,56 @@ struct Color {
         : r(red), g(green), b(blue), a(alpha) {}
 };
 
+// Rectangle structure
+struct Rect {
+    int x, y, width, height;
+    
+    Rect(int left = 0, int top = 0, int w = 0, int h = 0)
+        : x(left), y(top), width(w), height(h) {}
+};
+
 // Forward declarations for platform-specific types
 struct WindowHandle;
+struct Surface;
 
-// Window management functions
+// Window management functions. Windows can be created and destroyed from any
+// thread; a native window is polled and drawn from the thread that created it
+// (for SDL that has to be the main thread).
 WindowHandle* createWindow(const char* title, int width, int height);
 void destroyWindow(WindowHandle* window);
 bool windowShouldClose(WindowHandle* window);
 void pollEvents(WindowHandle* window);
 void swapBuffers(WindowHandle* window);
 
+// Threaded rendering: draw calls are recorded and replayed on a dedicated render
+// thread, which rasterizes and presents frame N while the caller builds frame N+1.
+// swapBuffers only blocks if the render thread is still busy with the previous frame.
+// Drawing must then happen from the thread that enabled it. Not available on SDL,
+// which only renders on the thread that created the window; isThreadedRendering
+// stays false there.
+void setThreadedRendering(WindowHandle* window, bool enabled);
+bool isThreadedRendering(WindowHandle* window);
+
+// Logical resolution: the window is drawn at width x height and upscaled by the
+// largest whole factor that fits (nearest neighbour, centered, black borders) at
+// swapBuffers. Drawing and mouse coordinates are in logical pixels. 0, 0 turns it off.
+void setLogicalSize(WindowHandle* window, int width, int height);
+
+// Present modes for swapBuffers
+enum PresentMode {
+    PRESENT_IMMEDIATE,  // Present right away, may tear (uncapped frame rate)
+    PRESENT_VSYNC,      // Wait for the display refresh
+    PRESENT_ADAPTIVE,   // Vsync while on time, present late frames right away
+    PRESENT_CAPPED      // Never block, present the first frame of each refresh right
+                        // away and drop later ones (rate-capped immediate, may tear)
+};
+
+// Default is PRESENT_VSYNC on SDL and PRESENT_IMMEDIATE on Win32 and X11.
+// Modes without native backend support are paced by the library. The X11 core
+// protocol has no vsync: there VSYNC and ADAPTIVE are emulated with a timer at
+// the screen's XRandR refresh rate (60 Hz if unknown) and can tear.
+void setPresentMode(WindowHandle* window, PresentMode mode);
+
 // Drawing functions
 void clearScreen(WindowHandle* window, const Color& color);
 void drawLine(WindowHandle* window, int x1, int y1, int x2, int y2, const Color& color);
@@ -49,10 +98,286 @@ void drawCircle(WindowHandle* window, int centerX, int centerY, int radius, cons
 void drawFilledCircle(WindowHandle* window, int centerX, int centerY, int radius, const Color& color);
 void drawPixel(WindowHandle* window, int x, int y, const Color& color);
 
+// Fills the area 4-connected to (x, y) that has the colour of that pixel, up to
+// the clip rectangle. Indexed and headless windows are filled in place; other
+// windows read the target back first, which waits for the GPU on SDL.
+void floodFill(WindowHandle* window, int x, int y, const Color& color);
+
+// Clip rectangle stack. Drawing, blits and floodFill only touch pixels inside
+// every pushed rectangle; clearScreen still clears the whole target. The clip
+// applies to whichever target is current and is set natively on the backend
+// (SDL_RenderSetClipRect, a GDI clip region, the X11 GC and XRender picture).
+void pushClipRect(WindowHandle* window, int x, int y, int width, int height);
+void popClipRect(WindowHandle* window);  // Does nothing on an empty stack
+
 // Utility functions
 void setDrawColor(WindowHandle* window, const Color& color);
 void delay(uint32_t milliseconds);
 
+// ============================================================================
+// PIXEL FORMATS
+// ============================================================================
+
+// Pixel formats named by byte order in memory. RGB565 is a native endian 16-bit word.
+enum PixelFormat {
+    PIXEL_RGBA32,   // Same layout as Color
+    PIXEL_BGRA32,   // Win32 DIBs, 24/32-bit X11 visuals, SDL ARGB8888 on little endian
+    PIXEL_BGRX32,   // BGRA32 without alpha (XRGB8888), reads back as opaque
+    PIXEL_ARGB32,
+    PIXEL_RGB565
+};
+
+// Converts count pixels between formats, using SSSE3/AVX2 where the CPU has them
+void convertPixels(const void* src, PixelFormat srcFormat, void* dst, PixelFormat dstFormat, int count);
+
+// ============================================================================
+// OFFSCREEN SURFACES
+// ============================================================================
+
+// Offscreen render targets (SDL target texture, X11 pixmap, Win32 memory DC).
+// Render rarely changing layers into a surface once, then composite it every
+// frame with blitSurface. A surface belongs to the window it was created for.
+Surface* createSurface(WindowHandle* window, int width, int height);
+void destroySurface(Surface* surface);
+
+// Redirects all drawing functions to the surface, nullptr draws to the window again
+void setRenderTarget(WindowHandle* window, Surface* surface);
+
+// Copies srcRect of the surface (nullptr = whole surface) to dstRect of the current
+// render target (nullptr = whole target), scaling if the sizes differ
+void blitSurface(WindowHandle* window, Surface* surface, const Rect* srcRect, const Rect* dstRect);
+
+enum ImageFilter {
+    FILTER_NEAREST,   // Closest texel, hard edges
+    FILTER_BILINEAR   // Weighted 2x2 texels, edges fade out over a pixel
+};
+
+// Draws the surface with its centre at (x, y), scaled by scaleX/scaleY and
+// then rotated clockwise by angle degrees; a negative scale mirrors it. The
+// image is blended over the target, pixels it doesn't cover are left alone.
+// SDL and XRender transform on the GPU/server, elsewhere only the pixels the
+// image covers are sampled, in fixed point and four at a time with SSE2.
+void drawImageTransformed(WindowHandle* window, Surface* image, float x, float y, float angle,
+                          float scaleX = 1.0f, float scaleY = 1.0f, ImageFilter filter = FILTER_BILINEAR);
+
+// ============================================================================
+// IMAGE FILES
+// ============================================================================
+
+// Loads a QOI, uncompressed BMP (8, 16, 24 or 32 bits) or binary PPM/PGM file
+// into a new surface of the window, nullptr if it can't be read. The file is
+// memory mapped and decoded in one pass into the backend's upload buffer,
+// large BMP and PPM files in parallel stripes on the job system. Alpha is kept
+// on SDL; Win32 and X11 surfaces are opaque. Free it with destroySurface.
+Surface* loadImage(WindowHandle* window, const char* path);
+
+// ============================================================================
+// IMAGE CACHE
+// ============================================================================
+
+// Per-window cache of loaded images keyed by path, for viewers that show the
+// same files again and again. acquireImage returns the resident surface or
+// loads it, and holds a reference until releaseImage. Unreferenced images stay
+// resident while the window's images fit the budget; beyond it the least
+// recently drawn ones are destroyed. Use from the application thread and
+// don't destroy acquired surfaces yourself.
+Surface* acquireImage(WindowHandle* window, const char* path);
+void releaseImage(WindowHandle* window, Surface* image);
+
+// Decodes path on the job system, so a later acquireImage only has to upload it
+void prefetchImage(WindowHandle* window, const char* path);
+
+// Bytes of images the cache may keep, 4 per pixel. Default 256 MiB.
+void setImageCacheBudget(WindowHandle* window, size_t bytes);
+
+struct ImageCacheStats {
+    uint64_t hits;          // acquireImage found the image resident
+    uint64_t prefetchHits;  // found it prefetched and only uploaded it
+    uint64_t misses;        // loaded it from the file
+    uint64_t prefetches;
+    uint64_t evictions;
+    size_t bytes;           // Resident images and finished prefetches
+    size_t budget;
+    int images;
+};
+
+ImageCacheStats getImageCacheStats(WindowHandle* window);
+
+// ============================================================================
+// HEADLESS WINDOWS
+// ============================================================================
+
+// Window without a display connection that draws into memory, for rendering
+// images nobody looks at directly (thumbnails, charts in a batch job). A
+// headless window shares no state with any other window, so many of them can
+// be created, drawn into and destroyed concurrently, one thread per window.
+// Surfaces, logical resolution and threaded rendering are not available, and
+// pollEvents/waitEvents only advance the input frame.
+WindowHandle* createHeadlessWindow(int width, int height);
+
+// The window's width * height pixels in PIXEL_RGBA32 rows, nullptr for a
+// native window. Indexed mode is expanded into them at swapBuffers.
+const Color* getHeadlessPixels(WindowHandle* window);
+
+// ============================================================================
+// INDEXED COLOUR
+// ============================================================================
+
+// Indexed mode: the window (or its logical canvas) becomes an 8-bit buffer of
+// palette indices, expanded through the palette at swapBuffers. Changing the
+// palette recolours the next frame without redrawing (palette cycling, fades).
+// Surfaces stay true colour; blitting into the indexed buffer is ignored.
+void setIndexedMode(WindowHandle* window, bool enabled);
+
+// Replaces count palette entries starting at first (256 entries). The default
+// palette is a 6x6x6 colour cube followed by a grey ramp.
+void setPalette(WindowHandle* window, int first, int count, const Color* colors);
+
+// A palette entry for the drawing calls below, which write it into the indexed
+// buffer as is. Colours are drawn with the nearest palette entry instead, and
+// fully transparent ones draw nothing. Outside indexed mode, or while a
+// surface is the render target, these draw the entry's colour.
+struct PaletteIndex {
+    uint8_t index;
+    
+    explicit PaletteIndex(uint8_t value) : index(value) {}
+};
+
+void clearScreen(WindowHandle* window, PaletteIndex index);
+void drawLine(WindowHandle* window, int x1, int y1, int x2, int y2, PaletteIndex index);
+void drawRectangle(WindowHandle* window, int x, int y, int width, int height, PaletteIndex index);
+void drawFilledRectangle(WindowHandle* window, int x, int y, int width, int height, PaletteIndex index);
+void drawCircle(WindowHandle* window, int centerX, int centerY, int radius, PaletteIndex index);
+void drawFilledCircle(WindowHandle* window, int centerX, int centerY, int radius, PaletteIndex index);
+void drawPixel(WindowHandle* window, int x, int y, PaletteIndex index);
+void floodFill(WindowHandle* window, int x, int y, PaletteIndex index);
+
+// ============================================================================
+// PARTICLES
+// ============================================================================
+
+// Particles with position, velocity, colour and lifetime, stored as separate
+// arrays and updated and projected with SIMD. Sized for starfields of up to
+// millions of particles drawn as single pixel points in one batch.
+struct ParticleSystem;
+
+ParticleSystem* createParticleSystem(int capacity);
+void destroyParticleSystem(ParticleSystem* system);
+
+// Adds a particle, false if the system is full. lifetime <= 0 never expires.
+bool emitParticle(ParticleSystem* system, float x, float y, float z, float vx, float vy, float vz,
+                  const Color& color, float lifetime);
+int particleCount(const ParticleSystem* system);
+void clearParticles(ParticleSystem* system);
+
+// Positions leaving [min, max) on an axis re-enter on the other side (a
+// starfield flying past the camera). max <= min leaves the axis unbounded.
+void setParticleWrap(ParticleSystem* system, float minX, float minY, float minZ, float maxX, float maxY, float maxZ);
+
+// Moves every particle by velocity * dt and removes expired ones. The order
+// of the remaining particles is not kept.
+void updateParticles(ParticleSystem* system, float dt);
+
+// Pinhole camera for drawParticles. Camera space has x right, y down and z
+// into the screen; a particle at camera position (x, y, z) lands on
+// (centerX + x * focalLength / z, centerY + y * focalLength / z).
+struct ParticleView {
+    float position[3];      // Camera position in world space
+    float rotation[9];      // World to camera rotation, row major
+    float focalLength;
+    float centerX, centerY;
+    float nearZ, farZ;      // Visible depth range
+    bool depthFade;         // Darken particles towards farZ
+    
+    ParticleView() : focalLength(200.0f), centerX(0.0f), centerY(0.0f), nearZ(0.1f), farZ(1000.0f),
+                     depthFade(false) {
+        for (int i = 0; i < 3; i++) position[i] = 0.0f;
+        for (int i = 0; i < 9; i++) rotation[i] = (i % 4 == 0) ? 1.0f : 0.0f;
+    }
+};
+
+// Projects all particles and draws the visible ones as one point batch
+void drawParticles(WindowHandle* window, ParticleSystem* system, const ParticleView& view);
+
+// ============================================================================
+// VECTOR PATHS
+// ============================================================================
+
+// Outlines of lines and quadratic and cubic Béziers, filled anti-aliased.
+// Curves are flattened as they are added (to within a fifth of a pixel), so
+// a path built once can be filled every frame without redoing that work.
+// Coordinates are in pixels of the draw target.
+struct Path;
+
+Path* createPath();
+void destroyPath(Path* path);
+void clearPath(Path* path);  // Removes every contour, for building the next shape
+
+// Segments without a current point start a contour at their first point, like
+// the HTML canvas. closePath moves back to the contour's first point; filling
+// closes open contours the same way.
+void moveTo(Path* path, float x, float y);
+void lineTo(Path* path, float x, float y);
+void quadTo(Path* path, float cx, float cy, float x, float y);
+void cubicTo(Path* path, float c1x, float c1y, float c2x, float c2y, float x, float y);
+void closePath(Path* path);
+
+enum FillRule {
+    FILL_NONZERO,   // Inside where the outline winds around the point
+    FILL_EVEN_ODD   // Inside where the outline encloses the point an odd number of times
+};
+
+// Fills every contour of the path with partial coverage along the edges,
+// blended with source over. Indexed windows fill pixels at least half covered
+// with the nearest palette entry, and so do X11 windows without XRender.
+void fillPath(WindowHandle* window, const Path* path, const Color& color, FillRule rule = FILL_NONZERO);
+
+// ============================================================================
+// FRAME ARENA
+// ============================================================================
+
+// Per-window scratch memory for data that only lives until the next
+// swapBuffers, which frees all of it at once. Allocation is a pointer bump and
+// nothing is freed individually. Once the arena has grown to a frame's needs it
+// no longer touches the heap. Use it from the thread that calls swapBuffers.
+// alignment must be a power of two up to alignof(std::max_align_t), anything
+// else returns nullptr.
+void* frameAlloc(WindowHandle* window, size_t size, size_t alignment);
+
+struct FrameArenaStats {
+    size_t used;                // Bytes allocated since the last swapBuffers
+    size_t capacity;            // Bytes reserved by the arena
+    uint64_t heapAllocations;   // Blocks taken from the heap so far, flat in steady state
+};
+
+FrameArenaStats getFrameArenaStats(WindowHandle* window);
+
+// STL allocator drawing from a window's frame arena, e.g.
+//   FrameVector<int> v{FrameAllocator<int>(window)};
+// Containers using it must not outlive the frame. Reserve up front, memory
+// left behind by growth is only reclaimed at swapBuffers.
+template <typename T>
+struct FrameAllocator {
+    typedef T value_type;
+    WindowHandle* window;
+    
+    explicit FrameAllocator(WindowHandle* owner) : window(owner) {}
+    template <typename U> FrameAllocator(const FrameAllocator<U>& other) : window(other.window) {}
+    
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "the frame arena can't over-align");
+        return static_cast<T*>(frameAlloc(window, n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, size_t) {}
+};
+
+template <typename T, typename U>
+bool operator==(const FrameAllocator<T>& a, const FrameAllocator<U>& b) { return a.window == b.window; }
+template <typename T, typename U>
+bool operator!=(const FrameAllocator<T>& a, const FrameAllocator<U>& b) { return a.window != b.window; }
+
+template <typename T> using FrameVector = std::vector<T, FrameAllocator<T>>;
+
 // ============================================================================
 // INPUT HANDLING
 // ============================================================================
@@ -123,6 +448,228 @@ void setMouseLocked(WindowHandle* window, bool locked); // Locks mouse to window
 bool isMouseLocked(WindowHandle* window);
 
 // Mouse wheel
-int getMouseWheelDelta(WindowHandle* window);
+int getMouseWheelDelta(WindowHandle* window); // Sum of all wheel steps since the last pollEvents
+
+// ============================================================================
+// EVENT QUEUE
+// ============================================================================
+
+enum EventType {
+    EVENT_NONE = 0,
+    EVENT_CLOSE,
+    EVENT_KEY_DOWN,
+    EVENT_KEY_UP,
+    EVENT_MOUSE_DOWN,
+    EVENT_MOUSE_UP,
+    EVENT_MOUSE_MOVE,
+    EVENT_MOUSE_WHEEL
+};
+
+// A single input event. Only the fields relevant to the type are meaningful.
+struct Event {
+    EventType type;
+    uint64_t timestamp;   // Microseconds on the getTimestamp() clock
+    KeyCode key;          // EVENT_KEY_DOWN / EVENT_KEY_UP
+    MouseButton button;   // EVENT_MOUSE_DOWN / EVENT_MOUSE_UP
+    int x, y;             // Mouse position at the time of the event
+    int wheel;            // EVENT_MOUSE_WHEEL, positive is away from the user
+    
+    Event() : type(EVENT_NONE), timestamp(0), key(KEY_UNKNOWN), button(MOUSE_LEFT),
+              x(0), y(0), wheel(0) {}
+};
+
+// Every event seen by pollEvents/waitEvents is also queued in arrival order.
+// The queue keeps the most recent MAX_QUEUED_EVENTS if it is never drained.
+const int MAX_QUEUED_EVENTS = 4096;
+
+bool nextEvent(WindowHandle* window, Event* event);  // Pops the oldest queued event, false if empty
+bool waitEvents(WindowHandle* window, int timeoutMs); // Like pollEvents, but sleeps until input arrives
+                                                      // (timeoutMs < 0 waits forever). False on timeout.
+uint64_t getTimestamp();                              // Monotonic clock in microseconds
+
+// ============================================================================
+// INPUT RECORDING
+// ============================================================================
+
+// Records the input every pollEvents/waitEvents publishes - keys, buttons,
+// mouse position and wheel, in logical pixels - to a compact binary file.
+// Replaying it feeds the window the same input frame by frame and ignores
+// the devices, so a scripted flythrough runs identically on any machine,
+// headless windows included. Closing the window still works during a replay.
+bool startInputRecording(WindowHandle* window, const char* path); // Truncates the file
+bool stopInputRecording(WindowHandle* window);                    // False if writing failed
+
+// Takes over the key/button state held when the recording started. Once the
+// recorded frames run out an EVENT_CLOSE is queued and windowShouldClose
+// returns true; waitEvents never sleeps during a replay.
+bool startInputReplay(WindowHandle* window, const char* path);
+void stopInputReplay(WindowHandle* window);   // Back to live input
+bool isReplayingInput(WindowHandle* window);  // False once the recording ran out
+
+// ============================================================================
+// JOB SYSTEM
+// ============================================================================
+
+// Process-wide work-stealing pool, started on first use with one worker per
+// hardware thread minus one (at least one). Every worker owns a deque: jobs
+// submitted from a worker are pushed to its own deque and popped newest first,
+// idle workers steal the oldest job of another. Jobs submitted from other
+// threads go to a shared queue.
+void submitJob(std::function<void()> job);
+
+// Runs one queued job on the calling thread. False if there was none.
+bool runPendingJob();
+
+int jobWorkerCount();
+
+// Calls body(first, last) for consecutive ranges of at most grain indices
+// covering [begin, end) (grain <= 0 picks one). The caller runs ranges too and
+// returns when all of them are done.
+void parallelFor(int begin, int end, int grain, const std::function<void(int, int)>& body);
+
+namespace jobdetail {
+
+struct StateBase {
+    std::atomic<bool> done;
+    std::mutex mutex;
+    std::vector<std::function<void()>> continuations;
+    
+    StateBase() : done(false) {}
+    void finish();                                      // Marks done, submits continuations
+    void addContinuation(std::function<void()> job);    // Submits right away if done
+    void wait();                                        // Runs other jobs while waiting
+};
+
+template <typename T> struct State : StateBase { T value; };
+template <> struct State<void> : StateBase {};
+
+template <typename T, typename F> void store(State<T>& state, F& f) { state.value = f(); }
+template <typename F> void store(State<void>&, F& f) { f(); }
+
+template <typename T, typename F> auto callWith(State<T>& state, F& f) -> decltype(f(state.value)) {
+    return f(state.value);
+}
+template <typename F> auto callWith(State<void>&, F& f) -> decltype(f()) { return f(); }
+
+template <typename T, typename F> struct ContinuationResult {
+    typedef decltype(std::declval<F&>()(std::declval<T&>())) type;
+};
+template <typename F> struct ContinuationResult<void, F> {
+    typedef decltype(std::declval<F&>()()) type;
+};
+
+} // namespace jobdetail
+
+// Result of a job started with runAsync. Copies share the same result.
+template <typename T>
+class JobFuture {
+public:
+    JobFuture() {}
+    explicit JobFuture(std::shared_ptr<jobdetail::State<T>> state) : state(state) {}
+    
+    bool valid() const { return state != nullptr; }
+    bool ready() const { return state && state->done.load(std::memory_order_acquire); }
+    
+    // Waits for the job, running queued jobs meanwhile, so it is safe inside jobs.
+    // The result stays owned by the future and can be moved out.
+    typename std::add_lvalue_reference<T>::type get() const {
+        state->wait();
+        return result(*state);
+    }
+    
+    // Runs f(result) (f() for void) as a new job once this one is done
+    template <typename F>
+    JobFuture<typename jobdetail::ContinuationResult<T, F>::type> then(F f) const {
+        typedef typename jobdetail::ContinuationResult<T, F>::type U;
+        std::shared_ptr<jobdetail::State<T>> source = state;
+        std::shared_ptr<jobdetail::State<U>> next = std::make_shared<jobdetail::State<U>>();
+        
+        state->addContinuation([source, next, f]() mutable {
+            auto call = [&]() { return jobdetail::callWith(*source, f); };
+            jobdetail::store(*next, call);
+            next->finish();
+        });
+        return JobFuture<U>(next);
+    }
+    
+private:
+    template <typename S> static S& result(jobdetail::State<S>& s) { return s.value; }
+    static void result(jobdetail::State<void>&) {}
+    
+    std::shared_ptr<jobdetail::State<T>> state;
+};
+
+// Runs f() on the job pool. The result type must be default constructible.
+template <typename F>
+JobFuture<decltype(std::declval<F&>()())> runAsync(F f) {
+    typedef decltype(std::declval<F&>()()) T;
+    std::shared_ptr<jobdetail::State<T>> state = std::make_shared<jobdetail::State<T>>();
+    
+    submitJob([state, f]() mutable {
+        jobdetail::store(*state, f);
+        state->finish();
+    });
+    return JobFuture<T>(state);
+}
+
+// ============================================================================
+// READBACK
+// ============================================================================
+
+// Copies rect (nullptr = all of it) of what has been drawn so far into dst,
+// rows pitch bytes apart (0 = tightly packed). Reads the current draw target:
+// the window, the logical canvas or a surface; indexed mode reads through the
+// palette. False if rect isn't inside the target, or while threaded rendering
+// is on. Reading a GPU target waits for the GPU, prefer readPixelsAsync there.
+bool readPixels(WindowHandle* window, const Rect* rect, void* dst, int pitch,
+                PixelFormat format = PIXEL_RGBA32);
+
+// Reads rect of the frame being drawn once it is finished, right before the
+// next swapBuffers presents it. The future completes after that present with
+// rect.width * rect.height PIXEL_RGBA32 pixels, or none if rect doesn't fit.
+// Works with threaded rendering, where the render thread does the read.
+JobFuture<std::vector<Color>> readPixelsAsync(WindowHandle* window, const Rect* rect = nullptr);
+
+// ============================================================================
+// TRACING
+// ============================================================================
+
+// Built with -DGRAPHICS_TRACE (library and application alike), the library
+// times its own work - pollEvents, swapBuffers, render thread frames, jobs,
+// image decoding, readback - into a ring buffer per thread that keeps the
+// most recent events. GRAPHICS_TRACE_SCOPE("name") times a scope of the
+// application's own; name must be a string literal. The timeline is written
+// as Chrome trace JSON, for chrome://tracing or ui.perfetto.dev. Without the
+// define the scopes compile to nothing and writeTrace fails.
+bool writeTrace(const char* path);      // Events recorded so far, false if not written
+void setTraceFile(const char* path);    // Also write the trace there at exit, nullptr = don't
+
+#ifdef GRAPHICS_TRACE
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+inline uint64_t traceClock() { return __builtin_ia32_rdtsc(); }
+#else
+inline uint64_t traceClock() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+#endif
+
+// Records one finished scope on the calling thread's ring
+void traceEvent(const char* name, uint64_t start, uint64_t end);
+
+struct TraceScope {
+    const char* name;
+    uint64_t start;
+    
+    explicit TraceScope(const char* scopeName) : name(scopeName), start(traceClock()) {}
+    ~TraceScope() { traceEvent(name, start, traceClock()); }
+};
+
+#define GRAPHICS_TRACE_JOIN2(a, b) a##b
+#define GRAPHICS_TRACE_JOIN(a, b) GRAPHICS_TRACE_JOIN2(a, b)
+#define GRAPHICS_TRACE_SCOPE(name) TraceScope GRAPHICS_TRACE_JOIN(traceScope, __LINE__)(name)
+#else
+#define GRAPHICS_TRACE_SCOPE(name) do {} while (0)
+#endif
 
 #endif // GRAPHICS_H
\ No newline at end of file